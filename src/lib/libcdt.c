@@ -79,6 +79,8 @@ _add_member_to_cache(dax_state *ds, int index, char *desc) {
         new->name = strdup(name);
         new->type = dax_string_to_type(ds, type);
         new->count = count;
+        new->byte = 0;
+        new->bit = 0;
         new->next = NULL;
         //--printf("_add_member() - name = %s type = 0x%X count = %ld\n", new->name, new->type, new->count);
         /* Add the new member to the end of the linked list */
@@ -97,6 +99,86 @@ _add_member_to_cache(dax_state *ds, int index, char *desc) {
     return 0;
 }
 
+/* Adds a run of elements to the datatype's run table.  If the run starts
+ * right where the last one ends and has the same type they are joined. */
+static int
+_run_add(datatype *dt, int *alloc, uint32_t offset, tag_type type, uint32_t count)
+{
+    cdt_run *last, *new;
+
+    if(dt->run_count > 0) {
+        last = &dt->runs[dt->run_count - 1];
+        if(last->type == type && last->offset + last->count * (TYPESIZE(type) / 8) == offset) {
+            last->count += count;
+            return 0;
+        }
+    }
+    if(dt->run_count == *alloc) {
+        new = realloc(dt->runs, sizeof(cdt_run) * (*alloc ? *alloc * 2 : 8));
+        if(new == NULL) return ERR_ALLOC;
+        dt->runs = new;
+        *alloc = *alloc ? *alloc * 2 : 8;
+    }
+    new = &dt->runs[dt->run_count++];
+    new->offset = offset;
+    new->type = type;
+    new->count = count;
+    return 0;
+}
+
+/* Figures the offset of each member of the datatype and the size of the
+ * whole thing so that finding a member doesn't have to add up the sizes of
+ * all the members in front of it every time.  This is the same layout that
+ * dax_get_typesize() and the server use.  BOOLs are packed together and
+ * everything else starts on a byte boundary.
+ *
+ * It also flattens the datatype into a table of runs of base datatypes so
+ * that the data conversion functions can make one pass through the data
+ * instead of walking the members of every nested datatype for every element.
+ * The single byte types never need to be converted so they are left out. */
+static void
+_cdt_layout(dax_state *ds, int index)
+{
+    unsigned int pos = 0; /* Bit position within the data area */
+    cdt_member *this;
+    datatype *dt, *sub;
+    int size, alloc = 0, n, i;
+
+    dt = &ds->datatypes[index];
+    dt->size = 0;
+    free(dt->runs);
+    dt->runs = NULL;
+    dt->run_count = 0;
+    for(this = dt->members; this != NULL; this = this->next) {
+        if(this->type != DAX_BOOL && pos % 8 != 0) {
+            pos |= 0x07;
+            pos++;
+        }
+        this->byte = pos / 8;
+        this->bit = pos % 8;
+        if(this->type == DAX_BOOL) {
+            pos += this->count;
+            continue;
+        }
+        size = dax_get_typesize(ds, this->type);
+        if(size < 0) return; /* Leave it to be figured the long way */
+        pos += size * this->count * 8;
+        if(IS_CUSTOM(this->type)) {
+            sub = &ds->datatypes[CDT_TO_INDEX(this->type)];
+            if(sub->size == 0) return;
+            for(n = 0; n < this->count; n++) {
+                for(i = 0; i < sub->run_count; i++) {
+                    if(_run_add(dt, &alloc, this->byte + n * size + sub->runs[i].offset,
+                                sub->runs[i].type, sub->runs[i].count)) return;
+                }
+            }
+        } else if(size > 1) {
+            if(_run_add(dt, &alloc, this->byte, this->type, this->count)) return;
+        }
+    }
+    dt->size = pos ? (pos - 1) / 8 + 1 : 1;
+}
+
 /*!
  * Calculate the size (in bytes) of the datatype.  This function
  * can be used on all datatypes including compound data types.
@@ -118,6 +200,9 @@ dax_get_typesize(dax_state *ds, tag_type type)
         return ERR_ARG;
 
     if(IS_CUSTOM(type)) {
+        if(ds->datatypes[CDT_TO_INDEX(type)].size > 0) {
+            return ds->datatypes[CDT_TO_INDEX(type)].size;
+        }
         this = ds->datatypes[CDT_TO_INDEX(type)].members;
         while (this != NULL) {
             if(this->type == DAX_BOOL) {
@@ -200,6 +285,9 @@ add_cdt_to_cache(dax_state *ds, tag_type type, char *typedesc)
         for(n = 0; n < DAX_DATATYPE_SIZE; n++) {
             ds->datatypes[n].name = NULL;
             ds->datatypes[n].members = NULL;
+            ds->datatypes[n].size = 0;
+            ds->datatypes[n].runs = NULL;
+            ds->datatypes[n].run_count = 0;
         }
         ds->datatype_size = DAX_DATATYPE_SIZE;
     }
@@ -217,6 +305,9 @@ add_cdt_to_cache(dax_state *ds, tag_type type, char *typedesc)
             for(n = ds->datatype_size; n < ds->datatype_size + DAX_DATATYPE_SIZE; n++) {
                 ds->datatypes[n].name = NULL;
                 ds->datatypes[n].members = NULL;
+                ds->datatypes[n].size = 0;
+                ds->datatypes[n].runs = NULL;
+                ds->datatypes[n].run_count = 0;
             }
             ds->datatype_size += DAX_DATATYPE_SIZE;
         } else {
@@ -236,6 +327,9 @@ add_cdt_to_cache(dax_state *ds, tag_type type, char *typedesc)
         result = _add_member_to_cache(ds, index, str);
         if(result) return result;
     }
+    /* Any datatypes that the members use were retrieved while the members
+     * were added so we can figure out where everything is now */
+    _cdt_layout(ds, index);
     //DF("add_cdt_to_cache() type = 0x%X, name = %s", type, typedesc);
     return 0;
 }
@@ -263,6 +357,9 @@ dax_cdt_new(char *name, int *error)
             result = ERR_ALLOC;
         } else {
             new->members = NULL;
+            new->size = 0;
+            new->runs = NULL;
+            new->run_count = 0;
             new->name = strdup(name);
             if(new->name == NULL) {
                 free(new);
@@ -319,6 +416,8 @@ dax_cdt_member(dax_state *ds, dax_cdt *cdt, char *name, tag_type type, unsigned
     if(new->name == NULL) return ERR_ALLOC;
     new->type = type;
     new->count = count;
+    new->byte = 0;
+    new->bit = 0;
     new->next = NULL;
 
     /* Put it in the linked list */
@@ -570,33 +669,17 @@ _parse_next_member(dax_state *ds, tag_type lasttype, tag_handle *h, char *str, i
         return ERR_NOTFOUND; /* This is a serious problem here */
     }
 
+    if(ds->datatypes[CDT_TO_INDEX(lasttype)].size == 0) {
+        return ERR_NOTFOUND; /* The member offsets couldn't be figured */
+    }
     this = ds->datatypes[CDT_TO_INDEX(lasttype)].members;
-
-    while(this != NULL) {
-        /* Start by adding all the bytes of the members before the
-         * one we are looking for */
-        if(strcmp(name, this->name)) {
-            if(this->type == DAX_BOOL) {
-                h->bit += this->count;
-                if(h->bit > 7) {
-                    h->byte += h->bit / 8;
-                    h->bit %= 8;
-                }
-            } else {
-                /* Gotta step up one if the last member was a bool */
-                if(h->type == DAX_BOOL && h->bit > 0) { h->byte++; }
-                h->byte += dax_get_typesize(ds, this->type) * this->count;
-                h->bit = 0;
-            }
-            h->type = this->type; /* We need to keep track of the last type */
-
-            this = this->next;
-        } else { /* Here we have found it */
-            break;
-        }
-
+    while(this != NULL && strcmp(name, this->name)) {
+        this = this->next;
     }
     if(this == NULL) return ERR_NOTFOUND;
+    /* The datatype that we are in always starts on a byte boundary */
+    h->byte += this->byte;
+    h->bit = this->bit;
 
     if(nextname) { /* Not the last item */
         if(isdigit(nextname[0])) {
@@ -613,18 +696,14 @@ _parse_next_member(dax_state *ds, tag_type lasttype, tag_handle *h, char *str, i
             h->byte += dax_get_typesize(ds, this->type) * index;
         }
     } else { /* We are the last item */
-        if(h->type == DAX_BOOL && this->type != DAX_BOOL && h->bit > 0) {
-            h->byte++;
-            h->bit = 0;
-        }
-
         h->type = this->type;
         if(index != ERR_NOTFOUND){
             if(count == 0 ) count = 1;
             if((index + count) > this->count ) return ERR_2BIG;
             if(this->type == DAX_BOOL) {
+                index += h->bit;
                 h->byte += index / 8;
-                h->bit += index % 8;
+                h->bit = index % 8;
                 /* Two bits across the byte boundry require two bytes */
                 h->size = (h->bit + count - 1) / 8 - (h->bit / 8) + 1;
                 h->count = count;
@@ -750,13 +829,22 @@ int
 dax_tag_handle(dax_state *ds, tag_handle *h, char *str, int count)
 {
     int result;
+    uint32_t epoch;
+
     if(h == NULL || ds == NULL || str == NULL) {
         return ERR_ARG;
     }
+    /* The handles that we have figured out before are cached */
+    if(check_cache_handle(ds, str, count, h) == 0) {
+        return 0;
+    }
+    epoch = cache_get_epoch(ds);
     bzero(h, sizeof(tag_handle)); /* Initialize h */
     result = _dax_tag_handle(ds, h, str, strlen(str) + 1, count);
     if(result) {
         bzero(h, sizeof(tag_handle)); /* Reset h in case of error */
+    } else {
+        cache_handle_add_since(ds, str, count, h, epoch);
     }
     return result;
 }
@@ -22,6 +22,13 @@
 
 #include <libdax.h>
 #include <libcommon.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define CONV_X86
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+# define CONV_NEON
+#endif
 
 /* TODO: All of these functions need to be written.  Right now we just
    assume that all is good and that we don't need any of this. */
@@ -235,3 +242,267 @@ stom_generic(tag_type type, void *dst, void *src) {
     }
     return 0;
 }
+
+/* Bulk byte swapping functions.  These reverse the bytes of every element
+ * in an array of 16, 32 or 64 bit values in place.  They are used to convert
+ * whole tags when the server has the opposite byte order.  Each set of
+ * kernels is written for one instruction set and the best one that the CPU
+ * supports is picked the first time one of them is called.  The data doesn't
+ * have to be aligned since the members of compound datatypes usually aren't.
+ */
+
+static void
+_swap16_scalar(void *data, size_t count)
+{
+    uint8_t *p = data;
+    uint16_t x;
+
+    for(size_t n = 0; n < count; n++, p += 2) {
+        memcpy(&x, p, 2);
+        x = __builtin_bswap16(x);
+        memcpy(p, &x, 2);
+    }
+}
+
+static void
+_swap32_scalar(void *data, size_t count)
+{
+    uint8_t *p = data;
+    uint32_t x;
+
+    for(size_t n = 0; n < count; n++, p += 4) {
+        memcpy(&x, p, 4);
+        x = __builtin_bswap32(x);
+        memcpy(p, &x, 4);
+    }
+}
+
+static void
+_swap64_scalar(void *data, size_t count)
+{
+    uint8_t *p = data;
+    uint64_t x;
+
+    for(size_t n = 0; n < count; n++, p += 8) {
+        memcpy(&x, p, 8);
+        x = __builtin_bswap64(x);
+        memcpy(p, &x, 8);
+    }
+}
+
+#ifdef CONV_X86
+
+/* Shuffle masks that reverse each 2, 4 or 8 byte group of a 16 byte lane */
+#define SWAP16_MASK 14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1
+#define SWAP32_MASK 12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3
+#define SWAP64_MASK 8,9,10,11,12,13,14,15,0,1,2,3,4,5,6,7
+
+/* Swaps count elements of size bytes using SSSE3 for the whole 16 byte
+ * blocks and the scalar function for whatever is left */
+__attribute__((target("ssse3"))) static inline size_t
+_swap_ssse3(uint8_t *p, size_t bytes, __m128i mask)
+{
+    size_t n;
+    __m128i x;
+
+    for(n = 0; n + 16 <= bytes; n += 16) {
+        x = _mm_loadu_si128((__m128i *)(p + n));
+        _mm_storeu_si128((__m128i *)(p + n), _mm_shuffle_epi8(x, mask));
+    }
+    return n;
+}
+
+__attribute__((target("ssse3"))) static void
+_swap16_ssse3(void *data, size_t count)
+{
+    size_t n = _swap_ssse3(data, count * 2, _mm_set_epi8(SWAP16_MASK));
+    _swap16_scalar((uint8_t *)data + n, count - n / 2);
+}
+
+__attribute__((target("ssse3"))) static void
+_swap32_ssse3(void *data, size_t count)
+{
+    size_t n = _swap_ssse3(data, count * 4, _mm_set_epi8(SWAP32_MASK));
+    _swap32_scalar((uint8_t *)data + n, count - n / 4);
+}
+
+__attribute__((target("ssse3"))) static void
+_swap64_ssse3(void *data, size_t count)
+{
+    size_t n = _swap_ssse3(data, count * 8, _mm_set_epi8(SWAP64_MASK));
+    _swap64_scalar((uint8_t *)data + n, count - n / 8);
+}
+
+/* The AVX2 shuffle works on each 16 byte half separately so the same masks
+ * are used for both halves */
+__attribute__((target("avx2"))) static inline size_t
+_swap_avx2(uint8_t *p, size_t bytes, __m256i mask)
+{
+    size_t n;
+    __m256i x;
+
+    for(n = 0; n + 32 <= bytes; n += 32) {
+        x = _mm256_loadu_si256((__m256i *)(p + n));
+        _mm256_storeu_si256((__m256i *)(p + n), _mm256_shuffle_epi8(x, mask));
+    }
+    return n;
+}
+
+__attribute__((target("avx2"))) static void
+_swap16_avx2(void *data, size_t count)
+{
+    size_t n = _swap_avx2(data, count * 2, _mm256_set_epi8(SWAP16_MASK, SWAP16_MASK));
+    _swap16_scalar((uint8_t *)data + n, count - n / 2);
+}
+
+__attribute__((target("avx2"))) static void
+_swap32_avx2(void *data, size_t count)
+{
+    size_t n = _swap_avx2(data, count * 4, _mm256_set_epi8(SWAP32_MASK, SWAP32_MASK));
+    _swap32_scalar((uint8_t *)data + n, count - n / 4);
+}
+
+__attribute__((target("avx2"))) static void
+_swap64_avx2(void *data, size_t count)
+{
+    size_t n = _swap_avx2(data, count * 8, _mm256_set_epi8(SWAP64_MASK, SWAP64_MASK));
+    _swap64_scalar((uint8_t *)data + n, count - n / 8);
+}
+
+static int
+_have_ssse3(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int
+_have_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* CONV_X86 */
+
+#ifdef CONV_NEON
+
+static void
+_swap16_neon(void *data, size_t count)
+{
+    uint8_t *p = data;
+    size_t n;
+
+    for(n = 0; n + 8 <= count; n += 8, p += 16) {
+        vst1q_u8(p, vrev16q_u8(vld1q_u8(p)));
+    }
+    _swap16_scalar(p, count - n);
+}
+
+static void
+_swap32_neon(void *data, size_t count)
+{
+    uint8_t *p = data;
+    size_t n;
+
+    for(n = 0; n + 4 <= count; n += 4, p += 16) {
+        vst1q_u8(p, vrev32q_u8(vld1q_u8(p)));
+    }
+    _swap32_scalar(p, count - n);
+}
+
+static void
+_swap64_neon(void *data, size_t count)
+{
+    uint8_t *p = data;
+    size_t n;
+
+    for(n = 0; n + 2 <= count; n += 2, p += 16) {
+        vst1q_u8(p, vrev64q_u8(vld1q_u8(p)));
+    }
+    _swap64_scalar(p, count - n);
+}
+
+#endif /* CONV_NEON */
+
+static int
+_always(void)
+{
+    return 1;
+}
+
+/* These are in order of preference */
+static const struct conv_kernel {
+    const char *name;
+    int (*supported)(void);
+    void (*swap16)(void *data, size_t count);
+    void (*swap32)(void *data, size_t count);
+    void (*swap64)(void *data, size_t count);
+} _kernels[] = {
+#ifdef CONV_X86
+    {"avx2", _have_avx2, _swap16_avx2, _swap32_avx2, _swap64_avx2},
+    {"ssse3", _have_ssse3, _swap16_ssse3, _swap32_ssse3, _swap64_ssse3},
+#endif
+#ifdef CONV_NEON
+    {"neon", _always, _swap16_neon, _swap32_neon, _swap64_neon},
+#endif
+    {"scalar", _always, _swap16_scalar, _swap32_scalar, _swap64_scalar}
+};
+#define CONV_KERNELS (sizeof(_kernels) / sizeof(_kernels[0]))
+
+static const struct conv_kernel *_kernel;
+static pthread_once_t _kernel_once = PTHREAD_ONCE_INIT;
+
+static void
+_kernel_init(void)
+{
+    int n;
+
+    for(n = 0; ! _kernels[n].supported(); n++);
+    _kernel = &_kernels[n];
+}
+
+void
+conv_swap16(void *data, size_t count)
+{
+    pthread_once(&_kernel_once, _kernel_init);
+    _kernel->swap16(data, count);
+}
+
+void
+conv_swap32(void *data, size_t count)
+{
+    pthread_once(&_kernel_once, _kernel_init);
+    _kernel->swap32(data, count);
+}
+
+void
+conv_swap64(void *data, size_t count)
+{
+    pthread_once(&_kernel_once, _kernel_init);
+    _kernel->swap64(data, count);
+}
+
+/* Uses the byte swapping kernel with the given name instead of the one
+ * that was picked for this CPU.  Returns ERR_NOTFOUND if there isn't one
+ * by that name that will run here.  This is for testing and benchmarks. */
+int
+conv_set_kernel(const char *name)
+{
+    int n;
+
+    pthread_once(&_kernel_once, _kernel_init);
+    for(n = 0; n < CONV_KERNELS; n++) {
+        if(strcmp(name, _kernels[n].name) == 0 && _kernels[n].supported()) {
+            _kernel = &_kernels[n];
+            return 0;
+        }
+    }
+    return ERR_NOTFOUND;
+}
+
+/* Returns the name of the byte swapping kernel that is being used */
+const char *
+conv_get_kernel(void)
+{
+    pthread_once(&_kernel_once, _kernel_init);
+    return _kernel->name;
+}
@@ -23,49 +23,190 @@
 #include <libcommon.h>
 
 /* Tag Cache Handling Code
- * The tag cache is a doubly linked circular list
- * the head pointer is fixed at the top of the list
- * tag searched for will bubble up one item in the list
- * each time it's found.  This will make the top of the list
- * the most searched for tags and the bottom the lesser used tags.
+ * The tag cache is a doubly linked circular list that is kept in least
+ * recently used order.  The head pointer is the tag that was used last and
+ * head->prev is the one that has gone unused the longest.  Each tag that is
+ * found is moved to the top of the list and when the cache is full the tag at
+ * the bottom is the one that is reused for the new tag.
+ *
+ * The nodes are also kept in two hash tables, one by name and one by index,
+ * so that finding a tag doesn't have to walk the list.  The tables are sized
+ * for the cachesize when the cache is initialized and don't grow.
+ *
+ * The server sends a MSG_NOTIFY message when a tag that we might have cached
+ * is deleted or changed and cache_invalidate() is called from the connection
+ * thread to drop it.  Since the connection thread can't wait on ds->lock the
+ * cache has its own lock.  A function that asks the server about a tag gets
+ * the epoch with cache_get_epoch() before it sends the request and adds the
+ * answer with cache_tag_add_since().  If a notice came in while the request
+ * was out the epoch will have changed and the answer is not cached.
+ *
+ * The handles that dax_tag_handle() figures out are cached the same way,
+ * keyed by the string and the count that were asked for.  The handle cache
+ * is the same size as the tag cache and a handle is dropped whenever the
+ * tag that it points into is dropped for being deleted or changed.
  */
 
-/* TODO: I need a way to invalidate the tag cache so that changes
-   to the tag can be put into the tag cache */
+/* FNV-1a, the same hash the server uses for the tag names */
+static inline uint32_t
+_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
 
-int
-init_tag_cache(dax_state *ds)
+    while(*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* The generation is in the upper bits of the index so we fold it down */
+static inline uint32_t
+_index_hash(dax_state *ds, tag_index idx)
 {
-    ds->cache_head = NULL;
-    ds->cache_limit = strtol(dax_get_attr(ds, "cachesize"), NULL, 0);
-    ds->cache_count = 0;
-    return 0;
+    return ((uint32_t)idx ^ ((uint32_t)idx >> 16)) & (ds->cache_hashsize - 1);
+}
+
+static tag_cnode *
+_find_index(dax_state *ds, tag_index idx)
+{
+    tag_cnode *this;
+
+    if(ds->cache_head == NULL) return NULL;
+    this = ds->cache_indexes[_index_hash(ds, idx)];
+    while(this != NULL && this->idx != idx) {
+        this = this->idx_next;
+    }
+    return this;
+}
+
+static tag_cnode *
+_find_name(dax_state *ds, const char *name)
+{
+    tag_cnode *this;
+    uint32_t hash;
+
+    if(ds->cache_head == NULL) return NULL;
+    hash = _name_hash(name);
+    this = ds->cache_names[hash & (ds->cache_hashsize - 1)];
+    while(this != NULL && (this->hash != hash || strcmp(this->name, name))) {
+        this = this->name_next;
+    }
+    return this;
+}
+
+/* Takes the node out of the list and both of the hash tables.  The
+ * node is not freed. */
+static void
+_node_remove(dax_state *ds, tag_cnode *node)
+{
+    tag_cnode **this;
+
+    this = &ds->cache_names[node->hash & (ds->cache_hashsize - 1)];
+    while(*this != node) this = &(*this)->name_next;
+    *this = node->name_next;
+
+    this = &ds->cache_indexes[_index_hash(ds, node->idx)];
+    while(*this != node) this = &(*this)->idx_next;
+    *this = node->idx_next;
+
+    if(node->next == node) { /* This is the Last One */
+        ds->cache_head = NULL;
+    } else {
+        node->next->prev = node->prev;
+        node->prev->next = node->next;
+        if(ds->cache_head == node) {
+            ds->cache_head = node->next;
+        }
+    }
+    ds->cache_count--;
 }
 
+/* Puts the node at the top of the list */
 static void
-_free_node(dax_state *ds, tag_cnode *this) {
-    if(this->next != ds->cache_head) {
-        _free_node(ds, this->next);
+_node_push(dax_state *ds, tag_cnode *node)
+{
+    tag_cnode *head;
+
+    head = ds->cache_head;
+    if(head == NULL) {
+        node->next = node;
+        node->prev = node;
+    } else {
+        node->next = head;
+        node->prev = head->prev;
+        head->prev->next = node;
+        head->prev = node;
     }
-    free(this);
+    ds->cache_head = node;
 }
 
+static void _free_handle_cache(dax_state *ds);
+static void _handle_del_index(dax_state *ds, tag_index idx);
+
 void
 free_tag_cache(dax_state *ds) {
-	if(ds->cache_head != NULL) {
-        _free_node(ds, ds->cache_head);
+    tag_cnode *this, *next;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    _free_handle_cache(ds);
+    if(ds->cache_head != NULL) {
+        this = ds->cache_head;
+        do {
+            next = this->next;
+            free(this);
+            this = next;
+        } while(this != ds->cache_head);
         ds->cache_head = NULL;
-	}
+    }
+    free(ds->cache_names);
+    free(ds->cache_indexes);
+    ds->cache_names = NULL;
+    ds->cache_indexes = NULL;
+    ds->cache_hashsize = 0;
+    ds->cache_count = 0;
+    pthread_mutex_unlock(&ds->cache_lock);
 }
 
+int
+init_tag_cache(dax_state *ds)
+{
+    unsigned int size;
+
+    free_tag_cache(ds);
+    pthread_mutex_lock(&ds->cache_lock);
+    ds->cache_limit = strtol(dax_get_attr(ds, "cachesize"), NULL, 0);
+    if(ds->cache_limit > 0) {
+        /* Twice as many buckets as tags keeps the chains short */
+        for(size = 16; size < (unsigned int)ds->cache_limit * 2; size <<= 1);
+        ds->cache_names = calloc(size, sizeof(tag_cnode *));
+        ds->cache_indexes = calloc(size, sizeof(tag_cnode *));
+        ds->handle_strs = calloc(size, sizeof(handle_cnode *));
+        ds->handle_indexes = calloc(size, sizeof(handle_cnode *));
+        if(ds->cache_names == NULL || ds->cache_indexes == NULL ||
+           ds->handle_strs == NULL || ds->handle_indexes == NULL) {
+            free(ds->cache_names);
+            free(ds->cache_indexes);
+            ds->cache_names = NULL;
+            ds->cache_indexes = NULL;
+            _free_handle_cache(ds);
+            ds->cache_limit = 0;
+            pthread_mutex_unlock(&ds->cache_lock);
+            return ERR_ALLOC;
+        }
+        ds->cache_hashsize = size;
+    } else {
+        ds->cache_limit = 0;
+    }
+    pthread_mutex_unlock(&ds->cache_lock);
+    return 0;
+}
 
-/* This function assigns the data to *tag and bubbles
-   this up one node in the list */
+/* This function assigns the data to *tag and moves
+   this node to the top of the list */
 static inline void
 _cache_hit(dax_state *ds, tag_cnode *this, dax_tag *tag)
 {
-    tag_cnode *before, *after;
-
     /* Store the return values in tag */
     strcpy(tag->name, this->name);
     tag->idx = this->idx;
@@ -73,26 +214,14 @@ _cache_hit(dax_state *ds, tag_cnode *this, dax_tag *tag)
     tag->count = this->count;
     tag->attr = this->attr;
 
-  /* Bubble up:
-    'after' is set to the node that we swap with
-    'before' is set to the node that will be before
-    us after the swap.  The special case is when our
-    node will become the first one, then we move the head. */
-    if(this != ds->cache_head) { /* Do nothing if we are already at the top */
-        /* If there are only two then we do it the easy way */
-        if(ds->cache_count == 2) {
-            ds->cache_head = ds->cache_head->next;
-        } else {
-            if(this == ds->cache_head->next) ds->cache_head = this;
-            after = this->prev;
-            before = after->prev;
-            before->next = this;
-            after->prev = this;
-            after->next = this->next;
-            this->next->prev = after;
-            this->next = after;
-            this->prev = before;
-        }
+    if(this == ds->cache_head) return;
+    if(this == ds->cache_head->prev) {
+        /* The bottom of a circular list is right above the top */
+        ds->cache_head = this;
+    } else {
+        this->next->prev = this->prev;
+        this->prev->next = this->next;
+        _node_push(ds, this);
     }
 }
 
@@ -105,24 +234,14 @@ check_cache_index(dax_state *ds, tag_index idx, dax_tag *tag)
 {
     tag_cnode *this;
 
-    if(ds->cache_head != NULL) {
-        this = ds->cache_head;
-    } else {
+    pthread_mutex_lock(&ds->cache_lock);
+    this = _find_index(ds, idx);
+    if(this == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
         return ERR_NOTFOUND;
     }
-    if(ds->cache_head->idx != idx) {
-        this = this->next;
-
-        while(this != ds->cache_head && this->idx != idx) {
-            this = this->next;
-        }
-        if(this == ds->cache_head) {
-            return ERR_NOTFOUND;
-        }
-    }
-
     _cache_hit(ds, this, tag);
-
+    pthread_mutex_unlock(&ds->cache_lock);
     return 0;
 }
 
@@ -134,110 +253,313 @@ check_cache_name(dax_state *ds, char *name, dax_tag *tag)
 {
     tag_cnode *this;
 
-    if(ds->cache_head != NULL) {
-        this = ds->cache_head;
-    } else {
+    pthread_mutex_lock(&ds->cache_lock);
+    this = _find_name(ds, name);
+    if(this == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
         return ERR_NOTFOUND;
     }
-    if( strcmp(ds->cache_head->name, name) ) {
-        this = this->next;
-
-        while(this != ds->cache_head && strcmp(this->name, name)) {
-            this = this->next;
-        }
-        if(this == ds->cache_head) {
-            return ERR_NOTFOUND;
-        }
-    }
     _cache_hit(ds, this, tag);
-
+    pthread_mutex_unlock(&ds->cache_lock);
     return 0;
 }
 
-
-/* Adds a tag to the cache */
-int
-cache_tag_add(dax_state *ds, dax_tag *tag)
+static int
+_cache_tag_add(dax_state *ds, dax_tag *tag)
 {
     tag_cnode *new;
+    uint32_t hash;
 
-    if(ds->cache_head == NULL) { /* First one */
-        //--printf("adding {%d} to the beginning\n", tag->handle);
-        new = malloc(sizeof(tag_cnode));
-        if(new) {
-            new->next = new;
-            new->prev = new;
-            ds->cache_head = new;
-            ds->cache_count++;
-        } else {
-            return ERR_ALLOC;
-        }
-    } else if(ds->cache_count < ds->cache_limit) { /* Add to end */
-        //--printf("adding {%d} to the end\n", tag->handle);
+    if(ds->cache_limit <= 0) return 0;
+    /* Whatever we had for this index or this name is out of date */
+    if((new = _find_index(ds, tag->idx)) != NULL) {
+        _node_remove(ds, new);
+        free(new);
+    }
+    if((new = _find_name(ds, tag->name)) != NULL) {
+        _node_remove(ds, new);
+        free(new);
+    }
+    if(ds->cache_count < ds->cache_limit) {
         new = malloc(sizeof(tag_cnode));
-        if(new) {
-            new->next = ds->cache_head;
-            new->prev = ds->cache_head->prev;
-            ds->cache_head->prev->next = new;
-            ds->cache_head->prev = new;
-            ds->cache_count++;
-        } else {
-            return ERR_ALLOC;
-        }
-    } else {
-        //--printf("Just putting {%s}  last\n", tag->name);
+        if(new == NULL) return ERR_ALLOC;
+    } else { /* Reuse the least recently used one */
         new = ds->cache_head->prev;
+        _node_remove(ds, new);
     }
     strcpy(new->name, tag->name);
     new->idx = tag->idx;
     new->type = tag->type;
     new->count = tag->count;
     new->attr = tag->attr;
-    //--print_cache();
+
+    hash = _name_hash(new->name);
+    new->hash = hash;
+    new->name_next = ds->cache_names[hash & (ds->cache_hashsize - 1)];
+    ds->cache_names[hash & (ds->cache_hashsize - 1)] = new;
+    hash = _index_hash(ds, new->idx);
+    new->idx_next = ds->cache_indexes[hash];
+    ds->cache_indexes[hash] = new;
+    _node_push(ds, new);
+    ds->cache_count++;
 
     return 0;
 }
 
+/* Adds a tag to the cache */
+int
+cache_tag_add(dax_state *ds, dax_tag *tag)
+{
+    int result;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    result = _cache_tag_add(ds, tag);
+    pthread_mutex_unlock(&ds->cache_lock);
+    return result;
+}
+
+/* Adds a tag that we got from the server to the cache unless the cache
+ * has been invalidated since 'epoch' was retrieved */
+int
+cache_tag_add_since(dax_state *ds, dax_tag *tag, uint32_t epoch)
+{
+    int result = 0;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    if(epoch == ds->cache_epoch) {
+        result = _cache_tag_add(ds, tag);
+    }
+    pthread_mutex_unlock(&ds->cache_lock);
+    return result;
+}
+
+uint32_t
+cache_get_epoch(dax_state *ds)
+{
+    uint32_t epoch;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    epoch = ds->cache_epoch;
+    pthread_mutex_unlock(&ds->cache_lock);
+    return epoch;
+}
+
 /* This function deletes the tag in the cache given by 'idx'
  * It returns 0 on success and ERR_NOTFOUND if the tag is not in the cache */
 int
 cache_tag_del(dax_state *ds, tag_index idx) {
-    tag_cnode *this, *head;
+    tag_cnode *this;
 
-    /* Search for the tag */
-    if(ds->cache_head != NULL) {
-        head = ds->cache_head;
-        this = head;
-    } else {
+    pthread_mutex_lock(&ds->cache_lock);
+    _handle_del_index(ds, idx);
+    this = _find_index(ds, idx);
+    if(this == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
         return ERR_NOTFOUND;
     }
-    if( head->idx != idx ) {
-        this = this->next;
+    _node_remove(ds, this);
+    pthread_mutex_unlock(&ds->cache_lock);
+    free(this);
+    return 0;
+}
 
-        while(this != head && (this->idx != idx)) {
-            this = this->next;
-        }
-        if(this == head) {
-            return ERR_NOTFOUND;
+/* Called when the server tells us that the tag at 'idx' was changed or
+ * deleted.  Besides removing the tag this bumps the epoch so that any
+ * answer to a request that was already out doesn't get cached. */
+void
+cache_invalidate(dax_state *ds, tag_index idx)
+{
+    tag_cnode *this;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    ds->cache_epoch++;
+    _handle_del_index(ds, idx);
+    this = _find_index(ds, idx);
+    if(this != NULL) {
+        _node_remove(ds, this);
+        free(this);
+    }
+    pthread_mutex_unlock(&ds->cache_lock);
+}
+
+/* Tag handle cache.  The list and the hash tables work just like the
+ * tag cache above.  The handle cache shares the lock, the epoch and the
+ * size of the hash tables with the tag cache. */
+
+static inline uint32_t
+_handle_hash(const char *str, int count)
+{
+    uint32_t hash;
+
+    hash = _name_hash(str) ^ (uint32_t)count;
+    return hash * 16777619u;
+}
+
+/* Takes the node out of the list and both of the hash tables.  The
+ * node is not freed. */
+static void
+_handle_remove(dax_state *ds, handle_cnode *node)
+{
+    handle_cnode **this;
+
+    this = &ds->handle_strs[node->hash & (ds->cache_hashsize - 1)];
+    while(*this != node) this = &(*this)->str_next;
+    *this = node->str_next;
+
+    this = &ds->handle_indexes[_index_hash(ds, node->h.index)];
+    while(*this != node) this = &(*this)->idx_next;
+    *this = node->idx_next;
+
+    if(node->next == node) {
+        ds->handle_head = NULL;
+    } else {
+        node->next->prev = node->prev;
+        node->prev->next = node->next;
+        if(ds->handle_head == node) {
+            ds->handle_head = node->next;
         }
     }
+    ds->handle_count--;
+}
 
-    /* If we get this far the tag was found and 'this' should point to
-     * the tag we want to delete */
-    if(this->next == this) { /* This is the Last One */
-        ds->cache_head = NULL;
+static void
+_handle_push(dax_state *ds, handle_cnode *node)
+{
+    handle_cnode *head;
+
+    head = ds->handle_head;
+    if(head == NULL) {
+        node->next = node;
+        node->prev = node;
     } else {
-        /* disconnect module */
-        (this->next)->prev = this->prev;
-        (this->prev)->next = this->next;
-        /* don't want current to be pointing to the one we are deleting */
-        if(head == this) {
-            ds->cache_head = this->next;
+        node->next = head;
+        node->prev = head->prev;
+        head->prev->next = node;
+        head->prev = node;
+    }
+    ds->handle_head = node;
+}
+
+/* Drops every handle that points into the tag at idx */
+static void
+_handle_del_index(dax_state *ds, tag_index idx)
+{
+    handle_cnode *this, *next;
+
+    if(ds->handle_head == NULL) return;
+    this = ds->handle_indexes[_index_hash(ds, idx)];
+    while(this != NULL) {
+        next = this->idx_next;
+        if(this->h.index == idx) {
+            _handle_remove(ds, this);
+            free(this);
         }
+        this = next;
     }
-    ds->cache_count--;
-    /* free allocated memory */
-    free(this);
+}
+
+/* Frees the handle cache, the caller has to have the cache lock */
+static void
+_free_handle_cache(dax_state *ds)
+{
+    handle_cnode *this, *next;
+
+    if(ds->handle_head != NULL) {
+        this = ds->handle_head;
+        do {
+            next = this->next;
+            free(this);
+            this = next;
+        } while(this != ds->handle_head);
+        ds->handle_head = NULL;
+    }
+    free(ds->handle_strs);
+    free(ds->handle_indexes);
+    ds->handle_strs = NULL;
+    ds->handle_indexes = NULL;
+    ds->handle_count = 0;
+}
+
+static handle_cnode *
+_find_handle(dax_state *ds, const char *str, int count, uint32_t hash)
+{
+    handle_cnode *this;
+
+    if(ds->handle_head == NULL) return NULL;
+    this = ds->handle_strs[hash & (ds->cache_hashsize - 1)];
+    while(this != NULL && (this->hash != hash || this->count != count || strcmp(this->str, str))) {
+        this = this->str_next;
+    }
+    return this;
+}
+
+/* Copies the handle that was cached for the string and count into *h.
+ * Returns zero if it was found and ERR_NOTFOUND otherwise */
+int
+check_cache_handle(dax_state *ds, char *str, int count, tag_handle *h)
+{
+    handle_cnode *this;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    this = _find_handle(ds, str, count, _handle_hash(str, count));
+    if(this == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        return ERR_NOTFOUND;
+    }
+    *h = this->h;
+    if(this != ds->handle_head) {
+        this->next->prev = this->prev;
+        this->prev->next = this->next;
+        _handle_push(ds, this);
+    }
+    pthread_mutex_unlock(&ds->cache_lock);
+    return 0;
+}
+
+/* Adds the handle for the string and count to the cache unless the cache
+ * has been invalidated since 'epoch' was retrieved */
+int
+cache_handle_add_since(dax_state *ds, char *str, int count, tag_handle *h, uint32_t epoch)
+{
+    handle_cnode *new;
+    uint32_t hash;
+    size_t len;
+
+    pthread_mutex_lock(&ds->cache_lock);
+    if(ds->cache_limit <= 0 || epoch != ds->cache_epoch) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        return 0;
+    }
+    hash = _handle_hash(str, count);
+    if((new = _find_handle(ds, str, count, hash)) != NULL) {
+        _handle_remove(ds, new);
+        free(new);
+    }
+    /* The nodes are different sizes so the least recently used one is
+     * freed instead of being reused */
+    if(ds->handle_count >= ds->cache_limit) {
+        new = ds->handle_head->prev;
+        _handle_remove(ds, new);
+        free(new);
+    }
+    len = strlen(str) + 1;
+    new = malloc(sizeof(handle_cnode) + len);
+    if(new == NULL) {
+        pthread_mutex_unlock(&ds->cache_lock);
+        return ERR_ALLOC;
+    }
+    memcpy(new->str, str, len);
+    new->h = *h;
+    new->count = count;
+    new->hash = hash;
+    new->str_next = ds->handle_strs[hash & (ds->cache_hashsize - 1)];
+    ds->handle_strs[hash & (ds->cache_hashsize - 1)] = new;
+    hash = _index_hash(ds, h->index);
+    new->idx_next = ds->handle_indexes[hash];
+    ds->handle_indexes[hash] = new;
+    _handle_push(ds, new);
+    ds->handle_count++;
+    pthread_mutex_unlock(&ds->cache_lock);
     return 0;
 }
 
@@ -245,105 +567,93 @@ cache_tag_del(dax_state *ds, tag_index idx) {
 /* Type specific reading and writing functions.  These should be the most common
  * methods to read and write tags to the sever.*/
 
-/* This is a recursive function that traverses the *data and makes the proper
- * data conversions based on the data type. */
+/* Converts count elements of the base datatype at *data between the
+ * server's format and ours.  The only difference that we can handle is the
+ * byte order and swapping the bytes works the same in both directions. */
 static inline int
-_read_format(dax_state *ds, tag_type type, int count, void *data, int offset)
+_format_base(dax_state *ds, tag_type type, int count, void *data)
+{
+    switch(type) {
+        case DAX_BOOL:
+        case DAX_BYTE:
+        case DAX_SINT:
+        case DAX_CHAR:
+            /* Since there are no conversions for byte level tags we do nothing */
+            break;
+        case DAX_WORD:
+        case DAX_UINT:
+        case DAX_INT:
+            if(ds->reformat & REF_INT_SWAP) conv_swap16(data, count);
+            break;
+        case DAX_DWORD:
+        case DAX_UDINT:
+        case DAX_DINT:
+            if(ds->reformat & REF_INT_SWAP) conv_swap32(data, count);
+            break;
+        case DAX_REAL:
+            if(ds->reformat & REF_FLT_SWAP) conv_swap32(data, count);
+            break;
+        case DAX_LWORD:
+        case DAX_ULINT:
+        case DAX_LINT:
+        case DAX_TIME:
+            if(ds->reformat & REF_INT_SWAP) conv_swap64(data, count);
+            break;
+        case DAX_LREAL:
+            if(ds->reformat & REF_FLT_SWAP) conv_swap64(data, count);
+            break;
+        default:
+            return ERR_ARG;
+    }
+    return 0;
+}
+
+/* Converts the data between the server's format and ours.  Compound
+ * datatypes are converted with the run table that was built when the
+ * datatype was cached so there is no recursion here.  If the server uses the
+ * same format that we do there is nothing to do. */
+static int
+_format_data(dax_state *ds, tag_type type, int count, void *data)
 {
-    int n, pos, result;
-    char *newdata;
-    datatype *dtype = NULL;
-    cdt_member *this = NULL;
+    int n, i, result;
+    datatype *dtype;
+    char *elem;
 
+    if(ds->reformat == 0) return 0;
     type &= ~DAX_QUEUE; /* Delete the Queue bit from the type */
-    newdata = (char *)data + offset;
     if(IS_CUSTOM(type)) {
-        /* iterate through the list */
         dtype = get_cdt_pointer(ds, type, NULL);
-        pos = offset;
-        if(dtype != NULL) {
-            this = dtype->members;
-        } else {
+        if(dtype == NULL || dtype->size == 0) {
             return ERR_NOTFOUND;
         }
-        while(this != NULL) {
-            result = _read_format(ds, this->type, this->count, data, pos);
-            if(result) return result;
-            if(IS_CUSTOM(this->type)) {
-                pos += (dax_get_typesize(ds, this->type) * this->count);
-            } else {
-                /* This gets the size in bits */
-                pos += TYPESIZE(this->type) * this->count / 8;
+        elem = data;
+        for(n = 0; n < count; n++) {
+            for(i = 0; i < dtype->run_count; i++) {
+                result = _format_base(ds, dtype->runs[i].type, dtype->runs[i].count, elem + dtype->runs[i].offset);
+                if(result) return result;
             }
-            this = this->next;
-        }
-    } else {
-        switch(type) {
-            case DAX_BOOL:
-            case DAX_BYTE:
-            case DAX_SINT:
-            case DAX_CHAR:
-                /* Since there are no conversions for byte level tags we do nothing */
-                break;
-            case DAX_WORD:
-            case DAX_UINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_uint *)newdata)[n] = stom_uint(((dax_uint *)newdata)[n]);
-                }
-                break;
-            case DAX_INT:
-                for(n = 0; n < count; n++) {
-                    ((dax_int *)newdata)[n] = stom_int(((dax_int *)newdata)[n]);
-                }
-                break;
-            case DAX_DWORD:
-            case DAX_UDINT:
-            case DAX_TIME:
-                for(n = 0; n < count; n++) {
-                    ((dax_udint *)newdata)[n] = stom_udint(((dax_udint *)newdata)[n]);
-                }
-                break;
-            case DAX_DINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_dint *)newdata)[n] = stom_dint(((dax_dint *)newdata)[n]);
-                }
-                break;
-            case DAX_REAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_real *)newdata)[n] = stom_real(((dax_real *)newdata)[n]);
-                }
-                break;
-            case DAX_LWORD:
-            case DAX_ULINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_ulint *)newdata)[n] = stom_ulint(((dax_ulint *)newdata)[n]);
-                }
-                break;
-            case DAX_LINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_lint *)newdata)[n] = stom_lint(((dax_lint *)newdata)[n]);
-                }
-                break;
-            case DAX_LREAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_lreal *)newdata)[n] = stom_lreal(((dax_lreal *)newdata)[n]);
-                }
-                break;
-            default:
-                return ERR_ARG;
-                break;
+            elem += dtype->size;
         }
+        return 0;
     }
-    return 0;
+    return _format_base(ds, type, count, data);
+}
+
+/* Converts the data that was read from the server to our format */
+static inline int
+_read_format(dax_state *ds, tag_type type, int count, void *data)
+{
+    return _format_data(ds, type, count, data);
 }
 
 /*!
  * Higher level tag reading function.  This function is much more intelligent
  * about what type of data is being read.  It reads the data and then does
  * any conversions necessary.  It will also break up large reads into several
- * smaller ones if necessary.  Since multiple messages are used to read
- * large amounts of data there is a race condition where tag data can be
- * changed by other modules between these read messages.
+ * smaller ones if they won't fit in the frame size that was negotiated with
+ * the server.  Since multiple messages are used to read large amounts of data
+ * there is a race condition where tag data can be changed by other modules
+ * between these read messages.
  *
  * @param ds Pointer to dax state object
  * @param handle The handle that describes the data that we wish to read
@@ -358,17 +668,17 @@ dax_tag_read(dax_state *ds, tag_handle handle, void *data)
     int rsize, tsize, type_size;
 
     /* If the read can't be done in one message...  */
-    if(handle.size > MSG_DATA_SIZE) {
+    if(handle.size > MSG_DATA_MAX(ds)) {
         tsize = handle.size;
         type_size = dax_get_typesize(ds, handle.type);
         /* We don't want to break individual tag reads to avoid getting
         bad data if another module updates the tag between reads.  If
         the size of the data type is larger than our maximum data size
         then we error out instead of risking bad data. */
-        if(type_size > MSG_DATA_SIZE) return ERR_2BIG;
+        if(type_size > MSG_DATA_MAX(ds)) return ERR_2BIG;
         n = 0;
         while(tsize > 0) {
-            rsize = MIN(tsize, MSG_DATA_SIZE);
+            rsize = MIN(tsize, MSG_DATA_MAX(ds));
             rsize -= (rsize % type_size); /* This should break accross tag boundaries */
             result = dax_read(ds, handle.index, handle.byte+n, &((uint8_t *)data)[n], rsize);
             if(result) return result;
@@ -401,7 +711,7 @@ dax_tag_read(dax_state *ds, tag_handle handle, void *data)
         free(newdata);
     } else {
         pthread_mutex_lock(&ds->lock);
-        result = _read_format(ds, handle.type, handle.count, data, 0);
+        result = _read_format(ds, handle.type, handle.count, data);
         pthread_mutex_unlock(&ds->lock);
         return result;
     }
@@ -410,99 +720,16 @@ dax_tag_read(dax_state *ds, tag_handle handle, void *data)
 
 
 /* This reformats the information in *data to prepare it to be written
- * to the server by changing the byte ordering and number format if
- * necessary to match the server */
+ * to the server by changing the byte ordering if necessary to match the
+ * server */
 static inline int
-_write_format(dax_state *ds, tag_type type, int count, void *data, int offset)
+_write_format(dax_state *ds, tag_type type, int count, void *data)
 {
-    int n, pos, result;
-    char *newdata;
-    datatype *dtype = NULL;
-    cdt_member *this = NULL;
-
-    type &= ~DAX_QUEUE; /* Delete the Queue bit from the type */
-    newdata = (char *)data + offset;
-    if(IS_CUSTOM(type)) {
-        /* iterate through the list */
-        dtype = get_cdt_pointer(ds, type, NULL);
-        pos = offset;
-        if(dtype != NULL) {
-            this = dtype->members;
-        } else {
-            return ERR_NOTFOUND;
-        }
-        while(this != NULL) {
-            result = _write_format(ds, this->type, this->count, newdata, pos);
-            if(result) return result;
-            if(IS_CUSTOM(this->type)) {
-                pos += (dax_get_typesize(ds, this->type) * this->count);
-            } else {
-                /* This gets the size in bits */
-                pos += TYPESIZE(this->type) * this->count / 8;
-            }
-            this = this->next;
-        }
-    } else {
-        switch(type) {
-            case DAX_BOOL:
-            case DAX_BYTE:
-            case DAX_SINT:
-            case DAX_CHAR:
-                break;
-            case DAX_WORD:
-            case DAX_UINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_uint *)newdata)[n] = mtos_uint(((dax_uint *)newdata)[n]);
-                }
-                break;
-            case DAX_INT:
-                for(n = 0; n < count; n++) {
-                    ((dax_int *)newdata)[n] = mtos_int(((dax_int *)newdata)[n]);
-                }
-                break;
-            case DAX_DWORD:
-            case DAX_UDINT:
-            case DAX_TIME:
-                for(n = 0; n < count; n++) {
-                    ((dax_udint *)newdata)[n] = mtos_udint(((dax_udint *)newdata)[n]);
-                }
-                break;
-            case DAX_DINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_dint *)newdata)[n] = mtos_dint(((dax_dint *)newdata)[n]);
-                }
-                break;
-            case DAX_REAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_real *)newdata)[n] = mtos_real(((dax_real *)newdata)[n]);
-                }
-                break;
-            case DAX_LWORD:
-            case DAX_ULINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_ulint *)newdata)[n] = mtos_ulint(((dax_ulint *)newdata)[n]);
-                }
-                break;
-            case DAX_LINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_lint *)newdata)[n] = mtos_lint(((dax_lint *)newdata)[n]);
-                }
-                break;
-            case DAX_LREAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_lreal *)newdata)[n] = mtos_lreal(((dax_lreal *)newdata)[n]);
-                }
-                break;
-            default:
-                return ERR_ARG;
-                break;
-        }
-    }
-    return 0;
+    return _format_data(ds, type, count, data);
 }
 
 /* Since a write message needs a couple of words in the header we have
-   to subtract these bytes from the MSG_DATA_SIZE to determine how much
+   to subtract these bytes from the MSG_DATA_MAX(ds) to determine how much
    room we have to write data.  This is here for convenience and clarity */
 #define WRITE_HEADER_SIZE 8
 
@@ -549,13 +776,13 @@ dax_tag_write(dax_state *ds, tag_handle handle, void *data)
             i++;
         }
         /* Determine if the write needs to be broken up into multiple messages */
-        if(handle.size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2) {
+        if(handle.size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2) {
             tsize = size;
             type_size = dax_get_typesize(ds, handle.type);
-            if(type_size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2) return ERR_2BIG;
+            if(type_size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2) return ERR_2BIG;
             n = 0;
             while(tsize > 0) {
-                rsize = MIN(tsize, (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2);
+                rsize = MIN(tsize, (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2);
                 rsize -= (rsize % type_size); /* This should break accross tag boundaries */
                 result = dax_mask(ds, handle.index, handle.byte+n, &((uint8_t *)newdata)[n], &mask[n], rsize);
                 if(result) return result;
@@ -569,7 +796,7 @@ dax_tag_write(dax_state *ds, tag_handle handle, void *data)
         free(mask);
     } else {
         pthread_mutex_lock(&ds->lock);
-        result =  _write_format(ds, handle.type, handle.count, data, 0);
+        result =  _write_format(ds, handle.type, handle.count, data);
         if(result) {
             pthread_mutex_unlock(&ds->lock);
             return result;
@@ -577,13 +804,13 @@ dax_tag_write(dax_state *ds, tag_handle handle, void *data)
         /* Unlock here because dax_write() has it's own locking */
         pthread_mutex_unlock(&ds->lock);
         /* Determine if the write needs to be broken up into multiple messages */
-        if(handle.size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)) {
+        if(handle.size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)) {
             tsize = handle.size;
             type_size = dax_get_typesize(ds, handle.type);
-            if(type_size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)) return ERR_2BIG;
+            if(type_size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)) return ERR_2BIG;
             n = 0;
             while(tsize > 0) {
-                rsize = MIN(tsize, (MSG_DATA_SIZE - WRITE_HEADER_SIZE));
+                rsize = MIN(tsize, (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE));
                 rsize -= (rsize % type_size); /* This should break accross tag boundaries */
                 result = dax_write(ds, handle.index, handle.byte+n, &((uint8_t *)data)[n], rsize);
                 if(result) return result;
@@ -643,13 +870,13 @@ dax_tag_mask(dax_state *ds, tag_handle handle, void *data, void *mask)
             i++;
         }
         /* Determine if the write needs to be broken up into multiple messages */
-        if(handle.size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2) {
+        if(handle.size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2) {
             tsize = size;
             type_size = dax_get_typesize(ds, handle.type);
-            if(type_size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)) return ERR_2BIG;
+            if(type_size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)) return ERR_2BIG;
             n = 0;
             while(tsize > 0) {
-                rsize = MIN(tsize, (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2);
+                rsize = MIN(tsize, (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2);
                 rsize -= (rsize % type_size); /* This should break accross tag boundaries */
                 result = dax_mask(ds, handle.index, handle.byte+n, &newdata[n], &newmask[n], rsize);
                 if(result) return result;
@@ -663,7 +890,7 @@ dax_tag_mask(dax_state *ds, tag_handle handle, void *data, void *mask)
         free(newdata);
     } else {
         pthread_mutex_lock(&ds->lock);
-        result =  _write_format(ds, handle.type, handle.count, data, 0);
+        result =  _write_format(ds, handle.type, handle.count, data);
         if(result) {
             pthread_mutex_unlock(&ds->lock);
             return result;
@@ -671,13 +898,13 @@ dax_tag_mask(dax_state *ds, tag_handle handle, void *data, void *mask)
         /* Unlock here because dax_mask() has it's own locking */
         pthread_mutex_unlock(&ds->lock);
         /* Determine if the write needs to be broken up into multiple messages */
-        if(handle.size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2) {
+        if(handle.size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2) {
             tsize = handle.size;
             type_size = dax_get_typesize(ds, handle.type);
-            if(type_size > (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2) return ERR_2BIG;
+            if(type_size > (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2) return ERR_2BIG;
             n = 0;
             while(tsize > 0) {
-                rsize = MIN(tsize, (MSG_DATA_SIZE - WRITE_HEADER_SIZE)/2);
+                rsize = MIN(tsize, (MSG_DATA_MAX(ds) - WRITE_HEADER_SIZE)/2);
                 rsize -= (rsize % type_size); /* This should break accross tag boundaries */
                 result = dax_mask(ds, handle.index, handle.byte+n, &((uint8_t *)data)[n], &((uint8_t *)mask)[n], rsize);
                 if(result) return result;
@@ -703,13 +930,52 @@ group_read_format(dax_state *ds, tag_group_id *id, uint8_t *buff) {
 
     for(n=0;n<id->count;n++) {
         h = id->handles[n];
-        result = _read_format(ds, h.type, h.count, &buff[offset], 0);
+        result = _read_format(ds, h.type, h.count, &buff[offset]);
         if(result) return result;
         offset += h.size;
     }
     return 0;
 }
 
+/* Copies the members that are in the response to a delta group read into
+ * the caller's data and reformats them.  buff starts with the bitmap of
+ * the members that are there.  Returns the number of members. */
+int
+group_read_apply(dax_state *ds, tag_group_id *id, uint8_t *data, uint8_t *buff, size_t size) {
+    int n, offset = 0, changed = 0, result;
+    size_t in;
+    tag_handle h;
+
+    in = GRP_DELTA_MAP_SIZE(id->count);
+    if(size < in) return ERR_MSG_BAD;
+    for(n=0;n<id->count;n++) {
+        h = id->handles[n];
+        if(buff[n / 8] & (1 << (n % 8))) {
+            if(in + h.size > size) return ERR_MSG_BAD;
+            memcpy(&data[offset], &buff[in], h.size);
+            result = _read_format(ds, h.type, h.count, &data[offset]);
+            if(result) return result;
+            in += h.size;
+            changed++;
+        }
+        offset += h.size;
+    }
+    return changed;
+}
+
+/* Returns the number of bytes of data that follow the bitmap at the start
+ * of the response to a delta group read */
+size_t
+group_delta_size(tag_group_id *id, uint8_t *map) {
+    int n;
+    size_t size = 0;
+
+    for(n=0;n<id->count;n++) {
+        if(map[n / 8] & (1 << (n % 8))) size += id->handles[n].size;
+    }
+    return size;
+}
+
 int
 group_write_format(dax_state *ds, tag_group_id *id, uint8_t *buff) {
     int n, offset = 0, result;
@@ -717,7 +983,7 @@ group_write_format(dax_state *ds, tag_group_id *id, uint8_t *buff) {
 
     for(n=0;n<id->count;n++) {
         h = id->handles[n];
-        result = _write_format(ds, h.type, h.count, &buff[offset], 0);
+        result = _write_format(ds, h.type, h.count, &buff[offset]);
         if(result) return result;
         offset += h.size;
     }
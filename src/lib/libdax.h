@@ -53,27 +53,55 @@ typedef struct tag_cnode {
     unsigned int type;
     unsigned int count;
     unsigned int attr;
-    struct tag_cnode *next;
+    uint32_t hash;                /* Hash of the name */
+    struct tag_cnode *next;       /* Least recently used order */
     struct tag_cnode *prev;
+    struct tag_cnode *name_next;  /* Next node in the name hash bucket */
+    struct tag_cnode *idx_next;   /* Next node in the index hash bucket */
     char name[DAX_TAGNAME_SIZE + 1];
 } tag_cnode;
 
+/* This is the structure for our tag handle cache */
+typedef struct handle_cnode {
+    tag_handle h;
+    int count;                      /* The count that the handle was asked for with */
+    uint32_t hash;                  /* Hash of the string and the count */
+    struct handle_cnode *next;      /* Least recently used order */
+    struct handle_cnode *prev;
+    struct handle_cnode *str_next;  /* Next node in the string hash bucket */
+    struct handle_cnode *idx_next;  /* Next node in the index hash bucket */
+    char str[];                     /* The string that the handle was asked for with */
+} handle_cnode;
+
 /* This is the compound datatype member definition.  The
  * members are represented as a linked list */
 struct cdt_member {
     char *name;
     tag_type type;
     int count;
+    unsigned int byte;  /* Offset of the member from the start of the datatype */
+    unsigned int bit;   /* Bit offset within that byte, only BOOLs have one */
     struct cdt_member *next;
 };
 
 typedef struct cdt_member cdt_member;
 
+/* This is a run of elements of the same base datatype somewhere inside of a
+ * compound datatype.  These are what the data conversion functions use. */
+typedef struct cdt_run {
+    uint32_t offset;    /* Byte offset from the start of the datatype */
+    tag_type type;      /* Base datatype of the elements */
+    uint32_t count;     /* Number of elements in the run */
+} cdt_run;
+
 /* This is the structure that represents the container for each
  * datatype. */
 struct datatype{
     char *name;
     cdt_member *members;
+    int size;           /* Size in bytes, zero until the member offsets are figured */
+    cdt_run *runs;      /* Every element that might need to be converted in order */
+    int run_count;      /* Number of runs in the array */
 };
 
 typedef struct datatype datatype;
@@ -82,21 +110,43 @@ struct tag_group_id {
     uint32_t index;     /* Unique identifier that the server uses */
     int count;           /* Number of tag handles in the group */
     int size;            /* Total size of the group's data in bytes */
-    uint8_t options;    /* Not implemented yet */
+    uint8_t options;    /* GROUP_OPT_* flags */
+    uint8_t resync;     /* Ask for every member on the next delta read */
     tag_handle *handles; /* Array of tag handles that describes the group */
 };
 
 typedef struct tag_group_id tag_group_id;
 
-/* Right now the event_db is stored within the dax_state as an array. */
+/* The event_db is stored within the dax_state as a hash table keyed by
+ * the tag index and the event id. */
 typedef struct event_db {
     uint32_t idx;  /* Tag index of the event */
     uint32_t id;   /* Individual id of the event */
+    struct event_db *next; /* Next event in the same hash bucket */
     void *udata;    /* The user data to be sent with callback() */
     void (*callback)(dax_state *ds, void *udata);  /* Callback function */
     void (*free_callback)(void *udata); /* Callback to free userdata */
 } event_db;
 
+/* This is a request that has been sent to the server and is waiting for
+ * a response.  The server answers the requests from a connection in the
+ * order that they were sent.  If the server copies our request ids into
+ * the responses they are matched by id and any requests in front of the
+ * one that was answered never will be.  Otherwise the responses are
+ * matched to the oldest request in the table. */
+typedef struct dax_request {
+    uint32_t id;       /* Sequential id of the request */
+    int command;       /* The command that was sent */
+    uint8_t flags;     /* REQ_SYNC, REQ_DISCARD */
+    void *data;        /* Where the response data goes for asynchronous requests */
+    size_t size;       /* Size of the data area */
+    void *udata;       /* The user data to be sent with callback() */
+    void (*callback)(dax_state *ds, int result, void *udata);
+} dax_request;
+
+#define REQ_SYNC    0x01 /* A synchronous function is waiting on last_msg */
+#define REQ_DISCARD 0x02 /* Nobody is waiting on the response anymore */
+
 
 /* This is the main dax_state structure that holds all the information
    for one dax server connection */
@@ -106,29 +156,52 @@ struct dax_state {
     char* modulename;
     int error_code; /* Last error code of the connection */
     int msgtimeout;
+    uint32_t msgmax;       /* Maximum frame size negotiated with the server */
     uint32_t id;           /* ID uniquely identifies the server instance */
     int sfd;               /* Server's File Descriptor */
     unsigned int reformat; /* Flags to show how to reformat the incoming data */
     int logflags;
-    tag_cnode *cache_head; /* First node in the cache list */
+    tag_cnode *cache_head; /* Most recently used node in the cache list */
     int cache_limit;       /* Total number of nodes that we'll allocate */
     int cache_count;       /* How many nodes we actually have */
+    tag_cnode **cache_names;     /* Hash table of the cache by name */
+    tag_cnode **cache_indexes;   /* Hash table of the cache by index */
+    unsigned int cache_hashsize; /* Number of buckets in each table */
+    uint32_t cache_epoch;        /* Incremented for every invalidation */
+    pthread_mutex_t cache_lock;  /* The connection thread uses the cache too */
+    handle_cnode *handle_head;     /* Most recently used node in the handle cache */
+    int handle_count;              /* How many handles are in the cache */
+    handle_cnode **handle_strs;    /* Hash table of the handle cache by string */
+    handle_cnode **handle_indexes; /* Hash table of the handle cache by tag index */
     datatype *datatypes;
     unsigned int datatype_size;
     pthread_mutex_t lock;
     pthread_t connection_thread;
+    int thread_running;    /* connection_thread has not been joined yet */
     pthread_barrier_t connect_barrier; /* Synchronize the connection thread */
     pthread_mutex_t event_lock, msg_lock; /* Locks for the message handling functions */
     pthread_cond_t event_cond, msg_cond; /* Condition variables for the message handling */
-    event_db *events;      /* Array of events stored for this connection */
-    int event_size;        /* Current size of the events array */
-    int event_count;       /* Total number of events stored in the array */
+    event_db **events;     /* Hash table of events stored for this connection */
+    int event_size;        /* Number of buckets in the events hash table */
+    int event_count;       /* Total number of events stored in the table */
     int event_data_size;   /* Size of the event data that is stored here */
     char *event_data;      /* Pointer to the event data that was returned */
-    dax_message **emsg_queue; /* Event Message FIFO Queue */
+    dax_message **emsg_queue; /* Event Message FIFO Queue (ring) */
     int emsg_queue_size;     /* Total size of the Event Message Queue */
+    int emsg_queue_head;     /* Index of the oldest entry in the ring */
     int emsg_queue_count;    /* number of entries in the event message queue */
+    dax_message **emsg_pool; /* Spare event message buffers */
+    int emsg_pool_count;     /* Number of buffers in emsg_pool */
     dax_message *last_msg;   /* The last message received on the socket */
+    dax_request *requests;   /* Ring of requests waiting on the server */
+    int request_head;        /* Index of the oldest request in the ring */
+    int request_count;       /* Number of requests in the ring */
+    uint32_t request_id;     /* Id of the last request that was sent */
+    uint32_t request_done;   /* Id of the last request that was answered */
+    uint32_t sync_id;        /* Id of the request that the synchronous functions are waiting on */
+    uint8_t reqids;          /* The server puts our request ids in the responses */
+    uint8_t *shm;            /* Shared memory tag data from the server, NULL if we don't have it */
+    uint32_t shm_size;       /* Size of the shared memory region */
     void (*disconnect_callback)(int result);
 };
 
@@ -137,6 +210,12 @@ struct dax_state {
 #define DEFAULT_TIMEOUT  "1000"
 
 #define EVENT_QUEUE_SIZE 8 /* Initial size of the event queue */
+#define EVENT_TABLE_SIZE 16 /* Initial number of buckets in the event hash table */
+#define MAX_REQUESTS 256   /* Number of requests that can be waiting on the server */
+#define SHM_READ_RETRIES 16 /* Times we'll retry a shared memory read that the server interrupted */
+
+/* Largest payload that will fit in a single message on this connection */
+#define MSG_DATA_MAX(ds) ((ds)->msgmax - MSG_HDR_SIZE)
 
 /* Data Conversion Functions */
 #define REF_INT_SWAP 0x0001
@@ -182,6 +261,13 @@ dax_lreal stom_lreal(dax_lreal);
 int mtos_generic(tag_type type, void *dst, void *src);
 int stom_generic(tag_type type, void *dst, void *src);
 
+/* Bulk byte swapping functions */
+void conv_swap16(void *data, size_t count);
+void conv_swap32(void *data, size_t count);
+void conv_swap64(void *data, size_t count);
+int conv_set_kernel(const char *name);
+const char *conv_get_kernel(void);
+
 /* Initialize the configuration */
 int init_config(dax_state *ds);
 /* These functions handle the tag cache */
@@ -191,6 +277,11 @@ int check_cache_index(dax_state *, tag_index, dax_tag *);
 int check_cache_name(dax_state *, char *, dax_tag *);
 int cache_tag_add(dax_state *, dax_tag *);
 int cache_tag_del(dax_state *, tag_index);
+int cache_tag_add_since(dax_state *, dax_tag *, uint32_t epoch);
+uint32_t cache_get_epoch(dax_state *);
+void cache_invalidate(dax_state *, tag_index);
+int check_cache_handle(dax_state *, char *str, int count, tag_handle *);
+int cache_handle_add_since(dax_state *, char *str, int count, tag_handle *, uint32_t epoch);
 
 int opt_get_msgtimeout(dax_state *);
 int opt_lua_init_func(dax_state *);
@@ -201,12 +292,17 @@ int dax_cdt_get(dax_state *ds, tag_type type, char *name);
 
 int push_event(dax_state *ds, dax_message *msg);
 dax_message *pop_event(dax_state *ds);
+dax_message *event_msg_alloc(dax_state *ds, uint32_t size);
+void event_msg_free(dax_state *ds, dax_message *msg);
+void free_events(dax_state *ds);
 int add_event(dax_state *ds, dax_id id, void *udata, void (*callback)(dax_state *ds, void *udata),
               void (*free_callback)(void *));
 int del_event(dax_state *ds, dax_id id);
 int exec_event(dax_state *ds, dax_id id);
 
 int group_read_format(dax_state *ds, tag_group_id *id, uint8_t *buff);
+int group_read_apply(dax_state *ds, tag_group_id *id, uint8_t *data, uint8_t *buff, size_t size);
+size_t group_delta_size(tag_group_id *id, uint8_t *map);
 int group_write_format(dax_state *ds, tag_group_id *id, uint8_t *buff);
 
 #endif /* !__LIBDAX_H */
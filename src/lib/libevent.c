@@ -84,6 +84,55 @@ dax_event_type_to_string(int type) {
     }
 }
 
+/* Returns the bucket in the event hash table for the tag index and event id.
+ * The table size is always a power of two. */
+static inline int
+_event_hash(dax_state *ds, uint32_t idx, uint32_t id)
+{
+    uint32_t hash;
+
+    hash = (idx * 2654435761u) ^ (id * 40503u);
+    return (hash ^ (hash >> 16)) & (ds->event_size - 1);
+}
+
+/* Doubles the number of buckets in the event hash table and moves the
+ * events into the new table */
+static int
+_event_grow(dax_state *ds)
+{
+    event_db **new_table, *this, *next;
+    int n, size, bucket;
+
+    size = ds->event_size;
+    new_table = calloc(size * 2, sizeof(event_db *));
+    if(new_table == NULL) return ERR_ALLOC;
+    ds->event_size = size * 2;
+    for(n = 0; n < size; n++) {
+        for(this = ds->events[n]; this != NULL; this = next) {
+            next = this->next;
+            bucket = _event_hash(ds, this->idx, this->id);
+            this->next = new_table[bucket];
+            new_table[bucket] = this;
+        }
+    }
+    free(ds->events);
+    ds->events = new_table;
+    return 0;
+}
+
+static event_db *
+_event_find(dax_state *ds, uint32_t idx, uint32_t id)
+{
+    event_db *this;
+
+    this = ds->events[_event_hash(ds, idx, id)];
+    while(this != NULL) {
+        if(this->idx == idx && this->id == id) return this;
+        this = this->next;
+    }
+    return NULL;
+}
+
 /* Store the event information into a database internal to the library.  This is
  * where the callbacks and the userdata are stored.  The server simply sends an ID
  */
@@ -92,26 +141,22 @@ add_event(dax_state *ds, dax_id id, void *udata, void (*callback)(dax_state *ds,
           void (*free_callback)(void *udata))
 {
     event_db *new_db;
+    int bucket;
 
-    /* check to see if we need to grow the database */
-    if(ds->event_count == ds->event_size) {
-        /* For now we just double the size */
-        new_db = realloc(ds->events, (ds->event_size * 2) * sizeof(event_db));
-        if(new_db != NULL) {
-            ds->events = new_db;
-            ds->event_size *= 2;
-        } else {
-            return ERR_ALLOC;
-        }
+    /* Keep the chains short by growing the table when it gets full */
+    if(ds->event_count >= ds->event_size) {
+        if(_event_grow(ds)) return ERR_ALLOC;
     }
-    /* For now we are just putting these in unsorted and the search
-     * routine in the dispatch function will be a simple linear search */
-    /* TODO: Sort this array and add binary search to event_dispatch() */
-    ds->events[ds->event_count].idx = id.index;
-    ds->events[ds->event_count].id = id.id;
-    ds->events[ds->event_count].udata = udata;
-    ds->events[ds->event_count].callback = callback;
-    ds->events[ds->event_count].free_callback = free_callback;
+    new_db = malloc(sizeof(event_db));
+    if(new_db == NULL) return ERR_ALLOC;
+    new_db->idx = id.index;
+    new_db->id = id.id;
+    new_db->udata = udata;
+    new_db->callback = callback;
+    new_db->free_callback = free_callback;
+    bucket = _event_hash(ds, id.index, id.id);
+    new_db->next = ds->events[bucket];
+    ds->events[bucket] = new_db;
 
     ds->event_count++;
     return 0;
@@ -122,21 +167,52 @@ add_event(dax_state *ds, dax_id id, void *udata, void (*callback)(dax_state *ds,
 int
 del_event(dax_state *ds, dax_id id)
 {
-    int n;
+    event_db **link, *this;
 
-    for(n = 0; n < ds->event_count; n++) {
-        if(ds->events[n].idx == id.index && ds->events[n].id == id.id) {
-            if(ds->events[n].free_callback) {
-                ds->events[n].free_callback(ds->events[n].udata);
+    link = &ds->events[_event_hash(ds, id.index, id.id)];
+    for(this = *link; this != NULL; this = *link) {
+        if(this->idx == id.index && this->id == id.id) {
+            if(this->free_callback) {
+                this->free_callback(this->udata);
             }
-            memmove(&ds->events[n], &ds->events[n+1], sizeof(event_db) * (ds->event_count - n-1));
+            *link = this->next;
+            free(this);
             ds->event_count--;
             return 0;
         }
+        link = &this->next;
     }
     return ERR_NOTFOUND;
 }
 
+/* Frees all of the events in the table and the queued event messages.  The
+ * free_callback() is called for each of the events that has one. */
+void
+free_events(dax_state *ds)
+{
+    event_db *this, *next;
+    int n;
+
+    for(n = 0; n < ds->event_size; n++) {
+        for(this = ds->events[n]; this != NULL; this = next) {
+            next = this->next;
+            if(this->free_callback) {
+                this->free_callback(this->udata);
+            }
+            free(this);
+        }
+        ds->events[n] = NULL;
+    }
+    ds->event_count = 0;
+    while(ds->emsg_queue_count > 0) {
+        free(pop_event(ds));
+    }
+    for(n = 0; n < ds->emsg_pool_count; n++) {
+        free(ds->emsg_pool[n]);
+    }
+    ds->emsg_pool_count = 0;
+}
+
 /* This function deals with a single event.
  *
  * @param ds Pointer to the dax state object
@@ -149,48 +225,112 @@ del_event(dax_state *ds, dax_id id)
 int
 dispatch_event(dax_state *ds, dax_message *msg, dax_id *id)
 {
-    int n;
+    event_db *event;
     uint32_t idx, eid;
 
     idx =      ntohl(*(uint32_t *)(&msg->data[0]));
     eid =      ntohl(*(uint32_t *)(&msg->data[4]));
+    event = _event_find(ds, idx, eid);
+    if(event == NULL) {
+        dax_log(DAX_LOG_ERROR, "dax_event_dispatch() received an event that does not exist in database");
+        return ERR_GENERIC;
+    }
     /* we just store the pointer to the message data in case the callback needs it
      * This data can be retrieved in the callback by dax_event_get_data() */
     ds->event_data = &msg->data[8];
     ds->event_data_size = msg->size-8;
-    for(n = 0; n < ds->event_count; n ++) {
-        if(ds->events[n].idx == idx && ds->events[n].id == eid) {
-            if(ds->events[n].callback != NULL) {
-                ds->events[n].callback(ds, ds->events[n].udata);
-            }
-            if(id != NULL) {
-                id->id = eid;
-                id->index = idx;
-            }
-            ds->event_data = NULL; /* This indicates that the data is out of scope now */
-            return 0;
-        }
+    if(event->callback != NULL) {
+        event->callback(ds, event->udata);
+    }
+    if(id != NULL) {
+        id->id = eid;
+        id->index = idx;
     }
     ds->event_data = NULL; /* This indicates that the data is out of scope now */
-    dax_log(DAX_LOG_ERROR, "dax_event_dispatch() received an event that does not exist in database");
-    return ERR_GENERIC;
+    return 0;
 }
 
-static void
-_pop_event(dax_state *ds, dax_message *msg) {
-    int n;
+/* Event messages that fit in MSG_DATA_SIZE are always allocated with room for
+ * MSG_DATA_SIZE bytes so that the buffers can be handed out again for the next
+ * event.  Up to emsg_queue_size of them are kept in emsg_pool.  The larger
+ * messages are allocated to size and freed when they are done. */
+dax_message *
+event_msg_alloc(dax_state *ds, uint32_t size)
+{
+    dax_message *msg = NULL;
+
+    if(size > MSG_DATA_SIZE) {
+        return malloc(sizeof(dax_message) + size);
+    }
+    pthread_mutex_lock(&ds->event_lock);
+    if(ds->emsg_pool_count > 0) {
+        msg = ds->emsg_pool[--ds->emsg_pool_count];
+    }
+    pthread_mutex_unlock(&ds->event_lock);
+    if(msg == NULL) {
+        msg = malloc(sizeof(dax_message) + MSG_DATA_SIZE);
+    }
+    return msg;
+}
+
+/* Gives a message from event_msg_alloc() back to the pool */
+void
+event_msg_free(dax_state *ds, dax_message *msg)
+{
+    if(msg == NULL) return;
+    if(msg->size <= MSG_DATA_SIZE) {
+        pthread_mutex_lock(&ds->event_lock);
+        if(ds->emsg_pool_count < ds->emsg_queue_size) {
+            ds->emsg_pool[ds->emsg_pool_count++] = msg;
+            msg = NULL;
+        }
+        pthread_mutex_unlock(&ds->event_lock);
+    }
+    free(msg);
+}
 
-    msg->msg_type = ds->emsg_queue[0]->msg_type;
-    msg->size = ds->emsg_queue[0]->size;
-    msg->fd = ds->emsg_queue[0]->fd;
-    memcpy(msg->data, ds->emsg_queue[0]->data, ds->emsg_queue[0]->size);
-    free(ds->emsg_queue[0]); /* Free the top one */
-    /* Move the rest up */
-    for(n = 0;n<ds->emsg_queue_count-1;n++) {
-        ds->emsg_queue[n] = ds->emsg_queue[n+1];
+/* Adds the message to the end of the event message queue.  The queue is a
+ * ring so if it is full the oldest message is thrown away to make room.
+ * Must be called with ds->event_lock held.  Returns ERR_OVERFLOW if a message
+ * was lost. */
+int
+push_event(dax_state *ds, dax_message *msg)
+{
+    dax_message *old;
+    int result = 0;
+
+    if(ds->emsg_queue_count == ds->emsg_queue_size) { /* FIFO is full */
+        old = ds->emsg_queue[ds->emsg_queue_head];
+        ds->emsg_queue_head = (ds->emsg_queue_head + 1) % ds->emsg_queue_size;
+        ds->emsg_queue_count--;
+        /* We already have the lock so we can't use event_msg_free() */
+        if(old->size <= MSG_DATA_SIZE && ds->emsg_pool_count < ds->emsg_queue_size) {
+            ds->emsg_pool[ds->emsg_pool_count++] = old;
+        } else {
+            free(old);
+        }
+        result = ERR_OVERFLOW;
     }
+    ds->emsg_queue[(ds->emsg_queue_head + ds->emsg_queue_count) % ds->emsg_queue_size] = msg;
+    ds->emsg_queue_count++;
+    return result;
+}
+
+/* Removes the oldest message from the event queue and returns it or NULL if
+ * the queue is empty.  Must be called with ds->event_lock held.  The caller
+ * is responsible for freeing the message with event_msg_free(). */
+dax_message *
+pop_event(dax_state *ds)
+{
+    dax_message *msg;
+
+    if(ds->emsg_queue_count == 0) return NULL;
+    msg = ds->emsg_queue[ds->emsg_queue_head];
+    ds->emsg_queue_head = (ds->emsg_queue_head + 1) % ds->emsg_queue_size;
     ds->emsg_queue_count--;
+    return msg;
 }
+
 /*!
  * Blocks waiting for an event to happen.  If an event is found it
  * will run the callback function for that event.
@@ -208,7 +348,7 @@ dax_event_wait(dax_state *ds, int timeout, dax_id *id)
 {
     int result;
     struct timespec ts;
-    dax_message msg;
+    dax_message *msg;
 
     pthread_mutex_lock(&ds->event_lock);
     while(ds->emsg_queue_count == 0) {
@@ -235,9 +375,11 @@ dax_event_wait(dax_state *ds, int timeout, dax_id *id)
     /* Pop the message off of the event queue before we dispatch
      * the event so that we can turn control back over to the connection
      * thread. */
-    _pop_event(ds, &msg);
+    msg = pop_event(ds);
     pthread_mutex_unlock(&ds->event_lock);
-    return dispatch_event(ds, &msg, id);
+    result = dispatch_event(ds, msg, id);
+    event_msg_free(ds, msg);
+    return result;
 }
 
 /*!
@@ -255,12 +397,16 @@ dax_event_wait(dax_state *ds, int timeout, dax_id *id)
 int
 dax_event_poll(dax_state *ds, dax_id *id)
 {
-    dax_message msg;
+    dax_message *msg;
+    int result;
+
     pthread_mutex_lock(&ds->event_lock);
     if(ds->emsg_queue_count > 0) {
-        _pop_event(ds, &msg);
+        msg = pop_event(ds);
         pthread_mutex_unlock(&ds->event_lock);
-        return dispatch_event(ds, &msg, id);
+        result = dispatch_event(ds, msg, id);
+        event_msg_free(ds, msg);
+        return result;
     }
     pthread_mutex_unlock(&ds->event_lock);
     return ERR_NOTFOUND;
@@ -50,34 +50,67 @@ dax_init(const char *name)
     if(ds->modulename == NULL) return NULL;
 
     ds->msgtimeout = 0;
+    ds->msgmax = DAX_MSGMAX; /* Until we negotiate something larger */
+    ds->shm = NULL;
+    ds->shm_size = 0;
     ds->id = 0;
     ds->sfd = -1;       /* Server's File Descriptor */
+    ds->thread_running = 0;
     ds->reformat = 0;  /* Flags to show how to reformat the incoming data */
     ds->logflags = 0;
     /* Tag Cache */
     ds->cache_head = NULL;     /* First node in the cache list */
     ds->cache_limit = 0;       /* Total number of nodes that we'll allocate */
     ds->cache_count = 0;       /* How many nodes we actually have */
+    ds->cache_names = NULL;
+    ds->cache_indexes = NULL;
+    ds->cache_hashsize = 0;
+    ds->cache_epoch = 0;
+    ds->handle_head = NULL;
+    ds->handle_count = 0;
+    ds->handle_strs = NULL;
+    ds->handle_indexes = NULL;
     /* datatype list */
     ds->datatypes = NULL;
     ds->datatype_size = 0;
-    /* Event list array */
-    ds->events = malloc(sizeof(event_db));
+    /* Event hash table */
+    ds->events = calloc(EVENT_TABLE_SIZE, sizeof(event_db *));
     if(ds->events == NULL) {
         free(ds->modulename);
         free(ds);
         return NULL;
     }
     ds->last_msg = NULL;
-    ds->event_size = 1;
+    ds->event_size = EVENT_TABLE_SIZE;
     ds->event_count = 0;
     /* Event Message FIFO Queue */
     ds->emsg_queue = malloc(sizeof(dax_message *)*EVENT_QUEUE_SIZE);
+    ds->emsg_pool = malloc(sizeof(dax_message *)*EVENT_QUEUE_SIZE);
     ds->emsg_queue_size = EVENT_QUEUE_SIZE;     /* Total size of the Event Message Queue */
+    ds->emsg_queue_head = 0;     /* oldest entry in the event message queue */
     ds->emsg_queue_count = 0;    /* number of entries in the event message queue */
+    ds->emsg_pool_count = 0;     /* spare message buffers */
+    /* Requests waiting on the server */
+    ds->requests = malloc(sizeof(dax_request) * MAX_REQUESTS);
+    if(ds->requests == NULL || ds->emsg_queue == NULL || ds->emsg_pool == NULL) {
+        free(ds->requests);
+        free(ds->emsg_pool);
+        free(ds->emsg_queue);
+        free(ds->events);
+        free(ds->modulename);
+        free(ds);
+        return NULL;
+    }
+    ds->request_head = 0;
+    ds->request_count = 0;
+    ds->request_id = 0;
+    ds->request_done = 0;
+    ds->sync_id = 0;
+    ds->reqids = 0;
     ds->disconnect_callback = NULL;
     /* Initialize locks and condition variables */
     pthread_mutex_init(&ds->lock, NULL);
+    pthread_mutex_init(&ds->cache_lock, NULL);
     pthread_mutex_init(&ds->event_lock, NULL);
     pthread_mutex_init(&ds->msg_lock, NULL);
     pthread_cond_init(&ds->event_cond, NULL);
@@ -104,10 +137,14 @@ dax_free(dax_state *ds)
 {
     pthread_mutex_unlock(&ds->lock);
     pthread_mutex_destroy(&ds->lock);
+    free_tag_cache(ds);
+    pthread_mutex_destroy(&ds->cache_lock);
     free(ds->modulename);
-    /* TODO: gotta loop through and free the udata in the events. */
+    free_events(ds);
     free(ds->events);
     free(ds->emsg_queue);
+    free(ds->emsg_pool);
+    free(ds->requests);
     free(ds);
     return 0;
 }
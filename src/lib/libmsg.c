@@ -24,6 +24,8 @@
 #include <libcommon.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <stddef.h>
 #include <pthread.h>
 #include <netinet/in.h>
@@ -31,45 +33,69 @@
 #include <math.h>
 
 
-/* These are the generic message functions.  They simply send the message of
+/* These are the generic message functions.  This one simply writes the message of
  * the type given by command, attach the payload.  The payloads size should be
- * given in bytes */
+ * given in bytes.  The header and the payload are written with writev() so
+ * that large payloads don't have to be copied.  'id' is the id of the request
+ * which goes in the command word if the server agreed to that. */
 static int
-_message_send(dax_state *ds, int command, void *payload, size_t size)
+_message_write(dax_state *ds, int command, void *payload, size_t size, uint32_t id)
 {
-    int result;
-    char buff[DAX_MSGMAX];
+    ssize_t result;
+    uint32_t header[2];
+    struct iovec iov[2];
+    int iovcnt;
 
     if(ds->sfd < 0) {
     	return ERR_DISCONNECTED;
     }
+    if(size > MSG_DATA_MAX(ds)) {
+        return ERR_2BIG;
+    }
     /* We always send the size and command in network order */
-    ((uint32_t *)buff)[0] = htonl(size + MSG_HDR_SIZE);
-    ((uint32_t *)buff)[1] = htonl(command);
-    memcpy(&buff[MSG_HDR_SIZE], payload, size);
+    header[0] = htonl(size + MSG_HDR_SIZE);
+    if(ds->reqids) command |= (id << MSG_ID_SHIFT) & MSG_ID_MASK;
+    header[1] = htonl(command);
+    iov[0].iov_base = header;
+    iov[0].iov_len = MSG_HDR_SIZE;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = size;
+    iovcnt = size ? 2 : 1;
 
     /* TODO: We need to set some kind of timeout here.  This could block
        forever if something goes wrong.  It may be a signal or something too. */
-    result = write(ds->sfd, buff, size + MSG_HDR_SIZE);
-    if(result < 0) {
-    /* TODO: Should we handle the case when this returns due to a signal */
-        dax_log(DAX_LOG_ERROR, "_message_send: %s", strerror(errno));
-        return ERR_MSG_SEND;
+    while(iovcnt) {
+        result = writev(ds->sfd, iov, iovcnt);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            dax_log(DAX_LOG_ERROR, "_message_write: %s", strerror(errno));
+            return ERR_MSG_SEND;
+        }
+        /* Large frames may not be written all at once */
+        while(iovcnt && (size_t)result >= iov[0].iov_len) {
+            result -= iov[0].iov_len;
+            iov[0] = iov[1];
+            iovcnt--;
+        }
+        if(iovcnt) {
+            iov[0].iov_base = (char *)iov[0].iov_base + result;
+            iov[0].iov_len -= result;
+        }
     }
     return 0;
 }
 
-/* This function retrieves a single message from the given fd. */
+/* Reads exactly 'size' bytes from the fd */
 static int
-_message_get(int fd, dax_message *msg) {
-    unsigned char buff[DAX_MSGMAX];
-    int index, result;
-    index = 0;
-
-    while( index < MSG_HDR_SIZE) {
-    	/* Start by reading the header */
-        result = read(fd, &buff[index], MSG_HDR_SIZE);
+_message_read(int fd, void *buff, size_t size)
+{
+    size_t index = 0;
+    ssize_t result;
+
+    while(index < size) {
+        result = read(fd, (char *)buff + index, size - index);
         if(result < 0) {
+            if(errno == EINTR) continue;
             if(errno == EWOULDBLOCK) {
                 return ERR_TIMEOUT;
             } else {
@@ -81,37 +107,230 @@ _message_get(int fd, dax_message *msg) {
             index += result;
         }
     }
-    /* At this point we should have the size and the message type */
-    msg->size = ntohl(*(uint32_t *)buff);
-    msg->msg_type = ntohl(*((uint32_t *)&buff[4]));
-    /* Now we get the rest of the message */
-    index = 0;
-    while( index < msg->size) {
-    	/* Read the rest of the message */
-        result = read(fd, &buff[index], msg->size-index);
-        if(result < 0) {
-            if(errno == EWOULDBLOCK) {
-                return ERR_TIMEOUT;
-            } else {
-                return ERR_MSG_RECV;
-            }
-        } else if(result == 0) {
-            return ERR_DISCONNECTED;
-        } else {
-            index += result;
+    return 0;
+}
+
+/* Same as _message_read() except that the first part is read with recvmsg()
+ * so that we get any file descriptor that the server sent along with the
+ * data.  *rfd is set to that file descriptor or -1 if there wasn't one. */
+static int
+_message_read_fd(int fd, void *buff, size_t size, int *rfd)
+{
+    ssize_t result;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    union {
+        char buff[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    *rfd = -1;
+    iov.iov_base = buff;
+    iov.iov_len = size;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buff;
+    mh.msg_controllen = sizeof(control.buff);
+
+    do {
+        result = recvmsg(fd, &mh, 0);
+    } while(result < 0 && errno == EINTR);
+    if(result < 0) {
+        return (errno == EWOULDBLOCK) ? ERR_TIMEOUT : ERR_MSG_RECV;
+    } else if(result == 0) {
+        return ERR_DISCONNECTED;
+    }
+    for(cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+        if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            memcpy(rfd, CMSG_DATA(cm), sizeof(int));
         }
     }
-    /* TODO: Use msg->data in the read functions instead of this copy */
-	memcpy(msg->data, buff, msg->size);
+    return _message_read(fd, (char *)buff + result, size - result);
+}
+
+/* Reads the header of the next message from the given fd into header[] in
+ * host byte order.  If rfd is not NULL it will be set to a file descriptor
+ * that was passed with the message or -1. */
+static int
+_message_header(int fd, uint32_t *header, int *rfd) {
+    int result;
+
+    if(rfd != NULL) {
+        result = _message_read_fd(fd, header, MSG_HDR_SIZE, rfd);
+    } else {
+        result = _message_read(fd, header, MSG_HDR_SIZE);
+    }
+    if(result) return result;
+    header[0] = ntohl(header[0]);
+    header[1] = ntohl(header[1]);
+    if(header[0] > DAX_FRAMEMAX) {
+        dax_log(DAX_LOG_ERROR, "Bad message size %u received from server", header[0]);
+        return ERR_MSG_RECV;
+    }
     return 0;
 }
 
-/* This function waits for a message with the given command to come in. If
-   a message of another command comes in it will send that message out to
-   an asynchronous command handler.  This is due to a race condition that could
-   happen if the server puts a message in the queue after we send a request but
-   before we retrieve the result. */
-/* TODO: Do a better job of explaining the functionality of this function */
+/* Reads the rest of the message described by header[] into msg.  msg
+ * has to have room for header[0] bytes of data. */
+static int
+_message_body(int fd, dax_message *msg, uint32_t *header) {
+    msg->size = header[0];
+    msg->msg_type = header[1];
+    msg->fd = fd;
+    return _message_read(fd, msg->data, msg->size);
+}
+
+/* This function retrieves a single message from the given fd.  The message
+ * is allocated here to fit the data and must be freed by the caller.  If
+ * rfd is not NULL it will be set to a file descriptor that was passed with
+ * the message or -1.  The caller has to close it even if there is an error. */
+static int
+_message_get(int fd, dax_message **msg, int *rfd) {
+    uint32_t header[2];
+    dax_message *newmsg;
+    int result;
+
+    result = _message_header(fd, header, rfd);
+    if(result) return result;
+    newmsg = malloc(sizeof(dax_message) + header[0]);
+    if(newmsg == NULL) return ERR_ALLOC;
+    result = _message_body(fd, newmsg, header);
+    if(result) {
+        free(newmsg);
+        return result;
+    }
+    *msg = newmsg;
+    return 0;
+}
+
+/* Sets *ts to 'ms' milliseconds from now for the timed waits */
+static void
+_abstime(struct timespec *ts, int ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += ms % 1000 * 1e6;
+    if(ts->tv_nsec > 1e9) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1e9;
+    }
+}
+
+/* Adds a request to the end of the table of requests that are waiting on
+ * the server.  If the table is full we wait for the server to answer some
+ * of them.  Must be called with ds->lock held so that the requests are
+ * added in the same order that they are written to the socket. */
+static int
+_request_push(dax_state *ds, int command, uint8_t flags, void *data, size_t size,
+              void (*callback)(dax_state *ds, int result, void *udata), void *udata,
+              uint32_t *id)
+{
+    dax_request *req;
+    struct timespec timeout;
+
+    pthread_mutex_lock(&ds->msg_lock);
+    while(ds->request_count == MAX_REQUESTS) {
+        _abstime(&timeout, ds->msgtimeout);
+        if(pthread_cond_timedwait(&ds->msg_cond, &ds->msg_lock, &timeout) == ETIMEDOUT) {
+            pthread_mutex_unlock(&ds->msg_lock);
+            return ERR_TIMEOUT;
+        }
+    }
+    req = &ds->requests[(ds->request_head + ds->request_count) % MAX_REQUESTS];
+    req->id = ++ds->request_id;
+    req->command = command;
+    req->flags = flags;
+    req->data = data;
+    req->size = size;
+    req->callback = callback;
+    req->udata = udata;
+    ds->request_count++;
+    if(id) *id = req->id;
+    pthread_mutex_unlock(&ds->msg_lock);
+    return 0;
+}
+
+/* Removes the last request that was added.  This is used when the message
+ * could not be sent so the server will never answer it. */
+static void
+_request_cancel(dax_state *ds)
+{
+    pthread_mutex_lock(&ds->msg_lock);
+    ds->request_count--;
+    ds->request_id--;
+    pthread_mutex_unlock(&ds->msg_lock);
+}
+
+/* Finds the request with the given id and marks it so that the response
+ * will be thrown away.  Called with msg_lock held. */
+static void
+_request_discard(dax_state *ds, uint32_t id)
+{
+    int n;
+    dax_request *req;
+
+    for(n = 0; n < ds->request_count; n++) {
+        req = &ds->requests[(ds->request_head + n) % MAX_REQUESTS];
+        if(req->id == id) {
+            req->flags |= REQ_DISCARD;
+            return;
+        }
+    }
+}
+
+/* Sends a message that a synchronous function will wait on with
+ * _message_recv().  ds->lock should be held by the caller until the
+ * response has been received */
+static int
+_message_send(dax_state *ds, int command, void *payload, size_t size)
+{
+    int result;
+
+    if(ds->sfd < 0) {
+    	return ERR_DISCONNECTED;
+    }
+    result = _request_push(ds, command, REQ_SYNC, NULL, 0, NULL, NULL, &ds->sync_id);
+    if(result) return result;
+    result = _message_write(ds, command, payload, size, ds->sync_id);
+    if(result) _request_cancel(ds);
+    return result;
+}
+
+/* Sends a message without waiting for the response.  When the response
+ * arrives the data is copied to *data and the callback is called from the
+ * connection thread. */
+static int
+_message_send_async(dax_state *ds, int command, void *payload, size_t size,
+                    void *data, size_t datasize,
+                    void (*callback)(dax_state *ds, int result, void *udata), void *udata,
+                    uint32_t *id)
+{
+    int result;
+    uint32_t reqid;
+
+    pthread_mutex_lock(&ds->lock);
+    if(ds->sfd < 0) {
+        pthread_mutex_unlock(&ds->lock);
+    	return ERR_DISCONNECTED;
+    }
+    result = _request_push(ds, command, 0, data, datasize, callback, udata, &reqid);
+    if(result == 0) {
+        if(id) *id = reqid;
+        result = _message_write(ds, command, payload, size, reqid);
+        if(result) _request_cancel(ds);
+    }
+    pthread_mutex_unlock(&ds->lock);
+    return result;
+}
+
+/* This function waits for the response to the request that was sent with
+ * _message_send().  The connection thread puts the response on last_msg
+ * when it arrives.  If we time out, the request is marked so that the
+ * response will be thrown away when it finally does show up instead of
+ * being mistaken for the answer to some later request.  *size is the room
+ * in payload going in and the size of the response coming out. */
 static int
 _message_recv(dax_state *ds, int command, void *payload, size_t *size, int response)
 {
@@ -120,16 +339,11 @@ _message_recv(dax_state *ds, int command, void *payload, size_t *size, int respo
 
     pthread_mutex_lock(&ds->msg_lock);
     while(ds->last_msg == NULL) {
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += ds->msgtimeout/1000;
-        timeout.tv_nsec += ds->msgtimeout%1000 *1e6;
-        if(timeout.tv_nsec>1e9) {
-            timeout.tv_sec++;
-            timeout.tv_nsec-=1e9;
-        }
+        _abstime(&timeout, ds->msgtimeout);
         result = pthread_cond_timedwait(&ds->msg_cond, &ds->msg_lock, &timeout);
         if(result == ETIMEDOUT) {
             DF("message_recv() Timeout");
+            _request_discard(ds, ds->sync_id);
             pthread_mutex_unlock(&ds->msg_lock);
             return ERR_TIMEOUT;
         }
@@ -143,14 +357,20 @@ _message_recv(dax_state *ds, int command, void *payload, size_t *size, int respo
         pthread_mutex_unlock(&ds->msg_lock);
         return result;
     }  else if(ds->last_msg->msg_type == (command | (response ? MSG_RESPONSE : 0))) {
+        result = 0;
         if(size) {
-            memcpy(payload, ds->last_msg->data, ds->last_msg->size);
-            *size = ds->last_msg->size;
+            if(ds->last_msg->size > *size) {
+                dax_log(DAX_LOG_ERROR, "Response of %u bytes won't fit in %zu", ds->last_msg->size, *size);
+                result = ERR_2BIG;
+            } else {
+                memcpy(payload, ds->last_msg->data, ds->last_msg->size);
+                *size = ds->last_msg->size;
+            }
         }
         free(ds->last_msg);
         ds->last_msg = NULL;
         pthread_mutex_unlock(&ds->msg_lock);
-        return 0;
+        return result;
     } else {
         free(ds->last_msg);
         ds->last_msg = NULL;
@@ -161,6 +381,130 @@ _message_recv(dax_state *ds, int command, void *payload, size_t *size, int respo
     return 0;
 }
 
+/* Marks the request as answered and wakes up anybody that is waiting on it */
+static void
+_request_done(dax_state *ds, uint32_t id)
+{
+    pthread_mutex_lock(&ds->msg_lock);
+    ds->request_done = id;
+    pthread_mutex_unlock(&ds->msg_lock);
+    pthread_cond_broadcast(&ds->msg_cond);
+}
+
+/* Finishes an asynchronous request with the result and calls its callback */
+static void
+_request_finish(dax_state *ds, dax_request *req, int result)
+{
+    if(!(req->flags & REQ_DISCARD) && req->callback != NULL) {
+        req->callback(ds, result, req->udata);
+    }
+    _request_done(ds, req->id);
+}
+
+/* Finds the request that the response answers and takes it and all of the
+ * requests in front of it out of the table.  The server answers requests
+ * in order so if it skipped over some they will never be answered.  Those
+ * are finished with ERR_TIMEOUT.  Returns zero if there isn't a request
+ * for the response.  Called with msg_lock held, which is released and
+ * taken again while the skipped requests are finished. */
+static int
+_request_match(dax_state *ds, dax_message *msg, dax_request *req)
+{
+    dax_request skip;
+    uint32_t id;
+    int n;
+
+    if(!ds->reqids) {
+        if(ds->request_count == 0) return 0;
+        *req = ds->requests[ds->request_head];
+    } else {
+        id = MSG_ID(msg->msg_type);
+        msg->msg_type &= ~MSG_ID_MASK;
+        for(n = 0; n < ds->request_count; n++) {
+            *req = ds->requests[(ds->request_head + n) % MAX_REQUESTS];
+            if((req->id & (MSG_ID_MASK >> MSG_ID_SHIFT)) == id) break;
+        }
+        if(n == ds->request_count) return 0;
+        while(n--) {
+            skip = ds->requests[ds->request_head];
+            ds->request_head = (ds->request_head + 1) % MAX_REQUESTS;
+            ds->request_count--;
+            dax_log(DAX_LOG_ERROR, "The server never answered request %u", skip.id);
+            /* A synchronous function can't still be waiting on one of these
+             * because it holds ds->lock until it is answered or times out */
+            pthread_mutex_unlock(&ds->msg_lock);
+            _request_finish(ds, &skip, ERR_TIMEOUT);
+            pthread_mutex_lock(&ds->msg_lock);
+        }
+    }
+    ds->request_head = (ds->request_head + 1) % MAX_REQUESTS;
+    ds->request_count--;
+    return 1;
+}
+
+/* Called from the connection thread with each response that comes in from
+ * the server.  Synchronous responses are left on last_msg for
+ * _message_recv(), the asynchronous ones are finished here. */
+static void
+_request_complete(dax_state *ds, dax_message *msg)
+{
+    dax_request req;
+    int result;
+
+    pthread_mutex_lock(&ds->msg_lock);
+    if(!_request_match(ds, msg, &req)) {
+        pthread_mutex_unlock(&ds->msg_lock);
+        dax_log(DAX_LOG_ERROR, "Received a response with no request waiting");
+        free(msg);
+        return;
+    }
+    if((req.flags & REQ_SYNC) && !(req.flags & REQ_DISCARD)) {
+        if(ds->last_msg != NULL) free(ds->last_msg);
+        ds->last_msg = msg;
+        ds->request_done = req.id;
+        pthread_mutex_unlock(&ds->msg_lock);
+        pthread_cond_broadcast(&ds->msg_cond);
+        return;
+    }
+    pthread_mutex_unlock(&ds->msg_lock);
+
+    result = 0;
+    if(msg->msg_type == (req.command | MSG_ERROR)) {
+        result = stom_dint((*(int32_t *)&msg->data[0]));
+    } else if(msg->msg_type == (req.command | MSG_RESPONSE)) {
+        if(req.data != NULL && !(req.flags & REQ_DISCARD)) {
+            memcpy(req.data, msg->data, MIN(req.size, msg->size));
+        }
+    } else {
+        dax_log(DAX_LOG_ERROR, "Received a response of a different type than expected");
+        result = ERR_GENERIC;
+    }
+    free(msg);
+    _request_finish(ds, &req, result);
+}
+
+/* Fails all of the requests that are waiting when the connection is lost */
+static void
+_request_fail_all(dax_state *ds, int result)
+{
+    dax_request req;
+
+    pthread_mutex_lock(&ds->msg_lock);
+    while(ds->request_count > 0) {
+        req = ds->requests[ds->request_head];
+        ds->request_head = (ds->request_head + 1) % MAX_REQUESTS;
+        ds->request_count--;
+        pthread_mutex_unlock(&ds->msg_lock);
+        if(!(req.flags & (REQ_SYNC | REQ_DISCARD)) && req.callback != NULL) {
+            req.callback(ds, result, req.udata);
+        }
+        pthread_mutex_lock(&ds->msg_lock);
+    }
+    ds->request_done = ds->request_id;
+    pthread_mutex_unlock(&ds->msg_lock);
+    pthread_cond_broadcast(&ds->msg_cond);
+}
+
 
 /* Connect to the server.  If the "server" attribute is local we
  * connect via LOCAL domain socket called out in "socketname" else
@@ -230,47 +574,81 @@ _get_connection(dax_state *ds)
 
 #define CON_HDR_SIZE 8
 
+/* Maps the shared memory tag data region that the server sent to us
+ * at registration.  If anything doesn't look right we just don't use it */
+static void
+_shm_map(dax_state *ds, int fd, uint32_t size)
+{
+    struct shm_header *hdr;
+    void *shm;
+
+    if(size < sizeof(struct shm_header)) return;
+    shm = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if(shm == MAP_FAILED) {
+        dax_log(DAX_LOG_ERROR, "Unable to map shared memory - %s", strerror(errno));
+        return;
+    }
+    hdr = (struct shm_header *)shm;
+    if(hdr->magic != SHM_MAGIC || hdr->size != size || hdr->dataoffset > size ||
+       hdr->dataoffset < sizeof(struct shm_header) + (size_t)hdr->tagcount * sizeof(struct shm_tag)) {
+        dax_log(DAX_LOG_ERROR, "Bad shared memory region received from the server");
+        munmap(shm, size);
+        return;
+    }
+    ds->shm = shm;
+    ds->shm_size = size;
+    dax_log(DAX_LOG_COMM, "Mapped %u bytes of shared memory tag data", size);
+}
+
 static int
 _mod_register(dax_state *ds, char *name)
 {
-    int result;
+    int result, shmfd;
     size_t len;
     char buff[DAX_MSGMAX];
-    dax_message msg;
+    dax_message *msg;
 
 /* TODO: Boundary check that a name that is longer than data size will
    be handled correctly. */
     len = strlen(name) + 1;
-    if(len > (MSG_DATA_SIZE - CON_HDR_SIZE)) {
-        len = MSG_DATA_SIZE - CON_HDR_SIZE;
-        name[len] = '\0';
+    if(len > (MSG_DATA_SIZE - CON_HDR_SIZE - sizeof(uint32_t))) {
+        len = MSG_DATA_SIZE - CON_HDR_SIZE - sizeof(uint32_t);
+        name[len - 1] = '\0';
     }
 
     /* For registration we send the data in network order no matter what */
     /* TODO: The timeout is not actually implemented */
     *((uint32_t *)&buff[0]) = htonl(1000);       /* Timeout  */
-    *((uint32_t *)&buff[4]) = htonl(CONNECT_SYNC);  /* registration flags */
+    *((uint32_t *)&buff[4]) = htonl(CONNECT_SYNC | CONNECT_FRAME | CONNECT_SHM | CONNECT_NOTIFY | CONNECT_REQID);  /* registration flags */
     strcpy(&buff[CON_HDR_SIZE], name);                /* The rest is the name */
+    /* ...followed by the largest frame that we can handle */
+    *((uint32_t *)&buff[CON_HDR_SIZE + len]) = htonl(DAX_FRAMEMAX);
 
     dax_log(DAX_LOG_COMM, "Sending registration for name - %s", ds->modulename);
-    if((result = _message_send(ds, MSG_MOD_REG, buff, CON_HDR_SIZE + len)))
+    ds->msgmax = DAX_MSGMAX;
+    if((result = _message_write(ds, MSG_MOD_REG, buff, CON_HDR_SIZE + len + sizeof(uint32_t), 0)))
         return result;
-    len = DAX_MSGMAX;
 
-    result = _message_get(ds->sfd, &msg);
+    result = _message_get(ds->sfd, &msg, &shmfd);
     if(result) {
+        if(shmfd >= 0) close(shmfd);
     	return result;
     }
+    if(msg->size < REG_RESPONSE_SIZE) {
+        if(shmfd >= 0) close(shmfd);
+        free(msg);
+        return ERR_MSG_BAD;
+    }
 
     /* Store the unique ID that the server has sent us. */
-    ds->id =  *((uint32_t *)&msg.data[0]);
+    ds->id =  *((uint32_t *)&msg->data[0]);
     /* Here we check to see if the data that we got in the registration message is in the same
        format as we use here on the client module. This should be offloaded to a separate
        function that can determine what needs to be done to the incoming and outgoing data to
        get it to match with the server */
-    if( (*((uint16_t *)&msg.data[4]) != REG_TEST_INT) ||
-        (*((uint32_t *)&msg.data[6]) != REG_TEST_DINT) ||
-        (*((uint64_t *)&msg.data[10]) != REG_TEST_LINT)) {
+    if( (*((uint16_t *)&msg->data[4]) != REG_TEST_INT) ||
+        (*((uint32_t *)&msg->data[6]) != REG_TEST_DINT) ||
+        (*((uint64_t *)&msg->data[10]) != REG_TEST_LINT)) {
         /* TODO: right now this is just to show error.  We need to determine if we can
            get the right data from the server by some means. */
         ds->reformat = REF_INT_SWAP;
@@ -278,15 +656,43 @@ _mod_register(dax_state *ds, char *name)
         ds->reformat = 0; /* this is redundant, already done in dax_init() */
     }
     /* There has got to be a better way to compare that we are getting good floating point numbers */
-    if( fabs(*((float *)&msg.data[18]) - REG_TEST_REAL) / REG_TEST_REAL   > 0.0000001 ||
-        fabs(*((double *)&msg.data[22]) - REG_TEST_LREAL) / REG_TEST_REAL > 0.0000001) {
+    /* Written so that a NaN counts as a mismatch too */
+    if( !(fabs(*((float *)&msg->data[18]) - REG_TEST_REAL) / REG_TEST_REAL   <= 0.0000001) ||
+        !(fabs(*((double *)&msg->data[22]) - REG_TEST_LREAL) / REG_TEST_REAL <= 0.0000001)) {
         ds->reformat |= REF_FLT_SWAP;
     }
-    /* TODO: returning _reformat is only good until we figure out how to reformat the
-     * messages. Then we should return 0.  Right now since there isn't any reformating
-     * of messages being done we consider it an error and return that so that the module
-     * won't try to communicate */
-    return ds->reformat;
+    /* Nothing is reformatted yet so we can't talk to a server that stores
+     * its data differently than we do */
+    if(ds->reformat) {
+        dax_log(DAX_LOG_ERROR, "The server's data format is different than ours (0x%X)", ds->reformat);
+        if(shmfd >= 0) close(shmfd);
+        free(msg);
+        return ERR_NOTIMPLEMENTED;
+    }
+    /* Servers that don't know about large frames won't send the frame size */
+    if(msg->size >= REG_RESPONSE_SIZE + sizeof(uint32_t)) {
+        ds->msgmax = ntohl(*((uint32_t *)&msg->data[REG_RESPONSE_SIZE]));
+        if(ds->msgmax < DAX_MSGMAX || ds->msgmax > DAX_FRAMEMAX) ds->msgmax = DAX_MSGMAX;
+    }
+    dax_log(DAX_LOG_COMM, "Negotiated frame size of %u bytes", ds->msgmax);
+    /* Local connections may get the shared memory tag data.  We don't need
+     * the file descriptor after the region is mapped */
+    len = REG_RESPONSE_SIZE + sizeof(uint32_t);
+    if(shmfd >= 0) {
+        if(msg->size >= len + sizeof(uint32_t)) {
+            _shm_map(ds, shmfd, ntohl(*((uint32_t *)&msg->data[len])));
+        }
+        close(shmfd);
+        len += sizeof(uint32_t);
+    }
+    /* Servers that don't know about request ids won't send the flags */
+    ds->reqids = 0;
+    if(msg->size >= len + sizeof(uint32_t) &&
+       ntohl(*((uint32_t *)&msg->data[len])) & CONNECT_REQID) {
+        ds->reqids = 1;
+    }
+    free(msg);
+    return 0;
 }
 
 /* This function retrieves one message using the _message_get() function and decides whether
@@ -298,47 +704,57 @@ static int
 _read_next_message(dax_state *ds)
 {
     static unsigned int events_lost;
+    uint32_t header[2];
     dax_message *msg;
-    int result, n;
-
-    msg = malloc(sizeof(dax_message));
-    if(msg == NULL) return ERR_ALLOC;
+    int result, event;
 
-    result = _message_get(ds->sfd, msg);
+    result = _message_header(ds->sfd, header, NULL);
+    if(result == 0) {
+        /* Event messages come out of the event buffer pool */
+        event = (header[1] & MSG_EVENT) && !(header[1] & MSG_NOTIFY);
+        if(event) {
+            msg = event_msg_alloc(ds, header[0]);
+        } else {
+            msg = malloc(sizeof(dax_message) + header[0]);
+        }
+        if(msg == NULL) {
+            result = ERR_ALLOC;
+        } else {
+            result = _message_body(ds->sfd, msg, header);
+            if(result) {
+                if(event) event_msg_free(ds, msg);
+                else free(msg);
+            }
+        }
+    }
     if(result) {
-        if(result == ERR_DISCONNECTED) {
+        if(ds->sfd < 0) {
+            ; /* dax_disconnect() closed the connection */
+        } else if(result == ERR_DISCONNECTED) {
             dax_log(DAX_LOG_ERROR, "Server disconnected abruptly");
         } else if(result == ERR_TIMEOUT) {
             ; /* Do nothing for timeout */
         } else {
             dax_log(DAX_LOG_ERROR, "_message_get() returned error %d", result);
         }
-        free(msg);
         return result;
     }
-    if(msg->msg_type & MSG_EVENT) { /* Events we store in the FIFO */
+    if(msg->msg_type & MSG_NOTIFY) { /* The server changed something on its own */
+        if((msg->msg_type & ~MSG_NOTIFY) == NOTIFY_TAG && msg->size >= sizeof(uint32_t)) {
+            cache_invalidate(ds, ntohl(*((uint32_t *)msg->data)));
+        }
+        free(msg);
+    } else if(msg->msg_type & MSG_EVENT) { /* Events we store in the FIFO */
         pthread_mutex_lock(&ds->event_lock);
-        if(ds->emsg_queue_count == ds->emsg_queue_size) {/* FIFO is full */
-            if(events_lost % 20 == 0) { /* We only log every 20 of these */
-                events_lost++;
+        if(push_event(ds, msg) == ERR_OVERFLOW) { /* FIFO was full */
+            if(events_lost++ % 20 == 0) { /* We only log every 20 of these */
                 dax_log(DAX_LOG_ERROR, "Event received from the server is lost.  Total = %u", events_lost);
             }
-            free(ds->emsg_queue[0]); /* Free the top one */
-            for(n = 0;n<ds->emsg_queue_size-1;n++) {
-                ds->emsg_queue[n] = ds->emsg_queue[n+1];
-            }
-            ds->emsg_queue[ds->emsg_queue_size - 1] = msg;
-        } else {
-            ds->emsg_queue[ds->emsg_queue_count] = msg;
-            ds->emsg_queue_count++;
         }
         pthread_mutex_unlock(&ds->event_lock);
         pthread_cond_signal(&ds->event_cond);
-    } else { /* All other messages we put here */
-        pthread_mutex_lock(&ds->msg_lock);
-        ds->last_msg = msg;
-        pthread_mutex_unlock(&ds->msg_lock);
-        pthread_cond_signal(&ds->msg_cond);
+    } else { /* All other messages are responses to our requests */
+        _request_complete(ds, msg);
     }
     return 0;
 }
@@ -346,6 +762,13 @@ _read_next_message(dax_state *ds)
 static void
 _connection_cleanup(dax_state *ds) {
     ds->sfd = -1;
+    ds->msgmax = DAX_MSGMAX;
+    if(ds->shm != NULL) {
+        munmap(ds->shm, ds->shm_size);
+        ds->shm = NULL;
+        ds->shm_size = 0;
+    }
+    _request_fail_all(ds, ERR_DISCONNECTED);
     if(ds->last_msg != NULL) free(ds->last_msg);
     ds->last_msg = NULL;
     free_tag_cache(ds);
@@ -365,14 +788,23 @@ _connection_thread(void *arg)
     ds->sfd = _get_connection(ds);
     if(ds->sfd >= 0) {
         result = _mod_register(ds, ds->modulename);
+        if(result) {
+            /* The server forgets about us when the socket is closed */
+            close(ds->sfd);
+            ds->sfd = -1;
+            ds->msgmax = DAX_MSGMAX;
+            ds->error_code = result;
+            pthread_barrier_wait(&ds->connect_barrier);
+            return NULL;
+        }
         init_tag_cache(ds);
         /* This basically let's the dax_connect function return success */
         ds->error_code = 0;
         pthread_barrier_wait(&ds->connect_barrier);
-        /* dax_disconnect() will set this to zero to get us out of this loop */
+        /* dax_disconnect() will set this to -1 to get us out of this loop */
         while(ds->sfd >= 0) { /* Main connection loop */
             result = _read_next_message(ds);
-            if(result == ERR_DISCONNECTED) {
+            if(result == ERR_DISCONNECTED && ds->sfd >= 0) {
                 if(ds->disconnect_callback) {
                     ds->disconnect_callback(result);
                 }
@@ -408,11 +840,13 @@ dax_connect(dax_state *ds)
     pthread_barrier_init(&ds->connect_barrier, NULL, 2);
 
     pthread_create(&ds->connection_thread, NULL, _connection_thread, ds);
-    pthread_detach(ds->connection_thread);
     pthread_barrier_wait(&ds->connect_barrier);
 
     if(ds->error_code == 0) {
+        ds->thread_running = 1;
         opt_lua_init_func(ds);
+    } else {
+        pthread_join(ds->connection_thread, NULL);
     }
 
     return ds->error_code;
@@ -429,21 +863,31 @@ dax_connect(dax_state *ds)
 int
 dax_disconnect(dax_state *ds)
 {
-    int result = -1;
+    int result = -1, fd;
     size_t len;
 
     pthread_mutex_lock(&ds->lock);
-    /* Tells the connection thread to exit */
-    if(ds->sfd) {
+    fd = ds->sfd;
+    if(fd >= 0) {
         result = _message_send(ds, MSG_MOD_REG, NULL, 0);
         if(! result ) {
             len = 0;
             result = _message_recv(ds, MSG_MOD_REG, NULL, &len, 1);
         }
-        close(ds->sfd);
-        ds->sfd = 0;
+        /* Tells the connection thread to exit and wakes it up if it is
+         * waiting on the socket */
+        ds->sfd = -1;
+        shutdown(fd, SHUT_RDWR);
     }
     pthread_mutex_unlock(&ds->lock);
+    /* The thread has to be gone before we close the socket.  Otherwise
+     * it could read from the next connection that gets the same fd or
+     * from the dax_state after it has been freed. */
+    if(ds->thread_running) {
+        pthread_join(ds->connection_thread, NULL);
+        ds->thread_running = 0;
+    }
+    if(fd >= 0) close(fd);
     return result;
 }
 
@@ -469,6 +913,7 @@ dax_tag_add(dax_state *ds, tag_handle *h, char *name, tag_type type, int count,
     int result;
     size_t size;
     dax_tag tag;
+    uint32_t epoch;
     char buff[DAX_TAGNAME_SIZE + 8 + 1];
 
     if(count == 0) return ERR_ARG;
@@ -489,6 +934,7 @@ dax_tag_add(dax_state *ds, tag_handle *h, char *name, tag_type type, int count,
     }
     pthread_mutex_lock(&ds->lock);
 
+    epoch = cache_get_epoch(ds);
     result = _message_send(ds, MSG_TAG_ADD, buff, size);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
@@ -518,7 +964,7 @@ dax_tag_add(dax_state *ds, tag_handle *h, char *name, tag_type type, int count,
         tag.attr = attr;
         /* Just in case this call modifies the tag */
         cache_tag_del(ds, tag.idx);
-        cache_tag_add(ds, &tag);
+        cache_tag_add_since(ds, &tag, epoch);
     }
     pthread_mutex_unlock(&ds->lock);
     return result;
@@ -549,6 +995,8 @@ dax_tag_del(dax_state* ds, tag_index index)
 
     size = 4; /* we just need the handle */
     result = _message_recv(ds, MSG_TAG_DEL, buff, &size, 1);
+    /* The index won't ever be good again */
+    if(result == 0) cache_tag_del(ds, index);
     pthread_mutex_unlock(&ds->lock);
     return result;
 }
@@ -568,6 +1016,7 @@ dax_tag_byname(dax_state *ds, dax_tag *tag, char *name)
 {
     int result;
     size_t size;
+    uint32_t epoch;
     char *buff;
 
     if(name == NULL) return ERR_ARG;
@@ -580,9 +1029,13 @@ dax_tag_byname(dax_state *ds, dax_tag *tag, char *name)
         /* We make buff big enough for the outgoing message and the incoming
            response message which would have 4 additional int32s */
         buff = malloc(size + 18);
-        if(buff == NULL) return ERR_ALLOC;
+        if(buff == NULL) {
+            pthread_mutex_unlock(&ds->lock);
+            return ERR_ALLOC;
+        }
         buff[0] = TAG_GET_NAME;
         strcpy(&buff[1], name);
+        epoch = cache_get_epoch(ds);
         /* Send the message to the server.  Add 2 to the size for the subcommand and the NULL */
         result = _message_send(ds, MSG_TAG_GET, buff, size + 2);
         if(result) {
@@ -605,15 +1058,50 @@ dax_tag_byname(dax_state *ds, dax_tag *tag, char *name)
         tag->attr = stom_udint(*((uint16_t *)&buff[12]));
         buff[size - 1] = '\0'; /* Just to make sure */
         strcpy(tag->name, &buff[14]);
-        cache_tag_add(ds, tag);
+        cache_tag_add_since(ds, tag, epoch);
         free(buff);
     }
     pthread_mutex_unlock(&ds->lock);
     return 0;
 }
 
+/* Asks the server for the tag by index or by slot.  'subcommand' is
+ * TAG_GET_INDEX or TAG_GET_SLOT.  Must be called with ds->lock held. */
+static int
+_tag_get_index(dax_state *ds, dax_tag *tag, int subcommand, tag_index idx)
+{
+    int result;
+    size_t size;
+    uint32_t epoch;
+    char buff[DAX_TAGNAME_SIZE + 17];
+
+    buff[0] = subcommand;
+    *((tag_index *)&buff[1]) = idx;
+    epoch = cache_get_epoch(ds);
+    result = _message_send(ds, MSG_TAG_GET, buff, sizeof(tag_index) + 1);
+    if(result) {
+        dax_log(DAX_LOG_ERROR, "Can't send MSG_TAG_GET message");
+        return result;
+    }
+    /* Maximum size of buffer, the 17 is the NULL plus four integers */
+    size = DAX_TAGNAME_SIZE + 17;
+    result = _message_recv(ds, MSG_TAG_GET, buff, &size, 1);
+    if(result) return result;
+    tag->idx = stom_dint(*((int32_t *)&buff[0]));
+    tag->type = stom_dint(*((int32_t *)&buff[4]));
+    tag->count = stom_dint(*((int32_t *)&buff[8]));
+    tag->attr = stom_dint(*((int16_t *)&buff[12]));
+    buff[DAX_TAGNAME_SIZE + 14] = '\0'; /* Just to be safe */
+    strcpy(tag->name, &buff[14]);
+    /* Add the tag to the tag cache unless it changed while we were asking */
+    cache_tag_add_since(ds, tag, epoch);
+    return 0;
+}
+
 /*!
- * Retrieve the tag by it's index.
+ * Retrieve the tag by it's index.  The index has to be one that the
+ * server gave us for the tag.  If the tag has been deleted ERR_DELETED
+ * is returned even if another tag has been added in its place.
  *
  * @param ds Pointer to the dax state object
  * @param tag Pointer to the structure that this function will
@@ -625,45 +1113,82 @@ dax_tag_byname(dax_state *ds, dax_tag *tag, char *name)
  int
 dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index idx)
 {
-    int result;
-    size_t size;
-    char buff[DAX_TAGNAME_SIZE + 17];
+    int result = 0;
 
     pthread_mutex_lock(&ds->lock);
     if(check_cache_index(ds, idx, tag)) {
-        buff[0] = TAG_GET_INDEX;
-        *((tag_index *)&buff[1]) = idx;
-        result = _message_send(ds, MSG_TAG_GET, buff, sizeof(tag_index) + 1);
-        if(result) {
-            dax_log(DAX_LOG_ERROR, "Can't send MSG_TAG_GET message");
-            pthread_mutex_unlock(&ds->lock);
-            return result;
-        }
-        /* Maximum size of buffer, the 17 is the NULL plus four integers */
-        size = DAX_TAGNAME_SIZE + 17;
-        result = _message_recv(ds, MSG_TAG_GET, buff, &size, 1);
-        if(result) {
-            pthread_mutex_unlock(&ds->lock);
-            return result;
-        }
-        tag->idx = stom_dint(*((int32_t *)&buff[0]));
-        tag->type = stom_dint(*((int32_t *)&buff[4]));
-        tag->count = stom_dint(*((int32_t *)&buff[8]));
-        tag->attr = stom_dint(*((int16_t *)&buff[12]));
-        buff[DAX_TAGNAME_SIZE + 14] = '\0'; /* Just to be safe */
-        strcpy(tag->name, &buff[14]);
-        /* Add the tag to the tag cache */
-        cache_tag_add(ds, tag);
+        result = _tag_get_index(ds, tag, TAG_GET_INDEX, idx);
     }
     pthread_mutex_unlock(&ds->lock);
-    return 0;
+    return result;
+}
+
+/*!
+ * Retrieve the tag that is in the given slot of the server's tag
+ * database.  This is used to walk through all of the tags by counting
+ * from zero up to the _lastindex tag.  ERR_DELETED is returned for an
+ * empty slot and ERR_ARG once the slot is past the end.  The idx member
+ * of the tag is the index to use for the tag from then on.
+ *
+ * @param ds Pointer to the dax state object
+ * @param tag Pointer to the structure that this function will
+ *            fill with the tags information
+ * @param slot The slot in the database
+ *
+ * @returns Zero on success or an error code otherwise
+ */
+int
+dax_tag_byslot(dax_state *ds, dax_tag *tag, tag_index slot)
+{
+    int result;
+
+    pthread_mutex_lock(&ds->lock);
+    result = _tag_get_index(ds, tag, TAG_GET_SLOT, slot);
+    pthread_mutex_unlock(&ds->lock);
+    return result;
+}
+
+/* Copies the data straight out of the shared memory region.  Returns
+ * ERR_NOTFOUND if the data has to come from the server instead.  The
+ * server might be changing the tag while we copy it so we check the
+ * sequence counter before and after and try again if it moved. */
+static int
+_shm_read(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size)
+{
+    struct shm_header *hdr;
+    struct shm_tag *t;
+    uint32_t s1, s2, toffset, tsize;
+    int n;
+
+    hdr = (struct shm_header *)ds->shm;
+    if(idx < 0 || TAG_SLOT(idx) >= hdr->tagcount) return ERR_NOTFOUND;
+    t = &((struct shm_tag *)&ds->shm[sizeof(struct shm_header)])[TAG_SLOT(idx)];
+
+    for(n = 0; n < SHM_READ_RETRIES; n++) {
+        s1 = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+        if(s1 & 1) continue; /* The server is writing it right now */
+        if(!(__atomic_load_n(&t->flags, __ATOMIC_RELAXED) & SHM_TAG_VALID)) return ERR_NOTFOUND;
+        if(__atomic_load_n(&t->index, __ATOMIC_RELAXED) != idx) return ERR_NOTFOUND;
+        toffset = __atomic_load_n(&t->offset, __ATOMIC_RELAXED);
+        tsize = __atomic_load_n(&t->size, __ATOMIC_RELAXED);
+        /* The server will give the proper error for a bad offset or size */
+        if((uint64_t)offset + size > tsize) return ERR_NOTFOUND;
+        if(toffset < hdr->dataoffset || (uint64_t)toffset + tsize > ds->shm_size) return ERR_NOTFOUND;
+        memcpy(data, &ds->shm[toffset + offset], size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&t->seq, __ATOMIC_RELAXED);
+        if(s1 == s2) return 0;
+    }
+    return ERR_NOTFOUND;
 }
 
 /*!
  * Raw low level database read.  The data will be retrieved exactly
  * like it appears in the server.  It is up to the module to convert
  * the data to the servers's number format.  There are other functions
- * in this library to help with the conversion.
+ * in this library to help with the conversion.  If the module is
+ * connected through the local domain socket and the server shared its
+ * tag data memory with us then the data is copied straight from there.
  *
  * @param ds The pointer to the dax state object
  * @param idx Tag index found in the tag_handle of the tag as
@@ -681,15 +1206,24 @@ dax_read(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size)
     uint8_t buff[14];
 
     /* If we try to read more data that can be held in a single message we return an error */
-    if(size > MSG_DATA_SIZE) {
+    if(size > MSG_DATA_MAX(ds)) {
         return ERR_2BIG;
     }
 
+    pthread_mutex_lock(&ds->lock);
+    /* Asynchronous writes that the server hasn't handled yet wouldn't be
+     * in the shared memory so we only use it when there aren't any */
+    if(ds->shm != NULL && ds->request_count == 0) {
+        if(_shm_read(ds, idx, offset, data, size) == 0) {
+            pthread_mutex_unlock(&ds->lock);
+            return 0;
+        }
+    }
+
     *((tag_index *)&buff[0]) = mtos_dint(idx);
     *((uint32_t *)&buff[4]) = mtos_dint(offset);
     *((uint32_t *)&buff[8]) = mtos_dint(size);
 
-    pthread_mutex_lock(&ds->lock);
     result = _message_send(ds, MSG_TAG_READ, (void *)buff, sizeof(buff));
     if(result) {
         pthread_mutex_unlock(&ds->lock);
@@ -727,7 +1261,8 @@ dax_write(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size
 {
     size_t sendsize;
     int result;
-    char buff[MSG_DATA_SIZE];
+    char sbuff[MSG_DATA_SIZE];
+    char *buff = sbuff;
 
     /* This calculates the amount of data that we can send with a single message
        It subtracts a handle_t from the data size for use as the tag handle and
@@ -735,9 +1270,14 @@ dax_write(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size
     sendsize = size + sizeof(tag_index) + sizeof(uint32_t);
     /* It is assumed that the flags that we want to set are the first 4 bytes are in *data */
     /* If we try to read more data that can be held in a single message we return an error */
-    if(sendsize > MSG_DATA_SIZE) {
+    if(sendsize > MSG_DATA_MAX(ds)) {
         return ERR_2BIG;
     }
+    /* Large frames won't fit on the stack */
+    if(sendsize > MSG_DATA_SIZE) {
+        buff = malloc(sendsize);
+        if(buff == NULL) return ERR_ALLOC;
+    }
 
     /* Write the data to the message buffer */
     *((tag_index *)&buff[0]) = mtos_dint(idx);
@@ -747,11 +1287,12 @@ dax_write(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size
 
     pthread_mutex_lock(&ds->lock);
     result = _message_send(ds, MSG_TAG_WRITE, buff, sendsize);
+    if(buff != sbuff) free(buff);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
     }
-    result = _message_recv(ds, MSG_TAG_WRITE, buff, 0, 1);
+    result = _message_recv(ds, MSG_TAG_WRITE, NULL, 0, 1);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         if(result == ERR_DELETED) {
@@ -784,7 +1325,8 @@ int
 dax_mask(dax_state *ds, tag_index idx, uint32_t offset, void *data, void *mask, size_t size)
 {
     size_t sendsize;
-    uint8_t buff[MSG_DATA_SIZE];
+    uint8_t sbuff[MSG_DATA_SIZE];
+    uint8_t *buff = sbuff;
     int result;
 
     /* This calculates the amount of data that we can send with a single message
@@ -792,9 +1334,14 @@ dax_mask(dax_state *ds, tag_index idx, uint32_t offset, void *data, void *mask,
     sendsize = size*2 + sizeof(tag_index) + sizeof(uint32_t);
     /* It is assumed that the flags that we want to set are the first 4 bytes are in *data */
     /* If we try to read more data that can be held in a single message we return an error */
-    if(sendsize > MSG_DATA_SIZE) {
+    if(sendsize > MSG_DATA_MAX(ds)) {
         return ERR_2BIG;
     }
+    /* Large frames won't fit on the stack */
+    if(sendsize > MSG_DATA_SIZE) {
+        buff = malloc(sendsize);
+        if(buff == NULL) return ERR_ALLOC;
+    }
     /* Write the data to the message buffer */
     *((tag_index *)&buff[0]) = mtos_dint(idx);
     *((uint32_t *)&buff[4]) = mtos_dint(offset);
@@ -803,11 +1350,12 @@ dax_mask(dax_state *ds, tag_index idx, uint32_t offset, void *data, void *mask,
 
     pthread_mutex_lock(&ds->lock);
     result = _message_send(ds, MSG_TAG_MWRITE, buff, sendsize);
+    if(buff != sbuff) free(buff);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         return result;
     }
-    result = _message_recv(ds, MSG_TAG_MWRITE, buff, 0, 1);
+    result = _message_recv(ds, MSG_TAG_MWRITE, NULL, 0, 1);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
         if(result == ERR_DELETED) {
@@ -819,6 +1367,214 @@ dax_mask(dax_state *ds, tag_index idx, uint32_t offset, void *data, void *mask,
     return 0;
 }
 
+/*!
+ * Sends a batch of raw writes to the server.  Each of the writes is the same
+ * as a dax_write() but they are sent together in as few messages as they
+ * will fit in.  The server groups the writes in a message by tag and then
+ * checks the events and mappings once for each part of a tag that was
+ * written, so several writes to the same tag are cheaper than writing
+ * them one at a time.  The writes to the same bytes of a tag are done in
+ * the order that they are in the array.  The writes to ordinary tags in
+ * each message are checked before any of them are done.  Writes to
+ * virtual and special tags are checked by the server as they are done, so
+ * an error there can come after other writes in the same message have
+ * been done.  If there is an error the writes in the messages that were
+ * sent before it have also been done.
+ *
+ * @param ds Pointer to the dax state object.
+ * @param items Array of the writes
+ * @param count Number of writes in the array
+ *
+ * @returns Zero upon success or an error code otherwise
+ */
+int
+dax_write_batch(dax_state *ds, dax_write_item *items, int count)
+{
+    size_t sendsize, max;
+    uint32_t u_temp, n;
+    uint8_t *buff;
+    int i, first, result = 0;
+
+    max = MSG_DATA_MAX(ds);
+    for(i = 0; i < count; i++) {
+        if(items[i].size > max - sizeof(uint32_t) - BWRITE_ITEM_HEADER_SIZE) return ERR_2BIG;
+    }
+    buff = malloc(MIN(max, DAX_MSGMAX));
+    if(buff == NULL) return ERR_ALLOC;
+    sendsize = MIN(max, DAX_MSGMAX);
+
+    pthread_mutex_lock(&ds->lock);
+    i = 0;
+    while(result == 0 && i < count) {
+        /* Put as many of the writes in this message as will fit */
+        n = 0;
+        first = i;
+        while(i < count && n + BWRITE_ITEM_HEADER_SIZE + items[i].size <= max - sizeof(uint32_t)) {
+            n += BWRITE_ITEM_HEADER_SIZE + items[i].size;
+            i++;
+        }
+        if(n + sizeof(uint32_t) > sendsize) {
+            free(buff);
+            sendsize = n + sizeof(uint32_t);
+            buff = malloc(sendsize);
+            if(buff == NULL) {
+                result = ERR_ALLOC;
+                break;
+            }
+        }
+        u_temp = mtos_udint(i - first);
+        memcpy(&buff[0], &u_temp, 4);
+        n = sizeof(uint32_t);
+        for(; first < i; first++) {
+            u_temp = mtos_dint(items[first].idx);
+            memcpy(&buff[n], &u_temp, 4);
+            u_temp = mtos_udint(items[first].offset);
+            memcpy(&buff[n + 4], &u_temp, 4);
+            u_temp = mtos_udint(items[first].size);
+            memcpy(&buff[n + 8], &u_temp, 4);
+            memcpy(&buff[n + BWRITE_ITEM_HEADER_SIZE], items[first].data, items[first].size);
+            n += BWRITE_ITEM_HEADER_SIZE + items[first].size;
+        }
+        result = _message_send(ds, MSG_TAG_BWRITE, buff, n);
+        if(result == 0) {
+            result = _message_recv(ds, MSG_TAG_BWRITE, NULL, 0, 1);
+        }
+    }
+    pthread_mutex_unlock(&ds->lock);
+    free(buff);
+    return result;
+}
+
+/*!
+ * Asynchronous version of dax_read().  The read request is sent to the
+ * server and this function returns without waiting for the response.  Many
+ * requests can be sent this way before any of the responses are received
+ * so that we don't have to wait on a round trip to the server for each one.
+ * When the response arrives the data is written to *data and the callback
+ * is called.  The server answers the requests in the order that they were
+ * sent.
+ *
+ * The callback is called from the connection thread.  It should be short and
+ * it must not call any of the library functions that send messages to the
+ * server.  *data must remain valid until the callback has been called.
+ *
+ * @param ds Pointer to the dax state object.
+ * @param idx The index of the tag that we are reading
+ * @param offset The byte offset within the data area of the tag
+ * @param data Pointer to the data area where the data will be written
+ * @param size The number of bytes to read.
+ * @param callback Function that will be called with the result of the
+ *                 read.  May be NULL.
+ * @param udata User data that will be passed to the callback
+ * @param id Pointer to where the id of the request will be stored.  This
+ *           can be passed to dax_async_wait().  May be NULL.
+ *
+ * @returns Zero if the request was sent or an error code otherwise
+ */
+int
+dax_read_async(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size,
+               void (*callback)(dax_state *ds, int result, void *udata), void *udata,
+               uint32_t *id)
+{
+    uint8_t buff[12];
+
+    if(size > MSG_DATA_MAX(ds)) {
+        return ERR_2BIG;
+    }
+    *((tag_index *)&buff[0]) = mtos_dint(idx);
+    *((uint32_t *)&buff[4]) = mtos_dint(offset);
+    *((uint32_t *)&buff[8]) = mtos_dint(size);
+
+    return _message_send_async(ds, MSG_TAG_READ, buff, sizeof(buff), data, size,
+                               callback, udata, id);
+}
+
+/*!
+ * Asynchronous version of dax_write().  The data is copied into the message
+ * before this function returns so *data can be reused right away.  The
+ * callback is called from the connection thread when the server answers
+ * and the same restrictions apply as with dax_read_async().
+ *
+ * @param ds Pointer to the dax state object.
+ * @param idx The index of the tag that we are writing to
+ * @param offset Byte offset within the tags data area where we are
+ *               writing the data
+ * @param data Pointer to the data that we wish to write
+ * @param size Size of the data that we wish to write in bytes
+ * @param callback Function that will be called with the result of the
+ *                 write.  May be NULL.
+ * @param udata User data that will be passed to the callback
+ * @param id Pointer to where the id of the request will be stored.  May be NULL.
+ *
+ * @returns Zero if the request was sent or an error code otherwise
+ */
+int
+dax_write_async(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size,
+                void (*callback)(dax_state *ds, int result, void *udata), void *udata,
+                uint32_t *id)
+{
+    size_t sendsize;
+    int result;
+    char sbuff[MSG_DATA_SIZE];
+    char *buff = sbuff;
+
+    sendsize = size + sizeof(tag_index) + sizeof(uint32_t);
+    if(sendsize > MSG_DATA_MAX(ds)) {
+        return ERR_2BIG;
+    }
+    /* Large frames won't fit on the stack */
+    if(sendsize > MSG_DATA_SIZE) {
+        buff = malloc(sendsize);
+        if(buff == NULL) return ERR_ALLOC;
+    }
+    *((tag_index *)&buff[0]) = mtos_dint(idx);
+    *((uint32_t *)&buff[4]) = mtos_dint(offset);
+    memcpy(&buff[8], data, size);
+
+    result = _message_send_async(ds, MSG_TAG_WRITE, buff, sendsize, NULL, 0,
+                                 callback, udata, id);
+    if(buff != sbuff) free(buff);
+    return result;
+}
+
+/*!
+ * Waits for asynchronous requests to be answered by the server.  Since the
+ * server answers requests in order, when a request is finished all of the
+ * requests that were sent before it are finished too.
+ *
+ * @param ds Pointer to the dax state object.
+ * @param id The id of the request to wait for.  If zero we wait for all of
+ *           the requests that have been sent.
+ * @param timeout Number of milliseconds to wait.  If set to zero it will
+ *                wait forever.
+ *
+ * @returns Zero when the request has been answered or ERR_TIMEOUT
+ */
+int
+dax_async_wait(dax_state *ds, uint32_t id, int timeout)
+{
+    struct timespec ts;
+    int result;
+
+    pthread_mutex_lock(&ds->msg_lock);
+    if(id == 0) id = ds->request_id;
+    _abstime(&ts, timeout);
+    /* The ids wrap so we compare the difference */
+    while((int32_t)(ds->request_done - id) < 0) {
+        if(timeout) {
+            result = pthread_cond_timedwait(&ds->msg_cond, &ds->msg_lock, &ts);
+        } else {
+            result = pthread_cond_wait(&ds->msg_cond, &ds->msg_lock);
+        }
+        if(result == ETIMEDOUT) {
+            pthread_mutex_unlock(&ds->msg_lock);
+            return ERR_TIMEOUT;
+        }
+    }
+    pthread_mutex_unlock(&ds->msg_lock);
+    return 0;
+}
+
 /*!
  * Used to add an override to the given tag
  * @param ds Pointer to the dax state object.
@@ -975,6 +1731,8 @@ dax_tag_get_override(dax_state *ds, tag_handle handle, void *data, void *mask) {
     size_t size;
     uint8_t buff[MSG_DATA_SIZE];
 
+    /* The data and the mask both come back in buff */
+    if(handle.size * 2 > sizeof(buff)) return ERR_2BIG;
     *((tag_index *)&buff[0]) = mtos_dint(handle.index);
     *((uint32_t *)&buff[4]) = mtos_dint(handle.byte);
     *((uint32_t *)&buff[8]) = mtos_dint(handle.size);
@@ -986,7 +1744,7 @@ dax_tag_get_override(dax_state *ds, tag_handle handle, void *data, void *mask) {
         pthread_mutex_unlock(&ds->lock);
         return result;
     }
-    size = handle.size * 2;
+    size = sizeof(buff);
     result = _message_recv(ds, MSG_GET_OVRD, buff, &size, 1);
     if(result) {
         pthread_mutex_unlock(&ds->lock);
@@ -1199,6 +1957,7 @@ dax_event_add(dax_state *ds, tag_handle *h, int event_type, void *data,
         pthread_mutex_unlock(&ds->lock);
         return result;
     } else {
+        size = sizeof(result);
         test = _message_recv(ds, MSG_EVNT_ADD, &result, &size, 1);
         if(test) {
             pthread_mutex_unlock(&ds->lock);
@@ -1251,7 +2010,9 @@ dax_event_del(dax_state *ds, dax_id id)
         pthread_mutex_unlock(&ds->lock);
         return result;
     } else {
-        test = _message_recv(ds, MSG_EVNT_DEL, &result, &size, 1);
+        /* The server sends back the index and the id */
+        size = sizeof(buff);
+        test = _message_recv(ds, MSG_EVNT_DEL, buff, &size, 1);
         if(test) {
             pthread_mutex_unlock(&ds->lock);
             return test;
@@ -1306,7 +2067,9 @@ dax_event_options(dax_state *ds, dax_id id, uint32_t options)
         pthread_mutex_unlock(&ds->lock);
         return result;
     } else {
-        test = _message_recv(ds, MSG_EVNT_OPT, &result, &size, 1);
+        /* The server sends back the index and the id */
+        size = sizeof(buff);
+        test = _message_recv(ds, MSG_EVNT_OPT, buff, &size, 1);
         pthread_mutex_unlock(&ds->lock);
         return test;
     }
@@ -1620,7 +2383,8 @@ dax_map_del(dax_state *ds, dax_id id) {
  * @param result  Pointer to the result 0 = success
  * @param h       Pointer to an array of tag_handles that define the group
  * @param count   Number of handles in the array
- * @param options Options Flags - Not Implemented set to zero
+ * @param options Options Flags - GROUP_OPT_DELTA makes dax_group_read()
+ *                only transfer the members that have changed
  * @returns       A pointer to a tag group object.  This will be filled in
  *                with all the information necessary to access this group.
  *                This will be used in all the functions that access the group.
@@ -1629,76 +2393,89 @@ dax_map_del(dax_state *ds, dax_id id) {
  */
 tag_group_id *
 dax_group_add(dax_state *ds, int *result, tag_handle *h, int count, uint8_t options) {
-    int offset, n;
+    int offset, n, i, chunk, per;
     tag_group_id *id = NULL;
     size_t size, group_size;
     dax_dint temp;
     dax_udint u_temp;
+    uint8_t *buff;
 
-    uint8_t buff[MSG_DATA_SIZE];
     *result = 0;
     /* Sanity check the sizes.  These checks are redundant because
      * the server also does them but this will keep from sending the message */
-    if(count > TAG_GROUP_MAX_MEMBERS) {
+    if(count < 0 || count > TAG_GROUP_MAX_MEMBERS) {
         *result = ERR_ARG;
         return NULL;
     }
     group_size = 0;
     for(n=0; n<count; n++) {
         group_size += h[n].size;
-        if(group_size > MSG_TAG_GROUP_DATA_SIZE) {
-            *result = ERR_2BIG;
-            return NULL;
-        }
     }
-    buff[0] = count;
-    buff[1] = options; /* Not implemented yet */
-    /* size of the handles array + the count and the options bytes */
-    size = 21*count + 2;
-    for(n=0; n<count; n++) {
-        offset = 21*n + 2;
-        temp = mtos_dint(h[n].index);
-        memcpy(&buff[offset], &temp, 4);
-        u_temp = mtos_udint(h[n].byte);
-        memcpy(&buff[offset+4], &u_temp, 4);
-        buff[offset+8] = h[n].bit;
-        u_temp = mtos_udint(h[n].count);
-        memcpy(&buff[offset+9], &u_temp, 4);
-        u_temp = mtos_udint(h[n].size);
-        memcpy(&buff[offset+13], &u_temp, 4);
-        u_temp = mtos_udint(h[n].type);
-        memcpy(&buff[offset+17], &u_temp, 4);
+    /* Delta reads send a bitmap of the members along with the data */
+    if(group_size + (options & GROUP_OPT_DELTA ? GRP_DELTA_MAP_SIZE(count) : 0) > TAG_GROUP_MAX_SIZE) {
+        *result = ERR_2BIG;
+        return NULL;
+    }
+    /* The handles are sent in as many frames as it takes */
+    per = (MSG_DATA_MAX(ds) - GRP_ADD_HEADER_SIZE) / GRP_HANDLE_SIZE;
+    buff = malloc(GRP_ADD_HEADER_SIZE + GRP_HANDLE_SIZE * MIN(count, per));
+    if(buff == NULL) {
+        *result = ERR_ALLOC;
+        return NULL;
     }
 
     pthread_mutex_lock(&ds->lock);
-    *result = _message_send(ds, MSG_GRP_ADD, buff, size);
+    n = 0;
+    do {
+        chunk = MIN(count - n, per);
+        u_temp = mtos_udint(chunk);
+        memcpy(buff, &u_temp, 4);
+        buff[4] = options;
+        buff[5] = (n > 0 ? GRP_XFER_NEXT : 0) | (n + chunk < count ? GRP_XFER_MORE : 0);
+        for(i=0; i<chunk; i++) {
+            offset = GRP_HANDLE_SIZE*i + GRP_ADD_HEADER_SIZE;
+            temp = mtos_dint(h[n+i].index);
+            memcpy(&buff[offset], &temp, 4);
+            u_temp = mtos_udint(h[n+i].byte);
+            memcpy(&buff[offset+4], &u_temp, 4);
+            buff[offset+8] = h[n+i].bit;
+            u_temp = mtos_udint(h[n+i].count);
+            memcpy(&buff[offset+9], &u_temp, 4);
+            u_temp = mtos_udint(h[n+i].size);
+            memcpy(&buff[offset+13], &u_temp, 4);
+            u_temp = mtos_udint(h[n+i].type);
+            memcpy(&buff[offset+17], &u_temp, 4);
+        }
+        *result = _message_send(ds, MSG_GRP_ADD, buff, GRP_ADD_HEADER_SIZE + GRP_HANDLE_SIZE*chunk);
+        if(*result == 0) {
+            size = GRP_ADD_HEADER_SIZE + GRP_HANDLE_SIZE * chunk;
+            *result = _message_recv(ds, MSG_GRP_ADD, buff, &size, 1);
+        }
+        n += chunk;
+    } while(*result == 0 && n < count);
 
-    if(*result) {
-        pthread_mutex_unlock(&ds->lock);
-        return NULL;
-    }
-    size = MSG_DATA_SIZE;
-    *result = _message_recv(ds, MSG_GRP_ADD, buff, &size, 1);
     if(*result == 0) {
         id = (tag_group_id *)malloc(sizeof(tag_group_id));
-        if(id == NULL) {
-            pthread_mutex_unlock(&ds->lock);
-            *result = ERR_ALLOC;
-            return NULL;
+        if(id != NULL) {
+            id->handles = (tag_handle *)malloc(sizeof(tag_handle)*count);
+            if(id->handles == NULL && count > 0) {
+                free(id);
+                id = NULL;
+            }
         }
-        id->handles = (tag_handle *)malloc(sizeof(tag_handle)*count);
-        if(id->handles == NULL) {
-            pthread_mutex_unlock(&ds->lock);
+        if(id == NULL) {
             *result = ERR_ALLOC;
-            return NULL;
+        } else {
+            memcpy(id->handles, h, sizeof(tag_handle)*count);
+            id->index = *(uint32_t *)buff;
+            id->count = count;
+            id->options = options;
+            id->resync = 0;
+            id->size = group_size;
         }
-        memcpy(id->handles, h, sizeof(tag_handle)*count);
-        id->index = *(uint32_t *)buff;
-        id->count = count;
-        id->options = options;
-        id->size = group_size;
     }
     pthread_mutex_unlock(&ds->lock);
+    free(buff);
     return id;
 }
 
@@ -1719,35 +2496,76 @@ dax_group_get_size(tag_group_id *id) {
  * and writes it into the data area pointed to by 'buff'.  buff must be large
  * enough to contain the entire tag data group.
  *
+ * If the group was added with GROUP_OPT_DELTA only the members that have
+ * changed since the last read are transferred and written into the buffer.
+ * The rest of the buffer is left alone so it should be the same buffer
+ * that was used for the last read of the group.
+ *
+ * Groups that are larger than a frame are read in pieces but all of the
+ * pieces come from the same read of the tags on the server.
+ *
  * @param ds      Pointer to the dax state object
  * @param id      Pointer to the tag group id returned by dax_group_add()
  * @param data    Pointer to a buffer that will receive the data
  * @param size    Size of the above buffer
- * @returns       0 on success an error code otherwise
+ * @returns       0 on success an error code otherwise.  For delta groups
+ *                the number of members that changed is returned on success
  */
 int
 dax_group_read(dax_state *ds, tag_group_id *id, void *data, size_t size) {
     int result;
-    uint32_t u_temp;
+    uint32_t u_temp, offset, total, map = 0;
+    size_t rsize;
+    uint8_t req[GRP_READ_HEADER_SIZE];
+    uint8_t *buff;
 
     if(size < id->size) return ERR_ARG;
+    if(id->options & GROUP_OPT_DELTA) {
+        /* We don't know how much is coming until we have the bitmap */
+        map = GRP_DELTA_MAP_SIZE(id->count);
+        buff = malloc(map + id->size);
+        if(buff == NULL && map + id->size > 0) return ERR_ALLOC;
+        total = map;
+    } else {
+        buff = data;
+        total = id->size;
+    }
     u_temp = mtos_udint(id->index);
-    memcpy(data, &u_temp, 4);
+    memcpy(req, &u_temp, 4);
+    req[4] = id->resync ? GRP_READ_FULL : 0;
 
+    /* Groups that are larger than a frame are read a frame at a time.
+     * The server reads the whole group when we ask for offset zero */
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_GRP_READ, data, 4);
-    if(result) {
-        pthread_mutex_unlock(&ds->lock);
-        return result;
-    }
+    offset = 0;
+    do {
+        u_temp = mtos_udint(offset);
+        memcpy(&req[5], &u_temp, 4);
+        result = _message_send(ds, MSG_GRP_READ, req, GRP_READ_HEADER_SIZE);
+        if(result == 0) {
+            rsize = map + id->size - offset;
+            result = _message_recv(ds, MSG_GRP_READ, &buff[offset], &rsize, 1);
+        }
+        if(result) break;
+        if(map && offset < map && offset + rsize >= map) {
+            total = map + group_delta_size(id, buff);
+        }
+        if((rsize == 0 && offset < total) || offset + rsize > total) {
+            result = ERR_MSG_BAD;
+            break;
+        }
+        offset += rsize;
+    } while(offset < total);
 
-    size = MSG_DATA_SIZE;
-    result = _message_recv(ds, MSG_GRP_READ, data, &size, 1);
-    if(result) {
-        pthread_mutex_unlock(&ds->lock);
-        return result;
-    }
-    if(result == 0) {
+    if(id->options & GROUP_OPT_DELTA) {
+        if(result == 0) {
+            result = group_read_apply(ds, id, data, buff, total);
+        }
+        /* If we missed a response the server's idea of what we have
+         * is wrong so we start over */
+        id->resync = (result < 0);
+        free(buff);
+    } else if(result == 0) {
         result = group_read_format(ds, id, data);
     }
     pthread_mutex_unlock(&ds->lock);
@@ -1755,7 +2573,9 @@ dax_group_read(dax_state *ds, tag_group_id *id, void *data, size_t size) {
 }
 
 /*!
- * Writes a tag data group to the server.
+ * Writes a tag data group to the server.  Groups that are larger than a
+ * frame are sent in pieces and the server writes them all when it has
+ * the last one.
  *
  * @param ds      Pointer to the dax state object
  * @param id      Pointer to the tag group id returned by dax_group_add()
@@ -1766,24 +2586,32 @@ dax_group_read(dax_state *ds, tag_group_id *id, void *data, size_t size) {
 int
 dax_group_write(dax_state *ds, tag_group_id *id, void *data) {
     int result;
-    uint32_t u_temp;
-    char buff[MSG_DATA_SIZE];
+    uint32_t u_temp, offset, chunk, per;
+    uint8_t *buff;
 
+    result = group_write_format(ds, id, data);
+    if(result) return result;
+    per = MSG_DATA_MAX(ds) - GRP_WRITE_HEADER_SIZE;
+    buff = malloc(GRP_WRITE_HEADER_SIZE + MIN(id->size, per));
+    if(buff == NULL) return ERR_ALLOC;
     u_temp = mtos_udint(id->index);
     memcpy(buff, &u_temp, 4);
 
-    result = group_write_format(ds, id, data);
-    if(result) return result;
-    memcpy(&buff[4], data, id->size);
     pthread_mutex_lock(&ds->lock);
-    result = _message_send(ds, MSG_GRP_WRITE, buff, id->size+4);
-    if(result) {
-        pthread_mutex_unlock(&ds->lock);
-        return result;
-    }
-
-    result = _message_recv(ds, MSG_GRP_WRITE, NULL, 0, 1);
+    offset = 0;
+    do {
+        chunk = MIN((uint32_t)id->size - offset, per);
+        u_temp = mtos_udint(offset);
+        memcpy(&buff[4], &u_temp, 4);
+        memcpy(&buff[GRP_WRITE_HEADER_SIZE], &((uint8_t *)data)[offset], chunk);
+        result = _message_send(ds, MSG_GRP_WRITE, buff, GRP_WRITE_HEADER_SIZE + chunk);
+        if(result == 0) {
+            result = _message_recv(ds, MSG_GRP_WRITE, NULL, 0, 1);
+        }
+        offset += chunk;
+    } while(result == 0 && offset < (uint32_t)id->size);
     pthread_mutex_unlock(&ds->lock);
+    free(buff);
     return result;
 }
 
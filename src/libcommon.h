@@ -53,17 +53,41 @@
 #define MSG_DEL_OVRD    0x0019 /* Delete override */
 #define MSG_GET_OVRD    0x001A /* Read the current override mask and raw value for the given tag */
 #define MSG_SET_OVRD    0x001B /* Set or clear tag override flag */
+#define MSG_TAG_BWRITE  0x001C /* Several writes to different tags in one message */
 
 /* More to come */
 
-#define NUM_COMMANDS 27
+#define NUM_COMMANDS 28
 
 #define MSG_RESPONSE  0x01000000LL /* Flag for defining a response message */
 #define MSG_ERROR     0x02000000LL /* Flag for defining an error message */
 #define MSG_EVENT     0x80000000LL /* Flag for defining an event message */
+#define MSG_NOTIFY    0x40000000LL /* Flag for a notice that the server sends on its own */
+
+/* These are the notices that are sent with MSG_NOTIFY */
+#define NOTIFY_TAG    0x0001 /* The tag at the index was changed or deleted */
 
 /* These are flags for the registration command */
 #define CONNECT_SYNC  0x01 /* Used to identify the synchronous socket during registration */
+#define CONNECT_FRAME 0x02 /* The requested maximum frame size follows the module name */
+#define CONNECT_SHM   0x04 /* The module would like the shared memory tag data region */
+#define CONNECT_NOTIFY 0x08 /* The module would like NOTIFY_TAG notices for its tag cache */
+#define CONNECT_REQID 0x10 /* The module puts request ids in its messages */
+
+/* Once the server has agreed to CONNECT_REQID the module puts an id for each
+ * request in these bits of the command word and the server copies them into
+ * the response or the error that answers the request.  Old modules leave
+ * them clear. */
+#define MSG_ID_MASK   0x00FFFF00
+#define MSG_ID_SHIFT  8
+#define MSG_ID(TYPE)  (((TYPE) & MSG_ID_MASK) >> MSG_ID_SHIFT)
+
+/* Size of the registration response.  If the module asked for a frame size
+ * the negotiated size is appended to the end of the response.  If the server
+ * also passed the shared memory file descriptor the size of the region
+ * follows the frame size.  If the module asked for CONNECT_REQID the flags
+ * that the server agreed to come after that. */
+#define REG_RESPONSE_SIZE 31
 
 /* These are the values that the registration system uses to
    determine whether or not the module will have to reformat
@@ -82,6 +106,7 @@
 /* Subcommands for the MSG_TAG_GET command */
 #define TAG_GET_NAME    0x01 /* Retrieve the tag by name */
 #define TAG_GET_INDEX   0x02 /* Retrieve the tag by it's index */
+#define TAG_GET_SLOT    0x03 /* Retrieve whatever tag is in a slot of the database */
 
 /* Subcommands for the MSG_CDT_GET command */
 #define CDT_GET_NAME    0x01 /* Retrieve the type by name */
@@ -91,36 +116,102 @@
 #define CDT_TO_INDEX(TYPE) (TYPE & ~DAX_CUSTOM)
 #define CDT_TO_TYPE(INDEX) (INDEX | DAX_CUSTOM)
 
-/* Maximum size allowed for a single message */
+/* Maximum size allowed for a single message.  This is the frame size that
+ * is used until a larger one has been negotiated at registration. */
 #ifndef DAX_MSGMAX
 #  define DAX_MSGMAX 4096
 #endif
 
+/* Largest frame size that can be negotiated */
+#ifndef DAX_FRAMEMAX
+#  define DAX_FRAMEMAX (16 * 1024 * 1024)
+#endif
+
 /* This defines the size of the message minus the actual data */
 #define MSG_HDR_SIZE (sizeof(uint32_t) + sizeof(uint32_t))
 #define MSG_DATA_SIZE (DAX_MSGMAX - MSG_HDR_SIZE)
 #define MSG_TAG_DATA_SIZE (MSG_DATA_SIZE - sizeof(tag_idx_t))
 #define MSG_TAG_GROUP_DATA_SIZE (MSG_DATA_SIZE - sizeof(uint32_t))
 
+/* The tag index that the modules see is the slot that the tag has in the
+ * server's database in the low bits and the generation of that slot in the
+ * high bits.  The generation goes up every time a tag is deleted so a stale
+ * index never finds the tag that reuses the slot.  The top bit is left
+ * alone so that an index is never negative. */
+#define TAG_SLOT_BITS 20
+#define TAG_SLOT_MASK ((1 << TAG_SLOT_BITS) - 1)
+#define TAG_GEN_MAX   0x7FF
+#define TAG_SLOT(IDX) ((IDX) & TAG_SLOT_MASK)
+#define TAG_GEN(IDX) (((IDX) >> TAG_SLOT_BITS) & TAG_GEN_MAX)
+#define TAG_INDEX(SLOT, GEN) (((GEN) << TAG_SLOT_BITS) | (SLOT))
+
 /* This is the initial size of the group array that will be allocated
  * for each module the first time a group is added to that module */
 #define TAG_GROUP_START_COUNT 16
 /* This is the maximum number of groups that will be allocated.  After
  * this the module will receive ERR_2BIG errors when trying to add a group */
-#define TAG_GROUP_MAX_COUNT 4096
- /* Maximum number of handle members that can be sent */
-#define TAG_GROUP_MAX_MEMBERS 150
-
-/* This is a full sized message.  It's the largest message allowed to be sent */
+#define TAG_GROUP_MAX_COUNT 65536
+ /* Maximum number of handle members in a single group */
+#define TAG_GROUP_MAX_MEMBERS 65535
+/* Largest amount of data that a group can have.  Groups that are larger
+ * than a message frame are sent in pieces. */
+#define TAG_GROUP_MAX_SIZE DAX_FRAMEMAX
+
+/* Each write in a MSG_TAG_BWRITE message starts with the tag index, the
+ * byte offset and the size of the data that follows */
+#define BWRITE_ITEM_HEADER_SIZE 12
+
+/* Flags that can follow the group index in a MSG_GRP_READ message */
+#define GRP_READ_FULL 0x01 /* Send all the members of a delta group */
+/* Flags that follow the options in a MSG_GRP_ADD message */
+#define GRP_XFER_MORE 0x01 /* More frames of the same message will follow */
+#define GRP_XFER_NEXT 0x02 /* This frame continues the last one */
+/* Sizes of the parts of the group messages that come before the data */
+#define GRP_ADD_HEADER_SIZE   6 /* count(4) options(1) flags(1) */
+#define GRP_READ_HEADER_SIZE  9 /* index(4) flags(1) offset(4) */
+#define GRP_WRITE_HEADER_SIZE 8 /* index(4) offset(4) */
+#define GRP_HANDLE_SIZE      21
+/* Size of the bitmap that starts the response to a delta group read */
+#define GRP_DELTA_MAP_SIZE(COUNT) (((COUNT) + 7) / 8)
+
+/* This is a received message.  The data is allocated along with the
+ * structure so that it is only as large as the message that was received */
 struct dax_message {
     /* Message Header Stuff.  Changes here should be reflected in the
      * MSG_HDR_SIZE definition above */
     uint32_t size;     /* size of the data sent */
     uint32_t msg_type;  /* Which function to call */
-    /* Main data payload */
-    char data[MSG_DATA_SIZE];
     /* The following stuff isn't in the socket message */
     int fd;             /* We'll use the fd to identify the module*/
+    /* Main data payload */
+    char data[];
+};
+
+/* The tag server keeps a copy of the data for each tag in a shared memory
+ * region that local modules can map read only.  The region starts with the
+ * header, followed by a table of shm_tag entries that is indexed by the tag
+ * slot, followed by the data area.  The server changes a tag's entry and
+ * data with the entry's seq counter odd and makes it even again when it is
+ * done.  A reader copies the data and then checks that seq was even and
+ * didn't change while it was copying. */
+#define SHM_MAGIC 0x44415853 /* "DAXS" */
+
+/* Flags for the shm_tag entry */
+#define SHM_TAG_VALID 0x01 /* The data in the region can be read directly */
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t size;       /* Total size of the region */
+    uint32_t tagcount;   /* Number of entries in the tag table */
+    uint32_t dataoffset; /* Offset of the data area from the start of the region */
+};
+
+struct shm_tag {
+    uint32_t seq;        /* Odd while the server is changing the entry */
+    uint32_t flags;
+    int32_t index;       /* Full index of the tag that is in the slot */
+    uint32_t offset;     /* Offset of the data from the start of the region */
+    uint32_t size;       /* Size of the tag data */
 };
 
 /*
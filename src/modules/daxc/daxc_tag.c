@@ -132,7 +132,7 @@ tag_del(char **tokens)
     int result;
 
     if(isdigit(tokens[0][0])) {
-        result = dax_tag_byindex(ds, &temp_tag, atoi(tokens[0]));
+        result = dax_tag_byslot(ds, &temp_tag, atoi(tokens[0]));
     } else {
         result = dax_tag_byname(ds, &temp_tag, tokens[0]);
     }
@@ -208,7 +208,7 @@ list_tags(char **tokens)
                 nextindex = start;
                 n=0;
                 while( n < count && nextindex <= lastindex) {
-                    result = dax_tag_byindex(ds, &temp_tag, nextindex);
+                    result = dax_tag_byslot(ds, &temp_tag, nextindex);
                     if(result == 0) {
                         show_tag(nextindex, temp_tag);
                         n++;
@@ -224,7 +224,7 @@ list_tags(char **tokens)
                 /* List the next 'start' amount of tags */
                 n = 0;
                 while(n < start && nextindex <= lastindex) {
-                    result = dax_tag_byindex(ds, &temp_tag, nextindex);
+                    result = dax_tag_byslot(ds, &temp_tag, nextindex);
                     if(result == 0) {
                         show_tag(nextindex, temp_tag);
                         n++;
@@ -241,7 +241,7 @@ list_tags(char **tokens)
     } else {
         /* List all tags */
         for(n=0; n<=lastindex; n++) {
-            result = dax_tag_byindex(ds, &temp_tag, n);
+            result = dax_tag_byslot(ds, &temp_tag, n);
             if(result == ERR_DELETED) {
                 ; /* do nothing */
             } else if(result) {
@@ -171,6 +171,9 @@ typedef struct lua_State lua_State;
 /* Event Options */
 #define EVENT_OPT_SEND_DATA  0x01 /* Send the affected data with the event */
 
+/* Tag Group Options */
+#define GROUP_OPT_DELTA  0x01 /* Reads only transfer the members that have changed */
+
 /* Atomic Operations */
 #define ATOMIC_OP_INC  0x0001  /* Increment */
 #define ATOMIC_OP_DEC  0x0002  /* Decrement */
@@ -277,6 +280,16 @@ typedef struct dax_id {
     dax_dint id;         /* The ID of the event */
 } dax_id;
 
+/*!
+ * One of the writes that are sent all together with dax_write_batch()
+ */
+typedef struct dax_write_item {
+    tag_index idx;       /*!< The Database Index of the Tag */
+    uint32_t offset;     /*!< Byte offset within the tag's data */
+    void *data;          /*!< The data to write in the server's format */
+    uint32_t size;       /*!< Size of the data in bytes */
+} dax_write_item;
+
 /*! Opaque pointer for storing a dax_state object in the library */
 typedef struct dax_state dax_state;
 /*! Opaque pointer for tag group */
@@ -340,6 +353,8 @@ int dax_tag_del(dax_state *ds, tag_index index);
 int dax_tag_byname(dax_state *ds, dax_tag *tag, char *name);
 /* Get tag by index */
 int dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index index);
+/* Get the tag in a slot of the database, for walking through all the tags */
+int dax_tag_byslot(dax_state *ds, dax_tag *tag, tag_index slot);
 
 /* The handle is a complete description of where in the tagbase the
  * data that we wish to retrieve is located.  This can be used in place
@@ -368,6 +383,22 @@ int dax_write(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t
 /* simple untyped masked tag write */
 int dax_mask(dax_state *ds, tag_index idx, uint32_t offset, void *data,
              void *mask, size_t size);
+/* many untyped tag writes in as few messages as possible */
+int dax_write_batch(dax_state *ds, dax_write_item *items, int count);
+
+/* These send the request without waiting for the server to answer.  Many
+ * requests can be in flight at once.  The callback is called from the
+ * connection thread with the result when the response arrives and must not
+ * call any library functions that send messages to the server. *id is set to
+ * an id that can be passed to dax_async_wait() and may be NULL. */
+int dax_read_async(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size,
+                   void (*callback)(dax_state *ds, int result, void *udata), void *udata,
+                   uint32_t *id);
+int dax_write_async(dax_state *ds, tag_index idx, uint32_t offset, void *data, size_t size,
+                    void (*callback)(dax_state *ds, int result, void *udata), void *udata,
+                    uint32_t *id);
+/* Wait for the request with the given id (or all requests if id is 0) to be answered */
+int dax_async_wait(dax_state *ds, uint32_t id, int timeout);
 
 /* These are the bread and butter tag handling functions.  The functions
  * understand the type of tag being written and take care of all the
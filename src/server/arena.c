@@ -0,0 +1,194 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  This file contains the slab allocator that the tag database uses for
+ *  tag data, names, overrides, events and mappings.
+ */
+
+#include "arena.h"
+
+/* Notes:
+ * Most of what the tag database allocates is very small.  A DINT tag has
+ * four bytes of data and the name is usually less than 16 bytes.  When each
+ * of these is a separate malloc() the overhead of the allocator is bigger
+ * than the data and the pieces end up spread all over the heap mixed in with
+ * the message buffers and everything else.
+ *
+ * Here the blocks are carved out of ARENA_SLAB_SIZE chunks.  Each pool hands
+ * out blocks of a single size so there is no header on the blocks and the
+ * blocks that are allocated one after the other sit next to each other in
+ * memory.  Since the tags are usually created in the same order that they
+ * are read, the data for a group of tags ends up packed together.  A block
+ * that is freed goes on the pool's free list and is handed out again before
+ * the slab is touched.  Slabs are never given back to the system.
+ *
+ * arena_alloc() picks one of the size class pools below for the size.  The
+ * caller has to give the same size to arena_free() so that the block goes
+ * back to the right pool.  Anything larger than ARENA_MAX_SIZE is given to
+ * malloc().
+ *
+ * There is no locking here.  Everything that allocates or frees from the
+ * arena does it while holding the tag database lock exclusively.
+ */
+
+/* Every block is a multiple of this so that the data is aligned for any
+ * of the tag data types */
+#define ARENA_ALIGN(x) (((x) + 7) & ~7)
+
+/* The size classes are close enough together that rounding up never wastes
+ * more than about a quarter of a block */
+static const uint32_t _class_sizes[] = {
+       8,   16,   24,   32,   40,   48,   64,   80,   96,  128,
+     160,  192,  256,  320,  384,  512,  640,  768, 1024, 1280,
+    1536, 2048
+};
+#define ARENA_CLASSES (sizeof(_class_sizes) / sizeof(_class_sizes[0]))
+
+static arena_pool _pools[ARENA_CLASSES];
+static int _pools_ready = 0;
+
+void
+arena_pool_init(arena_pool *pool, size_t size)
+{
+    /* A free block has to be big enough to hold the free list pointer */
+    if(size < sizeof(void *)) size = sizeof(void *);
+    pool->size = ARENA_ALIGN(size);
+    pool->freelist = NULL;
+    pool->slab = NULL;
+    pool->left = 0;
+    pool->used = 0;
+    pool->slabs = 0;
+}
+
+/* Returns a zeroed block from the pool or NULL if we are out of memory */
+void *
+arena_pool_alloc(arena_pool *pool)
+{
+    void *block;
+
+    if(pool->freelist != NULL) {
+        block = pool->freelist;
+        pool->freelist = *(void **)block;
+    } else {
+        if(pool->left < pool->size) {
+            /* Whatever is left at the end of the old slab is lost */
+            pool->slab = malloc(ARENA_SLAB_SIZE);
+            if(pool->slab == NULL) {
+                pool->left = 0;
+                return NULL;
+            }
+            pool->left = ARENA_SLAB_SIZE;
+            pool->slabs++;
+        }
+        block = pool->slab;
+        pool->slab += pool->size;
+        pool->left -= pool->size;
+    }
+    pool->used++;
+    bzero(block, pool->size);
+    return block;
+}
+
+void
+arena_pool_free(arena_pool *pool, void *ptr)
+{
+    if(ptr == NULL) return;
+    *(void **)ptr = pool->freelist;
+    pool->freelist = ptr;
+    pool->used--;
+}
+
+/* Returns the pool for the size or NULL if it's too big for the arena */
+static arena_pool *
+_get_pool(size_t size)
+{
+    int n;
+
+    if(size > ARENA_MAX_SIZE) return NULL;
+    if(! _pools_ready) {
+        for(n = 0; n < ARENA_CLASSES; n++) {
+            arena_pool_init(&_pools[n], _class_sizes[n]);
+        }
+        _pools_ready = 1;
+    }
+    for(n = 0; _class_sizes[n] < size; n++);
+    return &_pools[n];
+}
+
+/* Allocates a zeroed block of at least size bytes */
+void *
+arena_alloc(size_t size)
+{
+    arena_pool *pool;
+    void *ptr;
+
+    pool = _get_pool(size);
+    if(pool != NULL) {
+        return arena_pool_alloc(pool);
+    }
+    ptr = malloc(size);
+    if(ptr != NULL) bzero(ptr, size);
+    return ptr;
+}
+
+/* Frees a block from arena_alloc().  size has to be the same size that
+ * was used to allocate it. */
+void
+arena_free(void *ptr, size_t size)
+{
+    arena_pool *pool;
+
+    if(ptr == NULL) return;
+    pool = _get_pool(size);
+    if(pool != NULL) {
+        arena_pool_free(pool, ptr);
+    } else {
+        free(ptr);
+    }
+}
+
+char *
+arena_strdup(const char *str)
+{
+    char *new;
+    size_t len;
+
+    len = strlen(str) + 1;
+    new = arena_alloc(len);
+    if(new != NULL) memcpy(new, str, len);
+    return new;
+}
+
+void
+arena_strfree(char *str)
+{
+    if(str != NULL) arena_free(str, strlen(str) + 1);
+}
+
+/* Returns the total number of bytes in the size class slabs */
+size_t
+arena_get_size(void)
+{
+    size_t size = 0;
+    int n;
+
+    if(! _pools_ready) return 0;
+    for(n = 0; n < ARENA_CLASSES; n++) {
+        size += (size_t)_pools[n].slabs * ARENA_SLAB_SIZE;
+    }
+    return size;
+}
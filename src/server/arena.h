@@ -0,0 +1,52 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  Header file for the slab allocator that is used for the small, long lived
+ *  pieces of the tag database
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <common.h>
+
+/* Size of the chunks of memory that the blocks are carved out of */
+#define ARENA_SLAB_SIZE 16384
+/* Anything larger than this goes straight to malloc() */
+#define ARENA_MAX_SIZE  2048
+
+/* A pool of blocks that are all the same size */
+typedef struct arena_pool_t {
+    uint32_t size;        /* Size of each block */
+    void *freelist;       /* Blocks that have been freed */
+    uint8_t *slab;        /* The slab that new blocks are coming from */
+    uint32_t left;        /* Bytes that are left in that slab */
+    unsigned int used;    /* Blocks that are handed out */
+    unsigned int slabs;   /* Slabs that have been allocated */
+} arena_pool;
+
+void arena_pool_init(arena_pool *pool, size_t size);
+void *arena_pool_alloc(arena_pool *pool);
+void arena_pool_free(arena_pool *pool, void *ptr);
+
+void *arena_alloc(size_t size);
+void arena_free(void *ptr, size_t size);
+char *arena_strdup(const char *str);
+void arena_strfree(char *str);
+size_t arena_get_size(void);
+
+#endif /* !__ARENA_H */
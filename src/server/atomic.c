@@ -22,6 +22,7 @@
 #include "tagbase.h"
 #include "retain.h"
 #include "func.h"
+#include "shm.h"
 #include <ctype.h>
 #include <assert.h>
 
@@ -355,6 +356,7 @@ _atomic_xnor(tag_handle h, void *data) {
 
 int
 atomic_op(tag_handle h, void *data, uint16_t op) {
+    event_pending *pending = NULL;
     int result;
     /* We don't do these on custom data types */
     if(IS_CUSTOM(h.type)) {
@@ -413,10 +415,14 @@ atomic_op(tag_handle h, void *data, uint16_t op) {
             return ERR_NOTIMPLEMENTED;
     }
     if(result) return result;
-    event_check(h.index, h.byte, h.size);
+    shm_tag_update(h.index, h.byte, h.size);
+    /* The database is locked for writing while we are here so there is no
+     * shard lock to give back before the events are sent */
+    event_check(h.index, h.byte, h.size, &pending);
     if(_db[h.index].attr & TAG_ATTR_RETAIN) {
-        ret_tag_write(h.index);
+        ret_tag_write(h.index, h.byte, h.size);
     }
+    event_send(pending);
 
     return 0;
 }
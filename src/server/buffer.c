@@ -31,196 +31,265 @@
 #include <string.h>
 
 /* Notes:
- Okay here is how all this works.  To keep from having to have a buffer for
- each module and to keep from having some arbitrary amount of buffers for
- new modules we are going to share some buffers.  Each buffer has a file
- descriptor associated with it.  When the socket code decides that it needs
- to read information from a socket it will use these functions to find a buffer
- that is associated with the file descriptor.  If there isn't one associated
- with the file descriptor then it tries to find a free one.  If it can't
- find a free one then it'll create a new one.  There is a minimum number
- of buffers that will be kept allocated all the time to keep from calling
- malloc() and free() too much.
+ Each connection gets its own receive buffer.  The buffers are kept in a
+ table that is indexed by the file descriptor so finding the buffer for a
+ socket that is ready doesn't require any searching.
+
+ The buffer has a read index (head) and a write index (tail).  We read as
+ much as will fit at the tail and then every complete message between the
+ head and the tail is dispatched.  This way a burst of small messages from
+ a module is handled with a single read().  The messages are handled in
+ place, so instead of wrapping around at the end the buffer is compacted by
+ moving the remaining partial message to the front before the next read.
+
+ The buffers start small and grow when a message doesn't fit or when a
+ read fills the whole buffer.  Reading ahead only grows the buffer up to
+ BUFF_MAX_SIZE but a single message can make it as large as the frame
+ that the module negotiated when it registered.  Until then a connection
+ is held to DAX_MSGMAX so a socket that hasn't registered can't make us
+ allocate a large buffer.  When the server is idle the
+ buffers of idle connections are released.  A few are kept on a free list
+ so that we don't have to call malloc() and free() too much.
 
  There will be quite a few denial of service attacks that can be done here
  and I'll have to figure out a way to keep things limping along if some
  socket starts sending data to gum up the works.
 */
 
+/* Initial size of a connection buffer and the most that we'll grow it
+ * just to read ahead */
+#define BUFF_START_SIZE 512
+#define BUFF_MAX_SIZE   (DAX_MSGMAX * 4)
 
-typedef struct dax_BuffNode {
-    int fd;
-    int index; /* Index of the next available char in the buffer */
-    unsigned char buffer[DAX_MSGMAX];
-    struct dax_BuffNode *next;
-} dax_buffnode;
+typedef struct dax_connbuff_t {
+    uint32_t size;   /* Allocated size of the buffer */
+    uint32_t head;   /* Index of the start of the first unhandled message */
+    uint32_t tail;   /* Index of the next available char in the buffer */
+    unsigned char *buffer;
+    struct dax_connbuff_t *next; /* Used for the free list */
+} dax_connbuff;
 
-/* This is the head of the data buffer list */
-static dax_buffnode *_buffer;
+/* Table of buffers indexed by fd */
+static dax_connbuff **_buffers;
+static int _buffers_size;
+/* List of spare buffers */
+static dax_connbuff *_freelist;
+static int _freecount;
 
-/* Allocate and initialize a buffer node */
-static dax_buffnode *
-_new_buffnode(void)
+/* Allocate and initialize a buffer */
+static dax_connbuff *
+_new_connbuff(void)
 {
-    dax_buffnode *node;
+    dax_connbuff *cb;
 
-    node = malloc(sizeof(dax_buffnode));
-    if(node == NULL) return NULL;
-    node->fd = 0;
-    node->index = 0;
-    node->next = NULL;
+    cb = malloc(sizeof(dax_connbuff));
+    if(cb == NULL) return NULL;
+    cb->buffer = malloc(BUFF_START_SIZE);
+    if(cb->buffer == NULL) {
+        free(cb);
+        return NULL;
+    }
+    cb->size = BUFF_START_SIZE;
+    cb->head = 0;
+    cb->tail = 0;
+    cb->next = NULL;
+    return cb;
+}
 
-    return node;
+/* Put the buffer on the free list or free it if we have enough spares */
+static void
+_release_connbuff(dax_connbuff *cb)
+{
+    if(_freecount < opt_min_buffers() && cb->size == BUFF_START_SIZE) {
+        cb->head = 0;
+        cb->tail = 0;
+        cb->next = _freelist;
+        _freelist = cb;
+        _freecount++;
+    } else {
+        free(cb->buffer);
+        free(cb);
+    }
 }
 
-/* Create the initial linked list of buffer nodes */
+/* Create the initial list of spare buffers */
 int
 buff_initialize(void)
 {
     int n, count;
-    dax_buffnode *node, *last;
+    dax_connbuff *cb;
 
     count = opt_min_buffers();
-    last = NULL;
+    _freelist = NULL;
+    _freecount = 0;
+    _buffers = NULL;
+    _buffers_size = 0;
 
     for(n = 0; n < count; n++) {
-        node = _new_buffnode();
-        if(node == NULL) {
+        cb = _new_connbuff();
+        if(cb == NULL) {
             dax_log(DAX_LOG_FATAL, "Unable to allocate all of the communication buffers");
             kill(getpid(), SIGQUIT);
         }
-        if(n == 0) {
-            _buffer = node;
-        } else {
-            last->next = node;
-        }
-        last = node;
+        _release_connbuff(cb);
     }
     return 0;
 }
 
-/* Return the index of the buffer node that is either presently
-   assigned to the fd or if there isn't one a free one */
-static dax_buffnode *
-find_buff_slot(int fd)
+/* Return the buffer that is assigned to the fd.  If there isn't one we
+   take one from the free list or allocate a new one */
+static dax_connbuff *
+_get_connbuff(int fd)
 {
-    dax_buffnode *node, *firstfree, *result;
-
-    node = _buffer;
-    firstfree = NULL;
+    dax_connbuff **new_buffers;
+    dax_connbuff *cb;
+    int newsize;
 
-    while(node != NULL) {
-        if(node->fd == fd) /* found it */
-            return node;
-        else if(node->fd == 0 && firstfree == NULL)
-            firstfree = node;  /* store a free one for later */
-        node = node->next;
+    if(fd >= _buffers_size) {
+        newsize = _buffers_size ? _buffers_size : 64;
+        while(newsize <= fd) newsize *= 2;
+        new_buffers = realloc(_buffers, sizeof(dax_connbuff *) * newsize);
+        if(new_buffers == NULL) return NULL;
+        bzero(&new_buffers[_buffers_size], sizeof(dax_connbuff *) * (newsize - _buffers_size));
+        _buffers = new_buffers;
+        _buffers_size = newsize;
     }
-    /* couldn't find one that matched the fd so
-     * if we have one that was free return it */
-    if(firstfree != NULL) {
-        result = firstfree;
+    if(_buffers[fd] != NULL) return _buffers[fd];
+
+    if(_freelist != NULL) {
+        cb = _freelist;
+        _freelist = cb->next;
+        _freecount--;
     } else {
-        result = _new_buffnode();
-        if(result != NULL) {
-            node = _buffer;
-            /* double linked list would eliminate this ??? */
-            while(node->next != NULL) node = node->next;
-            node->next = result;
-        }
+        cb = _new_connbuff();
     }
-    if(result) result->fd = fd;
-    return result;
+    _buffers[fd] = cb;
+    return cb;
 }
 
+/* Make sure the buffer can hold at least 'size' bytes without letting it
+ * get larger than 'max' */
+static int
+_grow_connbuff(dax_connbuff *cb, uint32_t size, uint32_t max)
+{
+    unsigned char *new_buffer;
+    uint32_t newsize;
+
+    if(size <= cb->size) return 0;
+    newsize = cb->size;
+    while(newsize < size) newsize *= 2;
+    if(newsize > max) newsize = max;
+    if(newsize < size) return ERR_2BIG;
+    new_buffer = realloc(cb->buffer, newsize);
+    if(new_buffer == NULL) return ERR_ALLOC;
+    cb->buffer = new_buffer;
+    cb->size = newsize;
+    return 0;
+}
+
+/* Reads whatever data is waiting on the socket into the buffer associated
+ * with 'fd' and dispatches all of the complete messages that are in the
+ * buffer.  The read does not block.  Returns ERR_EMPTY when there is no
+ * more data waiting on the socket. */
 int
 buff_read(int fd)
 {
-    dax_buffnode *node;
-    size_t result;
-    uint32_t size;
-
-    node = find_buff_slot(fd);
+    dax_connbuff *cb;
+    ssize_t nread;
+    uint32_t space, msgsize, msgmax;
+    unsigned char save;
+    int result;
 
+    cb = _get_connbuff(fd);
     /* If we can't get a buffer then return error */
-    if(node == NULL) return ERR_ALLOC;
+    if(cb == NULL) return ERR_ALLOC;
 
-    /* We don't want to read too much now do we */
-    size = DAX_MSGMAX - node->index;
-    result = read(fd, &node->buffer[node->index], size);
-    //--Problem with xread() see func.c
-    //--result = xread(fd, &node->buffer[node->index], size);
+    /* Move any partial message to the front of the buffer */
+    if(cb->head == cb->tail) {
+        cb->head = cb->tail = 0;
+    } else if(cb->head > 0) {
+        memmove(cb->buffer, &cb->buffer[cb->head], cb->tail - cb->head);
+        cb->tail -= cb->head;
+        cb->head = 0;
+    }
+    /* We always keep a byte at the end for the NULL terminator */
+    space = cb->size - cb->tail - 1;
+    nread = recv(fd, &cb->buffer[cb->tail], space, MSG_DONTWAIT);
 
-    if(result < 0) {
+    if(nread < 0) {
+        if(errno == EINTR) return 0; /* Caller will try again */
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return ERR_EMPTY;
+        }
         dax_log(DAX_LOG_ERROR, "Unable to read data from socket %d", fd);
         return ERR_MSG_RECV;
-    } if(result == 0) { /* EOF means the other guy is closed */
+    } if(nread == 0) { /* EOF means the other guy is closed */
         dax_log(DAX_LOG_COMM, "Received EOF on socket %d", fd);
         return ERR_NO_SOCKET;
     }
+    cb->tail += nread;
+    /* Modules that haven't negotiated a larger frame are held to DAX_MSGMAX */
+    msgmax = msg_conn_max(fd);
 
-    node->index += result;
-
-    /* Check the size and let the caller know how it turns out. */
-    /* First four bytes of a message should always be the size of
-       the message and it should be in network byte order */
-    size = ntohl(*(uint32_t *)node->buffer);
-    if(node->index < (size - 1)) {
-        return ERR_MSG_BAD;
-    } else if(node->index >= (size - 1)) {
-        return msg_dispatcher(fd, node->buffer);
-    }else if(size > DAX_MSGMAX) {
-        return ERR_2BIG;
+    /* Dispatch every complete message in the buffer */
+    while(cb->tail - cb->head >= MSG_HDR_SIZE) {
+        /* First four bytes of a message should always be the size of
+           the message and it should be in network byte order */
+        msgsize = ntohl(*(uint32_t *)&cb->buffer[cb->head]);
+        if(msgsize > msgmax || msgsize < MSG_HDR_SIZE) {
+            dax_log(DAX_LOG_ERROR, "Bad message size %u received on socket %d", msgsize, fd);
+            cb->head = cb->tail = 0;
+            return ERR_MSG_RECV;
+        }
+        if(cb->tail - cb->head < msgsize) {
+            /* Make sure the rest of this message will fit.  The largest
+             * message needs one extra byte for the NULL terminator */
+            if(_grow_connbuff(cb, msgsize + 1, msgmax + 1)) return ERR_ALLOC;
+            break;
+        }
+        /* The dispatcher NULL terminates the message, which would clobber
+         * the first byte of the next one */
+        save = cb->buffer[cb->head + msgsize];
+        result = msg_dispatcher(fd, &cb->buffer[cb->head]);
+        cb->buffer[cb->head + msgsize] = save;
+        /* Every message is answered, even the ones that fail, by the
+         * handler, _msg_execute() or the worker so an error here is only
+         * logged.  Our return value is kept for socket problems. */
+        if(result) {
+            dax_log(DAX_LOG_MSGERR, "Message on fd %d returned error %d", fd, result);
+        }
+        cb->head += msgsize;
     }
-    return 0;
+    /* If we filled the buffer there is probably more to come so we give
+     * ourselves more room.  If we didn't then the socket is empty. */
+    if(nread == space) {
+        if(cb->size < BUFF_MAX_SIZE) _grow_connbuff(cb, cb->size * 2, BUFF_MAX_SIZE);
+        return 0;
+    }
+    return ERR_EMPTY;
 }
 
-/* TODO: Check boundary conditions where min_buffers = 0 or 1.  Shouldn't
-   be able to equal 0 but try to break it. */
-
-/* This frees the message buffer associated with 'fd' */
+/* This releases the buffer associated with 'fd' */
 void
 buff_free(int fd)
 {
-    dax_buffnode *node;
-    node = _buffer;
-
-    while(node != NULL) {
-        if(node->fd == fd) {
-            node->fd = 0;
-            node->index = 0;
-            return;
-        }
-        node = node->next;
+    if(fd < _buffers_size && _buffers[fd] != NULL) {
+        _release_connbuff(_buffers[fd]);
+        _buffers[fd] = NULL;
     }
 }
 
-/* This function essentially marks all of the buffers as free.  If there are
- * more than min_buffers it'll free() the last one.  Kindof a poor boy
- * garbage collection. */
+/* This function is called when the server has been idle for a while.  It
+ * releases the buffers for all of the connections that don't have a
+ * partial message waiting.  Kindof a poor boy garbage collection. */
 void
 buff_freeall(void)
 {
     int n;
-    dax_buffnode *node, *last;
-
-    n = 0;
-    node = _buffer;
-    last = NULL;
-
-    while(node != NULL) {
-        node->fd = 0;
-        node->index = 0;
-        n++;
-        /* If we are the last node, there are more than min_buffers nodes in the list
-           and last is not NULL then free the last node */
-        if(node->next == NULL && n > opt_min_buffers() && last != NULL) {
-            free(node);
-            node = NULL;
-            last->next = NULL;
-        } else {
-            last = node;
-            node = node->next;
+
+    for(n = 0; n < _buffers_size; n++) {
+        if(_buffers[n] != NULL && _buffers[n]->head == _buffers[n]->tail) {
+            buff_free(n);
         }
     }
 }
@@ -28,15 +28,51 @@
 
 /* Flag bits for the tag data groups */
 #define GRP_FLAG_NOT_EMPTY  0x01
+#define GRP_FLAG_DELTA      0x02 /* Reads only send the members that changed */
+#define GRP_FLAG_SHADOW     0x04 /* The shadow holds the data from the last read */
+
+/* Flag bits for the spans in a group's gather plan */
+#define TAG_SPAN_BOOL  0x01 /* The bits have to be packed to the start of the span */
+#define TAG_SPAN_SLOW  0x02 /* Always read with tag_read() */
+
+/* A piece of a tag that is copied in and out of a group's data.  Members
+ * that follow each other in the same tag share a single span. */
+typedef struct tag_span_t {
+    tag_index idx;
+    uint32_t byte;    /* Offset in the tag's data */
+    uint32_t offset;  /* Offset in the group's data */
+    uint32_t size;
+    uint32_t count;   /* Number of bits in BOOL spans */
+    uint8_t bit;
+    uint8_t flags;
+} tag_span;
 
 /* Tag groups are an array of handles in each module */
 typedef struct tag_group_t {
     uint8_t flags;    /* option flags for the group */
     unsigned int size; /* amount of memory needed to transfer this group */
-    uint8_t count;    /* number of members in this group */
+    uint32_t count;   /* number of members in this group */
     tag_handle *members;
+    tag_span *plan;   /* The members compiled into spans */
+    uint32_t plan_count;
+    uint8_t *shadow;  /* Data that the module got on the last delta read */
+    uint8_t *scratch; /* Room to unpack the largest BOOL span for a write */
 } tag_group;
 
+/* A group message that is too big for one frame is put together, or
+ * handed out, here a frame at a time */
+typedef struct group_xfer_t {
+    int command;      /* MSG_GRP_ADD, MSG_GRP_READ or MSG_GRP_WRITE */
+    uint32_t index;   /* The group that is being read or written */
+    uint8_t *data;
+    uint32_t size;    /* Total size of the transfer */
+    uint32_t fill;    /* Bytes that have been received or sent so far */
+    uint32_t alloc;   /* Allocated size of data */
+} group_xfer;
+
+/* Flags for the module */
+#define MFLAG_NOTIFY 0x01 /* Send NOTIFY_TAG notices to the module */
+
 /* Modules are implemented as a circular doubly linked list */
 typedef struct dax_Module {
     char *name;
@@ -45,10 +81,12 @@ typedef struct dax_Module {
     int fd;             /* The socket file descriptor for this module */
     tag_index tagindex; /* The index of the tag that represents this module */
     uint32_t timeout;  /* Module communication timeout. */
+    uint32_t msgmax;   /* Largest message frame negotiated with the module */
     time_t starttime;
     int event_count;
     tag_group *tag_groups; /* Array of tag group packet definitions */
     uint32_t groups_size;  /* Current size of the group array */
+    group_xfer xfer;       /* Group transfer that is in progress */
     struct dax_Module *next, *prev;
 } dax_module;
 
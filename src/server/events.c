@@ -21,6 +21,7 @@
 #include <common.h>
 #include "tagbase.h"
 #include "func.h"
+#include "arena.h"
 #include <ctype.h>
 #include <assert.h>
 
@@ -28,148 +29,164 @@ pthread_mutex_t _event_lock;
 
 extern _dax_tag_db *_db;
 
+/* The event nodes all come from here */
+static arena_pool _event_pool;
+
 /* Private function definitions */
+static void _free_event(_dax_event *event);
 
-static int
-_send_event(tag_index idx, _dax_event *event)
+/* Builds the message for an event that fired and puts it on the front of
+ * the *pending list.  The data is copied now, while the caller still has the
+ * tag locked, and event_send() sends it later. */
+static void
+_queue_event(tag_index idx, _dax_event *event, event_pending **pending)
 {
-    int result;
-    char buff[DAX_MSGMAX];
-    uint32_t msgsize;
+    event_pending *ev;
+    uint32_t size = 0;
 
     if(event->options & EVENT_OPT_SEND_DATA) {
-        msgsize = event->size + 16; /* Calculate the total size of this message */
-        *(uint32_t *)(&buff[0])  = htonl(event->size + 8); /* The size that we send */
-    } else {
-        msgsize = 16; /* Calculate the total size of this message */
-        *(uint32_t *)(&buff[0])  = htonl(8); /* The size that we send */
-    }
-    if(msgsize > DAX_MSGMAX) return ERR_2BIG;
-    *(uint32_t *)(&buff[4])  = htonl(MSG_EVENT | event->eventtype);
-    *(uint32_t *)(&buff[8])  = htonl(idx);
-    *(uint32_t *)(&buff[12])  = htonl(event->id);
-    if(event->options & EVENT_OPT_SEND_DATA) {
-        memcpy(&buff[16], &_db[idx].data[event->byte], event->size);
+        if(event->size + 16 > event->notify->msgmax) {
+            dax_log(DAX_LOG_ERROR, "_queue_event: Event data is too large for module %d",
+                    event->notify->fd);
+            return;
+        }
+        size = event->size;
+    }
+    ev = malloc(sizeof(event_pending) + size);
+    if(ev == NULL) {
+        dax_log(DAX_LOG_ERROR, "_queue_event: Unable to allocate event message");
+        return;
+    }
+    ev->fd = event->notify->fd;
+    ev->size = size;
+    ev->header[0] = htonl(size + 8); /* The size that we send */
+    ev->header[1] = htonl(MSG_EVENT | event->eventtype);
+    ev->header[2] = htonl(tag_extern(idx));
+    ev->header[3] = htonl(event->id);
+    if(size) memcpy(ev->data, &_db[idx].data[event->byte], size);
+    ev->next = *pending;
+    *pending = ev;
+}
+
+/* Sends the event messages that event_check() found and frees them.  This
+ * has to be called after the tag's shard lock has been given back.  Writing
+ * to a module's socket can block until the module reads it and we don't want
+ * every other tag in the shard to wait on that.  The caller still has the
+ * database locked so the modules can't go away in the meantime. */
+void
+event_send(event_pending *pending)
+{
+    event_pending *ev, *list = NULL;
+    struct iovec iov[2];
+
+    /* The list was built backwards */
+    while(pending != NULL) {
+        ev = pending;
+        pending = ev->next;
+        ev->next = list;
+        list = ev;
+    }
+    while(list != NULL) {
+        ev = list;
+        list = ev->next;
+        iov[0].iov_base = ev->header;
+        iov[0].iov_len = sizeof(ev->header);
+        iov[1].iov_base = ev->data;
+        iov[1].iov_len = ev->size;
+        dax_log(DAX_LOG_MSG, "Sending %d event to module %d",
+                ntohl(ev->header[1]) & ~MSG_EVENT, ev->fd);
+        if(xwritev(ev->fd, iov, ev->size ? 2 : 1) < 0) {
+            dax_log(DAX_LOG_ERROR, "event_send: %s", strerror(errno));
+        }
+        free(ev);
     }
-    dax_log(DAX_LOG_MSG, "Sending %d event to module %d",
-         event->eventtype, event->notify->fd);
-    result = xwrite(event->notify->fd, buff, msgsize);
-    if(result < 0) {
-        dax_log(DAX_LOG_ERROR, "_send_event: %s", strerror(errno));
-        return ERR_MSG_SEND;
+}
+
+/* These are the kinds of comparisons that _event_bits() can do */
+#define BITS_CHANGE 0
+#define BITS_SET    1
+#define BITS_RESET  2
+
+/* Checks the bits of a BOOL event against the test bits that are stored
+ * in the event.  The test bits line up with the data starting at the first
+ * byte of the event.  For change events they are a copy of the data, for set
+ * events they are set once the event has fired for a bit that is set and for
+ * reset events they are set once it has fired for a bit that is clear.  That
+ * makes every one of these the same test.  The data and the test bits are
+ * compared 64 bits at a time and only the bits in the bytes that were
+ * written are looked at. */
+static int
+_event_bits(_dax_event *event, tag_index idx, int offset, int size, int mode)
+{
+    uint8_t *test, *data;
+    uint64_t t, d, mask, hit = 0;
+    int first, last, i, len, lo, hi;
+
+    /* Bit numbers relative to the first byte of the event.  We only look
+     * at the part of the event that is inside the written bytes.  The test
+     * bits for set and reset events start out clear so the first time we
+     * look at the whole thing. */
+    if(event->primed) {
+        first = MAX(event->bit, (offset - event->byte) * 8);
+        last = MIN(event->bit + event->count, (offset + size - event->byte) * 8);
+        if(first >= last) return 0;
+    } else {
+        first = event->bit;
+        last = event->bit + event->count;
+        event->primed = 1;
+    }
+
+    test = (uint8_t *)event->test;
+    data = (uint8_t *)&(_db[idx].data[event->byte]);
+    for(i = first / 8; i * 8 < last; i += len) {
+        len = MIN(8, (last + 7) / 8 - i);
+        lo = MAX(first - i * 8, 0);
+        hi = MIN(last - i * 8, 64);
+        mask = (hi == 64) ? ~0ULL : ((1ULL << hi) - 1);
+        mask &= ~0ULL << lo;
+
+        t = get_le_word(&test[i], len);
+        d = get_le_word(&data[i], len);
+        if(mode == BITS_RESET) d = ~d;
+        if(mode == BITS_CHANGE) {
+            hit |= (d ^ t) & mask;
+        } else {
+            hit |= d & ~t & mask;
+        }
+        put_le_word(&test[i], (t & ~mask) | (d & mask), len);
     }
-    return 0;
+    return hit != 0;
 }
 
 static inline int
 _event_change(_dax_event *event, tag_index idx, int offset, int size) {
-    int bit, n, i, len, result;
+    int len;
     uint8_t *this, *that;
-    uint8_t mask;
-    result = 0;
-
 
     if(event->datatype == DAX_BOOL) {
-        /* TODO: Only check the bits that have changed.  For now we are just
-         * looping through each bit in the event to see if anything has
-         * changed.  This can be made much more efficient. */
-        this = (uint8_t *)event->test;
-        that = (uint8_t *)&(_db[idx].data[event->byte]);
-        bit = event->bit;
-        i = 0;
-        for(n = 0; n < event->count; n++) {
-            mask = (0x01 << bit);
-            if((this[i] & mask) != (that[i] & mask)) {
-                this[i] = that[i];
-                result = 1;
-            }
-            bit++;
-            if(bit == 8) {
-                bit = 0;
-                i++;
-            }
-        }
-
+        return _event_bits(event, idx, offset, size, BITS_CHANGE);
     } else {
         this = (uint8_t *)event->test + MAX(0, offset - event->byte);
         that = (uint8_t *)&(_db[idx].data[MAX(offset, event->byte)]);
         len = MIN(event->byte + event->size, offset + size) - MAX(offset, event->byte);
 
-        for(n = 0; n < len; n++) {
-            if(this[n] != that[n]) {
-                result = 1;
-                this[n] = that[n];
-            }
+        if(memcmp(this, that, len)) {
+            memcpy(this, that, len);
+            return 1;
         }
     }
-    return result;
+    return 0;
 }
 
 /* Checks to see if the bit is set and whether or not the event has been sent */
 static inline int
 _event_set(_dax_event *event, tag_index idx, int offset, int size) {
-    int bit, n, i, result;
-    uint8_t *this, *that;
-    uint8_t mask;
-    result = 0;
-
-    /* TODO: Only check the bits that have changed.  For now we are just
-     * looping through each bit in the event to see if anything has
-     * changed.  This can be made much more efficient. */
-    this = (uint8_t *)event->test;
-    that = (uint8_t *)&(_db[idx].data[event->byte]);
-    bit = event->bit;
-    i = 0;
-    for(n = 0; n < event->count; n++) {
-        mask = (0x01 << bit);
-        if(that[i] & mask) {
-            if(!(this[i] & mask)) {
-                result = 1;
-                this[i] |= mask; /* Set flag so we don't do this next time */
-            }
-        } else {
-            this[i] &= ~mask; /* Unset flag so event will fire next time */
-        }
-        bit++;
-        if(bit == 8) {
-            bit = 0;
-            i++;
-        }
-    }
-    return result;
+    return _event_bits(event, idx, offset, size, BITS_SET);
 }
 
 static inline int
 _event_reset(_dax_event *event, tag_index idx, int offset, int size) {
-    int bit, n, i, result;
-    uint8_t *this, *that;
-    uint8_t mask;
-    result = 0;
-
-    /* TODO: Only check the bits that have changed.  For now we are just
-     * looping through each bit in the event to see if anything has
-     * changed.  This can be made much more efficient. */
-    this = (uint8_t *)event->test;
-    that = (uint8_t *)&(_db[idx].data[event->byte]);
-    bit = event->bit;
-    i = 0;
-    for(n = 0; n < event->count; n++) {
-        mask = (0x01 << bit);
-        if(!(that[i] & mask)) {
-            if(!(this[i] & mask)) {
-                result = 1;
-                this[i] |= mask; /* Set flag so we don't do this next time */
-            }
-        } else {
-            this[i] &= ~mask; /* Unset flag so event will fire next time */
-        }
-        bit++;
-        if(bit == 8) {
-            bit = 0;
-            i++;
-        }
-    }
-    return result;
+    return _event_bits(event, idx, offset, size, BITS_RESET);
 }
 
 static inline int
@@ -391,32 +408,151 @@ _event_hit(_dax_event *event, tag_index idx, int offset, int size) {
     return 0;
 }
 
+/* The events for each tag are kept in a linked list and also in an array
+ * that is sorted by the starting byte of the event's range.  The array is
+ * used as an implicit binary tree.  The root of any part of the array is the
+ * element in the middle and maxend[] for that element holds the largest
+ * ending byte (byte + size) of all the events in that part.  This lets
+ * event_check() skip every part of the array that can't overlap the data
+ * that was written.  The index is only changed when events are added or
+ * deleted and that's a lot less often than tags are written. */
+
+/* Recalculates maxend[] for the part of the array from lo to hi and
+ * returns the largest ending byte in that part */
+static int
+_index_build(_dax_event_index *ei, int lo, int hi)
+{
+    int mid, end, result;
+
+    if(lo >= hi) return 0;
+    mid = lo + (hi - lo) / 2;
+    end = ei->events[mid]->byte + ei->events[mid]->size;
+    result = _index_build(ei, lo, mid);
+    if(result > end) end = result;
+    result = _index_build(ei, mid + 1, hi);
+    if(result > end) end = result;
+    ei->maxend[mid] = end;
+    return end;
+}
+
+/* Puts the event into the sorted index for the tag */
+static int
+_index_insert(tag_index idx, _dax_event *event)
+{
+    _dax_event_index *ei;
+    _dax_event **new_events;
+    int *new_maxend;
+    int lo, hi, mid, newsize;
+
+    ei = _db[idx].eindex;
+    if(ei == NULL) {
+        ei = xmalloc(sizeof(_dax_event_index));
+        if(ei == NULL) return ERR_ALLOC;
+        _db[idx].eindex = ei;
+    }
+    if(ei->count == ei->size) {
+        newsize = ei->size ? ei->size * 2 : 8;
+        new_events = xrealloc(ei->events, sizeof(_dax_event *) * newsize);
+        if(new_events == NULL) return ERR_ALLOC;
+        ei->events = new_events;
+        new_maxend = xrealloc(ei->maxend, sizeof(int) * newsize);
+        if(new_maxend == NULL) return ERR_ALLOC;
+        ei->maxend = new_maxend;
+        ei->size = newsize;
+    }
+    /* Find the first event that starts after this one */
+    lo = 0;
+    hi = ei->count;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(ei->events[mid]->byte <= event->byte) lo = mid + 1;
+        else hi = mid;
+    }
+    memmove(&ei->events[lo + 1], &ei->events[lo], sizeof(_dax_event *) * (ei->count - lo));
+    ei->events[lo] = event;
+    ei->count++;
+    _index_build(ei, 0, ei->count);
+    return 0;
+}
+
+static void
+_index_free(tag_index idx)
+{
+    _dax_event_index *ei;
+
+    ei = _db[idx].eindex;
+    if(ei != NULL) {
+        xfree(ei->events);
+        xfree(ei->maxend);
+        xfree(ei);
+        _db[idx].eindex = NULL;
+    }
+}
+
+/* Takes the event back out of the index for the tag */
+static void
+_index_remove(tag_index idx, _dax_event *event)
+{
+    _dax_event_index *ei;
+    int n;
+
+    ei = _db[idx].eindex;
+    if(ei == NULL) return;
+    for(n = 0; n < ei->count; n++) {
+        if(ei->events[n] == event) {
+            memmove(&ei->events[n], &ei->events[n + 1], sizeof(_dax_event *) * (ei->count - n - 1));
+            ei->count--;
+            break;
+        }
+    }
+    if(ei->count == 0) {
+        _index_free(idx);
+    } else {
+        _index_build(ei, 0, ei->count);
+    }
+}
+
+/* Checks every event in the part of the index from lo to hi that overlaps
+ * the data that was written.  The events are checked in order of their
+ * starting byte. */
+static void
+_index_check(tag_index idx, _dax_event_index *ei, int lo, int hi, int offset, int size,
+             event_pending **pending)
+{
+    _dax_event *event;
+    int mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        /* Nothing in this part ends after the start of the write */
+        if(ei->maxend[mid] <= offset) return;
+        _index_check(idx, ei, lo, mid, offset, size, pending);
+        event = ei->events[mid];
+        /* This event and all of the ones after it start after the write */
+        if(event->byte >= offset + size) return;
+        if(event->byte + event->size > offset) {
+            if(_event_hit(event, idx, offset, size)) {
+                _queue_event(idx, event, pending);
+            }
+        }
+        lo = mid + 1;
+    }
+}
+
 /* This function checks to see if an event has occurred.  It should be
  * called from the tag_write() function or the tag_mask_write() function.
  * If it decides that there is an event match to the data area given then
- * it will call the send_event() function to send the event message to
- * the proper module. This function assumes that the events that are stored
- * with events that make sense so it does no checking.  There is no return type
- * because there are no possible errors, and no information to pass back. */
-/* TODO: The event list should be sorted in increasing order of the bottom of
- * the range so that this function would not have to run through all of the
- * events.  For now we keep it simple. */
+ * it puts the event message on the *pending list and the caller sends them
+ * with event_send() once it has unlocked the tag. This function assumes that
+ * the events that are stored with events that make sense so it does no
+ * checking.  There is no return type because there are no possible errors. */
 void
-event_check(tag_index idx, int offset, int size) {
-    _dax_event *this;
-
-    this = _db[idx].events;
+event_check(tag_index idx, int offset, int size, event_pending **pending) {
+    _dax_event_index *ei;
 
-    while(this != NULL) {
-        /* This is to check whether the the data ranges intersect.  If this
-         * test passes then we have manipulated the data associated with
-         * this event. */
-        if(offset <= (this->byte + this->size - 1) && (offset + size -1 ) >= this->byte) {
-            if(_event_hit(this, idx, offset, size)) {
-                _send_event(idx, this);
-            }
-        }
-        this = this->next;
+    ei = _db[idx].eindex;
+    if(ei != NULL) {
+        _index_check(idx, ei, 0, ei->count, offset, size, pending);
     }
     return;
 }
@@ -426,16 +562,18 @@ event_check(tag_index idx, int offset, int size) {
 void
 event_del_check(tag_index idx) {
     _dax_event *this;
+    event_pending *pending = NULL;
 
     this = _db[idx].events;
 
     while(this != NULL) {
         /* Look for the tag delete event. */
         if(this->eventtype == EVENT_DELETED) {
-            _send_event(idx, this);
+            _queue_event(idx, this, &pending);
         }
         this = this->next;
     }
+    event_send(pending);
     return;
 }
 
@@ -488,7 +626,8 @@ _verify_event_type(tag_type ttype, int etype)
  * code otherwise. */
 int
 _set_event_data(_dax_event *event, tag_index index, void *data) {
-    int datasize = 0, testsize = 0, size;
+    int datasize = 0, testsize = 0, size, testoffset;
+    uint8_t *mem;
 
     /* Figure out how much memory to allocate */
     switch(event->eventtype) {
@@ -499,7 +638,9 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
         case EVENT_CHANGE:
             datasize = 0;
             if(event->datatype == DAX_BOOL) {
-                testsize = (event->count - 1)/8 + 1;
+                /* The test bits line up with the data so we need room for
+                 * the bit offset too */
+                testsize = (event->bit + event->count - 1)/8 + 1;
             } else {
                 testsize = type_size(event->datatype) * event->count;
             }
@@ -512,7 +653,7 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
         case EVENT_SET:
         case EVENT_RESET:
             datasize = 0;
-            testsize = (event->count - 1)/8 + 1;
+            testsize = (event->bit + event->count - 1)/8 + 1;
             break;
         case EVENT_EQUAL:
         case EVENT_GREATER:
@@ -521,26 +662,20 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
             testsize = (event->count - 1)/8 + 1;
             break;
     }
-    /* Allocate the memory that we need */
-    if(datasize > 0) {
-        event->data = malloc(datasize);
-        if(event->data == NULL) {
+    /* The data and the test areas share one block.  The test area is
+     * aligned because some of the events keep tag values there. */
+    testoffset = (datasize + 7) & ~7;
+    event->memsize = testoffset + testsize;
+    event->data = NULL;
+    event->test = NULL;
+    if(event->memsize > 0) {
+        mem = arena_alloc(event->memsize);
+        if(mem == NULL) {
             dax_log(DAX_LOG_ERROR, "event_add() - Unable to allocate memory for event data");
             return ERR_ALLOC;
         }
-    } else {
-        event->data = NULL;
-    }
-
-    if(testsize > 0) {
-        event->test = malloc(testsize);
-        if(event->test == NULL) {
-            if(event->data != NULL) free(event->data);
-            dax_log(DAX_LOG_ERROR, "event_add() - Unable to allocate memory for event test data");
-            return ERR_ALLOC;
-        }
-    } else {
-        event->test = NULL;
+        if(datasize > 0) event->data = mem;
+        if(testsize > 0) event->test = &mem[testoffset];
     }
 
     switch(event->eventtype) {
@@ -609,7 +744,8 @@ event_add(tag_handle h, int event_type, void *data, dax_module *module)
         return ERR_ARG;
     }
     /* If everything is okay then allocate the new event. */
-    new = xmalloc(sizeof(_dax_event));
+    if(_event_pool.size == 0) arena_pool_init(&_event_pool, sizeof(_dax_event));
+    new = arena_pool_alloc(&_event_pool);
     if(new == NULL) {
         dax_log(DAX_LOG_ERROR, "event_add() - Unable to allocate memory for new event");
         return ERR_ALLOC;
@@ -622,10 +758,16 @@ event_add(tag_handle h, int event_type, void *data, dax_module *module)
     new->options = 0x0000;
     new->datatype = h.type;
     new->eventtype = event_type;
+    new->primed = 0;
     new->notify = module;
     result = _set_event_data(new, h.index, data);
     if(result) {
-        free(new);
+        arena_pool_free(&_event_pool, new);
+        return result;
+    }
+    result = _index_insert(h.index, new);
+    if(result) {
+        _free_event(new);
         return result;
     }
 
@@ -636,10 +778,7 @@ event_add(tag_handle h, int event_type, void *data, dax_module *module)
         _db[h.index].events = new;
         _db[h.index].attr |= TAG_ATTR_EVENT; /* Add attribute flag to show we have at least one event */
     } else {
-        /* For now we are not going to sort these events.  The right optimization
-         * would be to sort by the bottom of the range.  This way the
-         * _event_check() function could stop once the top of the updated
-         * range is greater than the bottom of the range of the event. */
+        /* The list isn't sorted.  event_check() uses the sorted index */
         new->next = _db[h.index].events;
         _db[h.index].events = new;
     }
@@ -651,9 +790,8 @@ event_add(tag_handle h, int event_type, void *data, dax_module *module)
  * and bad things will happen. */
 static void
 _free_event(_dax_event *event) {
-    if(event->data != NULL) free(event->data);
-    if(event->test != NULL) free(event->test);
-    free(event);
+    arena_free(event->data != NULL ? event->data : event->test, event->memsize);
+    arena_pool_free(&_event_pool, event);
 }
 
 int
@@ -688,24 +826,29 @@ event_del(int index, int id, dax_module *module)
             return ERR_AUTH;
         }
         _db[index].events = this->next;
+        _index_remove(index, this);
         _free_event(this);
-    }
-    last = this;
-    this = this->next;
-    while(this != NULL) {
-        if(this->id == id) {
-            if(this->notify != module) {
-                dax_log(DAX_LOG_ERROR, "Module cannot delete another module's event");
-                return ERR_AUTH;
-            }
-            last->next = this->next;
-            _free_event(this);
-            result = 0;
-            break; /* Uggg */
-        }
+        result = 0;
+    } else {
         last = this;
         this = this->next;
+        while(this != NULL) {
+            if(this->id == id) {
+                if(this->notify != module) {
+                    dax_log(DAX_LOG_ERROR, "Module cannot delete another module's event");
+                    return ERR_AUTH;
+                }
+                last->next = this->next;
+                _index_remove(index, this);
+                _free_event(this);
+                result = 0;
+                break; /* Uggg */
+            }
+            last = this;
+            this = this->next;
+        }
     }
+    if(result) return result;
     /* If there are no more events on this tag then reset the attibute flag */
     if(_db[index].events == NULL) {
         _db[index].attr &= ~TAG_ATTR_EVENT;
@@ -715,16 +858,18 @@ event_del(int index, int id, dax_module *module)
     return result;
 }
 
-/* Traverse the linked list of events and delete them all */
+/* Traverse the linked list of events for the tag and delete them all */
 int
-events_del_all(_dax_event *head) {
+events_del_all(tag_index idx) {
     _dax_event *this, *next;
-    this = head;
+    this = _db[idx].events;
     while(this != NULL) {
         next = this->next;
         _free_event(this);
         this = next;
     }
+    _db[idx].events = NULL;
+    _index_free(idx);
     return 0;
 }
 
@@ -757,7 +902,7 @@ event_opt(int index, int id, uint32_t options, dax_module *module) {
 int
 events_cleanup(dax_module *module) {
     int n, count;
-    _dax_event *this;
+    _dax_event *this, *next;
 
     count = get_tagindex();
     /* We start our scan at the bottom and work our way up.  It's probably
@@ -767,10 +912,12 @@ events_cleanup(dax_module *module) {
         if(_db[n].events != NULL) {
             this = _db[n].events;
             while(this != NULL) {
+                /* event_del() frees the event */
+                next = this->next;
                 if(this->notify == module) {
                     event_del(n, this->id, module);
                 }
-                this = this->next;
+                this = next;
             }
         }
     }
@@ -28,21 +28,45 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* Number of locks used to keep writes to the same fd from interleaving */
+#define XWRITE_LOCKS 64
+
+static pthread_mutex_t _write_locks[XWRITE_LOCKS];
+static pthread_once_t _write_locks_once = PTHREAD_ONCE_INIT;
+
+static void
+_write_locks_init(void)
+{
+    int n;
+
+    for(n = 0; n < XWRITE_LOCKS; n++) {
+        pthread_mutex_init(&_write_locks[n], NULL);
+    }
+}
 
 /* Wrapper functions - Mostly system calls that need special handling */
 
 /* Wrapper for write.  This will block and retry until all the bytes
- * have been written or an error other than EINTR is returned */
+ * have been written or an error other than EINTR is returned.  Responses
+ * and events for a module can be sent from different threads so the whole
+ * buffer is written while holding a lock for the fd. */
 ssize_t
 xwrite(int fd, const void *buff, size_t nbyte)
 {
     const void *sbuff;
     size_t left;
     ssize_t result;
+    pthread_mutex_t *lock;
 
     sbuff = buff;
     left = nbyte;
 
+    pthread_once(&_write_locks_once, _write_locks_init);
+    lock = &_write_locks[fd % XWRITE_LOCKS];
+    pthread_mutex_lock(lock);
     while(left > 0) {
         result = write(fd, sbuff, left);
         if(result <= 0) {
@@ -52,15 +76,55 @@ xwrite(int fd, const void *buff, size_t nbyte)
                 result = 0;
             } else {
                 /* return error */
+                pthread_mutex_unlock(lock);
                 return -1;
             }
         }
         left -= result;
         sbuff += result;
     }
+    pthread_mutex_unlock(lock);
     return nbyte;
 }
 
+/* Wrapper for writev.  Like xwrite() above this retries until all of the
+ * data in the iov array has been written.  The iov array is modified. */
+ssize_t
+xwritev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t result, total;
+    pthread_mutex_t *lock;
+
+    pthread_once(&_write_locks_once, _write_locks_init);
+    lock = &_write_locks[fd % XWRITE_LOCKS];
+    total = 0;
+    pthread_mutex_lock(lock);
+    while(iovcnt > 0) {
+        result = writev(fd, iov, iovcnt);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            pthread_mutex_unlock(lock);
+            return -1;
+        } else if(result == 0) {
+            pthread_mutex_unlock(lock);
+            return -1;
+        }
+        total += result;
+        /* Skip over the buffers that were completely written */
+        while(iovcnt > 0 && result >= iov->iov_len) {
+            result -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return total;
+}
+
 /* Memory management functions.  These are just to override the
  * standard memory management functions in case I decide to do
  * something creative with them later. */
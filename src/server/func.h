@@ -19,12 +19,15 @@
 #include <opendax.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <sys/uio.h>
+#include <string.h>
 
 #ifndef __FUNC_H
 #define __FUNC_H
 
 /* Wrappers for system calls */
 ssize_t xwrite(int fd, const void *buff, size_t nbyte);
+ssize_t xwritev(int fd, struct iovec *iov, int iovcnt);
 
 /* Memory management functions.  These are just to override the
  * standard memory management functions in case I decide to do
@@ -42,4 +45,30 @@ char *xstrdup(char *);
 
 time_t xtime(void);
 
+/* Loads 'len' bytes into a word so that bit n of the data is always bit n
+ * of the word no matter what the byte order of the machine is */
+static inline uint64_t
+get_le_word(const uint8_t *src, int len)
+{
+    uint64_t word = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&word, src, len);
+#else
+    int n;
+    for(n = 0; n < len; n++) word |= (uint64_t)src[n] << (n * 8);
+#endif
+    return word;
+}
+
+static inline void
+put_le_word(uint8_t *dest, uint64_t word, int len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(dest, &word, len);
+#else
+    int n;
+    for(n = 0; n < len; n++) dest[n] = (uint8_t)(word >> (n * 8));
+#endif
+}
+
 #endif /* !__FUNC_H */
@@ -20,7 +20,43 @@
  * tag groups.
  */
 
-/* TODO Would be much better to pack the BOOLs together. */
+/* Notes:
+ * When a group is added the members are compiled into a gather plan.  The
+ * plan is a list of spans, each one a piece of a single tag and where it
+ * goes in the group's data.  Members that follow each other in the same
+ * tag are coalesced into one span so a group of array elements is read
+ * with a single memcpy().  Reading a group is then just a loop over the
+ * spans.  Only the spans of tags that are virtual, special or have an
+ * override set at the time of the read take the long way through
+ * tag_read().
+ *
+ * BOOL members that don't start on a byte boundary, or that don't end on
+ * one, are packed so that the first bit of the member is bit 0 of its
+ * part of the group data, the same way that dax_tag_read() returns them.
+ * Writes do the opposite and only change the bits of the member.
+ *
+ * Groups that are added with GROUP_OPT_DELTA keep a shadow copy of the
+ * data that was sent to the module on the last read.  The read compares
+ * each member to the shadow and only sends the ones that changed, after a
+ * bitmap that tells the module which members are there.  The module
+ * applies them to the buffer that it got the last read in.  All of the
+ * messages from one module are handled in order so nothing else touches
+ * the shadow while we are using it.
+ *
+ * A group can be larger than a message frame.  The handles of a large group
+ * are sent in several MSG_GRP_ADD frames and put back together in the
+ * module's transfer buffer before the group is added.  Writes work the same
+ * way with each frame carrying the offset of its piece of the data, and
+ * nothing is written until the last piece is in.  A read that doesn't fit
+ * in one frame is gathered once, when the module asks for offset zero, and
+ * the rest of the frames are handed out of the transfer buffer so all of
+ * them come from the same snapshot.  For a delta group that snapshot is
+ * already in the shadow, so the shadow isn't counted as valid until the
+ * last frame has gone out.  If the module gives up part way through, the
+ * next read sends every member.  Every frame gets its own response so
+ * the module's table of requests stays in step.  The transfer buffer is
+ * kept for the next transfer instead of being freed each time.
+ */
 
 #include "libcommon.h"
 #include "groups.h"
@@ -31,6 +67,10 @@ _init_group(tag_group *grp) {
     grp->size = 0;
     grp->flags = 0x00;
     grp->members = NULL;
+    grp->plan = NULL;
+    grp->plan_count = 0;
+    grp->shadow = NULL;
+    grp->scratch = NULL;
 }
 
 
@@ -71,6 +111,71 @@ _group_add(dax_module *mod) {
 }
 
 
+/* Turns the members of the group into the gather plan and figures the
+ * size of the group's data */
+static int
+_group_compile(tag_group *grp)
+{
+    tag_handle *h;
+    tag_span *span = NULL;
+    tag_index idx;
+    uint32_t n, offset = 0, boolsize = 0;
+
+    grp->plan_count = 0;
+    if(grp->count == 0) {
+        grp->size = 0;
+        return 0;
+    }
+    grp->plan = malloc(sizeof(tag_span) * grp->count);
+    if(grp->plan == NULL) return ERR_ALLOC;
+    for(n = 0; n < grp->count; n++) {
+        h = &grp->members[n];
+        /* Join this member to the last span if it picks up where that one left off */
+        if(span != NULL && span->flags == 0 && span->idx == h->index &&
+           span->byte + span->size == h->byte &&
+           (h->type != DAX_BOOL || (h->bit == 0 && h->count % 8 == 0))) {
+            span->size += h->size;
+        } else {
+            span = &grp->plan[grp->plan_count++];
+            span->idx = h->index;
+            span->byte = h->byte;
+            span->offset = offset;
+            span->size = h->size;
+            span->count = h->count;
+            span->bit = h->bit;
+            span->flags = 0;
+            if(h->type == DAX_BOOL && h->count > 0 && (h->bit != 0 || h->count % 8 != 0)) {
+                span->flags |= TAG_SPAN_BOOL;
+            }
+            /* tag_read() will return the error when the group is read */
+            idx = tag_resolve(h->index);
+            if(idx < 0 || h->byte + h->size > tag_get_size(idx)) {
+                span->flags |= TAG_SPAN_SLOW;
+            }
+        }
+        if(span->flags & TAG_SPAN_BOOL) boolsize = MAX(boolsize, span->size);
+        offset += h->size;
+        if(offset > TAG_GROUP_MAX_SIZE) {
+            free(grp->plan);
+            grp->plan = NULL;
+            grp->plan_count = 0;
+            return ERR_2BIG;
+        }
+    }
+    grp->size = offset;
+    /* group_write() unpacks the BOOL spans into the data and the mask here */
+    if(boolsize) {
+        grp->scratch = malloc(boolsize * 2);
+        if(grp->scratch == NULL) {
+            free(grp->plan);
+            grp->plan = NULL;
+            grp->plan_count = 0;
+            return ERR_ALLOC;
+        }
+    }
+    return 0;
+}
+
 /* This adds a tag group to the given module.  It simply determines if there
  * is space on the currently allocated array and if not allocates more space.
  * The handles array is the part of the message buffer that contains the
@@ -78,35 +183,49 @@ _group_add(dax_module *mod) {
  * Returns the index of the new group.
  */
 int
-group_add(dax_module *mod, uint8_t *handles, uint8_t count) {
-    int index, datasize, offset;
+group_add(dax_module *mod, uint8_t *handles, uint32_t count, uint8_t options) {
+    int index, result;
+    uint32_t n, offset;
+    tag_group *grp;
 
     if(count > TAG_GROUP_MAX_MEMBERS) return ERR_ARG;
     index = _group_add(mod);
     if(index < 0) return index; /* Pass the error on up */
-    mod->tag_groups[index].members = (tag_handle *)malloc(sizeof(tag_handle) * count);
-    if(mod->tag_groups[index].members == NULL) return ERR_ALLOC;
-    /* Check to make sure the size of the group is within bounds */
-    datasize = 0;
-    for(int n=0; n<count; n++) {
-        offset = 21*n;
-        memcpy(&mod->tag_groups[index].members[n].index, &handles[offset], 4);
-        memcpy(&mod->tag_groups[index].members[n].byte, &handles[offset+4], 4);
-        mod->tag_groups[index].members[n].bit = handles[offset+8];
-        memcpy(&mod->tag_groups[index].members[n].count, &handles[offset+9], 4);
-        memcpy(&mod->tag_groups[index].members[n].size, &handles[offset+13], 4);
-        memcpy(&mod->tag_groups[index].members[n].type, &handles[offset+17], 4);
-
-        datasize += mod->tag_groups[index].members[n].size;
-        if(datasize > MSG_TAG_GROUP_DATA_SIZE) {
-            free(mod->tag_groups[index].members);
-            mod->tag_groups[index].members = NULL;
-            return ERR_2BIG;
+    grp = &mod->tag_groups[index];
+    grp->members = (tag_handle *)malloc(sizeof(tag_handle) * count);
+    if(grp->members == NULL && count > 0) return ERR_ALLOC;
+    for(n=0; n<count; n++) {
+        offset = GRP_HANDLE_SIZE*n;
+        memcpy(&grp->members[n].index, &handles[offset], 4);
+        memcpy(&grp->members[n].byte, &handles[offset+4], 4);
+        grp->members[n].bit = handles[offset+8];
+        memcpy(&grp->members[n].count, &handles[offset+9], 4);
+        memcpy(&grp->members[n].size, &handles[offset+13], 4);
+        memcpy(&grp->members[n].type, &handles[offset+17], 4);
+    }
+    grp->count = count;
+    /* This also checks to make sure the size of the group is within bounds */
+    result = _group_compile(grp);
+    if(result == 0 && options & GROUP_OPT_DELTA) {
+        /* The bitmap is sent along with all the data */
+        if(grp->size + GRP_DELTA_MAP_SIZE(count) > TAG_GROUP_MAX_SIZE) {
+            result = ERR_2BIG;
+        } else {
+            /* The second half is where the new data is gathered */
+            grp->shadow = malloc(grp->size * 2 + 1);
+            if(grp->shadow == NULL) result = ERR_ALLOC;
         }
+        grp->flags |= GRP_FLAG_DELTA;
+    }
+    if(result) {
+        free(grp->members);
+        free(grp->plan);
+        free(grp->scratch);
+        _init_group(grp);
+        return result;
     }
 
-    mod->tag_groups[index].flags |= GRP_FLAG_NOT_EMPTY;
-    mod->tag_groups[index].count = count;
+    grp->flags |= GRP_FLAG_NOT_EMPTY;
     dax_log(DAX_LOG_MSG, "Group Add message from %s", mod->name);
     return index;
 }
@@ -115,51 +234,291 @@ group_add(dax_module *mod, uint8_t *handles, uint8_t count) {
 /* Deletes a single tag group from the given module */
 int
 group_del(dax_module *mod, int index) {
+    if(index < 0 || index >= mod->groups_size) return ERR_ARG;
     if((mod->tag_groups[index].flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
 
     free(mod->tag_groups[index].members);
-    mod->tag_groups[index].flags = 0x00;
+    free(mod->tag_groups[index].plan);
+    free(mod->tag_groups[index].shadow);
+    free(mod->tag_groups[index].scratch);
+    _init_group(&mod->tag_groups[index]);
+    /* A transfer can't be finished for a group that isn't there anymore */
+    if(mod->xfer.command && mod->xfer.index == index) mod->xfer.command = 0;
     mod->tag_groups[index].count = 0;
-    mod->groups_size--;
     dax_log(DAX_LOG_MSG, "Group Delete message from %s", mod->name);
     return 0;
 }
 
-/* loop through the array of members and populate buff with
- * the data.*/
+/* Moves the bits of a BOOL span that were just copied into buff down to
+ * the start of the span and clears the rest of it */
+static void
+_bool_pack(uint8_t *buff, tag_span *span)
+{
+    uint32_t n, bytes;
+
+    bytes = MIN((span->count - 1) / 8 + 1, span->size);
+    if(span->bit) {
+        for(n = 0; n < bytes; n++) {
+            buff[n] = buff[n] >> span->bit;
+            if(n + 1 < span->size) buff[n] |= buff[n + 1] << (8 - span->bit);
+        }
+    }
+    if(span->count % 8 && bytes == (span->count - 1) / 8 + 1) {
+        buff[bytes - 1] &= (1 << (span->count % 8)) - 1;
+    }
+    if(span->size > bytes) bzero(&buff[bytes], span->size - bytes);
+}
+
+/* The opposite of _bool_pack().  This builds the data and the mask that
+ * tag_mask_write() needs to write just the bits of the span */
+static void
+_bool_unpack(uint8_t *buff, uint8_t *data, uint8_t *mask, tag_span *span)
+{
+    uint32_t n, i;
+
+    bzero(data, span->size);
+    bzero(mask, span->size);
+    for(n = 0, i = span->bit; n < span->count && i / 8 < span->size; n++, i++) {
+        if(buff[n / 8] & (1 << (n % 8))) data[i / 8] |= 1 << (i % 8);
+        mask[i / 8] |= 1 << (i % 8);
+    }
+}
+
+/* Runs the gather plan of the group to populate buff with the data. */
+static int
+_group_gather(tag_group *group, uint8_t *buff) {
+    uint32_t n;
+    int result;
+
+    result = tag_gather(group->plan, group->plan_count, buff);
+    if(result) return result;
+    for(n = 0; n < group->plan_count; n++) {
+        if(group->plan[n].flags & TAG_SPAN_BOOL) {
+            _bool_pack(&buff[group->plan[n].offset], &group->plan[n]);
+        }
+    }
+    return 0;
+}
+
+/* Puts the bitmap of the members that have changed since the last read
+ * into buff followed by the data of those members */
+static int
+_group_read_delta(tag_group *group, uint8_t *buff, int size) {
+    uint8_t *current;
+    uint32_t n, offset = 0, out;
+    tag_handle *h;
+    int result;
+
+    out = GRP_DELTA_MAP_SIZE(group->count);
+    if(group->size + out > size) return ERR_ARG;
+    current = &group->shadow[group->size];
+    result = _group_gather(group, current);
+    if(result) return result;
+    bzero(buff, out);
+    for(n = 0; n < group->count; n++) {
+        h = &group->members[n];
+        if((group->flags & GRP_FLAG_SHADOW) == 0 ||
+           memcmp(&current[offset], &group->shadow[offset], h->size)) {
+            buff[n / 8] |= 1 << (n % 8);
+            memcpy(&buff[out], &current[offset], h->size);
+            memcpy(&group->shadow[offset], &current[offset], h->size);
+            out += h->size;
+        }
+        offset += h->size;
+    }
+    group->flags |= GRP_FLAG_SHADOW;
+    return out;
+}
+
+/* Reads the group into buff and returns the number of bytes.  If 'full'
+ * is set a delta group sends all of its members. */
 int
-group_read(dax_module *mod, uint32_t index, uint8_t *buff, int size) {
-    int n, offset=0, result;
+group_read(dax_module *mod, uint32_t index, uint8_t *buff, int size, int full) {
+    int result;
     tag_group *group;
 
+    if(index >= mod->groups_size) return ERR_ARG;
     group = &mod->tag_groups[index];
     if((group->flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
-    if(group->size > size) return ERR_ARG;
-    for(n = 0;n<group->count;n++) {
-        result = tag_read(-1, group->members[n].index, group->members[n].byte, &buff[offset], group->members[n].size);
-        if(result) return result;
-        offset += group->members[n].size;
+    if(group->flags & GRP_FLAG_DELTA) {
+        if(full) group->flags &= ~GRP_FLAG_SHADOW;
+        return _group_read_delta(group, buff, size);
     }
-    return offset;
+    if(group->size > size) return ERR_ARG;
+    result = _group_gather(group, buff);
+    if(result) return result;
+    return group->size;
 }
 
-/* loop through the array of members and populate buff with
- * the data.*/
+/* Writes the data in buff to each span of the group */
 int
 group_write(dax_module *mod, uint32_t index, uint8_t *buff) {
-    int n, offset=0, result;
+    uint32_t n;
+    int result;
     tag_group *group;
+    tag_span *span;
+    tag_index idx;
+    uint8_t *data;
 
+    if(index >= mod->groups_size) return ERR_ARG;
     group = &mod->tag_groups[index];
     if((group->flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
-    for(n = 0;n<group->count;n++) {
-        result = tag_write(-1, group->members[n].index, group->members[n].byte, &buff[offset], group->members[n].size);
+    data = group->scratch;
+    for(n = 0; n < group->plan_count; n++) {
+        span = &group->plan[n];
+        idx = tag_resolve(span->idx);
+        if(idx < 0) return idx;
+        if(span->flags & TAG_SPAN_BOOL) {
+            _bool_unpack(&buff[span->offset], data, &data[span->size], span);
+            result = tag_mask_write(-1, idx, span->byte, data, &data[span->size], span->size);
+        } else {
+            result = tag_write(-1, idx, span->byte, &buff[span->offset], span->size);
+        }
         if(result) return result;
-        offset += group->members[n].size;
     }
-    return offset;
+    return group->size;
+}
+
+
+/* Makes sure the transfer buffer can hold at least size bytes */
+static int
+_xfer_reserve(group_xfer *x, uint32_t size)
+{
+    uint8_t *new;
+
+    if(size <= x->alloc) return 0;
+    new = realloc(x->data, size);
+    if(new == NULL) return ERR_ALLOC;
+    x->data = new;
+    x->alloc = size;
+    return 0;
 }
 
+/* Starts a new transfer of size bytes.  Anything that was left over from a
+ * transfer that the module never finished is thrown away. */
+static int
+_xfer_start(dax_module *mod, int command, uint32_t index, uint32_t size)
+{
+    group_xfer *x = &mod->xfer;
+
+    x->command = 0;
+    if(_xfer_reserve(x, size)) return ERR_ALLOC;
+    x->command = command;
+    x->index = index;
+    x->size = size;
+    x->fill = 0;
+    return 0;
+}
+
+/* Handles one frame of a MSG_GRP_ADD message.  The handles are saved until
+ * the frame without GRP_XFER_MORE comes in and then the group is added.
+ * Returns the index of the group after the last frame and zero before. */
+int
+group_add_part(dax_module *mod, uint8_t *handles, uint32_t count, uint8_t options, uint8_t flags) {
+    group_xfer *x = &mod->xfer;
+    uint32_t size;
+
+    if((flags & GRP_XFER_NEXT) == 0) {
+        if((flags & GRP_XFER_MORE) == 0) {
+            x->command = 0;
+            return group_add(mod, handles, count, options);
+        }
+        if(_xfer_start(mod, MSG_GRP_ADD, 0, 0)) return ERR_ALLOC;
+    } else if(x->command != MSG_GRP_ADD) {
+        return ERR_ARG;
+    }
+    if(x->fill / GRP_HANDLE_SIZE + count > TAG_GROUP_MAX_MEMBERS) {
+        x->command = 0;
+        return ERR_ARG;
+    }
+    size = count * GRP_HANDLE_SIZE;
+    if(_xfer_reserve(x, x->fill + size)) {
+        x->command = 0;
+        return ERR_ALLOC;
+    }
+    memcpy(&x->data[x->fill], handles, size);
+    x->fill += size;
+    if(flags & GRP_XFER_MORE) return 0;
+    x->command = 0;
+    return group_add(mod, x->data, x->fill / GRP_HANDLE_SIZE, options);
+}
+
+/* Handles one frame of a MSG_GRP_READ message.  *data is set to the part of
+ * the group's data that starts at offset and the number of bytes that go in
+ * the frame is returned.  When offset is zero the group is read into buff,
+ * or into the transfer buffer if it won't fit in buff or in a single frame. */
+int
+group_read_part(dax_module *mod, uint32_t index, uint32_t offset, int full,
+                uint8_t *buff, uint32_t size, uint32_t frame, uint8_t **data) {
+    group_xfer *x = &mod->xfer;
+    tag_group *group;
+    uint32_t max;
+    int result;
+
+    if(offset == 0) {
+        if(index >= mod->groups_size) return ERR_ARG;
+        group = &mod->tag_groups[index];
+        if((group->flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
+        max = group->size;
+        if(group->flags & GRP_FLAG_DELTA) max += GRP_DELTA_MAP_SIZE(group->count);
+        if(max <= MIN(size, frame)) {
+            x->command = 0;
+            *data = buff;
+            return group_read(mod, index, buff, size, full);
+        }
+        if(_xfer_start(mod, MSG_GRP_READ, index, max)) return ERR_ALLOC;
+        result = group_read(mod, index, x->data, max, full);
+        if(result < 0) {
+            x->command = 0;
+            return result;
+        }
+        x->size = result;
+        group->flags &= ~GRP_FLAG_SHADOW;
+    } else if(x->command != MSG_GRP_READ || x->index != index || offset != x->fill) {
+        return ERR_ARG;
+    }
+    *data = &x->data[offset];
+    result = MIN(x->size - offset, frame);
+    x->fill += result;
+    if(x->fill == x->size) {
+        x->command = 0;
+        group = &mod->tag_groups[index];
+        if(group->flags & GRP_FLAG_DELTA) group->flags |= GRP_FLAG_SHADOW;
+    }
+    return result;
+}
+
+/* Handles one frame of a MSG_GRP_WRITE message.  The pieces are saved
+ * until all of the group's data is here and then it is all written.
+ * Returns zero until the last piece has been written. */
+int
+group_write_part(dax_module *mod, uint32_t index, uint32_t offset, uint8_t *data, uint32_t size) {
+    group_xfer *x = &mod->xfer;
+    tag_group *group;
+
+    if(index >= mod->groups_size) return ERR_ARG;
+    group = &mod->tag_groups[index];
+    if((group->flags & GRP_FLAG_NOT_EMPTY) == 0) return ERR_NOTFOUND;
+    if(offset == 0) {
+        if(size == group->size) {
+            x->command = 0;
+            return group_write(mod, index, data);
+        }
+        if(size > group->size) return ERR_2BIG;
+        if(_xfer_start(mod, MSG_GRP_WRITE, index, group->size)) return ERR_ALLOC;
+    } else if(x->command != MSG_GRP_WRITE || x->index != index || offset != x->fill) {
+        return ERR_ARG;
+    }
+    if(size > x->size - x->fill) {
+        x->command = 0;
+        return ERR_2BIG;
+    }
+    memcpy(&x->data[x->fill], data, size);
+    x->fill += size;
+    if(x->fill < x->size) return 0;
+    x->command = 0;
+    return group_write(mod, index, x->data);
+}
 
 /* Deletes all of the groups and free's the tag_groups array
  * This is called when we are removing the module */
@@ -173,6 +532,8 @@ groups_cleanup(dax_module *mod) {
     free(mod->tag_groups);
     mod->tag_groups = NULL;
     mod->groups_size = 0;
+    free(mod->xfer.data);
+    bzero(&mod->xfer, sizeof(group_xfer));
 
     return 0;
 }
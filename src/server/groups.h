@@ -35,10 +35,14 @@
  * array of groups is allocated as necessary for each module.
  */
 
-int group_add(dax_module *mod, uint8_t *handles, uint8_t count);
+int group_add(dax_module *mod, uint8_t *handles, uint32_t count, uint8_t options);
 int group_del(dax_module *mod, int index);
-int group_read(dax_module *mod, uint32_t index, uint8_t *buff, int size);
+int group_read(dax_module *mod, uint32_t index, uint8_t *buff, int size, int full);
 int group_write(dax_module *mod, uint32_t index, uint8_t *buff);
+int group_add_part(dax_module *mod, uint8_t *handles, uint32_t count, uint8_t options, uint8_t flags);
+int group_read_part(dax_module *mod, uint32_t index, uint32_t offset, int full,
+                    uint8_t *buff, uint32_t size, uint32_t frame, uint8_t **data);
+int group_write_part(dax_module *mod, uint32_t index, uint32_t offset, uint8_t *data, uint32_t size);
 int groups_cleanup(dax_module *mod);
 
 #endif /* !__DAX_GROUPS_H */
@@ -14,7 +14,6 @@
  *  You should have received a copy of the GNU General Public License
  *  along with this program; if not, write to the Free Software
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
-
  * This is the source file for the data mapping routines
  */
 
@@ -22,19 +21,90 @@
 #include <common.h>
 #include "tagbase.h"
 #include "func.h"
+#include "arena.h"
+
+/* Notes:
+ * When a mapping is added it is compiled into a plan for moving the data so
+ * that none of that work has to be done each time the source is written.
+ * Most mappings are a straight copy of the source bytes into the
+ * destination (MAP_COPY).  BOOL mappings that don't start and end on byte
+ * boundaries need a mask for the destination bytes.  If the bits are at the
+ * same place in the source and destination bytes then the source data is
+ * written with the mask as it is (MAP_MASK).  Otherwise the bits are
+ * shifted into place 56 at a time before the masked write (MAP_SHIFT).
+ *
+ * The mappings for each tag are kept in a linked list and also in an array
+ * that is sorted by the first byte of the source.  The array works the same
+ * way as the event index in events.c so map_check() only looks at the
+ * mappings that overlap the data that was written.
+ *
+ * map_check() is called with the database only locked for reading so it never
+ * changes the lists.  When a tag is deleted the mappings that point to it are
+ * removed by tag_del().  Other threads can be writing the source tag at the
+ * same time so its data is copied out under the tag's shard lock before the
+ * destination is written.  The two locks are never held together.
+ *
+ * Mappings can be chained.  When a mapping writes to a tag that has its own
+ * mappings those are followed too, all in the same call to map_check().  The
+ * tags that get written are kept in a list and the mappings of each tag are
+ * only run once, after everything that writes to that tag has been run.  To
+ * know what order to do that in every tag has a rank and the mappings always
+ * go from a lower rank to a higher one.  map_add() raises the rank of the
+ * destination tags as needed and refuses any mapping that would make a loop,
+ * since there would be no right order for that.  The one exception is a
+ * mapping that is the exact reverse of one that already exists.  That just
+ * keeps two tags the same, so it is marked as a mirror and the rank of the
+ * tags are left alone.  A mirror never writes back to a tag that has already
+ * been handled in the same call.
+ */
+
+/* The copy of the source data and the shifted data for a MAP_SHIFT mapping
+ * are kept in buffers of this size.  Only mappings that are larger than this
+ * have to allocate memory. */
+#define MAP_BUFFER_SIZE 8192
+/* Number of tags that a single write can reach before we have to allocate
+ * memory to keep track of them */
+#define MAP_WAVE_SIZE 64
+
+/* A tag that has been written in the current call to map_check() */
+typedef struct {
+    tag_index idx;
+    int offset;      /* First byte that was written */
+    int end;         /* One past the last byte that was written */
+    int depth;       /* Number of mappings from the tag that was written first */
+    uint8_t done;    /* Set once the mappings of this tag have been run */
+} map_dirty;
+
+typedef struct {
+    map_dirty *tags;
+    int count;
+    int size;
+    map_dirty stack[MAP_WAVE_SIZE];
+    uint8_t src[MAP_BUFFER_SIZE];  /* Copy of the source data */
+    uint8_t buff[MAP_BUFFER_SIZE]; /* Shifted data */
+} map_wave;
 
 extern _dax_tag_db *_db;
 
+/* The mapping nodes all come from here */
+static arena_pool _map_pool;
+
 /* Allocates and initializes a data map node */
 static _dax_datamap *
 _new_map(tag_handle src, tag_handle dest)
 {
     _dax_datamap *new;
 
-    new = (_dax_datamap *)malloc(sizeof(_dax_datamap));
+    if(_map_pool.size == 0) arena_pool_init(&_map_pool, sizeof(_dax_datamap));
+    new = arena_pool_alloc(&_map_pool);
+    if(new == NULL) return NULL;
     new->id = _db[src.index].nextmap++;
     new->source = src;
     new->dest = dest;
+    new->kind = MAP_COPY;
+    new->mirror = 0;
+    new->shift = 0;
+    new->dsize = src.size;
     new->mask = NULL;
     new->next = NULL;
 
@@ -43,10 +113,8 @@ _new_map(tag_handle src, tag_handle dest)
 
 static void
 _free_map(_dax_datamap *map) {
-    if(map->mask != NULL) {
-        free(map->mask);
-    }
-    free(map);
+    arena_free(map->mask, map->dsize);
+    arena_pool_free(&_map_pool, map);
 }
 
 static inline int
@@ -60,13 +128,404 @@ _handles_equal(tag_handle h1, tag_handle h2)
            h1.size == h2.size );
 }
 
+/* Returns 1 if the map is the exact reverse of a mapping from src to dest */
+static inline int
+_is_reverse(_dax_datamap *map, tag_handle src, tag_handle dest)
+{
+    return _handles_equal(map->source, dest) && _handles_equal(map->dest, src);
+}
+
+/* Used by _map_reaches() to keep track of the tags that it has been to.  A
+ * tag has been visited if its stamp is the same as _visit_gen so nothing has
+ * to be cleared between calls.  These are only used by map_add() which is
+ * called with the database locked for writing. */
+static uint32_t *_visit_stamp;
+static tag_index *_visit_stack;
+static int _visit_size;
+static uint32_t _visit_gen;
+
+/* Makes sure that the visit arrays cover every tag in the database */
+static int
+_visit_grow(void)
+{
+    uint32_t *new_stamp;
+    tag_index *new_stack;
+    int size;
+
+    size = get_tagindex();
+    if(size <= _visit_size) return 0;
+    new_stamp = realloc(_visit_stamp, sizeof(uint32_t) * size);
+    if(new_stamp == NULL) return ERR_ALLOC;
+    _visit_stamp = new_stamp;
+    new_stack = realloc(_visit_stack, sizeof(tag_index) * size);
+    if(new_stack == NULL) return ERR_ALLOC;
+    _visit_stack = new_stack;
+    bzero(&_visit_stamp[_visit_size], sizeof(uint32_t) * (size - _visit_size));
+    _visit_size = size;
+    return 0;
+}
+
+/* Returns 1 if following the mappings from the tag at 'from' gets to the tag
+ * at 'to'.  The reverse of the mapping from src to dest is not followed.
+ * Only the tags that can be reached from 'from' are looked at. */
+static int
+_map_reaches(tag_index from, tag_index to, tag_handle src, tag_handle dest)
+{
+    _dax_datamap *this;
+    tag_index n;
+    int count = 0;
+
+    if(_visit_grow()) return ERR_ALLOC;
+    /* When the generation wraps the old stamps could match again */
+    if(++_visit_gen == 0) {
+        bzero(_visit_stamp, sizeof(uint32_t) * _visit_size);
+        _visit_gen = 1;
+    }
+    _visit_stack[count++] = from;
+    _visit_stamp[from] = _visit_gen;
+    while(count > 0) {
+        n = _visit_stack[--count];
+        for(this = _db[n].mappings; this != NULL; this = this->next) {
+            if(_is_reverse(this, src, dest)) continue;
+            if(this->dest.index == to) return 1;
+            if(_visit_stamp[this->dest.index] != _visit_gen) {
+                _visit_stamp[this->dest.index] = _visit_gen;
+                _visit_stack[count++] = this->dest.index;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Makes sure that the rank of the tag at idx is at least 'rank' and that
+ * the tags that it maps to are higher still */
+static void
+_rank_raise(tag_index idx, int rank)
+{
+    _dax_datamap *this;
+
+    if(_db[idx].maprank >= rank) return;
+    _db[idx].maprank = rank;
+    for(this = _db[idx].mappings; this != NULL; this = this->next) {
+        if(!this->mirror) _rank_raise(this->dest.index, rank + 1);
+    }
+}
+
+/* Number of bytes that the bits of a BOOL handle touch */
+static inline int
+_bool_bytes(tag_handle h)
+{
+    return (h.bit + h.count - 1) / 8 + 1;
+}
+
+/* Works out the plan for moving the data and builds the mask */
+static int
+_map_compile(_dax_datamap *map)
+{
+    int n, last;
+
+    if(map->source.type != DAX_BOOL) {
+        map->kind = MAP_COPY;
+        map->dsize = map->source.size;
+        return 0;
+    }
+    map->shift = map->dest.bit - map->source.bit;
+    map->dsize = (map->dest.bit + map->source.count - 1) / 8 + 1;
+    if(map->source.bit == 0 && map->dest.bit == 0 && map->source.count % 8 == 0) {
+        map->kind = MAP_COPY;
+        return 0;
+    }
+    map->kind = map->shift ? MAP_SHIFT : MAP_MASK;
+    map->mask = arena_alloc(map->dsize);
+    if(map->mask == NULL) return ERR_ALLOC;
+    last = map->dest.bit + map->source.count;
+    for(n = map->dest.bit; n < last;) {
+        if(n % 8 == 0 && last - n >= 8) {
+            map->mask[n / 8] = 0xFF;
+            n += 8;
+        } else {
+            map->mask[n / 8] |= (0x01 << (n % 8));
+            n++;
+        }
+    }
+    return 0;
+}
+
+/* Moves the source bits of a MAP_SHIFT mapping to where they belong in the
+ * destination bytes.  'out' gets map->dsize bytes.  The bits that are not
+ * part of the mapping are junk but the mask keeps them out of the tag. */
+static void
+_map_shift(_dax_datamap *map, uint8_t *src, uint8_t *out)
+{
+    uint64_t word;
+    int n, bit, avail, srcbytes;
+
+    srcbytes = _bool_bytes(map->source);
+    for(n = 0; n < map->dsize; n += 7) {
+        /* The source bit that ends up in the first bit of out[n] */
+        bit = n * 8 - map->shift;
+        if(bit < 0) {
+            word = get_le_word(src, MIN(8, srcbytes)) << -bit;
+        } else {
+            avail = srcbytes - bit / 8;
+            word = get_le_word(&src[bit / 8], MIN(8, avail)) >> (bit % 8);
+        }
+        put_le_word(&out[n], word, MIN(7, map->dsize - n));
+    }
+}
+
+/* Writes the source data of the mapping to the destination.  'src' and
+ * 'buff' are MAP_BUFFER_SIZE bytes of scratch space. */
+static int
+_map_run(_dax_datamap *map, uint8_t *src, uint8_t *buff)
+{
+    uint8_t *srcdata, *data;
+    int result, srcsize;
+
+    srcsize = map->kind == MAP_SHIFT ? _bool_bytes(map->source) : map->dsize;
+    srcdata = src;
+    if(srcsize > MAP_BUFFER_SIZE) {
+        srcdata = malloc(srcsize);
+        if(srcdata == NULL) {
+            dax_log(DAX_LOG_ERROR, "Unable to allocate memory for map %d", map->id);
+            return ERR_ALLOC;
+        }
+    }
+    result = tag_read_stored(map->source.index, map->source.byte, srcdata, srcsize);
+    if(result) {
+        if(srcdata != src) free(srcdata);
+        return result;
+    }
+    switch(map->kind) {
+        case MAP_COPY:
+            result = tag_write(-1, map->dest.index, map->dest.byte, srcdata, map->dsize);
+            break;
+        case MAP_MASK:
+            result = tag_mask_write(-1, map->dest.index, map->dest.byte, srcdata, map->mask, map->dsize);
+            break;
+        case MAP_SHIFT:
+            data = buff;
+            if(map->dsize > MAP_BUFFER_SIZE) {
+                data = malloc(map->dsize);
+                if(data == NULL) {
+                    dax_log(DAX_LOG_ERROR, "Unable to allocate memory for map %d", map->id);
+                    result = ERR_ALLOC;
+                    break;
+                }
+            }
+            _map_shift(map, srcdata, data);
+            result = tag_mask_write(-1, map->dest.index, map->dest.byte, data, map->mask, map->dsize);
+            if(data != buff) free(data);
+            break;
+        default:
+            result = ERR_ARG;
+    }
+    if(srcdata != src) free(srcdata);
+    if(result && result != ERR_DELETED) {
+        dax_log(DAX_LOG_ERROR, "Unable to write map %d from tag index = %d, result = %d", map->id, map->source.index, result);
+    }
+    return result;
+}
+
+/* Returns the entry for the tag in the wave or NULL if it hasn't been
+ * written yet */
+static map_dirty *
+_wave_find(map_wave *wave, tag_index idx)
+{
+    int n;
+
+    for(n = 0; n < wave->count; n++) {
+        if(wave->tags[n].idx == idx) return &wave->tags[n];
+    }
+    return NULL;
+}
+
+/* Adds the bytes that were written to the tag's entry in the wave */
+static int
+_wave_add(map_wave *wave, tag_index idx, int offset, int end, int depth)
+{
+    map_dirty *entry, *new_tags;
+
+    entry = _wave_find(wave, idx);
+    if(entry != NULL) {
+        entry->offset = MIN(entry->offset, offset);
+        entry->end = MAX(entry->end, end);
+        entry->depth = MAX(entry->depth, depth);
+        return 0;
+    }
+    if(wave->count == wave->size) {
+        new_tags = malloc(sizeof(map_dirty) * wave->size * 2);
+        if(new_tags == NULL) return ERR_ALLOC;
+        memcpy(new_tags, wave->tags, sizeof(map_dirty) * wave->count);
+        if(wave->tags != wave->stack) free(wave->tags);
+        wave->tags = new_tags;
+        wave->size *= 2;
+    }
+    entry = &wave->tags[wave->count++];
+    entry->idx = idx;
+    entry->offset = offset;
+    entry->end = end;
+    entry->depth = depth;
+    entry->done = 0;
+    return 0;
+}
+
+/* Returns the index in the wave of the tag with the lowest rank that still
+ * needs its mappings run or -1 if there aren't any left */
+static int
+_wave_next(map_wave *wave)
+{
+    int n, next = -1;
+
+    for(n = 0; n < wave->count; n++) {
+        if(wave->tags[n].done) continue;
+        if(next < 0 || _db[wave->tags[n].idx].maprank < _db[wave->tags[next].idx].maprank) {
+            next = n;
+        }
+    }
+    return next;
+}
+
+/* Runs the mapping and adds the destination to the wave */
+static void
+_wave_run(map_wave *wave, _dax_datamap *map, int depth)
+{
+    map_dirty *entry;
+
+    entry = _wave_find(wave, map->dest.index);
+    /* Only a mirror can get back to a tag that is done */
+    if(entry != NULL && entry->done) return;
+    if(_map_run(map, wave->src, wave->buff) == 0) {
+        if(_wave_add(wave, map->dest.index, map->dest.byte, map->dest.byte + map->dsize, depth)) {
+            dax_log(DAX_LOG_ERROR, "Unable to allocate memory to follow map %d from tag index = %d", map->id, map->source.index);
+        }
+    }
+}
+
+/* Recalculates maxend[] for the part of the array from lo to hi and
+ * returns the largest ending byte in that part */
+static int
+_index_build(_dax_map_index *mi, int lo, int hi)
+{
+    int mid, end, result;
+
+    if(lo >= hi) return 0;
+    mid = lo + (hi - lo) / 2;
+    end = mi->maps[mid]->source.byte + mi->maps[mid]->source.size;
+    result = _index_build(mi, lo, mid);
+    if(result > end) end = result;
+    result = _index_build(mi, mid + 1, hi);
+    if(result > end) end = result;
+    mi->maxend[mid] = end;
+    return end;
+}
+
+/* Puts the mapping into the sorted index for the tag */
+static int
+_index_insert(tag_index idx, _dax_datamap *map)
+{
+    _dax_map_index *mi;
+    _dax_datamap **new_maps;
+    int *new_maxend;
+    int lo, hi, mid, newsize;
+
+    mi = _db[idx].mindex;
+    if(mi == NULL) {
+        mi = xmalloc(sizeof(_dax_map_index));
+        if(mi == NULL) return ERR_ALLOC;
+        _db[idx].mindex = mi;
+    }
+    if(mi->count == mi->size) {
+        newsize = mi->size ? mi->size * 2 : 8;
+        new_maps = xrealloc(mi->maps, sizeof(_dax_datamap *) * newsize);
+        if(new_maps == NULL) return ERR_ALLOC;
+        mi->maps = new_maps;
+        new_maxend = xrealloc(mi->maxend, sizeof(int) * newsize);
+        if(new_maxend == NULL) return ERR_ALLOC;
+        mi->maxend = new_maxend;
+        mi->size = newsize;
+    }
+    /* Find the first mapping that starts after this one */
+    lo = 0;
+    hi = mi->count;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(mi->maps[mid]->source.byte <= map->source.byte) lo = mid + 1;
+        else hi = mid;
+    }
+    memmove(&mi->maps[lo + 1], &mi->maps[lo], sizeof(_dax_datamap *) * (mi->count - lo));
+    mi->maps[lo] = map;
+    mi->count++;
+    _index_build(mi, 0, mi->count);
+    return 0;
+}
+
+static void
+_index_free(tag_index idx)
+{
+    _dax_map_index *mi;
+
+    mi = _db[idx].mindex;
+    if(mi != NULL) {
+        xfree(mi->maps);
+        xfree(mi->maxend);
+        xfree(mi);
+        _db[idx].mindex = NULL;
+    }
+}
+
+/* Takes the mapping back out of the index for the tag */
+static void
+_index_remove(tag_index idx, _dax_datamap *map)
+{
+    _dax_map_index *mi;
+    int n;
+
+    mi = _db[idx].mindex;
+    if(mi == NULL) return;
+    for(n = 0; n < mi->count; n++) {
+        if(mi->maps[n] == map) {
+            memmove(&mi->maps[n], &mi->maps[n + 1], sizeof(_dax_datamap *) * (mi->count - n - 1));
+            mi->count--;
+            break;
+        }
+    }
+    if(mi->count == 0) {
+        _index_free(idx);
+    } else {
+        _index_build(mi, 0, mi->count);
+    }
+}
+
+/* Runs every mapping in the part of the index from lo to hi whose source
+ * overlaps the data that was written. */
+static void
+_index_check(_dax_map_index *mi, int lo, int hi, int offset, int size, map_wave *wave, int depth)
+{
+    _dax_datamap *map;
+    int mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        /* Nothing in this part ends after the start of the write */
+        if(mi->maxend[mid] <= offset) return;
+        _index_check(mi, lo, mid, offset, size, wave, depth);
+        map = mi->maps[mid];
+        /* This mapping and all of the ones after it start after the write */
+        if(map->source.byte >= offset + size) return;
+        if(map->source.byte + map->source.size > offset) {
+            _wave_run(wave, map, depth);
+        }
+        lo = mid + 1;
+    }
+}
+
 int
 map_add(tag_handle src, tag_handle dest)
 {
     _dax_datamap *new_map;
     _dax_datamap *this;
-    int bit, offset;
-    uint8_t *mask;
+    int result, mirror = 0;
 
     DF("map added index1=%d, byte1, %d, size1=%d, index2=%d, byte2=%d, size2=%d", src.index, src.byte, src.size, dest.index, dest.byte, dest.size);
     /* Bounds check handles */
@@ -99,7 +558,19 @@ map_add(tag_handle src, tag_handle dest)
         dax_log(DAX_LOG_ERROR, "Size of the affected destination data in the new mapping is too large");
         return ERR_2BIG;
     }
-    if( src.size > dest.size ) {
+    if(src.type == DAX_BOOL) {
+        /* The source bits can span one more byte than the destination
+         * bits so we have to compare the bits themselves */
+        if(src.count > (dest.type == DAX_BOOL ? dest.count : dest.size * 8 - dest.bit)) {
+            dax_log(DAX_LOG_ERROR, "Size of the source data in the new mapping is too large");
+            return ERR_2BIG;
+        }
+        if(src.byte + _bool_bytes(src) > tag_get_size(src.index) ||
+           dest.byte + (dest.bit + src.count - 1) / 8 + 1 > tag_get_size(dest.index)) {
+            dax_log(DAX_LOG_ERROR, "Bits in the new mapping are outside of the tag");
+            return ERR_2BIG;
+        }
+    } else if( src.size > dest.size ) {
         dax_log(DAX_LOG_ERROR, "Size of the source data in the new mapping is too large");
         return ERR_2BIG;
     }
@@ -112,32 +583,38 @@ map_add(tag_handle src, tag_handle dest)
         }
         this = this->next;
     }
+    /* Check for loops */
+    if(src.index == dest.index) {
+        dax_log(DAX_LOG_ERROR, "Tag %s can't be mapped to itself", _db[src.index].name);
+        return ERR_ILLEGAL;
+    }
+    for(this = _db[dest.index].mappings; this != NULL; this = this->next) {
+        if(_is_reverse(this, src, dest)) mirror = 1;
+    }
+    result = _map_reaches(dest.index, src.index, src, dest);
+    if(result < 0) return result;
+    if(result) {
+        dax_log(DAX_LOG_ERROR, "Mapping from tag %s to tag %s would make a loop", _db[src.index].name, _db[dest.index].name);
+        return ERR_ILLEGAL;
+    }
 
     new_map = _new_map(src, dest);
-
-    if(src.type == DAX_BOOL) {
-        /* This basically creates a mask to write the bits that we want.
-         * We are putting the bits in mask according to the destination.
-         * The data itself will have to be shifted later when we write
-         * the data.
-         */
-        bit = dest.bit;
-        offset = 0;
-        mask = (uint8_t *)malloc(src.size);
-        bzero(mask, src.size);
-        for(int i=0; i<src.count; i++) {
-            mask[offset] |= (0x01 << bit);
-            bit++;
-            if(bit == 8) {
-                bit=0;
-                offset++;
-            }
-        }
-        new_map->mask = mask;
+    if(new_map == NULL) return ERR_ALLOC;
+    result = _map_compile(new_map);
+    if(result == 0) {
+        result = _index_insert(src.index, new_map);
+    }
+    if(result) {
+        _free_map(new_map);
+        return result;
     }
+    new_map->mirror = mirror;
     new_map->next = _db[src.index].mappings;
     _db[src.index].mappings = new_map;
     _db[src.index].attr |= TAG_ATTR_MAPPING;
+    if(!mirror) {
+        _rank_raise(dest.index, _db[src.index].maprank + 1);
+    }
 
     return new_map->id;
 }
@@ -145,32 +622,37 @@ map_add(tag_handle src, tag_handle dest)
 
 int
 map_del(tag_index index, int id) {
-    _dax_datamap *this, *prev;
+    _dax_datamap *this, *prev = NULL, *other;
 
     if(index < 0 || index >= get_tagindex()) {
         return ERR_ARG;
     }
-    this = _db[index].mappings;
-    if(this->id == id) {
-        _db[index].mappings = this->next;
-        _free_map(this);
-        return 0;
-    } else {
-        prev = this;
-        this = this->next;
-        while(this != NULL) {
-            if(this->id == id) {  /* Found it */
+    for(this = _db[index].mappings; this != NULL; prev = this, this = this->next) {
+        if(this->id == id) {  /* Found it */
+            if(prev == NULL) {
+                _db[index].mappings = this->next;
+            } else {
                 prev->next = this->next;
-                _free_map(this);
-                return 0;
             }
-            this = this->next;
+            _index_remove(index, this);
+            /* If this one had a mirror then the mirror becomes a normal
+             * mapping and the ranks have to account for it */
+            if(!this->mirror) {
+                for(other = _db[this->dest.index].mappings; other != NULL; other = other->next) {
+                    if(other->mirror && _is_reverse(other, this->source, this->dest)) {
+                        other->mirror = 0;
+                        _rank_raise(other->dest.index, _db[other->source.index].maprank + 1);
+                    }
+                }
+            }
+            _free_map(this);
+            /* If there are no more mappings reset the attribute flag */
+            if(_db[index].mappings == NULL) {
+                _db[index].attr &= ~TAG_ATTR_MAPPING;
+            }
+            return 0;
         }
     }
-    /* If there are no more mappings reset the attribute flag */
-    if(_db[index].mappings == NULL) {
-        _db[index].attr &= ~TAG_ATTR_MAPPING;
-    }
     return ERR_NOTFOUND;
 }
 
@@ -195,81 +677,72 @@ map_get(tag_handle *src, tag_handle *dest, tag_index index, int id) {
 }
 
 
-/* Traverse the linked list of maps and delete them all */
+/* Traverse the linked list of maps for the tag and delete them all */
 int
-map_del_all(_dax_datamap *head) {
+map_del_all(tag_index idx) {
     _dax_datamap *this, *next;
-    this = head;
+    this = _db[idx].mappings;
     while(this != NULL) {
         next = this->next;
         _free_map(this);
         this = next;
     }
+    _db[idx].mappings = NULL;
+    _db[idx].attr &= ~TAG_ATTR_MAPPING;
+    _index_free(idx);
     return 0;
 }
 
+/* Deletes all of the mappings whose destination is the tag at idx.  This
+ * is called from tag_del() */
+void
+map_del_dest(tag_index idx) {
+    _dax_datamap *this, *next;
+    tag_index n;
+
+    for(n = 0; n < get_tagindex(); n++) {
+        if(!(_db[n].attr & TAG_ATTR_MAPPING)) continue;
+        for(this = _db[n].mappings; this != NULL; this = next) {
+            next = this->next;
+            if(this->dest.index == idx) {
+                dax_log(DAX_LOG_DEBUG, "Destination tag has been deleted, removing map %d from tag index = %d", this->id, n);
+                map_del(n, this->id);
+            }
+        }
+    }
+}
+
+/* Writes the data to the destination of every mapping whose source overlaps
+ * the data that was written to the tag at idx and then follows the mappings
+ * of those destinations the same way. */
 int
 map_check(tag_index idx, int offset, int size) {
-    _dax_datamap *this;
-    uint8_t *new_data, *srcdb;
-    int srcByte;
-    int srcBit;
-    int destByte;
-    int destBit;
-    int result;
+    _dax_map_index *mi;
+    map_wave wave;
+    map_dirty *entry;
+    int n, first, end, depth;
 
-    this = _db[idx].mappings;
-    /* If this is the first time we've been called then it means that is is the tag that started
-     * the mapping.  If we chain too many then we'll tell the user which tag started it all. */
-    while(this != NULL) {
+    if(_db[idx].mindex == NULL) return 0;
+    wave.tags = wave.stack;
+    wave.count = 0;
+    wave.size = MAP_WAVE_SIZE;
+    _wave_add(&wave, idx, offset, offset + size, 0);
 
-        if(offset <= (this->source.byte + this->source.size - 1) && (offset + size -1 ) >= this->source.byte) {
-            srcdb = &_db[this->source.index].data[this->source.byte];
-            /* Mapping Hit */
-            if(this->mask != NULL) {
-                /* Move the bits from their position in the source to
-                 * where they should go in the destination */
-                srcByte = 0;
-                srcBit = this->source.bit;
-                destByte = 0;
-                destBit = this->dest.bit;
-                new_data = (uint8_t *)malloc(this->source.size);
-                if(new_data == NULL) {
-                    dax_log(DAX_LOG_ERROR, "Unable to allocate memory for map mask");
-                    return ERR_ALLOC;
-                }
-                bzero(new_data, this->source.size);
-                for(int n=0; n<this->source.count; n++) {
-                    if(srcdb[srcByte] & (0x01 << srcBit)) {
-                        new_data[destByte] |= (0x01 << destBit);
-                    }
-                    srcBit++;
-                    destBit++;
-                    if(srcBit == 8) {
-                        srcBit = 0;
-                        srcByte++;
-                    }
-                    if(destBit == 8) {
-                        destBit = 0;
-                        destByte++;
-                    }
-                }
-                result = tag_mask_write(-1, this->dest.index, this->dest.byte, new_data, this->mask, this->source.size);
-                /* If the destination tag has been deleted then delete this map */
-                if(result == ERR_DELETED) {
-                    dax_log(DAX_LOG_DEBUG, "Destination tag has been deleted, removing map %d from tag index = %d", this->id, this->source.index);
-                    map_del(this->source.index, this->id);
-                }
-                free(new_data);
-            } else {
-                result = tag_write(-1, this->dest.index, this->dest.byte, srcdb, this->source.size);
-                /* If the destination tag has been deleted then delete this map */
-                if(result == ERR_DELETED) {
-                    map_del(this->source.index, this->id);
-                }
-            }
+    while((n = _wave_next(&wave)) >= 0) {
+        entry = &wave.tags[n];
+        entry->done = 1;
+        mi = _db[entry->idx].mindex;
+        if(mi == NULL) continue;
+        if(entry->depth >= MAX_MAP_HOPS) {
+            dax_log(DAX_LOG_ERROR, "Too many mapping hops starting at tag %s", _db[idx].name);
+            continue;
         }
-        this = this->next;
+        /* The wave may move when more tags are added */
+        first = entry->offset;
+        end = entry->end;
+        depth = entry->depth;
+        _index_check(mi, 0, mi->count, first, end - first, &wave, depth + 1);
     }
+    if(wave.tags != wave.stack) free(wave.tags);
     return 0;
 }
@@ -30,6 +30,7 @@
 #include "options.h"
 #include "groups.h"
 #include "virtualtag.h"
+#include "shm.h"
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -41,85 +42,275 @@
 #define RESPONSE 1
 #define ERROR 2
 
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+
 #ifndef FD_COPY
 # define FD_COPY(x,y) memcpy((y),(x),sizeof(fd_set))
 #endif
 
-/* These are the listening sockets for the local UNIX domain
- *  socket and the remote TCP socket. */
-static fd_set _listenfdset;
+/* Per connection flags */
+#define CONN_ACTIVE  0x01 /* The fd is in use */
+#define CONN_LISTEN  0x02 /* This is a listening socket */
+
+/* This is the state that we keep for each file descriptor that the
+ * message loop is watching.  The table is indexed by the fd itself so
+ * finding the state for a ready socket doesn't require any searching */
+typedef struct msg_conn_t {
+    uint8_t flags;
+    uint32_t msgmax; /* Largest frame for the connection, the same as mod->msgmax */
+} msg_conn;
+
+static msg_conn *_conns;
+static int _connsize;
+/* The receive thread grows the table but the workers set msgmax when a
+ * module registers so changes to either are made under this lock */
+static pthread_mutex_t _conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Maximum number of ready events that we'll handle per call to epoll_wait() */
+# define MSG_MAX_EVENTS 64
+static int _epollfd;
+#else
 /* This is the set of all the sockets, both listening and conencted
  * it is used in the select() call in msg_receive() */
 static fd_set _fdset;
 static int _maxfd;
+#endif
+
+/* Job types for the message workers */
+#define JOB_MESSAGE 0 /* Handle the message */
+#define JOB_CLOSE   1 /* The connection has closed */
+
+/* This is a job that has been queued to one of the message workers.  The
+ * receive buffer is reused as soon as we return to the receive loop so the
+ * payload has to be copied into the job.  Messages that are larger than the
+ * default frame are copied into memory that is allocated for the job. */
+typedef struct msg_job_t {
+    int type;
+    int error;           /* The message couldn't be copied, send this error */
+    dax_srv_message msg;
+    char data[MSG_DATA_SIZE + 1];
+    struct msg_job_t *next;
+} msg_job;
+
+/* Each worker has its own queue of jobs.  All of the messages from a single
+ * connection are sent to the same worker so they are handled in order */
+typedef struct msg_worker_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    msg_job *head;
+    msg_job *tail;
+} msg_worker;
+
+static msg_worker *_workers;
+static int _workercount;
+/* Jobs are kept on this list after they are used so we don't have to
+ * allocate a new one for every message */
+static msg_job *_freejobs;
+static pthread_mutex_t _freejobs_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* This array holds the functions for each message command */
 /* Index 0 is not used. */
-int (*cmd_arr[NUM_COMMANDS+1])(dax_message *) = {NULL};
+int (*cmd_arr[NUM_COMMANDS+1])(dax_srv_message *) = {NULL};
+/* Commands that are set in this array only read the structure of the tag
+ * database so they can run in parallel with each other.  All the others
+ * have to lock the database exclusively. */
+static uint8_t _cmd_shared[NUM_COMMANDS+1] = {0};
 
 /* Macro to check whether or not the command 'x' is valid */
 #define CHECK_COMMAND(x) (((x) <= 0 || (x) > NUM_COMMANDS) ? 1 : 0)
 
-int msg_mod_register(dax_message *msg);
-int msg_tag_add(dax_message *msg);
-int msg_tag_del(dax_message *msg);
-int msg_tag_get(dax_message *msg);
-int msg_tag_list(dax_message *msg);
-int msg_tag_read(dax_message *msg);
-int msg_tag_write(dax_message *msg);
-int msg_tag_mask_write(dax_message *msg);
-int msg_evnt_add(dax_message *msg);
-int msg_evnt_del(dax_message *msg);
-int msg_evnt_get(dax_message *msg);
-int msg_evnt_opt(dax_message *msg);
-int msg_cdt_create(dax_message *msg);
-int msg_cdt_get(dax_message *msg);
-int msg_map_add(dax_message *msg);
-int msg_map_del(dax_message *msg);
-int msg_map_get(dax_message *msg);
-int msg_group_add(dax_message *msg);
-int msg_group_del(dax_message *msg);
-int msg_group_read(dax_message *msg);
-int msg_group_write(dax_message *msg);
-int msg_group_mask_write(dax_message *msg);
-int msg_atomic_op(dax_message *msg);
-int msg_add_override(dax_message *msg);
-int msg_del_override(dax_message *msg);
-int msg_get_override(dax_message *msg);
-int msg_set_override(dax_message *msg);
-
-
-/* Generic message sending function.  If response is MSG_ERROR then it is assumed that
- * an error is being sent to the module.  In that case payload should point to a
- * single int that indicates the error */
+int msg_mod_register(dax_srv_message *msg);
+int msg_tag_add(dax_srv_message *msg);
+int msg_tag_del(dax_srv_message *msg);
+int msg_tag_get(dax_srv_message *msg);
+int msg_tag_list(dax_srv_message *msg);
+int msg_tag_read(dax_srv_message *msg);
+int msg_tag_write(dax_srv_message *msg);
+int msg_tag_mask_write(dax_srv_message *msg);
+int msg_evnt_add(dax_srv_message *msg);
+int msg_evnt_del(dax_srv_message *msg);
+int msg_evnt_get(dax_srv_message *msg);
+int msg_evnt_opt(dax_srv_message *msg);
+int msg_cdt_create(dax_srv_message *msg);
+int msg_cdt_get(dax_srv_message *msg);
+int msg_map_add(dax_srv_message *msg);
+int msg_map_del(dax_srv_message *msg);
+int msg_map_get(dax_srv_message *msg);
+int msg_group_add(dax_srv_message *msg);
+int msg_group_del(dax_srv_message *msg);
+int msg_group_read(dax_srv_message *msg);
+int msg_group_write(dax_srv_message *msg);
+int msg_group_mask_write(dax_srv_message *msg);
+int msg_atomic_op(dax_srv_message *msg);
+int msg_add_override(dax_srv_message *msg);
+int msg_del_override(dax_srv_message *msg);
+int msg_get_override(dax_srv_message *msg);
+int msg_set_override(dax_srv_message *msg);
+int msg_tag_write_batch(dax_srv_message *msg);
+
+
+/* Generic message sending function.  It answers the request in *msg.  If
+ * response is MSG_ERROR then it is assumed that an error is being sent to the
+ * module.  In that case payload should point to a single int that indicates
+ * the error.  The header and the payload are written with a single writev()
+ * so the payload doesn't have to be copied.  A response that is too large for
+ * the module is turned into an ERR_2BIG error so that the module still gets
+ * an answer. */
 static int
-_message_send(int fd, int command, void *payload, size_t size, int response)
+_message_send(dax_srv_message *msg, int command, void *payload, size_t size, int response)
 {
-    int result;
-    char buff[DAX_MSGMAX];
-
-    ((uint32_t *)buff)[0] = htonl(size);
+    int result, fd, error = 0;
+    uint32_t header[2];
+    struct iovec iov[2];
+
+    fd = msg->fd;
+    /* Bounds check so we don't send more than the module will take */
+    if(size > (msg_conn_max(fd) - MSG_HDR_SIZE)) {
+        dax_log(DAX_LOG_ERROR, "Response of %u bytes is too large for fd %d", (unsigned)size, fd);
+        error = ERR_2BIG;
+        payload = &error;
+        size = sizeof(error);
+        response = ERROR;
+    }
+    header[0] = htonl(size);
     if(response == RESPONSE) {
-        ((uint32_t *)buff)[1] = htonl(command | MSG_RESPONSE);
+        header[1] = htonl(command | MSG_RESPONSE | msg->reqid);
     } else if(response == ERROR) {
         dax_log(DAX_LOG_MSGERR, "Returning Error '%s' to Module", dax_errstr(*(int *)payload));
-        ((uint32_t *)buff)[1] = htonl(command | MSG_ERROR);
+        header[1] = htonl(command | MSG_ERROR | msg->reqid);
     } else {
-        ((uint32_t *)buff)[1] = htonl(command);
+        header[1] = htonl(command | msg->reqid);
     }
-    /* Bounds check so we don't seg fault */
-    if(size > (DAX_MSGMAX - MSG_HDR_SIZE)) {
-        return ERR_2BIG;
-    }
-    memcpy(&buff[MSG_HDR_SIZE], payload, size);
-    result = xwrite(fd, buff, size + MSG_HDR_SIZE);
+    iov[0].iov_base = header;
+    iov[0].iov_len = MSG_HDR_SIZE;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = size;
+    result = xwritev(fd, iov, size ? 2 : 1);
     if(result < 0) {
         dax_log(DAX_LOG_ERROR, "_message_send: %s", strerror(errno));
         return ERR_MSG_SEND;
     }
+    return error;
+}
+
+/* Sends a response along with a file descriptor.  This only works on
+ * local domain sockets.  The message is small enough that it will go in
+ * a single sendmsg() */
+static int
+_message_send_fd(int fd, int command, void *payload, size_t size, int sendfd)
+{
+    ssize_t result;
+    uint32_t header[2];
+    struct iovec iov[2];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    union {
+        char buff[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    header[0] = htonl(size);
+    header[1] = htonl(command | MSG_RESPONSE);
+    iov[0].iov_base = header;
+    iov[0].iov_len = MSG_HDR_SIZE;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = size;
+
+    bzero(&mh, sizeof(mh));
+    bzero(&control, sizeof(control));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    mh.msg_control = control.buff;
+    mh.msg_controllen = sizeof(control.buff);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &sendfd, sizeof(int));
+
+    do {
+        result = sendmsg(fd, &mh, 0);
+    } while(result < 0 && errno == EINTR);
+    if(result != MSG_HDR_SIZE + size) {
+        dax_log(DAX_LOG_ERROR, "_message_send_fd: %s", strerror(errno));
+        return ERR_MSG_SEND;
+    }
     return 0;
 }
 
+/* Returns true if the socket is a local domain socket */
+static int
+_is_local_socket(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if(getsockname(fd, (struct sockaddr *)&addr, &len)) return 0;
+    return addr.ss_family == AF_UNIX;
+}
+
+/* Make sure that the connection table is large enough to hold 'fd' */
+static int
+_conn_grow(int fd)
+{
+    msg_conn *new_conns;
+    int newsize;
+
+    if(fd < _connsize) return 0;
+    newsize = _connsize ? _connsize : 64;
+    while(newsize <= fd) newsize *= 2;
+    pthread_mutex_lock(&_conn_lock);
+    new_conns = xrealloc(_conns, sizeof(msg_conn) * newsize);
+    if(new_conns == NULL) {
+        pthread_mutex_unlock(&_conn_lock);
+        return ERR_ALLOC;
+    }
+    bzero(&new_conns[_connsize], sizeof(msg_conn) * (newsize - _connsize));
+    _conns = new_conns;
+    _connsize = newsize;
+    pthread_mutex_unlock(&_conn_lock);
+    return 0;
+}
+
+/* Returns the largest message frame that may be sent to or received from
+ * the connection on 'fd'.  This is DAX_MSGMAX until the module registers
+ * and negotiates something larger. */
+uint32_t
+msg_conn_max(int fd)
+{
+    uint32_t msgmax = DAX_MSGMAX;
+
+    pthread_mutex_lock(&_conn_lock);
+    if(fd >= 0 && fd < _connsize && _conns[fd].msgmax) msgmax = _conns[fd].msgmax;
+    pthread_mutex_unlock(&_conn_lock);
+    return msgmax;
+}
+
+static void
+_conn_set_max(int fd, uint32_t msgmax)
+{
+    pthread_mutex_lock(&_conn_lock);
+    if(fd >= 0 && fd < _connsize) _conns[fd].msgmax = msgmax;
+    pthread_mutex_unlock(&_conn_lock);
+}
+
+/* Adds a listening socket to the message loop.  Listening sockets are
+ * set to non-blocking so that we can accept every pending connection
+ * when we are notified without the risk of blocking the loop. */
+static void
+_msg_add_listener(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    msg_add_fd(fd);
+    if(fd < _connsize) _conns[fd].flags |= CONN_LISTEN;
+}
+
 /* Sets up the local UNIX domain socket for listening. */
 static int
 _msg_setup_local_socket(void)
@@ -146,8 +337,7 @@ _msg_setup_local_socket(void)
         dax_log(DAX_LOG_FATAL, "Unable to listen for some reason");
         kill(getpid(), SIGQUIT);
     }
-    FD_SET(fd, &_listenfdset);
-    msg_add_fd(fd);
+    _msg_add_listener(fd);
 
     dax_log(DAX_LOG_COMM, "Listening on local socket - %s", opt_socketname());
     return 0;
@@ -181,17 +371,153 @@ _msg_setup_remote_socket(struct in_addr ipaddress, in_port_t ipport)
     if(listen(fd, 5) < 0) {
         dax_log(DAX_LOG_FATAL, "Unable to listen on remote socket - %s", strerror(errno));
     }
-    /* set the _remotefd set here.  This gives us a simpler way to
-     * determine if the fd that we get from the select() call in
-     * msg_receive() is a listening socket or not */
-    /* TODO: Does this need to be an fd_set?? */
-    FD_SET(fd, &_listenfdset);
-    msg_add_fd(fd);
+    /* Marking the socket as a listener gives us a simple way to
+     * determine if the fd that we get in msg_receive() is a listening
+     * socket or not */
+    _msg_add_listener(fd);
 
     dax_log(DAX_LOG_COMM, "Listening on remote socket - %s:%d",inet_ntoa(ipaddress), ipport);
     return 0;
 }
 
+/* Calls the handler for the message with the tag database locked */
+static int
+_msg_execute(dax_srv_message *msg)
+{
+    int result;
+
+    /* The module still gets an answer so that it doesn't wait for one */
+    if(CHECK_COMMAND(msg->msg_type) || cmd_arr[msg->msg_type] == NULL) {
+        result = ERR_MSG_BAD;
+        _message_send(msg, msg->msg_type, &result, sizeof(result), ERROR);
+        return result;
+    }
+    if(_cmd_shared[msg->msg_type]) {
+        tag_db_rdlock();
+    } else {
+        tag_db_wrlock();
+    }
+    result = (*cmd_arr[msg->msg_type])(msg);
+    tag_db_unlock();
+    return result;
+}
+
+/* Cleans up after a module whose connection has been closed */
+static void
+_msg_unregister(int fd)
+{
+    tag_db_wrlock();
+    module_unregister(fd);
+    tag_db_unlock();
+}
+
+static msg_job *
+_job_alloc(void)
+{
+    msg_job *job;
+
+    pthread_mutex_lock(&_freejobs_lock);
+    job = _freejobs;
+    if(job != NULL) _freejobs = job->next;
+    pthread_mutex_unlock(&_freejobs_lock);
+    if(job == NULL) job = malloc(sizeof(msg_job));
+    return job;
+}
+
+static void
+_job_free(msg_job *job)
+{
+    if(job->type == JOB_MESSAGE && job->msg.data != job->data) {
+        free(job->msg.data);
+    }
+    pthread_mutex_lock(&_freejobs_lock);
+    job->next = _freejobs;
+    _freejobs = job;
+    pthread_mutex_unlock(&_freejobs_lock);
+}
+
+/* Adds the job to the queue of the worker that handles 'fd' */
+static void
+_job_queue(int fd, msg_job *job)
+{
+    msg_worker *w;
+
+    w = &_workers[fd % _workercount];
+    job->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if(w->tail == NULL) {
+        w->head = job;
+    } else {
+        w->tail->next = job;
+    }
+    w->tail = job;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* This is the main loop for each of the message worker threads */
+static void *
+_msg_worker(void *arg)
+{
+    msg_worker *w;
+    msg_job *job;
+    int result;
+
+    w = (msg_worker *)arg;
+    while(1) {
+        pthread_mutex_lock(&w->lock);
+        while(w->head == NULL) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        job = w->head;
+        w->head = job->next;
+        if(w->head == NULL) w->tail = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        if(job->type == JOB_CLOSE) {
+            _msg_unregister(job->msg.fd);
+            /* We don't close the socket until now so that the fd cannot
+             * be reused while we still have messages for it in the queue */
+            close(job->msg.fd);
+        } else if(job->error) {
+            _message_send(&job->msg, job->msg.msg_type, &job->error, sizeof(int), ERROR);
+        } else {
+            result = _msg_execute(&job->msg);
+            if(result) {
+                dax_log(DAX_LOG_MSGERR, "Message from fd %d returned error %d", job->msg.fd, result);
+            }
+        }
+        _job_free(job);
+    }
+    return NULL;
+}
+
+/* Starts 'count' message worker threads.  If count is zero the messages
+ * are handled in the same thread that receives them. */
+static void
+_msg_start_workers(int count)
+{
+    int n;
+
+    _workercount = 0;
+    if(count <= 0) return;
+    _workers = xmalloc(sizeof(msg_worker) * count);
+    if(_workers == NULL) {
+        dax_log(DAX_LOG_ERROR, "Unable to allocate message workers");
+        return;
+    }
+    for(n = 0; n < count; n++) {
+        pthread_mutex_init(&_workers[n].lock, NULL);
+        pthread_cond_init(&_workers[n].cond, NULL);
+        if(pthread_create(&_workers[n].thread, NULL, _msg_worker, &_workers[n])) {
+            dax_log(DAX_LOG_ERROR, "Unable to create message worker thread %d", n);
+            break;
+        }
+        _workercount++;
+    }
+    dax_log(DAX_LOG_MINOR, "Started %d message worker threads", _workercount);
+}
+
 /* Creates and sets up the local message socket for the program.
    It's a fatal error if we cannot create the local socket.  The
    remote socket creation is allowed to fail without exiting.  This
@@ -199,10 +525,20 @@ _msg_setup_remote_socket(struct in_addr ipaddress, in_port_t ipport)
 int
 msg_setup(void)
 {
-    _maxfd = 0;
     struct in_addr s;
+
+    _conns = NULL;
+    _connsize = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    _epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(_epollfd < 0) {
+        dax_log(DAX_LOG_FATAL, "Unable to create epoll instance - %s", strerror(errno));
+        kill(getpid(), SIGQUIT);
+    }
+#else
+    _maxfd = 0;
     FD_ZERO(&_fdset);
-    FD_ZERO(&_listenfdset);
+#endif
 
     dax_log(DAX_LOG_DEBUG, "Opening Local Connection - %s", opt_socketname());
     _msg_setup_local_socket();
@@ -242,6 +578,23 @@ msg_setup(void)
     cmd_arr[MSG_DEL_OVRD]   = &msg_del_override;
     cmd_arr[MSG_GET_OVRD]   = &msg_get_override;
     cmd_arr[MSG_SET_OVRD]   = &msg_set_override;
+    cmd_arr[MSG_TAG_BWRITE] = &msg_tag_write_batch;
+
+    _cmd_shared[MSG_TAG_GET]    = 1;
+    _cmd_shared[MSG_TAG_LIST]   = 1;
+    _cmd_shared[MSG_TAG_READ]   = 1;
+    _cmd_shared[MSG_TAG_WRITE]  = 1;
+    _cmd_shared[MSG_TAG_MWRITE] = 1;
+    _cmd_shared[MSG_EVNT_GET]   = 1;
+    _cmd_shared[MSG_CDT_GET]    = 1;
+    _cmd_shared[MSG_MAP_GET]    = 1;
+    _cmd_shared[MSG_GRP_READ]   = 1;
+    _cmd_shared[MSG_GRP_WRITE]  = 1;
+    _cmd_shared[MSG_GRP_MWRITE] = 1;
+    _cmd_shared[MSG_GET_OVRD]   = 1;
+    _cmd_shared[MSG_TAG_BWRITE] = 1;
+
+    _msg_start_workers(opt_workers());
 
     return 0;
 }
@@ -255,17 +608,44 @@ msg_destroy(void)
 }
 
 /* These two functions are wrappers to deal with adding and deleting
-   file descriptors to the global _fdset and dealing with _maxfd */
+   file descriptors to the message loop and the connection table */
 void
 msg_add_fd(int fd)
 {
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+#endif
+
+    if(_conn_grow(fd)) {
+        dax_log(DAX_LOG_ERROR, "Unable to allocate connection state for fd %d", fd);
+        close(fd);
+        return;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    /* Edge triggered so we only hear about each socket once per burst of data.
+     * This means that we have to drain the socket every time we are notified */
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if(epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        dax_log(DAX_LOG_ERROR, "Unable to add fd %d to epoll - %s", fd, strerror(errno));
+        close(fd);
+        return;
+    }
+#else
     FD_SET(fd, &_fdset);
     if(fd > _maxfd) _maxfd = fd;
+#endif
+    _conns[fd].flags = CONN_ACTIVE;
+    _conn_set_max(fd, DAX_MSGMAX);
 }
 
-void
-msg_del_fd(int fd)
+/* Stops watching 'fd' in the message loop but doesn't close it */
+static void
+_msg_forget_fd(int fd)
 {
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_ctl(_epollfd, EPOLL_CTL_DEL, fd, NULL);
+#else
     int n, tmpfd = 0;
 
     FD_CLR(fd, &_fdset);
@@ -279,10 +659,132 @@ msg_del_fd(int fd)
         }
         _maxfd = tmpfd;
     }
-    close(fd); /* Just to make sure */
+#endif
+    if(fd < _connsize) _conns[fd].flags = 0;
     buff_free(fd);
 }
 
+void
+msg_del_fd(int fd)
+{
+    _msg_forget_fd(fd);
+    close(fd); /* Just to make sure */
+}
+
+/* Deals with a connection that has been closed or has failed.  If we are
+ * using workers the module is cleaned up by the worker that handles the
+ * connection, after any messages that are still in its queue. */
+static void
+_msg_close(int fd)
+{
+    msg_job *job;
+
+    if(_workercount) {
+        job = _job_alloc();
+        if(job != NULL) {
+            _msg_forget_fd(fd);
+            job->type = JOB_CLOSE;
+            job->msg.fd = fd;
+            _job_queue(fd, job);
+            return;
+        }
+    }
+    _msg_unregister(fd);
+    msg_del_fd(fd);
+}
+
+/* Accept all of the pending connections on the listening socket 'fd' */
+static void
+_msg_accept(int fd)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    int newfd;
+
+    while(1) {
+        len = sizeof(addr);
+        newfd = accept(fd, (struct sockaddr *)&addr, &len);
+        if(newfd < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                /* TODO: Need to handle these errors */
+                dax_log(DAX_LOG_ERROR, "Error Accepting socket: %s", strerror(errno));
+            }
+            return;
+        }
+        dax_log(DAX_LOG_COMM, "Accepted socket on fd %d", newfd);
+        msg_add_fd(newfd);
+    }
+}
+
+/* Read and dispatch all of the messages that are waiting on the connected
+ * socket 'fd'.  We have to read until the socket is empty because we won't
+ * be notified again for data that is already waiting. */
+static int
+_msg_read(int fd)
+{
+    int result;
+
+    while(1) {
+        result = buff_read(fd);
+        if(result == ERR_EMPTY) { /* Nothing left to read */
+            return 0;
+        } else if(result == ERR_NO_SOCKET) { /* This is the end of file */
+            dax_log(DAX_LOG_COMM, "Connection Closed for fd %d", fd);
+            _msg_close(fd);
+            return 0;
+        } else if(result == ERR_MSG_RECV) {
+            dax_log(DAX_LOG_ERROR, "Closing fd %d due to read error", fd);
+            _msg_close(fd);
+            return result;
+        } else if(result < 0) {
+            dax_log(DAX_LOG_MSGERR, "Message on fd %d returned error %d", fd, result);
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* This function blocks waiting for messages to be received.  Once a message
+ * is retrieved from the system the proper handling function is called.  Only
+ * the sockets that are ready are visited so the cost is proportional to the
+ * number of active connections and not to the number of open ones. */
+int
+msg_receive(void)
+{
+    struct epoll_event events[MSG_MAX_EVENTS];
+    int result, fd, n;
+
+    result = epoll_wait(_epollfd, events, MSG_MAX_EVENTS, opt_msg_timeout());
+
+    if(result < 0) {
+        /* Ignore interruption by signal */
+        if(errno != EINTR) {
+            /* TODO: Deal with these errors */
+            dax_log(DAX_LOG_ERROR, "msg_receive epoll error: %s", strerror(errno));
+            return ERR_MSG_RECV;
+        }
+    } else if(result == 0) { /* Timeout */
+        buff_freeall(); /* this releases the idle connection buffers */
+        return 0;
+    } else {
+        for(n = 0; n < result; n++) {
+            fd = events[n].data.fd;
+            /* The fd may have been closed by an earlier event in this batch */
+            if(fd >= _connsize || ! (_conns[fd].flags & CONN_ACTIVE)) continue;
+            if(_conns[fd].flags & CONN_LISTEN) {
+                _msg_accept(fd);
+            } else {
+                /* Hangups and errors are found by the read returning EOF */
+                _msg_read(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
 /* This function blocks waiting for a message to be received.  Once a message
  * is retrieved from the system the proper handling function is called */
 int
@@ -290,14 +792,12 @@ msg_receive(void)
 {
     fd_set tmpset;
     struct timeval tm;
-    struct sockaddr_un addr;
-    int result, fd, n;
-    socklen_t len = 0;
+    int result, n;
 
     FD_ZERO(&tmpset);
     FD_COPY(&_fdset, &tmpset);
-    tm.tv_sec = 1; /* TODO: this should be configuration */
-    tm.tv_usec = 0;
+    tm.tv_sec = opt_msg_timeout() / 1000;
+    tm.tv_usec = (opt_msg_timeout() % 1000) * 1000;
 
     result = select(_maxfd + 1, &tmpset, NULL, NULL, &tm);
 
@@ -309,29 +809,15 @@ msg_receive(void)
             return ERR_MSG_RECV;
         }
     } else if(result == 0) { /* Timeout */
-        buff_freeall(); /* this erases all of the _buffer nodes */
+        buff_freeall(); /* this releases the idle connection buffers */
         return 0;
     } else {
         for(n = 0; n <= _maxfd; n++) {
             if(FD_ISSET(n, &tmpset)) {
-                if(FD_ISSET(n, &_listenfdset)) { /* This is a listening socket */
-                    fd = accept(n, (struct sockaddr *)&addr, &len);
-                    if(fd < 0) {
-                        /* TODO: Need to handle these errors */
-                        dax_log(DAX_LOG_ERROR, "Error Accepting socket: %s", strerror(errno));
-                    } else {
-                        dax_log(DAX_LOG_COMM, "Accepted socket on fd %d", n);
-                        msg_add_fd(fd);
-                    }
+                if(_conns[n].flags & CONN_LISTEN) { /* This is a listening socket */
+                    _msg_accept(n);
                 } else {
-                    result = buff_read(n);
-                    if(result == ERR_NO_SOCKET) { /* This is the end of file */
-                        dax_log(DAX_LOG_COMM, "Connection Closed for fd %d", n);
-                        module_unregister(n);
-                        msg_del_fd(n);
-                    } else if(result < 0) {
-                        return result; /* Pass the error up */
-                    }
+                    _msg_read(n);
                 }
             }
         }
@@ -339,14 +825,21 @@ msg_receive(void)
     return 0;
 }
 
-/* This handles each message.  It extracts out the dax_message structure
- * and then calls the proper message handling function.  This message will
+#endif /* HAVE_SYS_EPOLL_H */
+
+/* This handles each message.  It fills in the dax_srv_message structure
+ * and then calls the proper message handling function.  This function will
  * unmarshal the header but it is up to the individual wrapper function to
- * unmarshal the data portion of the message if need be. */
+ * unmarshal the data portion of the message if need be.  The data in the
+ * message points into 'buff' so the buffer must be at least one byte larger
+ * than the message for the NULL terminator.  The buffer belongs to the
+ * caller and must not be changed until we return.  If we have workers the message
+ * is queued to the worker for this connection instead */
 int
 msg_dispatcher(int fd, unsigned char *buff)
 {
-    dax_message message;
+    dax_srv_message message;
+    msg_job *job;
 
     /* The first four bytes are the size and the size is always
      * sent in network order */
@@ -355,12 +848,40 @@ msg_dispatcher(int fd, unsigned char *buff)
      * byte order. */
     message.msg_type = ntohl(*(uint32_t *)&buff[4]);
 
-    if(CHECK_COMMAND(message.msg_type)) return ERR_MSG_BAD;
+    /* The request id goes back with the response.  Bad commands are
+     * answered by _msg_execute() so that the answers stay in order. */
+    message.reqid = message.msg_type & MSG_ID_MASK;
+    message.msg_type &= ~MSG_ID_MASK;
     message.fd = fd;
-    memcpy(message.data, &buff[8], message.size);
-    buff_free(fd);
+    /* The receive buffer is reused as soon as we return so the workers
+     * get a copy of the message.  Only the inline path works in place. */
+    if(_workercount) {
+        /* If this fails the module never gets an answer.  A module that
+         * uses request ids gets past that, an old one is out of step */
+        job = _job_alloc();
+        if(job == NULL) return ERR_ALLOC;
+        job->type = JOB_MESSAGE;
+        job->error = 0;
+        job->msg = message;
+        job->msg.data = job->data;
+        if(message.size > MSG_DATA_SIZE) {
+            job->msg.data = malloc(message.size + 1);
+            if(job->msg.data == NULL) {
+                /* The worker sends the error so that it is in order */
+                job->msg.data = job->data;
+                job->msg.size = 0;
+                job->error = ERR_ALLOC;
+            }
+        }
+        memcpy(job->msg.data, &buff[MSG_HDR_SIZE], job->msg.size);
+        job->msg.data[job->msg.size] = '\0';
+        _job_queue(fd, job);
+        return 0;
+    }
+    message.data = (char *)&buff[MSG_HDR_SIZE];
+    message.data[message.size] = '\0';
     /* Now call the function to deal with it */
-    return (*cmd_arr[message.msg_type])(&message);
+    return _msg_execute(&message);
 }
 
 
@@ -375,11 +896,12 @@ msg_dispatcher(int fd, unsigned char *buff)
  * message.  Otherwise the first four bytes are the PID of the calling module
  * the next four bytes are some flags and then the rest is the module name. */
 int
-msg_mod_register(dax_message *msg)
+msg_mod_register(dax_srv_message *msg)
 {
-    uint32_t parint;
-    int flags, result;
-    char buff[DAX_MSGMAX];
+    uint32_t parint, msgmax;
+    int flags, result, shm;
+    size_t len, size;
+    char buff[REG_RESPONSE_SIZE + 3 * sizeof(uint32_t)];
     dax_module *mod;
     dax_time starttime;
 
@@ -395,8 +917,8 @@ msg_mod_register(dax_message *msg)
             mod = module_register(&msg->data[MSG_HDR_SIZE], parint, msg->fd);
             if(!mod) {
                 result = ERR_NOTFOUND;
-                _message_send(msg->fd, MSG_MOD_REG, &result, sizeof(result) , ERROR);
-                return result;
+                _message_send(msg, MSG_MOD_REG, &result, sizeof(result) , ERROR);
+                return 0;
             } else {
                 tag_read(-1, INDEX_STARTED, 0, &starttime, 4);
                 *((uint32_t *)&buff[0]) = (uint32_t)starttime;   /* The lower 32 bits of the servers start time is the ID */
@@ -406,16 +928,51 @@ msg_mod_register(dax_message *msg)
                 *((uint64_t *)&buff[10]) = REG_TEST_LINT;   /* 64 bit integer test data */
                 *((float *)&buff[18])    = REG_TEST_REAL;   /* 32 bit float test data */
                 *((double *)&buff[22])   = REG_TEST_LREAL;  /* 64 bit float test data */
-                _message_send(msg->fd, MSG_MOD_REG, buff, 30 + 1, RESPONSE);
+                /* If the module asked for a frame size it follows the name.  We give
+                 * it the smaller of that and our own maximum */
+                len = strlen(&msg->data[MSG_HDR_SIZE]) + 1 + MSG_HDR_SIZE;
+                if(flags & CONNECT_FRAME && msg->size >= len + sizeof(uint32_t)) {
+                    msgmax = ntohl(*((uint32_t *)&msg->data[len]));
+                    msgmax = MIN(msgmax, opt_max_frame());
+                    mod->msgmax = MAX(msgmax, DAX_MSGMAX);
+                    _conn_set_max(msg->fd, mod->msgmax);
+                }
+                if(flags & CONNECT_NOTIFY) {
+                    mod->flags |= MFLAG_NOTIFY;
+                }
+                /* Local modules that ask for it get the shared memory tag data.
+                 * The file descriptor is passed along with the response and the
+                 * size of the region follows the frame size. */
+                shm = flags & CONNECT_SHM && shm_get_fd() >= 0 && _is_local_socket(msg->fd);
+                size = REG_RESPONSE_SIZE;
+                if(shm || (flags & CONNECT_FRAME && msg->size >= len + sizeof(uint32_t))) {
+                    *((uint32_t *)&buff[size]) = htonl(mod->msgmax);
+                    size += sizeof(uint32_t);
+                }
+                if(shm) {
+                    *((uint32_t *)&buff[size]) = htonl(shm_get_size());
+                    size += sizeof(uint32_t);
+                }
+                /* The flags that we agree to come last.  The module can only
+                 * find them if the frame size is there. */
+                if(flags & CONNECT_REQID && size > REG_RESPONSE_SIZE) {
+                    *((uint32_t *)&buff[size]) = htonl(CONNECT_REQID);
+                    size += sizeof(uint32_t);
+                }
+                if(shm) {
+                    _message_send_fd(msg->fd, MSG_MOD_REG, buff, size, shm_get_fd());
+                } else {
+                    _message_send(msg, MSG_MOD_REG, buff, size, RESPONSE);
+                }
                 dax_log(DAX_LOG_MSG, "Register Module message received for %s fd = %d", &msg->data[8], msg->fd);
             }
         } else { /* If the flags are bad send error */
             result = ERR_MSG_BAD;
-            _message_send(msg->fd, MSG_MOD_REG, &result, sizeof(result) , ERROR);
+            _message_send(msg, MSG_MOD_REG, &result, sizeof(result) , ERROR);
             dax_log(DAX_LOG_MSG, "Register Module message received for %s returning error %d", &msg->data[8], result);
         }
     } else {
-        _message_send(msg->fd, MSG_MOD_REG, buff, 0, 1);
+        _message_send(msg, MSG_MOD_REG, NULL, 0, 1);
     }
     return 0;
 }
@@ -424,7 +981,7 @@ msg_mod_register(dax_message *msg)
  * the type of tag, the next four bytes are the count and the remainder
  * of the message is the tag name */
 int
-msg_tag_add(dax_message *msg)
+msg_tag_add(dax_srv_message *msg)
 {
     tag_index idx;
     uint32_t type;
@@ -444,25 +1001,27 @@ msg_tag_add(dax_message *msg)
     }
 
     if(idx >= 0) {
-        _message_send(msg->fd, MSG_TAG_ADD, &idx, sizeof(tag_index), RESPONSE);
+        idx = tag_extern(idx);
+        _message_send(msg, MSG_TAG_ADD, &idx, sizeof(tag_index), RESPONSE);
     } else {
-        _message_send(msg->fd, MSG_TAG_ADD, &idx, sizeof(tag_index), ERROR);
+        _message_send(msg, MSG_TAG_ADD, &idx, sizeof(tag_index), ERROR);
     }
     return 0;
 }
 
 /* Delete a tag */
 int
-msg_tag_del(dax_message *msg)
+msg_tag_del(dax_srv_message *msg)
 {
     int result;
-    tag_index idx;
+    tag_index idx, slot;
     dax_tag tag;
 
     idx = *((tag_index *)&msg->data[0]);
 
     dax_log(DAX_LOG_MSG, "Tag Delete Message for index '%d' from module %d", idx, msg->fd);
-    result = tag_get_index(idx, &tag);
+    slot = tag_resolve(idx);
+    result = slot < 0 ? slot : tag_get_index(slot, &tag);
     if(result) {
         dax_log(DAX_LOG_MSGERR, "Tag Delete Message with unknown tag");
         result = ERR_ARG;
@@ -470,19 +1029,19 @@ msg_tag_del(dax_message *msg)
         dax_log(DAX_LOG_MSGERR, "Modules are not allowed to remove reserved tags");
         result = ERR_ILLEGAL; /* Modules are not allowed to remove reserved tags */
     } else {
-        result = tag_del(idx);
+        result = tag_del(slot);
     }
 
     if(!result) {
-        _message_send(msg->fd, MSG_TAG_DEL, &idx, sizeof(tag_index), RESPONSE);
+        _message_send(msg, MSG_TAG_DEL, &idx, sizeof(tag_index), RESPONSE);
     } else {
-        _message_send(msg->fd, MSG_TAG_DEL, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_TAG_DEL, &result, sizeof(int), ERROR);
     }
     return 0;
 }
 
 int
-msg_tag_get(dax_message *msg)
+msg_tag_get(dax_srv_message *msg)
 {
     int result, index, size;
     dax_tag tag;
@@ -490,10 +1049,18 @@ msg_tag_get(dax_message *msg)
 
     if(msg->data[0] == TAG_GET_INDEX) { /* Is it a string or index */
         index = *((tag_index *)&msg->data[1]); /* cast void * -> handle_t * then indirect */
-        result = tag_get_index(index, &tag); /* get the tag */
         dax_log(DAX_LOG_MSG, "Tag Get Message from %d for index 0x%X", msg->fd, index);
+        index = tag_resolve(index);
+        result = index < 0 ? index : tag_get_index(index, &tag); /* get the tag */
+    } else if(msg->data[0] == TAG_GET_SLOT) {
+        /* This is how the modules walk through all of the tags.  Whatever
+         * tag is in the slot is returned, whatever its generation. */
+        index = *((tag_index *)&msg->data[1]);
+        dax_log(DAX_LOG_MSG, "Tag Get Message from %d for slot %d", msg->fd, index);
+        result = tag_get_index(index, &tag);
     } else { /* A name was passed */
-        ((char *)msg->data)[DAX_TAGNAME_SIZE + 1] = 0x00; /* Add a NULL to avoid trouble */
+        /* Add a NULL to avoid trouble.  The message itself is always terminated */
+        if(msg->size > DAX_TAGNAME_SIZE + 1) msg->data[DAX_TAGNAME_SIZE + 1] = 0x00;
         /* Get the tag by it's name */
         result = tag_get_name((char *)&msg->data[1], &tag);
         dax_log(DAX_LOG_MSG, "Tag Get Message from %d for name '%s'", msg->fd, (char *)msg->data);
@@ -507,10 +1074,10 @@ msg_tag_get(dax_message *msg)
         *((uint32_t *)&buff[8]) = tag.count;
         *((uint16_t *)&buff[12]) = tag.attr;
         strcpy(&buff[14], tag.name);
-        _message_send(msg->fd, MSG_TAG_GET, buff, size, RESPONSE);
+        _message_send(msg, MSG_TAG_GET, buff, size, RESPONSE);
         dax_log(DAX_LOG_MSG, "Returning tag - '%s':0x%X to module %d",tag.name, tag.idx, msg->fd);
     } else {
-        _message_send(msg->fd, MSG_TAG_GET, &result, sizeof(result), ERROR);
+        _message_send(msg, MSG_TAG_GET, &result, sizeof(result), ERROR);
         dax_log(DAX_LOG_MSG, "Bad tag query for MSG_TAG_GET");
     }
     return 0;
@@ -518,9 +1085,12 @@ msg_tag_get(dax_message *msg)
 
 /* TODO: Make this do something */
 int
-msg_tag_list(dax_message *msg)
+msg_tag_list(dax_srv_message *msg)
 {
+    int result = ERR_NOTIMPLEMENTED;
+
     dax_log(DAX_LOG_MSG, "Tag List Message from %d", msg->fd);
+    _message_send(msg, MSG_TAG_LIST, &result, sizeof(result), ERROR);
     return 0;
 }
 
@@ -528,13 +1098,14 @@ msg_tag_list(dax_message *msg)
  * of the tag that we want to read and the next part is the size
  * of the buffer that we want to read */
 int
-msg_tag_read(dax_message *msg)
+msg_tag_read(dax_srv_message *msg)
 {
-    char data[MSG_DATA_SIZE];
+    char sdata[MSG_DATA_SIZE];
+    char *data = sdata;
     tag_index index;
     int result;
     uint32_t offset;
-    int size;
+    uint32_t size;
 
     index = *((tag_index *)&msg->data[0]);
     offset = *((uint32_t *)&msg->data[4]);
@@ -542,18 +1113,27 @@ msg_tag_read(dax_message *msg)
 
     dax_log(DAX_LOG_MSG, "Tag Read Message from module %d, index %d, offset %d, size %d", msg->fd, index, offset, size);
 
-    result = tag_read(msg->fd, index, offset, &data, size);
+    if(size > msg_conn_max(msg->fd) - MSG_HDR_SIZE) {
+        result = ERR_2BIG;
+    } else if(size > MSG_DATA_SIZE && (data = malloc(size)) == NULL) {
+        result = ERR_ALLOC;
+    } else if((index = tag_resolve(index)) < 0) {
+        result = index;
+    } else {
+        result = tag_read(msg->fd, index, offset, data, size);
+    }
     if(result) {
-        _message_send(msg->fd, MSG_TAG_READ, &result, sizeof(result), ERROR);
+        _message_send(msg, MSG_TAG_READ, &result, sizeof(result), ERROR);
     } else {
-        _message_send(msg->fd, MSG_TAG_READ, &data, size, RESPONSE);
+        _message_send(msg, MSG_TAG_READ, data, size, RESPONSE);
     }
+    if(data != sdata && data != NULL) free(data);
     return 0;
 }
 
 /* Generic write message */
 int
-msg_tag_write(dax_message *msg)
+msg_tag_write(dax_srv_message *msg)
 {
     tag_index idx;
     int result;
@@ -567,24 +1147,26 @@ msg_tag_write(dax_message *msg)
     data = &msg->data[8];
 
     dax_log(DAX_LOG_MSG, "Tag Write Message from module %d, index %d, offset %d, size %d", msg->fd, idx, offset, size);
-    if(is_tag_readonly(idx) && ! is_tag_owned(msg->fd, idx)) {
+    if((idx = tag_resolve(idx)) < 0) {
+        result = idx;
+    } else if(is_tag_readonly(idx) && ! is_tag_owned(msg->fd, idx)) {
         result = ERR_READONLY;
     } else {
         result = tag_write(msg->fd, idx, offset, data, size);
     }
     if(result) {
-        _message_send(msg->fd, MSG_TAG_WRITE, &result, sizeof(result), ERROR);
+        _message_send(msg, MSG_TAG_WRITE, &result, sizeof(result), ERROR);
         dax_log(DAX_LOG_ERROR, "Unable to write tag 0x%X with size %d",idx, size);
     } else {
         map_check(idx, offset, size);
-        _message_send(msg->fd, MSG_TAG_WRITE, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_TAG_WRITE, NULL, 0, RESPONSE);
     }
     return 0;
 }
 
 /* Generic write with bit mask */
 int
-msg_tag_mask_write(dax_message *msg)
+msg_tag_mask_write(dax_srv_message *msg)
 {
     tag_index idx;
     int result, offset;
@@ -598,24 +1180,90 @@ msg_tag_mask_write(dax_message *msg)
     mask = &msg->data[8 + size];
 
     dax_log(DAX_LOG_MSG, "Tag Masked Write Message from module %d, index %d, offset %d, size %d", msg->fd, idx, offset, size);
-    if(is_tag_readonly(idx)) {
+    if((idx = tag_resolve(idx)) < 0) {
+        result = idx;
+    } else if(is_tag_readonly(idx)) {
         result =  ERR_READONLY;
     } else {
         result = tag_mask_write(msg->fd, idx, offset, data, mask, size);
     }
     if(result) {
-        _message_send(msg->fd, MSG_TAG_MWRITE, &result, sizeof(result), ERROR);
+        _message_send(msg, MSG_TAG_MWRITE, &result, sizeof(result), ERROR);
         dax_log(DAX_LOG_ERROR, "Unable to write tag 0x%X with size %d: result %d", idx, size, result);
     } else {
         map_check(idx, offset, size);
-        _message_send(msg->fd, MSG_TAG_MWRITE, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_TAG_MWRITE, NULL, 0, RESPONSE);
     }
     return 0;
 }
 
+/* Several writes in one message.  The message starts with the number of
+ * writes and each write is the tag index, the offset and the size followed
+ * by the data.  The mappings are checked once for each piece of a tag that
+ * was written after all the writes are done. */
+int
+msg_tag_write_batch(dax_srv_message *msg)
+{
+    tag_write_item sitems[32];
+    tag_write_item *items = sitems;
+    uint32_t count, n, pos;
+    int result = 0, ranges = 0;
+
+    if(msg->size < sizeof(uint32_t)) {
+        result = ERR_MSG_BAD;
+    } else {
+        count = *((uint32_t *)&msg->data[0]);
+        /* Every write takes at least the header so this keeps a bad count
+         * from making us allocate too much */
+        if(count > (msg->size - sizeof(uint32_t)) / BWRITE_ITEM_HEADER_SIZE) {
+            result = ERR_MSG_BAD;
+        } else if(count > sizeof(sitems) / sizeof(tag_write_item)) {
+            items = malloc(sizeof(tag_write_item) * count);
+            if(items == NULL) result = ERR_ALLOC;
+        }
+    }
+    pos = sizeof(uint32_t);
+    for(n = 0; result == 0 && n < count; n++) {
+        if(msg->size - pos < BWRITE_ITEM_HEADER_SIZE) {
+            result = ERR_MSG_BAD;
+            break;
+        }
+        /* The writes are packed so these may not be aligned */
+        memcpy(&items[n].idx, &msg->data[pos], 4);
+        memcpy(&items[n].offset, &msg->data[pos + 4], 4);
+        memcpy(&items[n].size, &msg->data[pos + 8], 4);
+        pos += BWRITE_ITEM_HEADER_SIZE;
+        if(items[n].size > msg->size - pos) {
+            result = ERR_MSG_BAD;
+        } else if((items[n].idx = tag_resolve(items[n].idx)) < 0) {
+            result = items[n].idx;
+        } else if(is_tag_readonly(items[n].idx) && ! is_tag_owned(msg->fd, items[n].idx)) {
+            result = ERR_READONLY;
+        }
+        items[n].data = &msg->data[pos];
+        pos += items[n].size;
+    }
+    dax_log(DAX_LOG_MSG, "Tag Batch Write Message from module %d, count %d", msg->fd, result ? 0 : count);
+    if(result == 0) {
+        ranges = count;
+        result = tag_write_batch(msg->fd, items, &ranges);
+    }
+    /* Whatever was written before an error still has to be mapped */
+    for(n = 0; n < ranges; n++) {
+        map_check(items[n].idx, items[n].offset, items[n].size);
+    }
+    if(result < 0) {
+        _message_send(msg, MSG_TAG_BWRITE, &result, sizeof(result), ERROR);
+        dax_log(DAX_LOG_ERROR, "Unable to write tag batch: result %d", result);
+    } else {
+        _message_send(msg, MSG_TAG_BWRITE, NULL, 0, RESPONSE);
+    }
+    if(items != sitems) free(items);
+    return 0;
+}
 
 int
-msg_evnt_add(dax_message *msg)
+msg_evnt_add(dax_srv_message *msg)
 {
     tag_handle h;
     void *data = NULL;
@@ -634,21 +1282,22 @@ msg_evnt_add(dax_message *msg)
         h.bit = msg->data[24];
         data = (void *)&msg->data[25];
         dax_log(DAX_LOG_MSG, "Add Event Message from %d - Index = %d, Count = %d, Type = %d", msg->fd, h.index, h.count, event_type);
-        event_id = event_add(h, event_type, data, module);
+        h.index = tag_resolve(h.index);
+        event_id = h.index < 0 ? h.index : event_add(h, event_type, data, module);
     }
 
     if(event_id < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_EVNT_ADD, &event_id, sizeof(dax_dint), ERROR);
+        _message_send(msg, MSG_EVNT_ADD, &event_id, sizeof(dax_dint), ERROR);
     } else {
-        _message_send(msg->fd, MSG_EVNT_ADD, &event_id, sizeof(dax_dint), RESPONSE);
+        _message_send(msg, MSG_EVNT_ADD, &event_id, sizeof(dax_dint), RESPONSE);
     }
     return 0;
 }
 
 int
-msg_evnt_del(dax_message *msg)
+msg_evnt_del(dax_srv_message *msg)
 {
-    tag_index idx;
+    tag_index idx, slot;
     uint32_t id;
     int result;
     dax_module *module;
@@ -659,26 +1308,30 @@ msg_evnt_del(dax_message *msg)
 
     dax_log(DAX_LOG_MSG, "Event Delete Message from %d", msg->fd);
 
-    result = event_del(idx, id, module);
+    slot = tag_resolve(idx);
+    result = slot < 0 ? slot : event_del(slot, id, module);
 
-    if(idx >= 0) {
-        _message_send(msg->fd, MSG_EVNT_DEL, &idx, 8, RESPONSE);
+    if(slot >= 0) {
+        _message_send(msg, MSG_EVNT_DEL, &idx, 8, RESPONSE);
     } else {
-        _message_send(msg->fd, MSG_EVNT_DEL, &result, sizeof(result), ERROR);
+        _message_send(msg, MSG_EVNT_DEL, &result, sizeof(result), ERROR);
     }
     return 0;
 }
 
 int
-msg_evnt_get(dax_message *msg)
+msg_evnt_get(dax_srv_message *msg)
 {
+    int result = ERR_NOTIMPLEMENTED;
+
+    _message_send(msg, MSG_EVNT_GET, &result, sizeof(result), ERROR);
     return 0;
 }
 
 int
-msg_evnt_opt(dax_message *msg)
+msg_evnt_opt(dax_srv_message *msg)
 {
-    tag_index idx;
+    tag_index idx, slot;
     uint32_t id, options;
     int result;
     dax_module *module;
@@ -690,19 +1343,20 @@ msg_evnt_opt(dax_message *msg)
 
     dax_log(DAX_LOG_MSG, "Event Set Option Message from %d", msg->fd);
 
-    result = event_opt(idx, id, options, module);
+    slot = tag_resolve(idx);
+    result = slot < 0 ? slot : event_opt(slot, id, options, module);
 
-    if(idx >= 0) {
-        _message_send(msg->fd, MSG_EVNT_OPT, &idx, 8, RESPONSE);
+    if(slot >= 0) {
+        _message_send(msg, MSG_EVNT_OPT, &idx, 8, RESPONSE);
     } else {
-        _message_send(msg->fd, MSG_EVNT_OPT, &result, sizeof(result), ERROR);
+        _message_send(msg, MSG_EVNT_OPT, &result, sizeof(result), ERROR);
     }
     return 0;
 }
 
 
 int
-msg_cdt_create(dax_message *msg)
+msg_cdt_create(dax_srv_message *msg)
 {
     int result;
     tag_type type;
@@ -712,16 +1366,16 @@ msg_cdt_create(dax_message *msg)
     dax_log(DAX_LOG_MSG, "Create CDT message name = '%s' type = 0x%X", msg->data, type);
 
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_CDT_CREATE, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_CDT_CREATE, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_CDT_CREATE, &type, sizeof(tag_type), RESPONSE);
+        _message_send(msg, MSG_CDT_CREATE, &type, sizeof(tag_type), RESPONSE);
     }
     return 0;
 }
 
 
 int
-msg_cdt_get(dax_message *msg)
+msg_cdt_get(dax_srv_message *msg)
 {
     int result, size;
     unsigned char subcommand;
@@ -759,9 +1413,9 @@ msg_cdt_get(dax_message *msg)
         }
     }
     if(result) {
-        _message_send(msg->fd, MSG_CDT_GET, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_CDT_GET, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_CDT_GET, data, size + 4, RESPONSE);
+        _message_send(msg, MSG_CDT_GET, data, size + 4, RESPONSE);
     }
 
     if(data) free(data);
@@ -769,7 +1423,7 @@ msg_cdt_get(dax_message *msg)
     return 0;
 }
 
-int msg_map_add(dax_message *msg)
+int msg_map_add(dax_srv_message *msg)
 {
     int id;
     tag_handle src, dest;
@@ -788,19 +1442,27 @@ int msg_map_add(dax_message *msg)
     dest.size = *(dax_udint *)&msg->data[34];
     dest.type = *(dax_dint *)&msg->data[38];
 
-    id = map_add(src, dest);
     dax_log(DAX_LOG_MSG, "Create map from %d to %d", src.index, dest.index);
+    src.index = tag_resolve(src.index);
+    dest.index = tag_resolve(dest.index);
+    if(src.index < 0) {
+        id = src.index;
+    } else if(dest.index < 0) {
+        id = dest.index;
+    } else {
+        id = map_add(src, dest);
+    }
 
     if(id < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_MAP_ADD, &id, sizeof(int), ERROR);
+        _message_send(msg, MSG_MAP_ADD, &id, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_MAP_ADD, &id, sizeof(int), RESPONSE);
+        _message_send(msg, MSG_MAP_ADD, &id, sizeof(int), RESPONSE);
     }
     return 0;
 }
 
 int
-msg_map_del(dax_message *msg)
+msg_map_del(dax_srv_message *msg)
 {
     int result;
     dax_id id;
@@ -810,16 +1472,17 @@ msg_map_del(dax_message *msg)
 
     dax_log(DAX_LOG_MSG, "Map Delete Message received index=%d, id=%d", id.index, id.id);
 
-    result = map_del(id.index, id.id);
+    id.index = tag_resolve(id.index);
+    result = id.index < 0 ? id.index : map_del(id.index, id.id);
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_MAP_DEL, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_MAP_DEL, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_MAP_DEL, &result, sizeof(int), RESPONSE);
+        _message_send(msg, MSG_MAP_DEL, &result, sizeof(int), RESPONSE);
     }
-    return result;
+    return 0;
 }
 
-int msg_map_get(dax_message *msg)
+int msg_map_get(dax_srv_message *msg)
 {
     int result;
     dax_id id;
@@ -831,7 +1494,12 @@ int msg_map_get(dax_message *msg)
 
     dax_log(DAX_LOG_MSG, "Map Get Message received index=%d, id=%d", id.index, id.id);
 
-    result = map_get(&src, &dest, id.index, id.id);
+    id.index = tag_resolve(id.index);
+    result = id.index < 0 ? id.index : map_get(&src, &dest, id.index, id.id);
+    if(result >= 0) {
+        src.index = tag_extern(src.index);
+        dest.index = tag_extern(dest.index);
+    }
 
     *(dax_dint *)buff = src.index;
     *(dax_dint *)&buff[4] = src.byte;
@@ -847,110 +1515,153 @@ int msg_map_get(dax_message *msg)
     *(dax_dint *)&buff[38] = dest.type;
 
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_MAP_GET, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_MAP_GET, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_MAP_GET, &buff, sizeof(tag_handle) * 2, RESPONSE);
+        _message_send(msg, MSG_MAP_GET, &buff, sizeof(tag_handle) * 2, RESPONSE);
     }
-    return result;
+    return 0;
 }
 
 int
-msg_group_add(dax_message *msg) {
+msg_group_add(dax_srv_message *msg) {
     dax_module *mod;
     int id;
-    uint8_t count; //, options;
+    uint32_t count;
+    uint8_t options, flags;
 
     mod = module_find_fd(msg->fd);
-    count = msg->data[0];
-    //options = msg->data[1]; /* Might use this in the future to indicate maskable groups */
-    id = group_add(mod, (uint8_t *)&msg->data[2], count);
+    if(mod == NULL) { /* Only registered modules have groups */
+        id = ERR_NO_INIT;
+        _message_send(msg, MSG_GRP_ADD, &id, sizeof(int), ERROR);
+        return 0;
+    }
+    flags = 0;
+    if(msg->size < GRP_ADD_HEADER_SIZE) {
+        id = ERR_MSG_BAD;
+    } else {
+        memcpy(&count, &msg->data[0], 4);
+        options = msg->data[4];
+        flags = msg->data[5];
+        if(count > (msg->size - GRP_ADD_HEADER_SIZE) / GRP_HANDLE_SIZE) {
+            id = ERR_MSG_BAD;
+        } else {
+            id = group_add_part(mod, (uint8_t *)&msg->data[GRP_ADD_HEADER_SIZE], count, options, flags);
+        }
+    }
 
     if(id < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_GRP_ADD, &id, sizeof(int), ERROR);
+        _message_send(msg, MSG_GRP_ADD, &id, sizeof(int), ERROR);
         dax_log(DAX_LOG_MSGERR, "Group Add Message for %s Returning Error %d",mod->name, id);
+    } else if(flags & GRP_XFER_MORE) {
+        _message_send(msg, MSG_GRP_ADD, NULL, 0, RESPONSE);
     } else {
-        _message_send(msg->fd, MSG_GRP_ADD, &id, sizeof(int), RESPONSE);
+        _message_send(msg, MSG_GRP_ADD, &id, sizeof(int), RESPONSE);
         dax_log(DAX_LOG_MSG, "Group Add Message for %s", mod->name);
     }
     return 0;
 }
 
 int
-msg_group_del(dax_message *msg) {
+msg_group_del(dax_srv_message *msg) {
     int result;
     dax_module *mod;
     uint32_t index;
 
     mod = module_find_fd(msg->fd);
+    if(mod == NULL) { /* Only registered modules have groups */
+        result = ERR_NO_INIT;
+        _message_send(msg, MSG_GRP_DEL, &result, sizeof(int), ERROR);
+        return 0;
+    }
     memcpy(&index, &msg->data[0], 4);
     result = group_del(mod, index);
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_GRP_DEL, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_GRP_DEL, &result, sizeof(int), ERROR);
         dax_log(DAX_LOG_MSGERR, "Group Delete Message for %s Returning Error %d",mod->name, result);
      } else {
-        _message_send(msg->fd, MSG_GRP_DEL, &result, sizeof(int), RESPONSE);
+        _message_send(msg, MSG_GRP_DEL, &result, sizeof(int), RESPONSE);
         dax_log(DAX_LOG_MSG, "Group Delete Message for %s", mod->name);
     }
     return 0;
 }
 
 int
-msg_group_read(dax_message *msg) {
+msg_group_read(dax_srv_message *msg) {
     dax_module *mod;
     int result;
-    uint32_t index;
+    uint32_t index, offset = 0;
+    uint8_t flags = 0;
     uint8_t buff[MSG_TAG_GROUP_DATA_SIZE];
+    uint8_t *data;
 
     mod = module_find_fd(msg->fd);
+    if(mod == NULL) { /* Only registered modules have groups */
+        result = ERR_NO_INIT;
+        _message_send(msg, MSG_GRP_READ, &result, sizeof(int), ERROR);
+        return 0;
+    }
     memcpy(&index, &msg->data[0], 4);
-    result = group_read(mod, index, buff, MSG_TAG_GROUP_DATA_SIZE);
+    if(msg->size > 4) flags = msg->data[4];
+    if(msg->size >= GRP_READ_HEADER_SIZE) memcpy(&offset, &msg->data[5], 4);
+    result = group_read_part(mod, index, offset, flags & GRP_READ_FULL, buff, sizeof(buff),
+                             mod->msgmax - MSG_HDR_SIZE, &data);
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_GRP_READ, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_GRP_READ, &result, sizeof(int), ERROR);
         dax_log(DAX_LOG_MSGERR, "Group Read Message for %s Returning Error %d",mod->name, result);
     } else {
-        _message_send(msg->fd, MSG_GRP_READ, buff, result, RESPONSE);
+        _message_send(msg, MSG_GRP_READ, data, result, RESPONSE);
         dax_log(DAX_LOG_MSG, "Group Read Message for %s", mod->name);
     }
     return 0;
 }
 
 int
-msg_group_write(dax_message *msg) {
+msg_group_write(dax_srv_message *msg) {
     dax_module *mod;
     int result;
-    uint32_t index;
+    uint32_t index, offset;
 
     mod = module_find_fd(msg->fd);
-    memcpy(&index, &msg->data[0], 4);
-
-    result = group_write(mod, index, (uint8_t *)&msg->data[4]);
+    if(mod == NULL) { /* Only registered modules have groups */
+        result = ERR_NO_INIT;
+        _message_send(msg, MSG_GRP_WRITE, &result, sizeof(int), ERROR);
+        return 0;
+    }
+    if(msg->size < GRP_WRITE_HEADER_SIZE) {
+        result = ERR_MSG_BAD;
+    } else {
+        memcpy(&index, &msg->data[0], 4);
+        memcpy(&offset, &msg->data[4], 4);
+        result = group_write_part(mod, index, offset, (uint8_t *)&msg->data[GRP_WRITE_HEADER_SIZE],
+                                  msg->size - GRP_WRITE_HEADER_SIZE);
+    }
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_GRP_WRITE, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_GRP_WRITE, &result, sizeof(int), ERROR);
         dax_log(DAX_LOG_MSGERR, "Group Write Message for %s Returning Error %d",mod->name, result);
     } else {
-        _message_send(msg->fd, MSG_GRP_WRITE, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_GRP_WRITE, NULL, 0, RESPONSE);
         dax_log(DAX_LOG_MSG, "Group Write Message for %s", mod->name);
     }
     return 0;
 }
 
 int
-msg_group_mask_write(dax_message *msg) {
+msg_group_mask_write(dax_srv_message *msg) {
     int result;
 
     result = ERR_NOTIMPLEMENTED;
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_GRP_MWRITE, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_GRP_MWRITE, &result, sizeof(int), ERROR);
         //dax_log(LOG_MSGERR, "Group Masked Write Message for %s Returning Error %d",mod->name, result);
     } else {
-        _message_send(msg->fd, MSG_GRP_MWRITE, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_GRP_MWRITE, NULL, 0, RESPONSE);
         //dax_log(LOG_MSG, "Group Masked Write Message for %s", mod->name);
     }
     return 0;
 }
 
 int
-msg_atomic_op(dax_message *msg) {
+msg_atomic_op(dax_srv_message *msg) {
     int result;
     tag_handle h;
     uint16_t operation;
@@ -964,22 +1675,24 @@ msg_atomic_op(dax_message *msg) {
     h.size = msg->size - 21; /* Total message size minus the above data */
 
     dax_log(DAX_LOG_MSG, "Atomic Operation Message from module %d, index %d, offset %d, size %d", msg->fd, h.index, h.byte, h.size);
-    if(is_tag_readonly(h.index) && ! is_tag_owned(msg->fd, h.index)) {
+    if((h.index = tag_resolve(h.index)) < 0) {
+        result = h.index;
+    } else if(is_tag_readonly(h.index) && ! is_tag_owned(msg->fd, h.index)) {
         result = ERR_READONLY;
     } else {
         result = atomic_op(h, &msg->data[21], operation);
     }
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_ATOMIC_OP, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_ATOMIC_OP, &result, sizeof(int), ERROR);
     } else {
         map_check(h.index, h.byte, h.size);
-        _message_send(msg->fd, MSG_ATOMIC_OP, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_ATOMIC_OP, NULL, 0, RESPONSE);
     }
     return 0;
 }
 
 int
-msg_add_override(dax_message *msg) {
+msg_add_override(dax_srv_message *msg) {
     int result, size;
     dax_dint index, byte;
 
@@ -988,35 +1701,37 @@ msg_add_override(dax_message *msg) {
     size = (msg->size - 12) / 2;
     dax_log(DAX_LOG_MSG, "Add Override Message from module %d, index %d, offset %d, size %d", msg->fd, index, byte, size);
 
-    result = override_add(index, byte, &msg->data[12], &msg->data[12+size], size);
+    index = tag_resolve(index);
+    result = index < 0 ? index : override_add(index, byte, &msg->data[12], &msg->data[12+size], size);
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_ADD_OVRD, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_ADD_OVRD, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_ADD_OVRD, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_ADD_OVRD, NULL, 0, RESPONSE);
     }
     //printf("Message Add Override\n");
     return 0;
 }
 
 int
-msg_del_override(dax_message *msg) {
+msg_del_override(dax_srv_message *msg) {
     int result, size;
     dax_dint index, byte;
 
     index = *((tag_index *)&msg->data[0]);
     byte = *((uint32_t *)&msg->data[4]);
     size = (msg->size - 8);
-    result = override_del(index, byte, &msg->data[8], size);
+    index = tag_resolve(index);
+    result = index < 0 ? index : override_del(index, byte, &msg->data[8], size);
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_DEL_OVRD, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_DEL_OVRD, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_DEL_OVRD, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_DEL_OVRD, NULL, 0, RESPONSE);
     }
     return 0;
 }
 
 int
-msg_get_override(dax_message *msg) {
+msg_get_override(dax_srv_message *msg) {
     int result, size;
     dax_dint index, byte;
     uint8_t buff[MSG_DATA_SIZE];
@@ -1026,19 +1741,20 @@ msg_get_override(dax_message *msg) {
     size = *((uint32_t *)&msg->data[8]);
     dax_log(DAX_LOG_MSG, "Get Override Message from module %d, index %d, byte %d, size %d", msg->fd, index, byte, size);
 
-    result = override_get(index, byte, size, buff, &buff[size]);
+    index = tag_resolve(index);
+    result = index < 0 ? index : override_get(index, byte, size, buff, &buff[size]);
 
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_GET_OVRD, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_GET_OVRD, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_GET_OVRD, buff, size * 2, RESPONSE);
+        _message_send(msg, MSG_GET_OVRD, buff, size * 2, RESPONSE);
     }
     return 0;
 
 }
 
 int
-msg_set_override(dax_message *msg) {
+msg_set_override(dax_srv_message *msg) {
     int result;
     dax_dint index;
     uint8_t flag;
@@ -1047,11 +1763,12 @@ msg_set_override(dax_message *msg) {
     flag = *((uint32_t *)&msg->data[4]);
     dax_log(DAX_LOG_MSG, "Set Override Message from module %d, index %d", msg->fd, index);
 
-    result = override_set(index, flag);
+    index = tag_resolve(index);
+    result = index < 0 ? index : override_set(index, flag);
     if(result < 0) { /* Send Error */
-        _message_send(msg->fd, MSG_SET_OVRD, &result, sizeof(int), ERROR);
+        _message_send(msg, MSG_SET_OVRD, &result, sizeof(int), ERROR);
     } else {
-        _message_send(msg->fd, MSG_SET_OVRD, NULL, 0, RESPONSE);
+        _message_send(msg, MSG_SET_OVRD, NULL, 0, RESPONSE);
     }
     return 0;
 }
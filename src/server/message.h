@@ -27,6 +27,19 @@
 #include "daxtypes.h"
 #include <opendax.h>
 
+/* This is the server's view of a message that has been received.  The
+ * data pointer points directly into the receive buffer for the connection
+ * so that the handlers can work on the payload without copying it.  The
+ * payload is always followed by a NULL byte so that strings at the end of
+ * the message are terminated. */
+typedef struct dax_srv_message_t {
+    uint32_t size;      /* size of the data sent */
+    uint32_t msg_type;  /* Which function to call */
+    uint32_t reqid;     /* Request id bits that go back in the response */
+    int fd;             /* We'll use the fd to identify the module*/
+    char *data;         /* Main data payload */
+} dax_srv_message;
+
 /* message.c functions */
 int msg_setup(void);
 void msg_destroy(void);
@@ -34,11 +47,11 @@ int msg_receive(void);
 void msg_add_fd(int);
 void msg_del_fd(int);
 int msg_dispatcher(int, unsigned char *);
+uint32_t msg_conn_max(int fd);
 
 /* buffer.c functions */
 int buff_initialize(void);
 int buff_read(int fd);
-void buff_wipe(void);
 void buff_free(int);
 void buff_freeall(void);
 
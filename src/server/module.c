@@ -115,9 +115,11 @@ module_add(char *name, unsigned int flags)
         new->flags = flags;
 
         new->fd = 0;
+        new->msgmax = DAX_MSGMAX;
         new->event_count = 0;
         new->tag_groups = NULL;
         new->groups_size = 0;
+        bzero(&new->xfer, sizeof(group_xfer));
 
         /* name the module */
         new->name = strdup(name);
@@ -298,6 +300,8 @@ module_unregister(int fd)
     mod = _get_module_fd(fd);
     if(mod != NULL) {
         dax_log(DAX_LOG_MAJOR,"Removing module '%s' at file descriptor %d", mod->name, fd);
+        /* It doesn't need to hear about the tags that we delete here */
+        mod->flags &= ~MFLAG_NOTIFY;
         events_cleanup(mod);
         groups_cleanup(mod);
         /* This deletes any tag that is owned by this module. */
@@ -330,3 +334,27 @@ module_find_fd(int fd)
     } while(_current_mod != last);
     return NULL;
 }
+
+/* Tells every module that asked for it that the tag at idx was changed or
+ * deleted so that it can drop the tag from its cache.  idx is the index
+ * that the modules see. */
+void
+module_notify_tag(tag_index idx)
+{
+    dax_module *mod;
+    uint32_t msg[3];
+
+    if(_current_mod == NULL) return;
+    msg[0] = htonl(sizeof(uint32_t)); /* The size that we send */
+    msg[1] = htonl(MSG_NOTIFY | NOTIFY_TAG);
+    msg[2] = htonl(idx);
+    mod = _current_mod;
+    do {
+        if(mod->flags & MFLAG_NOTIFY) {
+            if(xwrite(mod->fd, msg, sizeof(msg)) < 0) {
+                dax_log(DAX_LOG_ERROR, "module_notify_tag: %s", strerror(errno));
+            }
+        }
+        mod = mod->next;
+    } while(mod != _current_mod);
+}
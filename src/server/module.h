@@ -38,6 +38,7 @@ dax_module *module_register(char *name, uint32_t timeout, int fd);
 dax_module *event_register(uint32_t mid , int fd);
 void module_unregister(pid_t pid);
 dax_module *module_find_fd(int fd);
+void module_notify_tag(tag_index idx);
 
 
 #ifdef DEBUG
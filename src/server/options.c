@@ -37,12 +37,24 @@ static struct in_addr _serverip;
 static unsigned int _serverport;
 static char *_mod_tag_exclude;
 static int _min_buffers;
+static int _msg_timeout;
+static int _workers;
+static int _max_frame;
+static int _shm_size;
+static int _retain_interval;
+static char *_retain_backend;
 
 
 /* Initialize the configuration to NULL or 0 for cleanliness */
 static void initconfig(void) {
 
     _min_buffers = 0;
+    _msg_timeout = 0;
+    _workers = -1;
+    _max_frame = 0;
+    _shm_size = -1;
+    _retain_interval = -1;
+    _retain_backend = NULL;
     _socketname = NULL;
     _serverip.s_addr = 0;
     _serverport = 0;
@@ -55,6 +67,16 @@ static void
 setdefaults(void)
 {
     if(!_min_buffers) _min_buffers = DEFAULT_MIN_BUFFERS;
+    if(_msg_timeout <= 0) _msg_timeout = DEFAULT_MSG_TIMEOUT;
+    if(_workers < 0) _workers = 0;
+    if(_workers > MAX_WORKERS) _workers = MAX_WORKERS;
+    if(_max_frame <= 0) _max_frame = DEFAULT_MAX_FRAME;
+    if(_max_frame < DAX_MSGMAX) _max_frame = DAX_MSGMAX;
+    if(_max_frame > DAX_FRAMEMAX) _max_frame = DAX_FRAMEMAX;
+    if(_shm_size < 0) _shm_size = DEFAULT_SHM_SIZE;
+    if(_shm_size > MAX_SHM_SIZE) _shm_size = MAX_SHM_SIZE;
+    if(_retain_interval < 0) _retain_interval = DEFAULT_RETAIN_INTERVAL;
+    if(_retain_interval > MAX_RETAIN_INTERVAL) _retain_interval = MAX_RETAIN_INTERVAL;
     if(!_socketname) _socketname = strdup("/tmp/opendax");
     if(!_serverport) _serverport = DEFAULT_PORT;
     if(!_serverip.s_addr) inet_aton("0.0.0.0", &_serverip);
@@ -74,13 +96,19 @@ parsecommandline(int argc, const char *argv[])
         {"serverip", required_argument, 0, 'I'},
         {"serverport", required_argument, 0, 'P'},
         {"mod-tag-exclude", required_argument, 0, 'X'},
+        {"msg-timeout", required_argument, 0, 'M'},
+        {"workers", required_argument, 0, 'W'},
+        {"max-frame", required_argument, 0, 'F'},
+        {"shm-size", required_argument, 0, 'D'},
+        {"retain-interval", required_argument, 0, 'R'},
+        {"retain-backend", required_argument, 0, 'B'},
         {"version", no_argument, 0, 'V'},
         {"verbose", no_argument, 0, 'v'},
         {0, 0, 0, 0}
     };
 
 /* Get the command line arguments */
-    while ((c = getopt_long (argc, (char * const *)argv, "C:K:S:I:P:X:Vv", options, NULL)) != -1) {
+    while ((c = getopt_long (argc, (char * const *)argv, "C:K:S:I:P:X:M:W:F:D:R:B:Vv", options, NULL)) != -1) {
         switch (c) {
         case 'C':
             _configfile = strdup(optarg);
@@ -102,6 +130,24 @@ parsecommandline(int argc, const char *argv[])
         case 'X':
             _mod_tag_exclude=strdup(optarg);
             break;
+        case 'M':
+            _msg_timeout = strtol(optarg, NULL, 0);
+            break;
+        case 'W':
+            _workers = strtol(optarg, NULL, 0);
+            break;
+        case 'F':
+            _max_frame = strtol(optarg, NULL, 0);
+            break;
+        case 'D':
+            _shm_size = strtol(optarg, NULL, 0);
+            break;
+        case 'R':
+            _retain_interval = strtol(optarg, NULL, 0);
+            break;
+        case 'B':
+            _retain_backend = strdup(optarg);
+            break;
         case 'V':
             printf("%s Version %s\n", PACKAGE, VERSION);
             exit(0);
@@ -165,6 +211,43 @@ readconfigfile(void)
     }
     lua_pop(L, 1);
 
+    lua_getglobal(L, "msg_timeout");
+    if(_msg_timeout == 0) { /* Make sure we didn't get anything on the commandline */
+        _msg_timeout = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "workers");
+    if(_workers < 0 && lua_isnumber(L, -1)) { /* Make sure we didn't get anything on the commandline */
+        _workers = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "max_frame");
+    if(_max_frame == 0) { /* Make sure we didn't get anything on the commandline */
+        _max_frame = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "shm_size");
+    if(_shm_size < 0 && lua_isnumber(L, -1)) { /* Make sure we didn't get anything on the commandline */
+        _shm_size = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "retain_interval");
+    if(_retain_interval < 0 && lua_isnumber(L, -1)) { /* Make sure we didn't get anything on the commandline */
+        _retain_interval = (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "retain_backend");
+    if(_retain_backend == NULL) { /* Make sure we didn't get anything on the commandline */
+        c = (char *)lua_tostring(L, -1);
+        if(c) _retain_backend = strdup(c);
+    }
+    lua_pop(L, 1);
+
     lua_getglobal(L, "socketname");
     if(_socketname == NULL) {
         c = (char *)lua_tostring(L, -1);
@@ -251,3 +334,38 @@ opt_min_buffers(void)
     return _min_buffers;
 }
 
+int
+opt_msg_timeout(void)
+{
+    return _msg_timeout;
+}
+
+int
+opt_workers(void)
+{
+    return _workers;
+}
+
+int
+opt_max_frame(void)
+{
+    return _max_frame;
+}
+
+int
+opt_shm_size(void)
+{
+    return _shm_size;
+}
+
+int
+opt_retain_interval(void)
+{
+    return _retain_interval;
+}
+
+char *
+opt_retain_backend(void)
+{
+    return _retain_backend;
+}
@@ -28,12 +28,50 @@
 # define DEFAULT_PORT 7777
 #endif
 
-/* This is the default minimum number of communcation buffers that
-   will be allocated if none is specified in the configuration */
+/* This is the default number of spare communcation buffers that
+   will be kept allocated if none is specified in the configuration */
 #ifndef DEFAULT_MIN_BUFFERS
 #  define DEFAULT_MIN_BUFFERS 5
 #endif
 
+/* This is the default time in milliseconds that the message receive
+   loop will wait for activity before doing its idle housekeeping */
+#ifndef DEFAULT_MSG_TIMEOUT
+#  define DEFAULT_MSG_TIMEOUT 1000
+#endif
+
+/* The maximum number of message worker threads */
+#ifndef MAX_WORKERS
+#  define MAX_WORKERS 64
+#endif
+
+/* This is the default for the largest message frame that a module
+   can negotiate when it registers */
+#ifndef DEFAULT_MAX_FRAME
+#  define DEFAULT_MAX_FRAME (4 * 1024 * 1024)
+#endif
+
+/* This is the default size of the shared memory region that local
+   modules use to read tag data.  Zero disables the shared memory */
+#ifndef DEFAULT_SHM_SIZE
+#  define DEFAULT_SHM_SIZE (16 * 1024 * 1024)
+#endif
+
+/* This is the default time in milliseconds between writes of the
+   retained tag data to the retention file.  Zero writes the data
+   every time the tag is written */
+#ifndef DEFAULT_RETAIN_INTERVAL
+#  define DEFAULT_RETAIN_INTERVAL 1000
+#endif
+
+#ifndef MAX_RETAIN_INTERVAL
+#  define MAX_RETAIN_INTERVAL 60000
+#endif
+
+#ifndef MAX_SHM_SIZE
+#  define MAX_SHM_SIZE (1024 * 1024 * 1024)
+#endif
+
 int opt_configure(int argc, const char *argv[]);
 
 /* These functions return the configuration parameters */
@@ -41,8 +79,21 @@ char *opt_socketname(void);
 struct in_addr opt_serverip(void);
 unsigned int opt_serverport(void);
 char *opt_mod_tag_exclude(void);
-/* Minimum number of communication buffers to allocate */
+/* Number of spare communication buffers to keep allocated */
 int opt_min_buffers(void);
 int opt_start_timeout(void);
+/* Idle timeout of the message receive loop in milliseconds */
+int opt_msg_timeout(void);
+/* Number of message worker threads.  Zero means that messages are
+   handled in the receiving thread */
+int opt_workers(void);
+/* Largest message frame that a module can negotiate */
+int opt_max_frame(void);
+/* Size of the shared memory tag data region.  Zero means disabled */
+int opt_shm_size(void);
+/* Milliseconds between writes to the retention file.  Zero means every write */
+int opt_retain_interval(void);
+/* Name of the tag retention backend.  NULL means the default */
+char *opt_retain_backend(void);
 
 #endif /* !__OPTIONS_H */
@@ -22,301 +22,304 @@
 #include "retain.h"
 #include "func.h"
 #include "tagbase.h"
-#include <sys/stat.h>
-#include <fcntl.h>
-#ifdef HAVE_SQLITE
-#include <sqlite3.h>
-#endif
+#include <pthread.h>
 
 extern _dax_tag_db *_db;
 
-#ifdef HAVE_SQLITE
-static sqlite3 *_sql;
-static sqlite3_stmt *update_stmt;
+/* Notes:
+ * The code in this file decides when the retained data is written and the
+ * backend decides how it gets into the file.  There are two backends.  One
+ * keeps the tags in an SQLite database (retsqlite.c) and the other keeps
+ * them in a memory mapped file of our own (retmap.c).
+ *
+ * Writing to the file every time a retained tag is written would make
+ * every module wait on the disk.  Instead ret_tag_write() just remembers
+ * which bytes of the tag have changed and puts the tag on the dirty list.
+ * A background thread wakes up every 'interval' milliseconds, takes the
+ * dirty list, copies the changed bytes out of the tag data and hands them
+ * all to the backend between a single begin() and commit().
+ *
+ * If the server crashes we lose at most the writes from the last interval
+ * plus however long the flush itself takes.  ret_close() stops the thread
+ * and writes whatever is left.  An interval of zero goes back to writing
+ * the data to the file inside ret_tag_write().
+ */
 
-/* Create the types that are found in the retention database */
-static int
-_create_types(void) {
-    sqlite3_stmt *stmt;
-    int result, error;
-    char *name;
-    char *definition;
+/* A piece of a tag that is being written to the file by _flush() */
+typedef struct {
+    tag_index idx;
+    uint32_t pointer; /* The backend's ret_file_pointer for the tag */
+    int offset;
+    int size;
+    uint32_t data;    /* Where the bytes are in the flush buffer */
+} ret_chunk;
 
-    result = sqlite3_prepare_v2(_sql, "SELECT name,definition FROM types ORDER BY id;", -1, &stmt, NULL);
-    if(result != SQLITE_OK) {
-        /* Most errors are because we have a new file */
-        dax_log(DAX_LOG_ERROR, "Unable to compile SQL statement to create types");
-        sqlite3_finalize(stmt);
-        return result;
-    }
-    while((result = sqlite3_step(stmt)) == SQLITE_ROW) {
-        name = (char *)sqlite3_column_text(stmt, 0);
-        definition = (char *)sqlite3_column_text(stmt, 1);
-        result = cdt_create(definition, &error);
-        if(result == 0) {
-            dax_log(DAX_LOG_ERROR, "Problem creating datatype %s - %d", name, error);
-        }
+static ret_backend *_backends[] = {
+#ifdef HAVE_SQLITE
+    &ret_sqlite_backend,
+#endif
+    &ret_mmap_backend,
+    NULL
+};
+
+/* NULL until ret_init() has opened a file */
+static ret_backend *_backend;
+/* Protects the backend */
+static pthread_mutex_t _file_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Protects the dirty list and the dirty ranges in the tags.  Writes can
+ * come from any of the message worker threads */
+static pthread_mutex_t _ret_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _ret_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t _ret_thread;
+static int _thread_running;
+static int _quit;
+static int _interval;
+
+/* The list of tags that have been written since the last flush */
+static tag_index *_dirty;
+static int _dirty_count;
+static int _dirty_size;
+/* Only used by _flush() */
+static ret_chunk *_chunks;
+static int _chunk_size;
+static uint8_t *_buffer;
+static uint32_t _buffer_size;
+
+
+/* Makes sure that the flush arrays can hold count chunks and size bytes */
+static int
+_flush_grow(int count, uint32_t size)
+{
+    ret_chunk *new_chunks;
+    uint8_t *new_buffer;
+
+    if(count > _chunk_size) {
+        new_chunks = realloc(_chunks, sizeof(ret_chunk) * count);
+        if(new_chunks == NULL) return ERR_ALLOC;
+        _chunks = new_chunks;
+        _chunk_size = count;
     }
-    if(result != SQLITE_DONE) {
-        dax_log(DAX_LOG_ERROR, "Problem writing tags to database - %d", result);
-        sqlite3_finalize(stmt);
-        return result;
+    if(size > _buffer_size) {
+        new_buffer = realloc(_buffer, size);
+        if(new_buffer == NULL) return ERR_ALLOC;
+        _buffer = new_buffer;
+        _buffer_size = size;
     }
-    sqlite3_finalize(stmt);
     return 0;
 }
 
-/* Create the tags that we find in the database */
-static int
-_create_tags(void) {
-    sqlite3_stmt *stmt;
-    int result;
-    char *name;
-    char *type;
-    const void *data;
-    int count, size;
-    tag_index tag_index;
-
-
-    // CREATE ALL THE DATATYPES FIRST
-    result = sqlite3_prepare_v2(_sql, "SELECT name,type,count,data FROM tags;", -1, &stmt, NULL);
-    if(result != SQLITE_OK) {
-        /* Most errors are because we have a new file */
-        dax_log(DAX_LOG_ERROR, "Unable to compile SQL statement to create tags");
-        sqlite3_finalize(stmt);
-        return result;
+/* Writes all of the dirty data to the file.  This is only called by
+ * the retention thread and ret_close() */
+static void
+_flush(void)
+{
+    ret_chunk *chunk;
+    uint32_t total = 0;
+    int n, count = 0;
+
+    /* Keeps the tags from being deleted until their data is in the file.
+     * tag_del() holds the write lock when it calls ret_del_tag() so the
+     * file pointers that we use can't be given to some other tag. */
+    tag_db_rdlock();
+    pthread_mutex_lock(&_ret_lock);
+    if(_dirty_count == 0 || _flush_grow(_dirty_count, 0)) {
+        pthread_mutex_unlock(&_ret_lock);
+        tag_db_unlock();
+        return;
     }
-    while((result = sqlite3_step(stmt)) == SQLITE_ROW) {
-        name = (char *)sqlite3_column_text(stmt, 0);
-        type = (char *)sqlite3_column_text(stmt, 1);
-        count = sqlite3_column_int(stmt, 2);
-        data =  sqlite3_column_blob(stmt, 3);
-        size =  sqlite3_column_bytes(stmt, 3);
-
-        tag_index = tag_add(-1, name, cdt_get_type(type), count, 0);
-
-        if(tag_index < 0) {
-            dax_log(DAX_LOG_ERROR, "Retained tag not created properly");
-        } else {
-            memcpy(_db[tag_index].data, data, MIN(size, tag_get_size(tag_index)));
+    /* The tags are marked clean here so that any write after this puts
+     * them back on the list for the next flush */
+    for(n = 0; n < _dirty_count; n++) {
+        chunk = &_chunks[count];
+        chunk->idx = _dirty[n];
+        chunk->offset = _db[chunk->idx].ret_dirty_start;
+        chunk->size = _db[chunk->idx].ret_dirty_end - chunk->offset;
+        _db[chunk->idx].ret_dirty_end = 0;
+        if(chunk->size > 0) {
+            chunk->data = total;
+            total += chunk->size;
+            count++;
         }
     }
-    if(result != SQLITE_DONE) {
-        dax_log(DAX_LOG_ERROR, "Problem writing tags to database - %d", result);
-        sqlite3_finalize(stmt);
-        return result;
-    }
-    sqlite3_finalize(stmt);
-    return 0;
-}
-
-/* Create the databae tables */
-static int
-_create_database_tables(void) {
-    char *errormsg;
-    int result;
-    const char *query = "CREATE TABLE IF NOT EXISTS types (" \
-	                    "id     INTEGER PRIMARY KEY,"\
-	                    "name   TEXT NOT NULL UNIQUE," \
-                        "definition TEXT);" \
-                        "CREATE TABLE IF NOT EXISTS tags (" \
-	                    "id     INTEGER PRIMARY KEY AUTOINCREMENT," \
-	                    "name   TEXT NOT NULL UNIQUE," \
-	                    "type   TEXT NOT NULL," \
-	                    "count  INTEGER," \
-                        "data   BLOB);";
-    result = sqlite3_exec(_sql, query, NULL, 0 , &errormsg);
-    if(result != SQLITE_OK) {
-        dax_log(DAX_LOG_ERROR, "Unable to create tag retention database tables - %s", errormsg);
-        return result;
-    }
-    return 0;
-}
-
-static int
-_init(char *filename) {
-    int result;
-    char *errmsg;
+    _dirty_count = 0;
+    pthread_mutex_unlock(&_ret_lock);
 
-    dax_log(DAX_LOG_DEBUG, "Setting up SQLite Tag Retention - %s", filename);
-    result = sqlite3_open(filename, &_sql);
-    if(result != SQLITE_OK) {
-        dax_log(DAX_LOG_ERROR, "Unable to open tag retention database - %s", filename);
-        sqlite3_close(_sql);
-        _sql=NULL;
-        return result;
-    }
-    /* First we attempt to create data types and tags if they exist in the retention database
-       These may fail if the file doesn't exist but that's okay */
-    result = _create_types(); /* Creates the types that are stored in the data base */
-    result = _create_tags(); /* Creates the tags that are in the data base */
-    result = sqlite3_exec(_sql, "DROP TABLE IF EXISTS tags;", NULL, 0, &errmsg);
-    if(result != SQLITE_OK) {
-        DF("unable to drop table 'tags' - %s", errmsg);
+    if(_flush_grow(0, total)) {
+        dax_log(DAX_LOG_ERROR, "Unable to allocate memory to write retained tags");
+        tag_db_unlock();
+        return;
     }
-    result = sqlite3_exec(_sql, "DROP TABLE IF EXISTS types;", NULL, 0, &errmsg);
-    if(result != SQLITE_OK) {
-        DF("unable to drop table 'types' - %s", errmsg);
+    for(n = 0; n < count; n++) {
+        chunk = &_chunks[n];
+        chunk->pointer = _db[chunk->idx].ret_file_pointer;
+        if(tag_read_stored(chunk->idx, chunk->offset, &_buffer[chunk->data], chunk->size)) {
+            chunk->size = 0;
+        }
     }
-    result = _create_database_tables();
-    result = sqlite3_prepare_v2(_sql, "UPDATE tags SET data = ?1 WHERE id = ?2;", -1, &update_stmt, NULL);
-    if(result) {
-        DF("problem with prepare %d", result);
+
+    pthread_mutex_lock(&_file_lock);
+    if(_backend->begin() == 0) {
+        for(n = 0; n < count; n++) {
+            chunk = &_chunks[n];
+            if(chunk->size == 0) continue;
+            _backend->write(chunk->idx, chunk->pointer, chunk->offset, &_buffer[chunk->data], chunk->size);
+        }
+        _backend->commit();
     }
-    return 0;
+    pthread_mutex_unlock(&_file_lock);
+    tag_db_unlock();
 }
 
-int
-ret_init(char *filename) {
-    if(filename == NULL) {
-        filename = "retentive.db";
+static void *
+_ret_thread_func(void *arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&_ret_lock);
+    while(!_quit) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += _interval / 1000;
+        ts.tv_nsec += (_interval % 1000) * 1000000;
+        if(ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&_ret_cond, &_ret_lock, &ts);
+        if(_quit) break;
+        pthread_mutex_unlock(&_ret_lock);
+        _flush();
+        pthread_mutex_lock(&_ret_lock);
     }
-    return _init(filename);
+    pthread_mutex_unlock(&_ret_lock);
+    return NULL;
 }
 
+/* Opens the retention file with the backend named 'backend' and creates the
+ * tags that are in it.  If filename or backend are NULL the backend's
+ * default file and the first backend that we have are used.  'interval' is
+ * the time in milliseconds between writes to the file.  If it is zero the
+ * data is written every time the tag is written */
 int
-_add_type(tag_type type) {
-    datatype *dt;
-    cdt_member *next;
-    char *type_str;
-    sqlite3_stmt *stmt;
-    int index;
-    int result;
-    char query[256];
+ret_init(char *filename, char *backend, int interval) {
+    int n, result;
 
-    dt = cdt_get_entry(type);
-    index = CDT_TO_INDEX(type);
-
-    if(dt == NULL) {
-        dax_log(DAX_LOG_ERROR, "Bad type passed");
-    }
-    /* Loop through all the members and recursively add any
-       compound data types that we find */
-    next = dt->members;
-    while(next != NULL) {
-        if(IS_CUSTOM(next->type)) {
-            _add_type(next->type);
-        }
-        next = next->next;
+    for(n = 0; _backends[n] != NULL; n++) {
+        if(backend == NULL || strcasecmp(backend, _backends[n]->name) == 0) break;
     }
-    /* Turn the type into a string that we can use to reload it later */
-    serialize_datatype(type, &type_str);
-    if(_sql == NULL) return ERR_FILE_CLOSED;
-
-    snprintf(query, 256, "INSERT INTO main.types(id,name,definition) VALUES (%d,'%s',?);",index, dt->name);
-
-    result = sqlite3_prepare_v2(_sql, query, -1, &stmt , NULL);
-    if(result != SQLITE_OK) {
-        dax_log(DAX_LOG_ERROR, "Unable to create tag in retention ");
-        return result;
+    if(_backends[n] == NULL) {
+        dax_log(DAX_LOG_ERROR, "Unknown tag retention backend %s", backend);
+        return ERR_NOTFOUND;
     }
-    sqlite3_bind_text(stmt, 1, type_str, -1, NULL);
-    result = sqlite3_step(stmt);
-    if(result != SQLITE_DONE) {
-        dax_log(DAX_LOG_ERROR, "Problem inserting tag");
-        return -1;
+    result = _backends[n]->open(filename);
+    if(result) return result;
+    _backend = _backends[n];
+    dax_log(DAX_LOG_MINOR, "Tag retention using the %s backend", _backend->name);
+
+    _interval = interval;
+    if(_interval > 0) {
+        if(pthread_create(&_ret_thread, NULL, _ret_thread_func, NULL)) {
+            dax_log(DAX_LOG_ERROR, "Unable to start the tag retention thread, retained tags will be written immediately");
+            _interval = 0;
+        } else {
+            _thread_running = 1;
+        }
     }
-    sqlite3_finalize(stmt);
-
     return 0;
 }
 
 int
 ret_add_tag(int index) {
-    sqlite3_stmt *stmt;
-    int id;
     int result;
-    char query[256];
 
     dax_log(DAX_LOG_DEBUG, "Adding Retained Tag at index %d", index);
-    /* TODO: Implement retaining custom data type tags */
-    if(IS_CUSTOM(_db[index].type)) {
-        _add_type(_db[index].type);
-    }
-    if(_sql == NULL) return ERR_FILE_CLOSED;
-    snprintf(query, 256, "INSERT INTO main.tags(name,type,count,data) VALUES ('%s','%s',%d,NULL);",
-                         _db[index].name, cdt_get_name(_db[index].type), _db[index].count);
-
-    result = sqlite3_prepare_v2(_sql, query, -1, &stmt , NULL);
-    if(result != SQLITE_OK) {
-        dax_log(DAX_LOG_ERROR, "Unable to create tag in retention ");
-        return result;
-    }
-    result = sqlite3_step(stmt);
-    if(result == SQLITE_DONE) {
-        /* This might be a race condition if we ever multi thread the server */
-        id = sqlite3_last_insert_rowid(_sql);
-        _db[index].ret_file_pointer = id; /* We'll use this on tag writes */
-    } else {
-        dax_log(DAX_LOG_ERROR, "Problem inserting tag");
-        return -1;
-    }
-    sqlite3_finalize(stmt);
-    return 0;
+    if(_backend == NULL) return ERR_FILE_CLOSED;
+    pthread_mutex_lock(&_file_lock);
+    result = _backend->add_tag(index);
+    pthread_mutex_unlock(&_file_lock);
+    return result;
 }
 
 int
 ret_del_tag(int index) {
+    int result;
 
     dax_log(DAX_LOG_DEBUG, "Deleting Retained Tag at index %d", index);
-
-    return 0;
+    if(_backend == NULL) return ERR_FILE_CLOSED;
+    /* The tag stays on the dirty list but _flush() will skip it */
+    pthread_mutex_lock(&_ret_lock);
+    _db[index].ret_dirty_end = 0;
+    pthread_mutex_unlock(&_ret_lock);
+    pthread_mutex_lock(&_file_lock);
+    result = _backend->del_tag(index);
+    pthread_mutex_unlock(&_file_lock);
+    return result;
 }
 
+/* This is called whenever size bytes of the retained tag at index have been
+ * written starting at offset.  The caller holds the lock for the tag's data */
 int
-ret_tag_write(int index) {
-    int result;
-
-    result = sqlite3_bind_blob(update_stmt, 1, _db[index].data, type_size(_db[index].type) * _db[index].count, NULL);
-    if(result) {
-        DF("Problem with bind_blob %d", result);
+ret_tag_write(int index, int offset, int size) {
+    tag_index *new_dirty;
+    int newsize, result;
+
+    if(_backend == NULL) return ERR_FILE_CLOSED;
+    if(_interval == 0) {
+        pthread_mutex_lock(&_file_lock);
+        result = _backend->begin();
+        if(result == 0) {
+            result = _backend->write(index, _db[index].ret_file_pointer, offset, &_db[index].data[offset], size);
+            if(_backend->commit()) result = ERR_GENERIC;
+        }
+        pthread_mutex_unlock(&_file_lock);
+        return result;
     }
-    result = sqlite3_bind_int(update_stmt, 2, _db[index].ret_file_pointer);
-    if(result) {
-        DF("Problem with bind_int %d", result);
+
+    pthread_mutex_lock(&_ret_lock);
+    if(_db[index].ret_dirty_end == 0) {
+        if(_dirty_count == _dirty_size) {
+            newsize = _dirty_size ? _dirty_size * 2 : 64;
+            new_dirty = realloc(_dirty, sizeof(tag_index) * newsize);
+            if(new_dirty == NULL) {
+                pthread_mutex_unlock(&_ret_lock);
+                dax_log(DAX_LOG_ERROR, "Unable to allocate memory to retain tag %s", _db[index].name);
+                return ERR_ALLOC;
+            }
+            _dirty = new_dirty;
+            _dirty_size = newsize;
+        }
+        _dirty[_dirty_count++] = index;
+        _db[index].ret_dirty_start = offset;
+        _db[index].ret_dirty_end = offset + size;
+    } else {
+        _db[index].ret_dirty_start = MIN(_db[index].ret_dirty_start, offset);
+        _db[index].ret_dirty_end = MAX(_db[index].ret_dirty_end, offset + size);
     }
-    result = sqlite3_step(update_stmt);
-    result = sqlite3_reset(update_stmt);
+    pthread_mutex_unlock(&_ret_lock);
     return 0;
 }
 
+/* Stops the retention thread, writes whatever is left and closes the file */
 int
 ret_close(void) {
 
     dax_log(DAX_LOG_DEBUG, "Closing Tag Data Retention");
+    if(_thread_running) {
+        pthread_mutex_lock(&_ret_lock);
+        _quit = 1;
+        pthread_cond_signal(&_ret_cond);
+        pthread_mutex_unlock(&_ret_lock);
+        pthread_join(_ret_thread, NULL);
+        _thread_running = 0;
+    }
+    if(_backend != NULL) {
+        _flush();
+        pthread_mutex_lock(&_file_lock);
+        _backend->close();
+        _backend = NULL;
+        pthread_mutex_unlock(&_file_lock);
+    }
+    /* So that the retention can be started again */
+    _quit = 0;
+    _dirty_count = 0;
     return 0;
 }
-
-#else
-
-int
-ret_init(char *filename) {
-   dax_log(DAX_LOG_WARN, "No SQLite3 available so tag retention will not work");
-   return 0;
-}
-
-
-int
-ret_add_tag(int index) {
-    return 0;
-}
-
-
-int
-ret_del_tag(int index) {
-    return 0;
-}
-
-
-int
-ret_tag_write(int index) {
-    return 0;
-}
-
-
-int
-ret_close(void) {
-    return 0;
-}
-
-#endif /* HAVE_SQLITE */
\ No newline at end of file
@@ -22,12 +22,35 @@
 #ifndef __RETAIN_H
 #define __RETAIN_H
 
+#include "tagbase.h"
+
 #define RET_FLAG_DELETED 0x01
 
-int ret_init(char *filename);
+/* The functions that a tag retention backend has to supply.  The generic
+ * code in retain.c serializes all the calls with a single mutex.  The
+ * writes between begin() and commit() should all reach the file or none
+ * of them should.  'pointer' is whatever the backend stored in
+ * ret_file_pointer when the tag was added. */
+typedef struct {
+    char *name;
+    int (*open)(char *filename);
+    int (*add_tag)(tag_index index);
+    int (*del_tag)(tag_index index);
+    int (*begin)(void);
+    int (*write)(tag_index index, uint32_t pointer, int offset, const void *data, int size);
+    int (*commit)(void);
+    void (*close)(void);
+} ret_backend;
+
+#ifdef HAVE_SQLITE
+extern ret_backend ret_sqlite_backend;  /* retsqlite.c */
+#endif
+extern ret_backend ret_mmap_backend;    /* retmap.c */
+
+int ret_init(char *filename, char *backend, int interval);
 int ret_add_tag(int index);
 int ret_del_tag(int index);
-int ret_tag_write(int index);
+int ret_tag_write(int index, int offset, int size);
 int ret_close(void);
 
 
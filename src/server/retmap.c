@@ -0,0 +1,599 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  Tag retention backend that keeps the retained tags in a memory mapped
+ *  file of our own.
+ */
+
+#include <common.h>
+#include "retain.h"
+#include "retmap.h"
+#include "func.h"
+#include "tagbase.h"
+#include "shm.h"
+#include "crc.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* Notes:
+ * The retained tags are kept in a copy of the file's data that we call the
+ * image.  Restoring the tags at startup is just reading the image and
+ * creating the tags that are in it, and writing a tag is a memcpy() into
+ * the image that marks the page dirty.  Nothing goes to the disk until
+ * commit().
+ *
+ * Every page of the image has two slots in the file.  commit() writes each
+ * dirty page into the slot that isn't holding the current copy, stamped
+ * with the next generation number and a CRC, and calls msync().  Only
+ * after that is the header written with the new generation, into the
+ * header slot that the last commit didn't use, and synced again.  When the
+ * file is opened we take the good header with the highest generation and
+ * for every page the good slot with the highest generation that isn't
+ * newer than the header.  A crash anywhere in a commit leaves us with
+ * either all of the commit or none of it, and a page that has been torn or
+ * corrupted falls back to its older copy.
+ *
+ * Tags and types are appended to the image as records and deleting a tag
+ * only marks its record.  The space is taken back when the file is opened
+ * if enough of it is dead.
+ */
+
+/* Number of pages in a new file */
+#define RETMAP_START_PAGES 4
+#define RETMAP_ALIGN(x) (((x) + 7) & ~7)
+
+extern _dax_tag_db *_db;
+
+static int _fd = -1;
+static uint8_t *_map;           /* The whole file */
+static size_t _map_size;
+static uint32_t _page_count;
+static uint64_t _gen;           /* Generation of the last commit */
+static uint8_t *_image;
+static uint8_t *_active;        /* Slot that has the current copy of each page */
+static uint8_t *_page_dirty;
+static uint32_t *_dirty_list;
+static uint32_t _dirty_count;
+/* The custom types that are already in the image */
+static tag_type *_types;
+static int _type_count;
+static int _type_size;
+
+static inline uint8_t *
+_slot(uint32_t n)
+{
+    return &_map[(size_t)n * RETMAP_SLOT_SIZE];
+}
+
+static inline uint32_t
+_crc(const void *buff, int size)
+{
+    return (uint32_t)CRC32((const unsigned char *)buff, size);
+}
+
+static int
+_header_valid(retmap_header *h)
+{
+    return h->magic == RETMAP_MAGIC &&
+           h->version == RETMAP_VERSION &&
+           h->slot_size == RETMAP_SLOT_SIZE &&
+           h->crc == _crc(h, offsetof(retmap_header, crc));
+}
+
+/* Returns true if the slot holds a good copy of a page that was committed
+ * at or before generation 'gen' */
+static int
+_slot_valid(uint8_t *slot, uint64_t gen)
+{
+    retmap_trailer *t;
+
+    t = (retmap_trailer *)&slot[RETMAP_PAGE_DATA];
+    return t->magic == RETMAP_MAGIC && t->seq <= gen &&
+           t->crc == _crc(slot, RETMAP_SLOT_SIZE - sizeof(uint32_t));
+}
+
+static void
+_mark_dirty(uint32_t offset, uint32_t size)
+{
+    uint32_t page, last;
+
+    if(size == 0) return;
+    last = (offset + size - 1) / RETMAP_PAGE_DATA;
+    for(page = offset / RETMAP_PAGE_DATA; page <= last; page++) {
+        if(!_page_dirty[page]) {
+            _page_dirty[page] = 1;
+            _dirty_list[_dirty_count++] = page;
+        }
+    }
+}
+
+/* Sizes the file and all of our arrays for page_count pages.  The new slots
+ * in the file are all zero so none of them are valid until they are
+ * written */
+static int
+_resize(uint32_t page_count)
+{
+    size_t size;
+    uint8_t *new_map, *new_image, *new_active, *new_dirty;
+    uint32_t *new_list;
+
+    size = (size_t)RETMAP_PAGE_SLOT(page_count, 0) * RETMAP_SLOT_SIZE;
+    if(ftruncate(_fd, size)) {
+        dax_log(DAX_LOG_ERROR, "Unable to size the tag retention file - %s", strerror(errno));
+        return ERR_ALLOC;
+    }
+    new_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if(new_map == MAP_FAILED) {
+        dax_log(DAX_LOG_ERROR, "Unable to map the tag retention file - %s", strerror(errno));
+        return ERR_ALLOC;
+    }
+    new_image = realloc(_image, (size_t)page_count * RETMAP_PAGE_DATA);
+    if(new_image) _image = new_image;
+    new_active = realloc(_active, page_count);
+    if(new_active) _active = new_active;
+    new_dirty = realloc(_page_dirty, page_count);
+    if(new_dirty) _page_dirty = new_dirty;
+    new_list = realloc(_dirty_list, sizeof(uint32_t) * page_count);
+    if(new_list) _dirty_list = new_list;
+    if(new_image == NULL || new_active == NULL || new_dirty == NULL || new_list == NULL) {
+        munmap(new_map, size);
+        return ERR_ALLOC;
+    }
+    if(page_count > _page_count) {
+        bzero(&_image[(size_t)_page_count * RETMAP_PAGE_DATA], (size_t)(page_count - _page_count) * RETMAP_PAGE_DATA);
+        /* So the first write goes to slot 0 */
+        memset(&_active[_page_count], 1, page_count - _page_count);
+        bzero(&_page_dirty[_page_count], page_count - _page_count);
+    }
+    if(_map != NULL) munmap(_map, _map_size);
+    _map = new_map;
+    _map_size = size;
+    _page_count = page_count;
+    return 0;
+}
+
+/* Throws away whatever is in the file and starts a new empty image */
+static int
+_new_file(void)
+{
+    retmap_image *ih;
+    int result;
+
+    /* The old slots have to be gone or they might look newer than ours */
+    if(_map != NULL) {
+        munmap(_map, _map_size);
+        _map = NULL;
+    }
+    _page_count = 0;
+    _dirty_count = 0;
+    _gen = 0;
+    if(ftruncate(_fd, 0)) return ERR_GENERIC;
+    result = _resize(RETMAP_START_PAGES);
+    if(result) return result;
+    ih = (retmap_image *)_image;
+    ih->end = sizeof(retmap_image);
+    ih->dead = 0;
+    _mark_dirty(0, sizeof(retmap_image));
+    return 0;
+}
+
+/* Reads the file into the image.  If there isn't a good copy of the file
+ * we start a new one. */
+static int
+_load(void)
+{
+    struct stat sb;
+    retmap_header *h, *h0, *h1;
+    retmap_image *ih;
+    retmap_trailer *t;
+    uint8_t *s0, *s1;
+    uint32_t page;
+    int v0, v1, result;
+
+    if(fstat(_fd, &sb)) return ERR_GENERIC;
+    if(sb.st_size < RETMAP_SLOT_SIZE * 2) return _new_file();
+
+    _map_size = sb.st_size;
+    _map = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if(_map == MAP_FAILED) {
+        _map = NULL;
+        dax_log(DAX_LOG_ERROR, "Unable to map the tag retention file - %s", strerror(errno));
+        return ERR_ALLOC;
+    }
+    h0 = (retmap_header *)_slot(0);
+    h1 = (retmap_header *)_slot(1);
+    v0 = _header_valid(h0);
+    v1 = _header_valid(h1);
+    if(v0 && v1) {
+        h = h0->gen > h1->gen ? h0 : h1;
+    } else if(v0 || v1) {
+        h = v0 ? h0 : h1;
+    } else {
+        dax_log(DAX_LOG_ERROR, "Tag retention file has no good header, starting a new one");
+        return _new_file();
+    }
+    if(h->page_count == 0 || (size_t)RETMAP_PAGE_SLOT(h->page_count, 0) * RETMAP_SLOT_SIZE > _map_size) {
+        dax_log(DAX_LOG_ERROR, "Tag retention file is too short, starting a new one");
+        return _new_file();
+    }
+    _gen = h->gen;
+    /* The map is replaced with one that is exactly the right size */
+    result = _resize(h->page_count);
+    if(result) return result;
+
+    for(page = 0; page < _page_count; page++) {
+        s0 = _slot(RETMAP_PAGE_SLOT(page, 0));
+        s1 = _slot(RETMAP_PAGE_SLOT(page, 1));
+        /* A slot from a commit that never finished can't be left around to
+         * be confused with a later commit that uses the same gen */
+        t = (retmap_trailer *)&s0[RETMAP_PAGE_DATA];
+        if(t->seq > _gen) bzero(t, sizeof(retmap_trailer));
+        t = (retmap_trailer *)&s1[RETMAP_PAGE_DATA];
+        if(t->seq > _gen) bzero(t, sizeof(retmap_trailer));
+
+        v0 = _slot_valid(s0, _gen);
+        v1 = _slot_valid(s1, _gen);
+        if(v0 && v1) {
+            _active[page] = ((retmap_trailer *)&s1[RETMAP_PAGE_DATA])->seq >
+                            ((retmap_trailer *)&s0[RETMAP_PAGE_DATA])->seq;
+        } else if(v0 || v1) {
+            _active[page] = v1;
+        } else {
+            /* Pages that have never been written are all zeros */
+            if(((retmap_trailer *)&s0[RETMAP_PAGE_DATA])->magic == RETMAP_MAGIC ||
+               ((retmap_trailer *)&s1[RETMAP_PAGE_DATA])->magic == RETMAP_MAGIC) {
+                dax_log(DAX_LOG_ERROR, "Page %u of the tag retention file is corrupt", page);
+            }
+            bzero(&_image[(size_t)page * RETMAP_PAGE_DATA], RETMAP_PAGE_DATA);
+            _active[page] = 1;
+            continue;
+        }
+        memcpy(&_image[(size_t)page * RETMAP_PAGE_DATA], _slot(RETMAP_PAGE_SLOT(page, _active[page])), RETMAP_PAGE_DATA);
+    }
+    msync(_map, _map_size, MS_SYNC);
+
+    ih = (retmap_image *)_image;
+    if(ih->end < sizeof(retmap_image) || ih->end > (size_t)_page_count * RETMAP_PAGE_DATA) {
+        dax_log(DAX_LOG_ERROR, "Tag retention file is corrupt, starting a new one");
+        return _new_file();
+    }
+    return 0;
+}
+
+/* Moves all of the live records down over the deleted ones */
+static void
+_compact(void)
+{
+    retmap_image *ih;
+    retmap_record *rec;
+    uint32_t offset, end, size;
+
+    ih = (retmap_image *)_image;
+    end = sizeof(retmap_image);
+    for(offset = end; offset < ih->end; offset += size) {
+        rec = (retmap_record *)&_image[offset];
+        size = rec->size;
+        if(size < sizeof(retmap_record) || offset + size > ih->end) break;
+        if(rec->flags & RETMAP_DELETED) continue;
+        if(offset != end) memmove(&_image[end], rec, size);
+        end += size;
+    }
+    dax_log(DAX_LOG_DEBUG, "Compacted tag retention file from %u to %u bytes", ih->end, end);
+    ih->end = end;
+    ih->dead = 0;
+    _mark_dirty(0, end);
+}
+
+static int
+_type_saved(tag_type type)
+{
+    int n;
+
+    for(n = 0; n < _type_count; n++) {
+        if(_types[n] == type) return 1;
+    }
+    return 0;
+}
+
+static void
+_type_remember(tag_type type)
+{
+    tag_type *new_types;
+    int newsize;
+
+    if(_type_count == _type_size) {
+        newsize = _type_size ? _type_size * 2 : 16;
+        new_types = realloc(_types, sizeof(tag_type) * newsize);
+        if(new_types == NULL) return;
+        _types = new_types;
+        _type_size = newsize;
+    }
+    _types[_type_count++] = type;
+}
+
+/* Creates all of the types and tags that are in the image */
+static void
+_restore(void)
+{
+    retmap_image *ih;
+    retmap_record *rec;
+    uint32_t offset;
+    char *name, *str;
+    tag_type type;
+    tag_index idx;
+    int error, size;
+
+    ih = (retmap_image *)_image;
+    for(offset = sizeof(retmap_image); offset < ih->end; offset += rec->size) {
+        rec = (retmap_record *)&_image[offset];
+        if(rec->size < sizeof(retmap_record) || offset + rec->size > ih->end ||
+           rec->data > rec->size || rec->datasize > rec->size - rec->data) {
+            dax_log(DAX_LOG_ERROR, "Bad record in the tag retention file at %u", offset);
+            ih->end = offset;
+            _mark_dirty(0, sizeof(retmap_image));
+            break;
+        }
+        if(rec->flags & RETMAP_DELETED) continue;
+        name = (char *)&rec[1];
+        str = name + strlen(name) + 1;
+        if(rec->kind == RETMAP_TYPE) {
+            type = cdt_create(str, &error);
+            if(type == 0) {
+                dax_log(DAX_LOG_ERROR, "Problem creating datatype %s - %d", name, error);
+            } else {
+                _type_remember(type);
+            }
+        } else if(rec->kind == RETMAP_TAG) {
+            idx = tag_add(-1, name, cdt_get_type(str), rec->count, 0);
+            if(idx < 0) {
+                dax_log(DAX_LOG_ERROR, "Retained tag %s not created properly", name);
+                continue;
+            }
+            size = MIN(rec->datasize, tag_get_size(idx));
+            memcpy(_db[idx].data, (uint8_t *)rec + rec->data, size);
+            shm_tag_update(idx, 0, size);
+            /* It's still in the file so it is still retained */
+            _db[idx].attr |= TAG_ATTR_RETAIN;
+            _db[idx].ret_file_pointer = offset;
+        }
+    }
+}
+
+/* Adds a record to the end of the image and returns its offset */
+static int
+_append(int kind, const char *name, const char *str, uint32_t count, const void *data, uint32_t datasize)
+{
+    retmap_image *ih;
+    retmap_record *rec;
+    uint32_t offset, head, size, pages;
+    int result;
+
+    ih = (retmap_image *)_image;
+    head = RETMAP_ALIGN(sizeof(retmap_record) + strlen(name) + 1 + strlen(str) + 1);
+    size = head + RETMAP_ALIGN(datasize);
+    pages = _page_count;
+    while((size_t)ih->end + size > (size_t)pages * RETMAP_PAGE_DATA) pages *= 2;
+    if(pages != _page_count) {
+        result = _resize(pages);
+        if(result) return result;
+        ih = (retmap_image *)_image;
+    }
+    offset = ih->end;
+    rec = (retmap_record *)&_image[offset];
+    bzero(rec, size);
+    rec->size = size;
+    rec->kind = kind;
+    rec->count = count;
+    rec->datasize = datasize;
+    rec->data = head;
+    strcpy((char *)&rec[1], name);
+    strcpy((char *)&rec[1] + strlen(name) + 1, str);
+    if(data != NULL) memcpy((uint8_t *)rec + head, data, datasize);
+    ih->end += size;
+    _mark_dirty(offset, size);
+    _mark_dirty(0, sizeof(retmap_image));
+    return offset;
+}
+
+/* Writes the type and any types that it uses to the image */
+static int
+_add_type(tag_type type)
+{
+    datatype *dt;
+    cdt_member *member;
+    char *type_str;
+    int result;
+
+    if(_type_saved(type)) return 0;
+    dt = cdt_get_entry(type);
+    if(dt == NULL) return ERR_BADTYPE;
+    for(member = dt->members; member != NULL; member = member->next) {
+        if(IS_CUSTOM(member->type)) {
+            result = _add_type(member->type);
+            if(result < 0) return result;
+        }
+    }
+    if(serialize_datatype(type, &type_str) < 0) return ERR_BADTYPE;
+    result = _append(RETMAP_TYPE, dt->name, type_str, 0, NULL, 0);
+    free(type_str); /* Allocated by serialize_datatype() */
+    if(result < 0) return result;
+    _type_remember(type);
+    return 0;
+}
+
+static int
+_map_begin(void)
+{
+    return _map == NULL ? ERR_FILE_CLOSED : 0;
+}
+
+static int
+_map_write(tag_index index, uint32_t pointer, int offset, const void *data, int size)
+{
+    retmap_record *rec;
+
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    rec = (retmap_record *)&_image[pointer];
+    if(rec->kind != RETMAP_TAG || rec->flags & RETMAP_DELETED) return ERR_DELETED;
+    /* Only in case the tag grew after we saved it */
+    if(offset >= rec->datasize) return 0;
+    size = MIN(size, rec->datasize - offset);
+    memcpy((uint8_t *)rec + rec->data + offset, data, size);
+    _mark_dirty(pointer + rec->data + offset, size);
+    return 0;
+}
+
+static int
+_map_commit(void)
+{
+    retmap_header *h;
+    retmap_trailer *t;
+    uint8_t *slot;
+    uint64_t gen;
+    uint32_t n, page;
+
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    if(_dirty_count == 0) return 0;
+    gen = _gen + 1;
+    for(n = 0; n < _dirty_count; n++) {
+        page = _dirty_list[n];
+        slot = _slot(RETMAP_PAGE_SLOT(page, !_active[page]));
+        memcpy(slot, &_image[(size_t)page * RETMAP_PAGE_DATA], RETMAP_PAGE_DATA);
+        t = (retmap_trailer *)&slot[RETMAP_PAGE_DATA];
+        t->seq = gen;
+        t->magic = RETMAP_MAGIC;
+        t->crc = _crc(slot, RETMAP_SLOT_SIZE - sizeof(uint32_t));
+    }
+    if(msync(_map, _map_size, MS_SYNC)) {
+        dax_log(DAX_LOG_ERROR, "Unable to sync the tag retention file - %s", strerror(errno));
+        return ERR_GENERIC;
+    }
+    /* The pages don't count until this is on the disk */
+    h = (retmap_header *)_slot(RETMAP_HEADER_SLOT(gen));
+    h->magic = RETMAP_MAGIC;
+    h->version = RETMAP_VERSION;
+    h->slot_size = RETMAP_SLOT_SIZE;
+    h->page_count = _page_count;
+    h->gen = gen;
+    h->reserved = 0;
+    h->crc = _crc(h, offsetof(retmap_header, crc));
+    if(msync(_map, RETMAP_SLOT_SIZE * 2, MS_SYNC)) {
+        dax_log(DAX_LOG_ERROR, "Unable to sync the tag retention file - %s", strerror(errno));
+        return ERR_GENERIC;
+    }
+    for(n = 0; n < _dirty_count; n++) {
+        page = _dirty_list[n];
+        _active[page] = !_active[page];
+        _page_dirty[page] = 0;
+    }
+    _dirty_count = 0;
+    _gen = gen;
+    return 0;
+}
+
+static void
+_map_close(void)
+{
+    _map_commit();
+    if(_map != NULL) munmap(_map, _map_size);
+    if(_fd >= 0) close(_fd);
+    free(_image);
+    free(_active);
+    free(_page_dirty);
+    free(_dirty_list);
+    free(_types);
+    _map = NULL;
+    _fd = -1;
+    _image = NULL;
+    _active = _page_dirty = NULL;
+    _dirty_list = NULL;
+    _types = NULL;
+    _page_count = _dirty_count = 0;
+    _type_count = _type_size = 0;
+}
+
+static int
+_map_open(char *filename)
+{
+    retmap_image *ih;
+    int result;
+
+    if(filename == NULL) {
+        filename = "retentive.map";
+    }
+    dax_log(DAX_LOG_DEBUG, "Setting up Memory Mapped Tag Retention - %s", filename);
+    _fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if(_fd < 0) {
+        dax_log(DAX_LOG_ERROR, "Unable to open tag retention file %s - %s", filename, strerror(errno));
+        return ERR_FILE_CLOSED;
+    }
+    result = _load();
+    if(result) {
+        _map_close();
+        return result;
+    }
+    ih = (retmap_image *)_image;
+    if(ih->dead > RETMAP_PAGE_DATA && ih->dead > (ih->end - sizeof(retmap_image)) / 2) {
+        _compact();
+    }
+    _restore();
+    return _map_commit();
+}
+
+static int
+_map_add_tag(tag_index index)
+{
+    int result;
+
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    if(IS_CUSTOM(_db[index].type)) {
+        result = _add_type(_db[index].type);
+        if(result) return result;
+    }
+    result = _append(RETMAP_TAG, _db[index].name, cdt_get_name(_db[index].type), _db[index].count,
+                     _db[index].data, tag_get_size(index));
+    if(result < 0) return result;
+    _db[index].ret_file_pointer = result;
+    return _map_commit();
+}
+
+static int
+_map_del_tag(tag_index index)
+{
+    retmap_record *rec;
+
+    if(_map == NULL) return ERR_FILE_CLOSED;
+    rec = (retmap_record *)&_image[_db[index].ret_file_pointer];
+    if(rec->kind != RETMAP_TAG || rec->flags & RETMAP_DELETED) return 0;
+    rec->flags |= RETMAP_DELETED;
+    ((retmap_image *)_image)->dead += rec->size;
+    _mark_dirty(_db[index].ret_file_pointer, sizeof(retmap_record));
+    _mark_dirty(0, sizeof(retmap_image));
+    return _map_commit();
+}
+
+ret_backend ret_mmap_backend = {
+    "mmap",
+    _map_open,
+    _map_add_tag,
+    _map_del_tag,
+    _map_begin,
+    _map_write,
+    _map_commit,
+    _map_close
+};
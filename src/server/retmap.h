@@ -0,0 +1,81 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  Header file for the layout of the memory mapped tag retention file
+ */
+
+#ifndef __RETMAP_H
+#define __RETMAP_H
+
+#include <stdint.h>
+
+/* The file is divided into slots.  The first two slots hold the two copies
+ * of the file header and every page of the retained data gets the two
+ * slots after that, so page p is in slot 2 + 2p or slot 3 + 2p */
+#define RETMAP_SLOT_SIZE 4096
+#define RETMAP_MAGIC     0x4D584144 /* "DAXM" */
+#define RETMAP_VERSION   1
+
+#define RETMAP_HEADER_SLOT(gen) ((gen) & 1)
+#define RETMAP_PAGE_SLOT(page, k) (2 + 2 * (page) + (k))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t page_count;
+    uint64_t gen;         /* Goes up by one with every commit */
+    uint32_t reserved;
+    uint32_t crc;         /* CRC32 of everything above */
+} retmap_header;
+
+/* This is at the end of every page slot.  A slot is only good if the crc
+ * matches and seq is not newer than the gen in the header. */
+typedef struct {
+    uint64_t seq;         /* The gen of the commit that wrote this slot */
+    uint32_t magic;
+    uint32_t crc;         /* CRC32 of the whole slot up to here */
+} retmap_trailer;
+
+#define RETMAP_PAGE_DATA (RETMAP_SLOT_SIZE - sizeof(retmap_trailer))
+
+/* The data in the pages is treated as one long image.  It starts with
+ * this and then the records follow one after the other. */
+typedef struct {
+    uint32_t end;         /* Offset of the byte after the last record */
+    uint32_t dead;        /* Bytes in the records that have been deleted */
+} retmap_image;
+
+#define RETMAP_TYPE    1
+#define RETMAP_TAG     2
+
+#define RETMAP_DELETED 0x01
+
+/* After the record comes the name and then either the type name for a tag
+ * or the serialized definition for a type, both NULL terminated.  The tag
+ * data starts at 'data' bytes from the start of the record. */
+typedef struct {
+    uint32_t size;        /* Size of the whole record, always a multiple of 8 */
+    uint16_t kind;
+    uint16_t flags;
+    uint32_t count;
+    uint32_t datasize;
+    uint32_t data;
+    uint32_t reserved;
+} retmap_record;
+
+#endif /* !__RETMAP_H */
@@ -0,0 +1,336 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2021 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  Tag retention backend that keeps the retained tags in an SQLite database
+ */
+
+#include <common.h>
+#include "retain.h"
+#include "func.h"
+#include "tagbase.h"
+#include "shm.h"
+
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+
+extern _dax_tag_db *_db;
+
+static sqlite3 *_sql;
+/* Used while a batch is being written */
+static sqlite3_blob *_blob;
+
+/* Create the types that are found in the retention database */
+static int
+_create_types(void) {
+    sqlite3_stmt *stmt;
+    int result, error;
+    char *name;
+    char *definition;
+
+    result = sqlite3_prepare_v2(_sql, "SELECT name,definition FROM types ORDER BY id;", -1, &stmt, NULL);
+    if(result != SQLITE_OK) {
+        /* Most errors are because we have a new file */
+        dax_log(DAX_LOG_ERROR, "Unable to compile SQL statement to create types");
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    while((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        name = (char *)sqlite3_column_text(stmt, 0);
+        definition = (char *)sqlite3_column_text(stmt, 1);
+        result = cdt_create(definition, &error);
+        if(result == 0) {
+            dax_log(DAX_LOG_ERROR, "Problem creating datatype %s - %d", name, error);
+        }
+    }
+    if(result != SQLITE_DONE) {
+        dax_log(DAX_LOG_ERROR, "Problem writing tags to database - %d", result);
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+/* Create the tags that we find in the database */
+static int
+_create_tags(void) {
+    sqlite3_stmt *stmt;
+    int result;
+    char *name;
+    char *type;
+    const void *data;
+    int count, size;
+    tag_index tag_index;
+
+
+    // CREATE ALL THE DATATYPES FIRST
+    result = sqlite3_prepare_v2(_sql, "SELECT name,type,count,data FROM tags;", -1, &stmt, NULL);
+    if(result != SQLITE_OK) {
+        /* Most errors are because we have a new file */
+        dax_log(DAX_LOG_ERROR, "Unable to compile SQL statement to create tags");
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    while((result = sqlite3_step(stmt)) == SQLITE_ROW) {
+        name = (char *)sqlite3_column_text(stmt, 0);
+        type = (char *)sqlite3_column_text(stmt, 1);
+        count = sqlite3_column_int(stmt, 2);
+        data =  sqlite3_column_blob(stmt, 3);
+        size =  sqlite3_column_bytes(stmt, 3);
+
+        tag_index = tag_add(-1, name, cdt_get_type(type), count, 0);
+
+        if(tag_index < 0) {
+            dax_log(DAX_LOG_ERROR, "Retained tag not created properly");
+        } else {
+            memcpy(_db[tag_index].data, data, MIN(size, tag_get_size(tag_index)));
+            shm_tag_update(tag_index, 0, MIN(size, tag_get_size(tag_index)));
+        }
+    }
+    if(result != SQLITE_DONE) {
+        dax_log(DAX_LOG_ERROR, "Problem writing tags to database - %d", result);
+        sqlite3_finalize(stmt);
+        return result;
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+/* Create the databae tables */
+static int
+_create_database_tables(void) {
+    char *errormsg;
+    int result;
+    const char *query = "CREATE TABLE IF NOT EXISTS types (" \
+	                    "id     INTEGER PRIMARY KEY,"\
+	                    "name   TEXT NOT NULL UNIQUE," \
+                        "definition TEXT);" \
+                        "CREATE TABLE IF NOT EXISTS tags (" \
+	                    "id     INTEGER PRIMARY KEY AUTOINCREMENT," \
+	                    "name   TEXT NOT NULL UNIQUE," \
+	                    "type   TEXT NOT NULL," \
+	                    "count  INTEGER," \
+                        "data   BLOB);";
+    result = sqlite3_exec(_sql, query, NULL, 0 , &errormsg);
+    if(result != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to create tag retention database tables - %s", errormsg);
+        return result;
+    }
+    return 0;
+}
+
+static int
+_sqlite_open(char *filename) {
+    int result;
+    char *errmsg;
+
+    if(filename == NULL) {
+        filename = "retentive.db";
+    }
+    dax_log(DAX_LOG_DEBUG, "Setting up SQLite Tag Retention - %s", filename);
+    result = sqlite3_open(filename, &_sql);
+    if(result != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to open tag retention database - %s", filename);
+        sqlite3_close(_sql);
+        _sql=NULL;
+        return result;
+    }
+    /* First we attempt to create data types and tags if they exist in the retention database
+       These may fail if the file doesn't exist but that's okay */
+    result = _create_types(); /* Creates the types that are stored in the data base */
+    result = _create_tags(); /* Creates the tags that are in the data base */
+    result = sqlite3_exec(_sql, "DROP TABLE IF EXISTS tags;", NULL, 0, &errmsg);
+    if(result != SQLITE_OK) {
+        DF("unable to drop table 'tags' - %s", errmsg);
+    }
+    result = sqlite3_exec(_sql, "DROP TABLE IF EXISTS types;", NULL, 0, &errmsg);
+    if(result != SQLITE_OK) {
+        DF("unable to drop table 'types' - %s", errmsg);
+    }
+    result = _create_database_tables();
+    return 0;
+}
+
+static int
+_add_type(tag_type type) {
+    datatype *dt;
+    cdt_member *next;
+    char *type_str;
+    sqlite3_stmt *stmt;
+    int index;
+    int result;
+    char query[256];
+
+    dt = cdt_get_entry(type);
+    index = CDT_TO_INDEX(type);
+
+    if(dt == NULL) {
+        dax_log(DAX_LOG_ERROR, "Bad type passed");
+    }
+    /* Loop through all the members and recursively add any
+       compound data types that we find */
+    next = dt->members;
+    while(next != NULL) {
+        if(IS_CUSTOM(next->type)) {
+            _add_type(next->type);
+        }
+        next = next->next;
+    }
+    if(_sql == NULL) return ERR_FILE_CLOSED;
+
+    snprintf(query, 256, "INSERT INTO main.types(id,name,definition) VALUES (%d,'%s',?);",index, dt->name);
+
+    result = sqlite3_prepare_v2(_sql, query, -1, &stmt , NULL);
+    if(result != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to create tag in retention ");
+        return result;
+    }
+    /* Turn the type into a string that we can use to reload it later */
+    serialize_datatype(type, &type_str);
+    sqlite3_bind_text(stmt, 1, type_str, -1, SQLITE_TRANSIENT);
+    free(type_str); /* Allocated by serialize_datatype() */
+    result = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if(result != SQLITE_DONE) {
+        dax_log(DAX_LOG_ERROR, "Problem inserting tag");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+_sqlite_add_tag(tag_index index) {
+    sqlite3_stmt *stmt;
+    int id;
+    int result;
+    char query[256];
+
+    /* TODO: Implement retaining custom data type tags */
+    if(IS_CUSTOM(_db[index].type)) {
+        _add_type(_db[index].type);
+    }
+    if(_sql == NULL) return ERR_FILE_CLOSED;
+    /* The data goes in now so that the blob is the right size for
+     * the partial writes later */
+    snprintf(query, 256, "INSERT INTO main.tags(name,type,count,data) VALUES ('%s','%s',%d,?);",
+                         _db[index].name, cdt_get_name(_db[index].type), _db[index].count);
+
+    result = sqlite3_prepare_v2(_sql, query, -1, &stmt , NULL);
+    if(result != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to create tag in retention ");
+        return result;
+    }
+    sqlite3_bind_blob(stmt, 1, _db[index].data, tag_get_size(index), SQLITE_TRANSIENT);
+    result = sqlite3_step(stmt);
+    if(result == SQLITE_DONE) {
+        id = sqlite3_last_insert_rowid(_sql);
+        _db[index].ret_file_pointer = id; /* We'll use this on tag writes */
+    } else {
+        sqlite3_finalize(stmt);
+        dax_log(DAX_LOG_ERROR, "Problem inserting tag");
+        return -1;
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int
+_sqlite_del_tag(tag_index index) {
+    char query[64];
+    char *errmsg;
+
+    if(_sql == NULL) return ERR_FILE_CLOSED;
+    snprintf(query, 64, "DELETE FROM main.tags WHERE id = %u;", _db[index].ret_file_pointer);
+    if(sqlite3_exec(_sql, query, NULL, 0, &errmsg) != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to remove tag from retention - %s", errmsg);
+        sqlite3_free(errmsg);
+        return ERR_GENERIC;
+    }
+    return 0;
+}
+
+static int
+_sqlite_begin(void) {
+    char *errmsg;
+
+    if(_sql == NULL) return ERR_FILE_CLOSED;
+    if(sqlite3_exec(_sql, "BEGIN;", NULL, 0, &errmsg) != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to begin retention transaction - %s", errmsg);
+        sqlite3_free(errmsg);
+        return ERR_GENERIC;
+    }
+    return 0;
+}
+
+/* Writes size bytes of data into the blob of the tag's row at offset. The
+ * blob handle is kept open and moved from row to row until the commit. */
+static int
+_sqlite_write(tag_index index, uint32_t pointer, int offset, const void *data, int size)
+{
+    int result;
+
+    if(_blob == NULL) {
+        result = sqlite3_blob_open(_sql, "main", "tags", "data", pointer, 1, &_blob);
+    } else {
+        result = sqlite3_blob_reopen(_blob, pointer);
+    }
+    if(result == SQLITE_OK) {
+        result = sqlite3_blob_write(_blob, data, size, offset);
+    }
+    if(result != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to write retained data for row %d - %s", pointer, sqlite3_errmsg(_sql));
+        /* A handle that failed can't be moved to another row */
+        sqlite3_blob_close(_blob);
+        _blob = NULL;
+        return ERR_GENERIC;
+    }
+    return 0;
+}
+
+static int
+_sqlite_commit(void) {
+    char *errmsg;
+
+    sqlite3_blob_close(_blob);
+    _blob = NULL;
+    if(sqlite3_exec(_sql, "COMMIT;", NULL, 0, &errmsg) != SQLITE_OK) {
+        dax_log(DAX_LOG_ERROR, "Unable to commit retention transaction - %s", errmsg);
+        sqlite3_free(errmsg);
+        return ERR_GENERIC;
+    }
+    return 0;
+}
+
+static void
+_sqlite_close(void) {
+    sqlite3_close(_sql);
+    _sql = NULL;
+}
+
+ret_backend ret_sqlite_backend = {
+    "sqlite",
+    _sqlite_open,
+    _sqlite_add_tag,
+    _sqlite_del_tag,
+    _sqlite_begin,
+    _sqlite_write,
+    _sqlite_commit,
+    _sqlite_close
+};
+
+#endif /* HAVE_SQLITE */
@@ -23,6 +23,7 @@
 #include "tagbase.h"
 #include "retain.h"
 #include "func.h"
+#include "shm.h"
 #include <pthread.h>
 #include <syslog.h>
 #include <signal.h>
@@ -58,9 +59,12 @@ main(int argc, const char *argv[])
 
     result = msg_setup();    /* This creates and sets up the message sockets */
     if(result) dax_log(DAX_LOG_ERROR, "msg_setup() returned %d", result);
+    /* The shared memory has to be there before the first tag is created */
+    result = shm_init(opt_shm_size());
+    if(result) dax_log(DAX_LOG_ERROR, "Unable to create shared memory, modules will use messages");
     initialize_tagbase(); /* initialize the tag name database */
     /* TODO: Add retention filename from configuration */
-    ret_init(NULL);
+    ret_init(NULL, opt_retain_backend(), opt_retain_interval());
     /* Start the message handling thread */
     if(pthread_create(&message_thread, NULL, (void *)&messagethread, NULL)) {
         dax_log(DAX_LOG_FATAL, "Unable to create message thread");
@@ -0,0 +1,330 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  This file contains the code that keeps the shared memory copy of the
+ *  tag data up to date.
+ */
+
+#define _GNU_SOURCE
+#include <common.h>
+#include <libcommon.h>
+#include "shm.h"
+#include "tagbase.h"
+#include "func.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* Notes:
+ * The tag data that modules read most often is copied into a shared memory
+ * region.  Modules that connect through the local domain socket receive the
+ * file descriptor of the region when they register and map it read only.
+ * When a module reads a tag that is in the region it copies the data
+ * directly instead of sending a message to the server and waiting on the
+ * response.
+ *
+ * The database in _db is still where the data really lives.  Every place
+ * that changes the data of a tag calls shm_tag_update() while it still holds
+ * the lock for that tag so the copy is always current.  Tags that can't be
+ * read directly (virtual tags, queues, special tags and tags with an
+ * override set) have the SHM_TAG_VALID flag cleared and the modules fall
+ * back to sending the message.
+ *
+ * Each entry in the tag table has a sequence counter.  The server makes it
+ * odd before it changes the entry or the data and even again when it is
+ * done.  The readers copy the data and then make sure that the counter was
+ * even and didn't change while they were copying.  The server never waits on
+ * the readers.  The entry also has the full index of the tag that is in
+ * the slot so a reader with the index of a tag that was deleted doesn't get
+ * the data of the tag that took its slot.
+ *
+ * The data area is handed out with a simple first fit free list that is
+ * kept in order so that neighboring free blocks can be put back together.
+ * If the region is full the tag just doesn't get a copy.
+ */
+
+/* Number of bytes in the region for each entry in the tag table */
+#define SHM_BYTES_PER_TAG 128
+/* All the tag data is aligned to this */
+#define SHM_ALIGN(x) (((x) + 7) & ~7)
+
+typedef struct shm_block_t {
+    uint32_t offset;
+    uint32_t size;
+    struct shm_block_t *next;
+} shm_block;
+
+extern _dax_tag_db *_db;
+
+static int _fd = -1;
+static uint8_t *_region;
+static struct shm_header *_header;
+static struct shm_tag *_tags;
+static shm_block *_freelist;
+
+static int
+_create_fd(void)
+{
+#ifdef HAVE_MEMFD_CREATE
+    return memfd_create("opendax", MFD_CLOEXEC);
+#else
+    char name[64];
+    int fd;
+
+    /* We only need the name long enough to open it */
+    snprintf(name, sizeof(name), "/opendax-%d", getpid());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd >= 0) shm_unlink(name);
+    return fd;
+#endif
+}
+
+/* Creates the shared memory region.  If size is zero the region is
+ * disabled and all the other functions in this file do nothing */
+int
+shm_init(unsigned int size)
+{
+    uint32_t tagcount, dataoffset;
+
+    if(size == 0) {
+        dax_log(DAX_LOG_MINOR, "Shared memory tag data is disabled");
+        return 0;
+    }
+    tagcount = size / SHM_BYTES_PER_TAG;
+    dataoffset = SHM_ALIGN(sizeof(struct shm_header) + tagcount * sizeof(struct shm_tag));
+
+    _fd = _create_fd();
+    if(_fd < 0) {
+        dax_log(DAX_LOG_ERROR, "Unable to create shared memory - %s", strerror(errno));
+        return ERR_ALLOC;
+    }
+    if(ftruncate(_fd, size)) {
+        dax_log(DAX_LOG_ERROR, "Unable to size shared memory - %s", strerror(errno));
+        close(_fd);
+        _fd = -1;
+        return ERR_ALLOC;
+    }
+    _region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if(_region == MAP_FAILED) {
+        dax_log(DAX_LOG_ERROR, "Unable to map shared memory - %s", strerror(errno));
+        close(_fd);
+        _fd = -1;
+        _region = NULL;
+        return ERR_ALLOC;
+    }
+    _freelist = xmalloc(sizeof(shm_block));
+    if(_freelist == NULL) {
+        munmap(_region, size);
+        close(_fd);
+        _fd = -1;
+        _region = NULL;
+        return ERR_ALLOC;
+    }
+    _freelist->offset = dataoffset;
+    _freelist->size = size - dataoffset;
+    _freelist->next = NULL;
+
+    _header = (struct shm_header *)_region;
+    _tags = (struct shm_tag *)&_region[sizeof(struct shm_header)];
+    _header->size = size;
+    _header->tagcount = tagcount;
+    _header->dataoffset = dataoffset;
+    /* The magic goes last so a half built region is never used */
+    __atomic_store_n(&_header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    dax_log(DAX_LOG_MINOR, "Shared memory created with size = %u for %u tags", size, tagcount);
+    return 0;
+}
+
+/* Returns the file descriptor of the region or -1 if it is disabled */
+int
+shm_get_fd(void)
+{
+    return _fd;
+}
+
+uint32_t
+shm_get_size(void)
+{
+    return _region ? _header->size : 0;
+}
+
+/* Returns the offset of a block of at least size bytes or 0 if
+ * there isn't room */
+static uint32_t
+_block_alloc(uint32_t size)
+{
+    shm_block *this, *last = NULL;
+    uint32_t offset;
+
+    for(this = _freelist; this != NULL; last = this, this = this->next) {
+        if(this->size >= size) {
+            offset = this->offset;
+            this->offset += size;
+            this->size -= size;
+            if(this->size == 0) {
+                if(last) last->next = this->next;
+                else _freelist = this->next;
+                xfree(this);
+            }
+            return offset;
+        }
+    }
+    return 0;
+}
+
+/* Puts the block back on the free list and joins it to its neighbors */
+static void
+_block_free(uint32_t offset, uint32_t size)
+{
+    shm_block *this, *last = NULL, *new;
+
+    for(this = _freelist; this != NULL && this->offset < offset; last = this, this = this->next);
+
+    if(last != NULL && last->offset + last->size == offset) {
+        last->size += size;
+        if(this != NULL && last->offset + last->size == this->offset) {
+            last->size += this->size;
+            last->next = this->next;
+            xfree(this);
+        }
+        return;
+    }
+    if(this != NULL && offset + size == this->offset) {
+        this->offset = offset;
+        this->size += size;
+        return;
+    }
+    new = xmalloc(sizeof(shm_block));
+    /* If we can't get the memory we just lose this bit of the region */
+    if(new == NULL) return;
+    new->offset = offset;
+    new->size = size;
+    new->next = this;
+    if(last) last->next = new;
+    else _freelist = new;
+}
+
+/* The sequence counter is odd between these two */
+static inline void
+_write_begin(struct shm_tag *t)
+{
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+_write_end(struct shm_tag *t)
+{
+    __atomic_store_n(&t->seq, t->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns true if the modules can read the tag straight from the region */
+static int
+_tag_readable(tag_index idx)
+{
+    if(_db[idx].data == NULL) return 0;
+    if(IS_QUEUE(_db[idx].type)) return 0;
+    if(_db[idx].attr & (TAG_ATTR_VIRTUAL | TAG_ATTR_SPECIAL | TAG_ATTR_OVR_SET)) return 0;
+    return 1;
+}
+
+/* Gives the tag at idx space in the region and copies the data into it.
+ * This should be called after the tag's data area has been allocated */
+void
+shm_tag_alloc(tag_index idx)
+{
+    struct shm_tag *t;
+    uint32_t offset, size;
+
+    if(_region == NULL || idx < 0 || idx >= _header->tagcount) return;
+    if(IS_QUEUE(_db[idx].type) || _db[idx].attr & TAG_ATTR_VIRTUAL) return;
+    t = &_tags[idx];
+    if(t->offset != 0) return;
+
+    size = tag_get_size(idx);
+    offset = _block_alloc(SHM_ALIGN(size));
+    if(offset == 0) {
+        dax_log(DAX_LOG_MINOR, "No room in shared memory for tag %s", _db[idx].name);
+        return;
+    }
+    _write_begin(t);
+    t->index = tag_extern(idx);
+    t->offset = offset;
+    t->size = size;
+    memcpy(&_region[offset], _db[idx].data, size);
+    t->flags = _tag_readable(idx) ? SHM_TAG_VALID : 0;
+    _write_end(t);
+}
+
+/* Takes the tag at idx out of the region */
+void
+shm_tag_free(tag_index idx)
+{
+    struct shm_tag *t;
+    uint32_t offset, size;
+
+    if(_region == NULL || idx < 0 || idx >= _header->tagcount) return;
+    t = &_tags[idx];
+    if(t->offset == 0) return;
+
+    offset = t->offset;
+    size = t->size;
+    _write_begin(t);
+    t->flags = 0;
+    t->index = -1;
+    t->offset = 0;
+    t->size = 0;
+    _write_end(t);
+    _block_free(offset, SHM_ALIGN(size));
+}
+
+/* This should be called whenever something changes that might change
+ * whether or not the tag can be read from the region */
+void
+shm_tag_check(tag_index idx)
+{
+    struct shm_tag *t;
+    uint32_t flags;
+
+    if(_region == NULL || idx < 0 || idx >= _header->tagcount) return;
+    t = &_tags[idx];
+    if(t->offset == 0) return;
+
+    flags = _tag_readable(idx) ? SHM_TAG_VALID : 0;
+    if(flags != t->flags) {
+        _write_begin(t);
+        t->flags = flags;
+        _write_end(t);
+    }
+}
+
+/* Copies size bytes of the tag's data starting at offset into the region.
+ * The caller must hold the lock that protects the tag's data */
+void
+shm_tag_update(tag_index idx, int offset, int size)
+{
+    struct shm_tag *t;
+
+    if(_region == NULL || idx < 0 || idx >= _header->tagcount) return;
+    t = &_tags[idx];
+    if(t->offset == 0 || offset + size > t->size) return;
+
+    _write_begin(t);
+    memcpy(&_region[t->offset + offset], &_db[idx].data[offset], size);
+    _write_end(t);
+}
@@ -0,0 +1,35 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ *  Header file for the shared memory tag data functions
+ */
+
+#ifndef __SHM_H
+#define __SHM_H
+
+#include <common.h>
+#include <opendax.h>
+
+int shm_init(unsigned int size);
+int shm_get_fd(void);
+uint32_t shm_get_size(void);
+void shm_tag_alloc(tag_index idx);
+void shm_tag_free(tag_index idx);
+void shm_tag_check(tag_index idx);
+void shm_tag_update(tag_index idx, int offset, int size);
+
+#endif /* !__SHM_H */
@@ -20,10 +20,14 @@
 
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
 #include <common.h>
 #include "tagbase.h"
 #include "retain.h"
 #include "func.h"
+#include "shm.h"
+#include "arena.h"
+#include "module.h"
 
 /* Notes:
  * The tags are stored in the server in two different arrays.  Both
@@ -34,20 +38,50 @@
  * the name of the tag, the type of tag and the number of items.  It
  * also contains any status flags as well as the data area itself. The
  * tags are stored in this array in the order that they were created.
- * The index of the tag in this array is used as the identifier for
- * that tag for the duration of the program.
+ * When a tag is deleted its slot goes on a free list and the next tag that
+ * is added takes it, so the array only grows as large as the most tags
+ * that have been in the database at one time.  Each slot has a generation
+ * that goes up when its tag is deleted.  The index that the modules are
+ * given is the slot and the generation together (see TAG_INDEX() in
+ * libcommon.h) so an index that a module kept for a deleted tag doesn't
+ * find the new tag in that slot.  Inside the server everything works with
+ * the slot and tag_resolve() and tag_extern() convert between the two in
+ * the message handlers.  A slot whose generation would wrap around is
+ * retired instead of being put back on the free list.  The data areas,
+ * names and override areas of the tags come from the slab allocator in
+ * arena.c, except for the data of the virtual tags.
  *
  * The second array is the index.  Each item in the index contains a pointer
  * to the name of the tag and the index where the tag data can be found in the
- * first array.  This array is kept sorted in alphabetical order for quicker
- * searching by name.  The name pointer in both arrays point to the same
+ * first array.  This array is an open addressing hash table keyed on the
+ * name of the tag, using linear probing.  It is kept at most half full so
+ * that lookups and inserts stay close to constant time no matter how many
+ * tags there are.  The name pointer in both arrays point to the same
  * address so the string is not duplicated.
+ *
+ * When the tags are needed in alphabetical order the ordered view in
+ * _sorted is used.  It is rebuilt only when it is asked for after tags
+ * have been added or deleted.
+ *
+ * Locking: _dblock protects the structure of the database.  Anything that
+ * adds or removes tags, events, mappings etc. must hold it exclusively.  The
+ * message handlers that only read and write tag data hold it shared and the
+ * data itself is protected by the sharded locks in _shardlocks.  The shard
+ * for a tag is chosen by its index so that access to unrelated tags can
+ * proceed in parallel.
  */
 
 _dax_tag_db *_db;
 static _dax_tag_index *_index;
 static tag_index _indexcount = 0;     /* Number of tags in the index */
+static tag_index _indexsize = 0;      /* Number of slots in the index, always a power of 2 */
+static tag_index *_sorted;            /* Tag indexes in alphabetical order */
+static tag_index _sortedcount = 0;    /* Number of tags in _sorted when it is valid */
+static int _sortedvalid = 0;
+static pthread_mutex_t _sortedlock = PTHREAD_MUTEX_INITIALIZER;
 static tag_index _tagnextindex = 0;   /* The next index in the database */
+static tag_index _freehead = -1;      /* Slots of deleted tags that can be reused */
+static tag_index _freetail = -1;
 static tag_index _tagcount = 0;
 static tag_index _ovrdinstalled = 0;  /* Installled overrides */
 static tag_index _ovrdset = 0;        /* Overrides that are set */
@@ -55,6 +89,10 @@ static tag_index _dbsize = 0;         /* Size of the database and the index */
 static datatype *_datatypes;
 static unsigned int _datatype_index;  /* Next datatype index */
 static unsigned int _datatype_size;
+static pthread_rwlock_t _dblock;
+static pthread_rwlock_t _shardlocks[TAG_LOCK_SHARDS];
+
+#define SHARD_LOCK(idx) (&_shardlocks[(idx) % TAG_LOCK_SHARDS])
 
 
 /* Private function definitions */
@@ -128,6 +166,59 @@ tag_get_size(tag_index idx)
         return type_size(_db[idx].type)  * _db[idx].count;
 }
 
+/* The data of the virtual tags comes from malloc() and everything else
+ * comes from the arena */
+static void
+_tag_data_free(tag_index idx)
+{
+    if(_db[idx].attr & TAG_ATTR_VIRTUAL) {
+        xfree(_db[idx].data);
+    } else {
+        arena_free(_db[idx].data, tag_get_size(idx));
+    }
+}
+
+/* Size of the override data and mask areas of the tag */
+static inline int
+_ovrd_size(tag_index idx)
+{
+    return _db[idx].count * type_size(_db[idx].type);
+}
+
+static void
+_ovrd_free(tag_index idx)
+{
+    arena_free(_db[idx].odata, _ovrd_size(idx));
+    arena_free(_db[idx].omask, _ovrd_size(idx));
+    _db[idx].odata = NULL;
+    _db[idx].omask = NULL;
+}
+
+/* Makes the override areas of the tag big enough for 'count' items.  This
+ * has to be called before the count of the tag is changed. */
+static int
+_ovrd_grow(tag_index idx, uint32_t count)
+{
+    uint8_t *odata, *omask;
+    int size;
+
+    if(_db[idx].odata == NULL) return 0;
+    size = count * type_size(_db[idx].type);
+    odata = arena_alloc(size);
+    omask = arena_alloc(size);
+    if(odata == NULL || omask == NULL) {
+        arena_free(odata, size);
+        arena_free(omask, size);
+        return ERR_ALLOC;
+    }
+    memcpy(odata, _db[idx].odata, _ovrd_size(idx));
+    memcpy(omask, _db[idx].omask, _ovrd_size(idx));
+    _ovrd_free(idx);
+    _db[idx].odata = odata;
+    _db[idx].omask = omask;
+    return 0;
+}
+
 /* Determine whether or not the tag name is okay */
 static int
 _validate_name(char *name)
@@ -149,28 +240,49 @@ _validate_name(char *name)
     return 0;
 }
 
-/* This function searches the _index array to find the tag with
- * the given name.  It returns the index into the _index array */
+/* FNV-1a hash of the tag name */
+static inline uint32_t
+_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while(*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the slot in the _index hash table where 'name' is found or the
+ * empty slot where it would go if it's not there */
+static inline int
+_index_slot(const char *name, uint32_t hash)
+{
+    int n, mask;
+
+    mask = _indexsize - 1;
+    n = hash & mask;
+    while(_index[n].name != NULL) {
+        if(_index[n].hash == hash && strcmp(name, _index[n].name) == 0) {
+            break;
+        }
+        n = (n + 1) & mask;
+    }
+    return n;
+}
+
+/* This function searches the _index hash table to find the tag with
+ * the given name.  It returns the index of the tag in the database */
 static int
 _get_by_name(char *name)
 {
-    int i, min, max, try;
-
-    min = 0;
-    max = _indexcount - 1;
-    while(min <= max) {
-        try = min + ((max - min) / 2);
-
-        i = strcmp(name, _index[try].name);
-        if(i > 0) {
-            min = try + 1;
-        } else if(i < 0) {
-            max = try - 1;
-        } else {
-            return _index[try].tag_idx;
-        }
+    int n;
+
+    n = _index_slot(name, _name_hash(name));
+    if(_index[n].name == NULL) {
+        return ERR_NOTFOUND;
     }
-    return ERR_NOTFOUND;
+    return _index[n].tag_idx;
 }
 
 /* This function incrememnts the reference counter for the
@@ -194,98 +306,154 @@ _cdt_dec_refcount(tag_type type) {
 static int
 _database_grow(void)
 {
-    _dax_tag_index *new_index;
     _dax_tag_db *new_db;
 
-    new_index = xrealloc(_index, (_dbsize *2) * sizeof(_dax_tag_index));
     new_db = xrealloc(_db, (_dbsize *2) * sizeof(_dax_tag_db));
-
-    if(new_index != NULL && new_db != NULL) {
-        _index = new_index;
-        _db = new_db;
-        _dbsize *= 2;
-        return 0;
-    } else {
-        /* This is to shrink the one that didn't get allocated
-         so that they won't be lop sided */
-        if(new_index)
-            _index = xrealloc(_index, _dbsize * sizeof(_dax_tag_index));
-        if(new_db)
-            _db = xrealloc(_db, _dbsize * sizeof(_dax_tag_db));
-
+    if(new_db == NULL) {
         return ERR_ALLOC;
     }
+    bzero(&new_db[_dbsize], _dbsize * sizeof(_dax_tag_db));
+    _db = new_db;
+    _dbsize *= 2;
+    return 0;
 }
 
+/* Double the size of the index hash table and rehash all of the entries */
+static int
+_index_grow(void)
+{
+    _dax_tag_index *old_index;
+    tag_index old_size;
+    int n, slot, mask;
+
+    old_index = _index;
+    old_size = _indexsize;
+    _index = xmalloc(sizeof(_dax_tag_index) * old_size * 2);
+    if(_index == NULL) {
+        _index = old_index;
+        return ERR_ALLOC;
+    }
+    _indexsize = old_size * 2;
+    mask = _indexsize - 1;
+    for(n = 0; n < old_size; n++) {
+        if(old_index[n].name != NULL) {
+            slot = old_index[n].hash & mask;
+            while(_index[slot].name != NULL) {
+                slot = (slot + 1) & mask;
+            }
+            _index[slot] = old_index[n];
+        }
+    }
+    xfree(old_index);
+    return 0;
+}
 
 /* This adds the name of the tag to the index */
 static int
 _add_index(char *name, tag_index index)
 {
     int n;
+    uint32_t hash;
     char *temp;
-    int i, min, max, try;
+
+    /* Keep the table at most half full so the probe sequences stay short */
+    if((_indexcount + 1) * 2 > _indexsize) {
+        if(_index_grow()) return ERR_ALLOC;
+    }
     /* Let's allocate the memory for the string first in case it fails */
-    temp = strdup(name);
+    temp = arena_strdup(name);
     if(temp == NULL)
         return ERR_ALLOC;
 
-    if(_indexcount == 0) {
-        n = 0;
-    } else {
-        min = 0;
-        max = _indexcount - 1;
-
-        while(min <= max) {
-            try = min + ((max - min) / 2);
-            i = strcmp(name, _index[try].name);
-            if(i > 0) {
-                min = try + 1;
-            } else if(i < 0) {
-                max = try - 1;
-            } else {
-                /* It can't really get here because duplicates were checked in add_tag()
-                 * before this function was called */
-                assert(0);
-            }
-        }
-        n = min;
-        memmove(&_index[n + 1], &_index[n], (_dbsize - n - 1) * sizeof(_dax_tag_index));
-    }
+    hash = _name_hash(name);
+    n = _index_slot(name, hash);
+    /* It can't really be there because duplicates were checked in add_tag()
+     * before this function was called */
+    assert(_index[n].name == NULL);
     /* Assign pointer to database node in the index */
     _index[n].tag_idx = index;
+    _index[n].hash = hash;
     /* The name pointer in the __index and the __db point to the same string */
     _index[n].name = temp;
     _db[index].name = temp;
     _indexcount++;
+    _sortedvalid = 0;
     return 0;
 }
 
-/* Delete the entry from the index for the given tag.
- * The tag name must exist or this is an infinite loop */
+/* Delete the entry from the index for the given tag. Since we use linear
+ * probing the entries that follow in the same cluster are shifted back
+ * so that we don't have to leave a marker in the deleted slot */
 int
 _del_index(char *name) {
-    int i, min, max, try, n=-1;
-    min = 0;
-    max = _indexcount - 1;
-
-    while(min <= max) {
-        try = min + ((max - min) / 2);
-        i = strcmp(name, _index[try].name);
-        if(i > 0) {
-            min = try + 1;
-        } else if(i < 0) {
-            max = try - 1;
+    int n, next, home, mask;
+
+    n = _index_slot(name, _name_hash(name));
+    if(_index[n].name == NULL) return ERR_NOTFOUND;
+    mask = _indexsize - 1;
+    next = n;
+    while(1) {
+        next = (next + 1) & mask;
+        if(_index[next].name == NULL) break;
+        home = _index[next].hash & mask;
+        /* If the entry's home slot is cyclically between the hole and
+         * this entry then it can't be moved into the hole */
+        if(n <= next) {
+            if(n < home && home <= next) continue;
         } else {
-            n = try;
-            break;
+            if(n < home || home <= next) continue;
         }
+        _index[n] = _index[next];
+        n = next;
     }
-    memmove(&_index[n], &_index[n+1], (_dbsize - n - 1) * sizeof(_dax_tag_index));
+    _index[n].name = NULL;
     _indexcount--;
+    _sortedvalid = 0;
     return 0;
 }
 
+static int
+_sorted_compare(const void *a, const void *b)
+{
+    return strcmp(_db[*(tag_index *)a].name, _db[*(tag_index *)b].name);
+}
+
+/* Returns the database index of the tag that is at position 'n' when all
+ * of the tags are in alphabetical order by name.  The ordered view is
+ * rebuilt here if the tags have changed since the last time. */
+int
+tag_get_ordered(int n)
+{
+    tag_index *new_sorted;
+    int i, count, result;
+
+    pthread_mutex_lock(&_sortedlock);
+    if(! _sortedvalid) {
+        new_sorted = xrealloc(_sorted, sizeof(tag_index) * (_indexcount + 1));
+        if(new_sorted == NULL) {
+            pthread_mutex_unlock(&_sortedlock);
+            return ERR_ALLOC;
+        }
+        _sorted = new_sorted;
+        count = 0;
+        for(i = 0; i < _indexsize; i++) {
+            if(_index[i].name != NULL) {
+                _sorted[count++] = _index[i].tag_idx;
+            }
+        }
+        qsort(_sorted, count, sizeof(tag_index), _sorted_compare);
+        _sortedcount = count;
+        _sortedvalid = 1;
+    }
+    if(n < 0 || n >= _sortedcount) {
+        result = ERR_ARG;
+    } else {
+        result = _sorted[n];
+    }
+    pthread_mutex_unlock(&_sortedlock);
+    return result;
+}
+
 static int
 _queue_add(int idx, tag_type type, unsigned int count) {
     virt_functions vf;
@@ -338,7 +506,8 @@ virtual_tag_add(char *name, tag_type type, unsigned int count, vfunction *rf, vf
 
     idx = tag_add(-1, name, type, count, 0);
     /* We just allocated this data but that was just for convenience */
-    free(_db[idx].data);
+    shm_tag_free(idx);
+    arena_free(_db[idx].data, tag_get_size(idx));
     vf.rf = rf;
     vf.wf = wf;
     _db[idx].data = xmalloc(sizeof(virt_functions));
@@ -350,6 +519,27 @@ virtual_tag_add(char *name, tag_type type, unsigned int count, vfunction *rf, vf
 }
 
 
+/* Lock the structure of the tag database for reading.  Tag data may
+ * still be written while this is held */
+void
+tag_db_rdlock(void)
+{
+    pthread_rwlock_rdlock(&_dblock);
+}
+
+/* Lock the entire tag database for exclusive access */
+void
+tag_db_wrlock(void)
+{
+    pthread_rwlock_wrlock(&_dblock);
+}
+
+void
+tag_db_unlock(void)
+{
+    pthread_rwlock_unlock(&_dblock);
+}
+
 /* Allocates the symbol table and the database array.  There's no return
  value because failure of this function is fatal */
 void
@@ -357,6 +547,12 @@ initialize_tagbase(void)
 {
     tag_type type, tag_type;
     uint64_t starttime;
+    int n;
+
+    pthread_rwlock_init(&_dblock, NULL);
+    for(n = 0; n < TAG_LOCK_SHARDS; n++) {
+        pthread_rwlock_init(&_shardlocks[n], NULL);
+    }
 
     _db = xmalloc(sizeof(_dax_tag_db) * DAX_TAGLIST_SIZE);
     if(!_db) {
@@ -364,10 +560,11 @@ initialize_tagbase(void)
         kill(getpid(), SIGQUIT);
     }
     _dbsize = DAX_TAGLIST_SIZE;
-    /* Allocate the primary database */
+    /* Allocate the index hash table */
     _index = (_dax_tag_index *)xmalloc(sizeof(_dax_tag_index)
             * DAX_TAGLIST_SIZE);
-    if(!_db) {
+    _indexsize = DAX_TAGLIST_SIZE;
+    if(!_index) {
         dax_log(DAX_LOG_FATAL, "Unable to allocate the database");
         kill(getpid(), SIGQUIT);
     }
@@ -432,9 +629,11 @@ static void
 _set_attribute(tag_index idx, uint32_t attr) {
     /* We only let the Tag Retention attribute to be set at this point */
     if(attr & TAG_ATTR_RETAIN) {
-        /* TODO: add tag retention */;
-        ret_add_tag(idx);
-        _db[idx].attr |= TAG_ATTR_RETAIN;
+        /* Tags that were restored from the retention file are already in it */
+        if(!(_db[idx].attr & TAG_ATTR_RETAIN)) {
+            ret_add_tag(idx);
+            _db[idx].attr |= TAG_ATTR_RETAIN;
+        }
     } else {
         if(attr & TAG_ATTR_OWNED && attr & TAG_ATTR_READONLY) {
             _db[idx].attr |= (TAG_ATTR_OWNED | TAG_ATTR_READONLY);
@@ -455,6 +654,7 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
     void *newdata;
     unsigned int size;
     int result;
+    uint32_t oldattr;
     uint8_t tag_desc[47];
 
     if(count == 0) {
@@ -462,7 +662,11 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
         return ERR_ARG;
     }
 
-    if(_tagnextindex >= _dbsize) {
+    if(_freehead < 0 && _tagnextindex >= _dbsize) {
+        if(_tagnextindex > TAG_SLOT_MASK) {
+            dax_log(DAX_LOG_ERROR, "The tag database is full");
+            return ERR_2BIG;
+        }
         if(_database_grow()) {
             dax_log(DAX_LOG_ERROR, "Failure to increase database size");
             return ERR_ALLOC;
@@ -494,18 +698,38 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
         }
         /* If the tag is identical or bigger then just return the handle */
         if(_db[n].type == type && _db[n].count >= count) {
+            oldattr = _db[n].attr;
             _set_attribute(n, attr);
+            if(_db[n].attr != oldattr) {
+                module_notify_tag(tag_extern(n));
+            }
             return n;
         } else if(_db[n].type == type && _db[n].count < count) {
             /* If the new count is greater than the existing count then lets
              try to increase the size of the tags data */
-            newdata = xrealloc(_db[n].data, size);
+            newdata = arena_alloc(size);
+            if(newdata && _ovrd_grow(n, count)) {
+                arena_free(newdata, size);
+                newdata = NULL;
+            }
             if(newdata) {
+                memcpy(newdata, _db[n].data, tag_get_size(n));
+                arena_free(_db[n].data, tag_get_size(n));
                 _db[n].data = newdata;
                 _db[n].count = count;
+                /* The retained copy has to be replaced with a bigger one */
+                if(_db[n].attr & TAG_ATTR_RETAIN) {
+                    ret_del_tag(n);
+                    ret_add_tag(n);
+                }
                 _set_attribute(n, attr);
+                /* The copy in shared memory has to grow too */
+                shm_tag_free(n);
+                shm_tag_alloc(n);
+                module_notify_tag(tag_extern(n));
                 /* Since it changed we update this tag so the write event will trigger */
-                tag_write(-1, INDEX_ADDED_TAG, 0, &n, sizeof(tag_index));
+                result = tag_extern(n);
+                tag_write(-1, INDEX_ADDED_TAG, 0, &result, sizeof(tag_index));
                 return n;
             } else {
                 dax_log(DAX_LOG_ERROR, "Unable to allocate memory to grow the size of tag %s", name);
@@ -515,8 +739,11 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
             dax_log(DAX_LOG_MSGERR, "Duplicate tag name %s", name);
             return ERR_TAG_DUPL;
         }
+    } else if(_freehead >= 0) {
+        n = _freehead;
     } else {
         n = _tagnextindex;
+        _db[n].gen = 0;
     }
 
     /* Assign everything to the new tag, copy the string and git */
@@ -528,24 +755,29 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
     if(IS_QUEUE(type)) {
         _queue_add(n, type, count);
     } else {
-        /* Allocate the data area */
-        if((_db[n].data = xmalloc(size)) == NULL){
+        /* Allocate the data area, it comes back zeroed */
+        if((_db[n].data = arena_alloc(size)) == NULL){
             dax_log(DAX_LOG_ERROR, "Unable to allocate memory for tag %s", name);
             return ERR_ALLOC;
-        } else {
-            bzero(_db[n].data, size);
         }
     }
     _db[n].nextevent = 1;
     _db[n].nextmap = 1;
     _db[n].fd = fd;
     _db[n].events = NULL;
+    _db[n].eindex = NULL;
+    _db[n].mappings = NULL;
+    _db[n].mindex = NULL;
+    _db[n].maprank = 0;
+    _db[n].ret_dirty_start = 0;
+    _db[n].ret_dirty_end = 0;
     _db[n].omask = NULL;
     _db[n].odata = NULL;
 
     if(_add_index(name, n)) {
         /* free up our previous allocation if we can't put this in the __index */
-        free(_db[n].data);
+        _tag_data_free(n);
+        _db[n].data = NULL; /* The slot might still be on the free list */
         dax_log(DAX_LOG_ERROR, "Unable to allocate data for the tag database index");
         return ERR_ALLOC;
     }
@@ -553,19 +785,25 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
     if(IS_CUSTOM(type)) {
         _cdt_inc_refcount(type);
     }
-    if(_db[INDEX_LASTINDEX].data != NULL) {
-        tag_write(-1, INDEX_LASTINDEX, 0, &_tagnextindex, sizeof(tag_index));
+    if(n == _freehead) {
+        _freehead = _db[n].nextfree;
+        if(_freehead < 0) _freetail = -1;
+    } else {
+        if(_db[INDEX_LASTINDEX].data != NULL) {
+            tag_write(-1, INDEX_LASTINDEX, 0, &_tagnextindex, sizeof(tag_index));
+        }
+        _tagnextindex++;
     }
-    _tagnextindex++;
     _tagcount++;
     if(_db[INDEX_TAGCOUNT].data != NULL) {
         tag_write(-1, INDEX_TAGCOUNT, 0, &_tagcount, sizeof(tag_index));
     }
     _set_attribute(n, attr);
+    shm_tag_alloc(n);
 
     /* Update the '_tag_added' system tag */
     memset(&tag_desc, 0, sizeof(dax_tag));
-    *((tag_index *)tag_desc) = n;
+    *((tag_index *)tag_desc) = tag_extern(n);
     *((tag_type *)&tag_desc[4]) = type;
     *((dax_udint *)&tag_desc[8]) = count;
     *((uint16_t *)&tag_desc[12]) = attr;
@@ -580,24 +818,24 @@ tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr)
 int
 tag_set_attribute(tag_index index, uint32_t attr) {
     _db[index].attr |= attr;
+    shm_tag_check(index);
     return 0;
 }
 
 int
 tag_clr_attribute(tag_index index, uint32_t attr) {
     _db[index].attr &= ~attr;
+    shm_tag_check(index);
     return 0;
 }
 
 
-/* Deletes the tag given my index.  The tags position in the _db array is not
- * moved.  The name and data fields are freed and set to NULL.  The events
- * and the mappings are also freed and removed.  The item in the index is also
- * removed.  After a tag is deleted the index will always be smaller than the
- * database.  We cannot remove the items from the database and reuse them
- * because some modules may have stored an index to that tag and may try to
- * access it in the future.  If the tag is now different then bad things could
- * happen.
+/* Deletes the tag given my index.  The name and data fields are freed and
+ * set to NULL.  The events, mappings and overrides are also freed and
+ * removed.  The item in the index is also removed.  The slot's generation is
+ * incremented so that the modules that still have the old index get
+ * ERR_DELETED and the slot is put at the end of the free list.  Using the
+ * oldest free slot first keeps each generation around as long as possible.
  */
 int
 tag_del(tag_index idx)
@@ -619,35 +857,75 @@ tag_del(tag_index idx)
     if(_db[idx].attr & TAG_ATTR_RETAIN) {
         ret_del_tag(idx);
     }
-    events_del_all(_db[idx].events);
-    _db[idx].events = NULL;
-    map_del_all(_db[idx].mappings);
-    _db[idx].mappings = NULL;
+    events_del_all(idx);
+    map_del_all(idx);
+    map_del_dest(idx);
     _del_index(_db[idx].name);
     dax_log(DAX_LOG_DEBUG, "Tag deleted with name = %s", _db[idx].name);
 
     /* Update the '_tag_deleted' system tag */
     memset(&tag_desc, 0, sizeof(dax_tag));
-    *((tag_index *)tag_desc) = idx;
+    *((tag_index *)tag_desc) = tag_extern(idx);
     *((tag_type *)&tag_desc[4]) = _db[idx].type;
     *((dax_udint *)&tag_desc[8]) = _db[idx].count;
     *((uint16_t *)&tag_desc[12]) = _db[idx].attr;
     memcpy(&tag_desc[14], _db[idx].name, DAX_TAGNAME_SIZE + 1);
     tag_write(-1, INDEX_DELETED_TAG, 0, tag_desc, 47);
 
-    xfree(_db[idx].name);
-    xfree(_db[idx].data);
+    shm_tag_free(idx);
+    arena_strfree(_db[idx].name);
+    _tag_data_free(idx);
     _db[idx].name = NULL;
     _db[idx].data = NULL;
+    if(_db[idx].odata != NULL) {
+        if(_db[idx].attr & TAG_ATTR_OVR_SET) {
+            _ovrdset--;
+            tag_write(-1, INDEX_OVRD_SET, 0, &_ovrdset, sizeof(tag_index));
+        }
+        _ovrdinstalled--;
+        tag_write(-1, INDEX_OVRD_INSTALLED, 0, &_ovrdinstalled, sizeof(tag_index));
+        _ovrd_free(idx);
+    }
     _db[idx].attr = 0;
     _tagcount--;
     if(_db[INDEX_TAGCOUNT].data != NULL) {
         tag_write(-1, INDEX_TAGCOUNT, 0, &_tagcount, sizeof(tag_index));
     }
+    /* This has to go out before the generation changes the index */
+    module_notify_tag(tag_extern(idx));
+    _db[idx].gen++;
+    if(_db[idx].gen <= TAG_GEN_MAX) {
+        _db[idx].nextfree = -1;
+        if(_freetail < 0) _freehead = idx;
+        else _db[_freetail].nextfree = idx;
+        _freetail = idx;
+    }
 
     return 0;
 }
 
+/* Returns the slot in the database for the index that a module gave us.
+ * Returns ERR_ARG if the slot doesn't exist and ERR_DELETED if the tag
+ * that the index was given for has been deleted */
+tag_index
+tag_resolve(tag_index idx)
+{
+    tag_index slot;
+
+    if(idx < 0) return ERR_ARG;
+    slot = TAG_SLOT(idx);
+    if(slot >= _tagnextindex) return ERR_ARG;
+    if(_db[slot].gen != TAG_GEN(idx)) return ERR_DELETED;
+    return slot;
+}
+
+/* Returns the index that the modules use for the tag in the slot */
+tag_index
+tag_extern(tag_index slot)
+{
+    return TAG_INDEX(slot, _db[slot].gen);
+}
+
 /* Finds a tag based on it's name.  Basically just a wrapper for _get_by_name().
  * Fills in the structure 'tag' and returns zero on success */
 int
@@ -663,7 +941,7 @@ tag_get_name(char *name, dax_tag *tag)
         return ERR_DELETED;
     } else {
         if(tag != NULL) { /* Sometimes we just want to know if the tag exists */
-            tag->idx = i;
+            tag->idx = tag_extern(i);
             tag->type = _db[i].type;
             tag->count = _db[i].count;
             tag->attr = _db[i].attr;
@@ -685,7 +963,7 @@ tag_get_index(int index, dax_tag *tag)
     if(_db[index].data == NULL) {
         return ERR_DELETED;
     } else {
-        tag->idx = index;
+        tag->idx = tag_extern(index);
         tag->type = _db[index].type;
         tag->count = _db[index].count;
         tag->attr = _db[index].attr;
@@ -750,7 +1028,11 @@ tag_read(int fd, tag_index idx, int offset, void *data, int size)
          * pointed to by the *data pointer */
         vf = (virt_functions *)_db[idx].data;
         if(vf->rf == NULL) return ERR_WRITEONLY;
-        return vf->rf(fd, idx, offset, data, size, vf->userdata);
+        /* Reading some virtual tags (queues) changes their state */
+        pthread_rwlock_wrlock(SHARD_LOCK(idx));
+        result = vf->rf(fd, idx, offset, data, size, vf->userdata);
+        pthread_rwlock_unlock(SHARD_LOCK(idx));
+        return result;
     } else {
         /* Bounds check size */
         if( (offset + size) > tag_get_size(idx)) {
@@ -759,13 +1041,17 @@ tag_read(int fd, tag_index idx, int offset, void *data, int size)
         if(_db[idx].data == NULL) {
             return ERR_DELETED;
         }
+        pthread_rwlock_rdlock(SHARD_LOCK(idx));
         /* Copy the data into the right place. */
         memcpy(data, &(_db[idx].data[offset]), size);
         /* If the tag is special then call the hook */
         /* NOTE: Not sure this should be before the override */
         if(_db[idx].attr & TAG_ATTR_SPECIAL) {
             result = special_tag_read(fd, idx, offset, data, size);
-            if(result) return result;
+            if(result) {
+                pthread_rwlock_unlock(SHARD_LOCK(idx));
+                return result;
+            }
         }
         if(_db[idx].attr & TAG_ATTR_OVR_SET) {
             for(n=0; n<size; n++) {
@@ -774,16 +1060,70 @@ tag_read(int fd, tag_index idx, int offset, void *data, int size)
                  ((uint8_t *)data)[n] = x | y;
             }
         }
+        pthread_rwlock_unlock(SHARD_LOCK(idx));
     }
 
     return 0;
 }
 
+/* Copies each of the spans of a group's gather plan into buff.  Spans of
+ * plain tags are copied straight out of the database and everything else
+ * goes through tag_read().  The spans hold the index that the module gave
+ * us so a tag that was deleted since the group was added is caught here.
+ * The caller holds the database read lock. */
+int
+tag_gather(tag_span *spans, int count, uint8_t *buff)
+{
+    tag_span *span;
+    tag_index idx;
+    int n, result;
+
+    for(n = 0; n < count; n++) {
+        span = &spans[n];
+        idx = tag_resolve(span->idx);
+        if(idx < 0) return idx;
+        if(span->flags & TAG_SPAN_SLOW || _db[idx].data == NULL ||
+           _db[idx].attr & (TAG_ATTR_VIRTUAL | TAG_ATTR_SPECIAL | TAG_ATTR_OVR_SET) ||
+           IS_QUEUE(_db[idx].type)) {
+            result = tag_read(-1, idx, span->byte, &buff[span->offset], span->size);
+            if(result) return result;
+        } else {
+            pthread_rwlock_rdlock(SHARD_LOCK(idx));
+            memcpy(&buff[span->offset], &_db[idx].data[span->byte], span->size);
+            pthread_rwlock_unlock(SHARD_LOCK(idx));
+        }
+    }
+    return 0;
+}
+
+/* Copies the data that is stored in the tag without applying any overrides
+ * or calling the special tag hooks.  This is what tag retention saves and
+ * what the mappings copy to their destinations. */
+int
+tag_read_stored(tag_index idx, int offset, void *data, int size)
+{
+    if(idx < 0 || idx >= _tagnextindex) {
+        return ERR_ARG;
+    }
+    if(_db[idx].attr & TAG_ATTR_VIRTUAL) return ERR_ILLEGAL;
+    if( (offset + size) > tag_get_size(idx)) {
+        return ERR_2BIG;
+    }
+    if(_db[idx].data == NULL) {
+        return ERR_DELETED;
+    }
+    pthread_rwlock_rdlock(SHARD_LOCK(idx));
+    memcpy(data, &(_db[idx].data[offset]), size);
+    pthread_rwlock_unlock(SHARD_LOCK(idx));
+    return 0;
+}
+
 /* This function writes data to the _db just like the above function reads it */
 int
 tag_write(int fd, tag_index idx, int offset, void *data, int size)
 {
     virt_functions *vf;
+    event_pending *pending = NULL;
     int result;
 
     /* Bounds check handle */
@@ -796,7 +1136,15 @@ tag_write(int fd, tag_index idx, int offset, void *data, int size)
         * pointed to by the *data pointer */
        vf = (virt_functions *)_db[idx].data;
        if(vf->wf == NULL) return ERR_READONLY;
-       return vf->wf(fd, idx, offset, data, size, vf->userdata);
+       pthread_rwlock_wrlock(SHARD_LOCK(idx));
+       result = vf->wf(fd, idx, offset, data, size, vf->userdata);
+       /* Queues are the only virtual tags that have events */
+       if(result == 0 && IS_QUEUE(_db[idx].type)) {
+           event_check(idx, offset, size, &pending);
+       }
+       pthread_rwlock_unlock(SHARD_LOCK(idx));
+       event_send(pending);
+       return result;
     } else {
         /* Bounds check size */
         if( (offset + size) > tag_get_size(idx)) {
@@ -809,32 +1157,135 @@ tag_write(int fd, tag_index idx, int offset, void *data, int size)
             result = special_tag_write(fd, idx, offset, data, size);
             if(result) return result;
         }
+        pthread_rwlock_wrlock(SHARD_LOCK(idx));
         /* Copy the data into the right place. */
         memcpy(&(_db[idx].data[offset]), data, size);
-        event_check(idx, offset, size);
-    }
+        shm_tag_update(idx, offset, size);
+        event_check(idx, offset, size, &pending);
 
-    if(_db[idx].attr & TAG_ATTR_RETAIN) {
-        ret_tag_write(idx);
+        if(_db[idx].attr & TAG_ATTR_RETAIN) {
+            ret_tag_write(idx, offset, size);
+        }
+        pthread_rwlock_unlock(SHARD_LOCK(idx));
+        event_send(pending);
     }
 
     return 0;
 }
 
+/* Sorts the writes of a batch by tag.  The writes to each tag stay in the
+ * order that they came in so that the last one to the same bytes wins. */
+static int
+_batch_compare(const void *a, const void *b)
+{
+    const tag_write_item *x = a, *y = b;
+
+    if(x->idx != y->idx) return x->idx < y->idx ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Sorts the pieces of one tag by offset so that they can be joined */
+static int
+_batch_compare_offset(const void *a, const void *b)
+{
+    const tag_write_item *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Does all of the writes in items.  The writes are grouped by tag so all
+ * of the writes to a tag are done under one lock, wherever they are in the
+ * batch, and the events, shared memory and retention are updated once for
+ * each piece of the tag that they cover instead of once for each write.
+ * The writes to plain tags are all checked before anything is written.
+ * Virtual and special tags are handed to their functions one write at a
+ * time and those can fail after other writes in the batch have been done.
+ *
+ * *count is the number of items on the way in.  On the way out the first
+ * items in the array are the pieces of the tags that were written, with
+ * the data set to NULL, and *count is the number of them so that the
+ * caller can check the mappings.  That is true even when an error is
+ * returned. */
+int
+tag_write_batch(int fd, tag_write_item *items, int *count)
+{
+    tag_index idx;
+    uint32_t start, end;
+    event_pending *pending;
+    int n, i, first, ranges = 0, result = 0, total;
+
+    total = *count;
+    *count = 0;
+    for(n = 0; n < total; n++) {
+        idx = items[n].idx;
+        if(idx < 0 || idx >= _tagnextindex) return ERR_ARG;
+        items[n].seq = n;
+        /* Virtual tags do their own checking */
+        if(_db[idx].attr & TAG_ATTR_VIRTUAL) continue;
+        if(_db[idx].data == NULL) return ERR_DELETED;
+        if(items[n].size > (uint32_t)tag_get_size(idx) ||
+           items[n].offset > tag_get_size(idx) - items[n].size) return ERR_2BIG;
+    }
+    qsort(items, total, sizeof(tag_write_item), _batch_compare);
+    n = 0;
+    while(n < total) {
+        idx = items[n].idx;
+        /* The functions for these tags have to see every write */
+        if(_db[idx].attr & (TAG_ATTR_VIRTUAL | TAG_ATTR_SPECIAL)) {
+            result = tag_write(fd, idx, items[n].offset, items[n].data, items[n].size);
+            if(result) break;
+            items[n].data = NULL;
+            items[ranges++] = items[n++];
+            continue;
+        }
+        pending = NULL;
+        pthread_rwlock_wrlock(SHARD_LOCK(idx));
+        for(first = n; n < total && items[n].idx == idx; n++) {
+            memcpy(&_db[idx].data[items[n].offset], items[n].data, items[n].size);
+        }
+        /* Writes that touch or overlap are joined into one piece */
+        qsort(&items[first], n - first, sizeof(tag_write_item), _batch_compare_offset);
+        for(i = first; i < n;) {
+            start = items[i].offset;
+            end = start + items[i].size;
+            for(i++; i < n && items[i].offset <= end; i++) {
+                end = MAX(end, items[i].offset + items[i].size);
+            }
+            shm_tag_update(idx, start, end - start);
+            event_check(idx, start, end - start, &pending);
+            if(_db[idx].attr & TAG_ATTR_RETAIN) {
+                ret_tag_write(idx, start, end - start);
+            }
+            /* We are done with everything up to i so it's safe to reuse */
+            items[ranges].idx = idx;
+            items[ranges].offset = start;
+            items[ranges].size = end - start;
+            items[ranges].data = NULL;
+            ranges++;
+        }
+        pthread_rwlock_unlock(SHARD_LOCK(idx));
+        event_send(pending);
+    }
+    *count = ranges;
+    return result;
+}
+
 /* Writes the data to the tagbase but only if the corresponding mask bit is set */
 int
 tag_mask_write(int fd, tag_index idx, int offset, void *data, void *mask, int size)
 {
     uint8_t *db, *newdata, *newmask;
+    uint64_t d, s, m;
+    event_pending *pending = NULL;
     int n, result;
 
-    /* We don't allow masked writes to virtual tags.  This would be
-     * too ambiguous */
-    if(_db[idx].attr & TAG_ATTR_VIRTUAL) return ERR_ILLEGAL;
     /* Bounds check handle */
     if(idx < 0 || idx >= _tagnextindex) {
         return ERR_ARG;
     }
+    /* We don't allow masked writes to virtual tags.  This would be
+     * too ambiguous */
+    if(_db[idx].attr & TAG_ATTR_VIRTUAL) return ERR_ILLEGAL;
     /* Bounds check size */
     if( (offset + size) > tag_get_size(idx)) {
         return ERR_2BIG;
@@ -847,18 +1298,30 @@ tag_mask_write(int fd, tag_index idx, int offset, void *data, void *mask, int si
         if(result) return result;
     }
 
+    pthread_rwlock_wrlock(SHARD_LOCK(idx));
     /* Just to make it easier */
     db = &_db[idx].data[offset];
     newdata = (uint8_t *)data;
     newmask = (uint8_t *)mask;
-    for(n = 0; n < size; n++) {
+    /* Eight bytes at a time and then whatever is left over */
+    for(n = 0; n + 8 <= size; n += 8) {
+        memcpy(&d, &db[n], 8);
+        memcpy(&s, &newdata[n], 8);
+        memcpy(&m, &newmask[n], 8);
+        d = (s & m) | (d & ~m);
+        memcpy(&db[n], &d, 8);
+    }
+    for(; n < size; n++) {
         db[n] = (newdata[n] & newmask[n]) | (db[n] & ~newmask[n]);
     }
-    event_check(idx, offset, size);
+    shm_tag_update(idx, offset, size);
+    event_check(idx, offset, size, &pending);
 
     if(_db[idx].attr & TAG_ATTR_RETAIN) {
-        ret_tag_write(idx);
+        ret_tag_write(idx, offset, size);
     }
+    pthread_rwlock_unlock(SHARD_LOCK(idx));
+    event_send(pending);
 
     return 0;
 }
@@ -1225,20 +1688,18 @@ override_add(tag_index idx, int offset, void *data, void *mask, int size) {
     if(_db[idx].data == NULL) {
         return ERR_DELETED;
     }
-    tag_size = _db[idx].count * type_size(_db[idx].type);
+    tag_size = _ovrd_size(idx);
 
     if(_db[idx].odata == NULL) {
-        _db[idx].odata = malloc(tag_size);
+        _db[idx].odata = arena_alloc(tag_size);
         if(_db[idx].odata == NULL) return ERR_ALLOC;
-        _db[idx].omask = malloc(tag_size);
+        _db[idx].omask = arena_alloc(tag_size);
         if(_db[idx].omask == NULL) {
-            xfree(_db[idx].odata);
+            arena_free(_db[idx].odata, tag_size);
             _db[idx].odata = NULL;
 
             return ERR_ALLOC;
         }
-        bzero(_db[idx].odata, size);
-        bzero(_db[idx].omask, size);
     }
     if((offset + size) > tag_size) return ERR_2BIG;
     memcpy(&_db[idx].odata[offset], data, size);
@@ -1282,16 +1743,14 @@ override_del(tag_index idx, int offset, void *mask, int size) {
     }
     /* Remove both of the flags that indicate we have an override installed or set */
     _db[idx].attr &= ~(TAG_ATTR_OVERRIDE | TAG_ATTR_OVR_SET);
+    shm_tag_check(idx);
     /* If we get here then we've deleted the last of the overrides for this
      * tag so we'll free the memory */
     _ovrdinstalled--;
     if(_db[INDEX_OVRD_INSTALLED].data != NULL) {
         tag_write(-1, INDEX_OVRD_INSTALLED, 0, &_ovrdinstalled, sizeof(tag_index));
     }
-    xfree(_db[idx].odata);
-    _db[idx].odata = NULL;
-    xfree(_db[idx].omask);
-    _db[idx].omask = NULL;
+    _ovrd_free(idx);
 
     return 0;
 }
@@ -1330,6 +1789,7 @@ override_set(tag_index idx, uint8_t flag) {
                 tag_write(-1, INDEX_OVRD_SET, 0, &_ovrdset, sizeof(tag_index));
             }
             _db[idx].attr |= TAG_ATTR_OVR_SET;
+            shm_tag_check(idx);
         }
     } else {
         if(_db[idx].attr & TAG_ATTR_OVR_SET) {
@@ -1338,6 +1798,7 @@ override_set(tag_index idx, uint8_t flag) {
                 tag_write(-1, INDEX_OVRD_SET, 0, &_ovrdset, sizeof(tag_index));
             }
             _db[idx].attr &= ~TAG_ATTR_OVR_SET;
+            shm_tag_check(idx);
         }
     }
     return 0;
@@ -1451,9 +1912,9 @@ type_size(tag_type type)
 void
 diag_list_tags(void)
 {
-    int n;
-    for (n=0; n<_tagnextindex; n++) {
-        printf("__db[%d] = %s[%d] type = %d\n", n, _db[n].name, _db[n].count, _db[n].type);
+    int n, i;
+    for (n=0; (i = tag_get_ordered(n)) >= 0; n++) {
+        printf("__db[%d] = %s[%d] type = %d\n", i, _db[i].name, _db[i].count, _db[i].type);
     }
 }
 #endif /* TESTING */
@@ -29,10 +29,13 @@
 
 /* This stuff may be better to belong in the configuration */
 
-/* This is the initial size of the tagname list array */
+/* This is the initial size of the tagname index hash table.  It
+ * must be a power of 2 */
 #ifndef DAX_TAGLIST_SIZE
  #define DAX_TAGLIST_SIZE 1024
 #endif
+_Static_assert(DAX_TAGLIST_SIZE > 0 && (DAX_TAGLIST_SIZE & (DAX_TAGLIST_SIZE - 1)) == 0,
+               "DAX_TAGLIST_SIZE must be a power of 2");
 
 /* This is the amount that the tagname list array will grow when
  * the size is exceeded. */
@@ -51,8 +54,14 @@
 #endif
 
 
-/* This is the maximum number of mapping hops that we'll make before we print an
- * error and do some otheR drastic action. */
+/* The number of locks that protect the tag data.  Tags are assigned to
+ * a lock by their index. */
+#ifndef TAG_LOCK_SHARDS
+# define TAG_LOCK_SHARDS 64
+#endif
+
+/* This is the maximum number of mapping hops that we'll make from the tag
+ * that was written before we print an error and stop following the maps. */
 #define MAX_MAP_HOPS 128
 
 /* database indexes for status tags. */
@@ -82,54 +91,117 @@ typedef struct dax_event_t {
     uint32_t options;   /* Options for the event */
     tag_type datatype;   /* The data type of the block */
     int eventtype;       /* The type of event */
+    uint8_t primed;      /* Set after the first check of the whole range */
+    uint32_t memsize;    /* Size of the block that holds data and test */
     void *data;          /* Data given by module */
     void *test;          /* Internal data, depends on event type */
     dax_module *notify;  /* Module to be notified of this event */
     struct dax_event_t *next;
 } _dax_event;
 
+/* An event message that event_check() has built but that hasn't been sent
+ * yet.  The messages are sent with event_send() after the tag is unlocked. */
+typedef struct event_pending_t {
+    int fd;              /* Module that gets the event */
+    uint32_t header[4];  /* Message header, size, type, tag index and event id */
+    uint32_t size;       /* Size of the data, zero if no data is sent */
+    struct event_pending_t *next;
+    uint8_t data[];
+} event_pending;
+
+/* The events of a tag sorted by the starting byte of their range so that
+ * event_check() only has to look at the events that overlap a write.  See
+ * events.c */
+typedef struct {
+    int count;           /* Number of events in the index */
+    int size;            /* Allocated size of the arrays */
+    _dax_event **events; /* Events sorted by the starting byte */
+    int *maxend;         /* Largest ending byte in the subtree of each event */
+} _dax_event_index;
+
+/* These are the kinds of plans that a mapping can be compiled into */
+#define MAP_COPY  0  /* Straight copy of the source bytes */
+#define MAP_MASK  1  /* The source bits line up with the destination */
+#define MAP_SHIFT 2  /* The source bits have to be shifted into place */
+
 typedef struct dax_datamap_t {
     int id;
     tag_handle source;
     tag_handle dest;
-    uint8_t *mask;
+    uint8_t kind;        /* How the data is moved, one of the MAP_* constants */
+    uint8_t mirror;      /* Set if this is the reverse of another mapping */
+    int8_t shift;        /* Bits to move the data from source to dest (dest.bit - source.bit) */
+    int dsize;           /* Number of destination bytes that are written */
+    uint8_t *mask;       /* Mask for the destination bytes, NULL for MAP_COPY */
     struct dax_datamap_t *next;
 } _dax_datamap;
 
+/* The mappings of a tag sorted by the starting byte of their source.  This
+ * works just like the event index. See mapping.c */
+typedef struct {
+    int count;           /* Number of mappings in the index */
+    int size;            /* Allocated size of the arrays */
+    _dax_datamap **maps; /* Mappings sorted by the starting byte */
+    int *maxend;         /* Largest ending byte in the subtree of each mapping */
+} _dax_map_index;
+
 /* This is the internal structure for the tag array. */
 typedef struct {
     tag_type type;
     uint16_t attr;
+    uint16_t gen;            /* Generation of the slot, see TAG_GEN() */
     unsigned int count;
     char *name;
+    tag_index nextfree;      /* Next slot in the free list */
     int fd;                  /* fd of moduled that created the tag -1 = tagserver created tags*/
     int nextevent;           /* Counter for keeping track of event IDs */
     int nextmap;             /* Counter for keeping track of map IDs */
     _dax_event *events;      /* Linked list of events */
+    _dax_event_index *eindex; /* Events sorted by range, NULL if there are no events */
     _dax_datamap *mappings;  /* Linked list of mappings */
+    _dax_map_index *mindex;  /* Mappings sorted by source range, NULL if there are none */
+    int maprank;             /* Mappings only go from lower to higher ranks, see mapping.c */
     uint8_t *data;
     uint8_t *omask;        /* Override mask pointer */
     uint8_t *odata;        /* Override data pointer */
     uint32_t ret_file_pointer; /* Pointer to the data area of the tag retention file */
+    int ret_dirty_start;     /* Bytes that haven't been written to the retention file yet */
+    int ret_dirty_end;       /* zero if there aren't any */
 } _dax_tag_db;
 
 typedef struct {
     /* TODO: Name's size is no longer fixed, should it be?
              It still is in the library.  Let's leave it for now?? */
-    char *name;
+    char *name;          /* NULL if this slot in the hash table is empty */
+    uint32_t hash;       /* Hash of the name */
     int tag_idx;
 } _dax_tag_index;
 
+/* One of the writes in a MSG_TAG_BWRITE message */
+typedef struct {
+    tag_index idx;
+    uint32_t offset;
+    uint32_t size;
+    void *data;
+    uint32_t seq;      /* Position in the message, set by tag_write_batch() */
+} tag_write_item;
+
 /* Tag Database Handling Functions */
 void initialize_tagbase(void);
+void tag_db_rdlock(void);
+void tag_db_wrlock(void);
+void tag_db_unlock(void);
 tag_index tag_add(int fd, char *name, tag_type type, uint32_t count, uint32_t attr);
 int tag_set_attribute(tag_index index, uint32_t attr);
 int tag_clr_attribute(tag_index index, uint32_t attr);
 
 tag_index virtual_tag_add(char *name, tag_type type, unsigned int count, vfunction *rf, vfunction *wf);
 int tag_del(tag_index idx);
+tag_index tag_resolve(tag_index idx);
+tag_index tag_extern(tag_index slot);
 int tag_get_name(char *, dax_tag *);
 int tag_get_index(int, dax_tag *);
+int tag_get_ordered(int n);
 tag_index get_tagindex(void);
 int is_tag_readonly(tag_index idx);
 int is_tag_virtual(tag_index idx);
@@ -139,8 +211,11 @@ int tag_get_size(tag_index idx);
 
 /* Database reading and writing functions */
 int tag_read(int fd, tag_index handle, int offset, void *data, int size);
+int tag_read_stored(tag_index idx, int offset, void *data, int size);
+int tag_gather(tag_span *spans, int count, uint8_t *buff);
 int tag_write(int fd, tag_index handle, int offset, void *data, int size);
 int tag_mask_write(int fd, tag_index handle, int offset, void *data, void *mask, int size);
+int tag_write_batch(int fd, tag_write_item *items, int *count);
 
 /* Perform an atomic operation on the data */
 int atomic_op(tag_handle h, void *data, uint16_t op);
@@ -154,18 +229,20 @@ int type_size(tag_type type);
 int serialize_datatype(tag_type type, char **str);
 
 /* The event stuff is defined in events.c */
-void event_check(tag_index idx, int offset, int size);
+void event_check(tag_index idx, int offset, int size, event_pending **pending);
+void event_send(event_pending *pending);
 void event_del_check(tag_index idx);
 int event_add(tag_handle h, int event_type, void *data, dax_module *module);
 int event_del(int index, int id, dax_module *module);
-int events_del_all(_dax_event *head);
+int events_del_all(tag_index idx);
 int event_opt(int index, int id, uint32_t options, dax_module *module);
 int events_cleanup(dax_module *module);
 
 int map_add(tag_handle src, tag_handle dest);
 int map_del(tag_index index, int id);
 int map_get(tag_handle *src, tag_handle *dest, tag_index index, int id);
-int map_del_all(_dax_datamap *head);
+int map_del_all(tag_index idx);
+void map_del_dest(tag_index idx);
 int map_check(tag_index idx, int offset, int size);
 
 int override_add(tag_index idx, int offset, void *data, void *mask, int size);
@@ -106,8 +106,8 @@ write_queue(int fd, tag_index idx, int offset, void *data, int size, void *userd
     }
     memcpy(q->queue[next], data, q->size);
     q->qcount++;
-    /* This will break if we have any event other than "WRITE" */
-    event_check(idx, offset, size);
+    /* tag_write() checks the events once this returns.  This will break if
+     * we have any event other than "WRITE" */
 
     return 0;
 }
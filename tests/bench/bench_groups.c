@@ -0,0 +1,209 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures the memory that the tag server uses for a lot of
+ *  small tags and how fast a group that has a member in each of those tags
+ *  can be read.  The tags are added the way a typical module would do it,
+ *  with events added and temporary tags deleted along the way, so that the
+ *  server's allocations are mixed together.
+ *
+ *  The group reads are timed several times and the median is reported along
+ *  with the slowest and fastest run.  The read speed varies a lot from one
+ *  run to the next on a busy machine so a single number isn't worth much.
+ *
+ *  usage: bench_groups [tags] [seconds] [runs]
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+
+static pid_t
+_start_server(void)
+{
+    pid_t pid;
+    dax_state *ds;
+
+    pid = fork();
+    if(pid == 0) {
+        execl("../../src/server/tagserver", "../../src/server/tagserver", NULL);
+        printf("Failed to launch tagserver\n");
+        exit(-1);
+    } else if(pid < 0) {
+        return pid;
+    }
+    /* Wait for the server to start accepting connections */
+    ds = dax_init("bench_loader");
+    dax_configure(ds, 1, (char **)"dummy", 0);
+    for(int n = 0; n < 50; n++) {
+        if(dax_connect(ds) == 0) {
+            dax_disconnect(ds);
+            break;
+        }
+        usleep(20000);
+    }
+    dax_free(ds);
+    return pid;
+}
+
+/* Returns the resident set size of the process in kB */
+static long
+_get_rss(pid_t pid)
+{
+    char path[64], line[256];
+    FILE *f;
+    long rss = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if(f == NULL) return -1;
+    while(fgets(line, sizeof(line), f) != NULL) {
+        if(strncmp(line, "VmRSS:", 6) == 0) {
+            rss = atol(&line[6]);
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+static int
+_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int tags = 20000;
+    int seconds = 3;
+    int runs = 5;
+    int n, run, result;
+    long rss_start, rss_tags, reads;
+    double start, elapsed, *rates;
+    pid_t pid;
+    dax_state *ds;
+    tag_handle h, *members;
+    tag_group_id *group;
+    dax_id id;
+    char name[DAX_TAGNAME_SIZE + 1];
+    uint8_t *buff;
+
+    if(argc > 1) tags = atoi(argv[1]);
+    if(argc > 2) seconds = atoi(argv[2]);
+    if(argc > 3) runs = atoi(argv[3]);
+    if(runs < 1) runs = 1;
+
+    pid = _start_server();
+    if(pid < 0) return -1;
+    ds = dax_init("bench");
+    dax_configure(ds, 1, (char **)"dummy", 0);
+    if(dax_connect(ds)) {
+        fprintf(stderr, "Unable to connect to the server\n");
+        kill(pid, SIGINT);
+        return -1;
+    }
+    members = malloc(sizeof(tag_handle) * tags);
+    rates = malloc(sizeof(double) * runs);
+    if(members == NULL || rates == NULL) return -1;
+    rss_start = _get_rss(pid);
+
+    for(n = 0; n < tags; n++) {
+        snprintf(name, sizeof(name), "BENCH_%d", n);
+        /* A mix of the sizes that we usually see */
+        switch(n % 4) {
+            case 0: result = dax_tag_add(ds, &h, name, DAX_DINT, 1, 0); break;
+            case 1: result = dax_tag_add(ds, &h, name, DAX_REAL, 4, 0); break;
+            case 2: result = dax_tag_add(ds, &h, name, DAX_BOOL, 16, 0); break;
+            default: result = dax_tag_add(ds, &h, name, DAX_INT, 10, 0); break;
+        }
+        if(result) {
+            fprintf(stderr, "Unable to add tag %s\n", name);
+            kill(pid, SIGINT);
+            return -1;
+        }
+        members[n] = h;
+        members[n].count = 1;
+        members[n].size = h.type == DAX_BOOL ? 1 : h.size / h.count;
+        if(n % 3 == 0) {
+            dax_event_add(ds, &h, EVENT_CHANGE, NULL, &id, NULL, NULL, NULL);
+        }
+        if(n % 5 == 0) {
+            snprintf(name, sizeof(name), "TEMP_%d", n);
+            if(dax_tag_add(ds, &h, name, DAX_DINT, 8, 0) == 0) {
+                dax_tag_del(ds, h.index);
+            }
+        }
+    }
+    rss_tags = _get_rss(pid);
+
+    group = dax_group_add(ds, &result, members, tags, 0);
+    if(result) {
+        fprintf(stderr, "Unable to add the group %d\n", result);
+        kill(pid, SIGINT);
+        return -1;
+    }
+    buff = malloc(dax_group_get_size(group));
+    if(buff == NULL) return -1;
+    for(run = 0; run < runs; run++) {
+        reads = 0;
+        start = _now();
+        do {
+            for(n = 0; n < 100; n++) {
+                if(dax_group_read(ds, group, buff, dax_group_get_size(group))) {
+                    fprintf(stderr, "Group read failed\n");
+                    break;
+                }
+            }
+            reads += n;
+            elapsed = _now() - start;
+        } while(elapsed < seconds);
+        rates[run] = reads / elapsed;
+    }
+    qsort(rates, runs, sizeof(double), _compare_double);
+
+    printf("%d tags, %d byte group\n", tags, dax_group_get_size(group));
+    printf("server RSS: %ld kB at start, %ld kB with the tags (%ld bytes per tag)\n",
+           rss_start, rss_tags, (rss_tags - rss_start) * 1024 / tags);
+    printf("group reads: %.0f per second median of %d runs (%.0f - %.0f)\n",
+           rates[runs / 2], runs, rates[0], rates[runs - 1]);
+
+    dax_disconnect(ds);
+    kill(pid, SIGINT);
+    waitpid(pid, &result, 0);
+    free(members);
+    free(rates);
+    free(buff);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark compares the byte swapping kernels that the library uses
+ *  to convert tag data from a server with the other byte order.  The element
+ *  loop is the way the conversion used to be done, one function call for each
+ *  element like the stom_*() functions.  It doesn't need a tag server.
+ *
+ *  usage: bench_swap [elements] [milliseconds]
+ */
+
+#include <common.h>
+#include <libdax.h>
+#include <time.h>
+
+static const char *kernels[] = {"scalar", "ssse3", "avx2", "neon", NULL};
+
+static double
+_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* These are kept out of line so that they cost what the stom_*() calls did */
+__attribute__((noinline)) static uint16_t _elem16(uint16_t x) { return __builtin_bswap16(x); }
+__attribute__((noinline)) static uint32_t _elem32(uint32_t x) { return __builtin_bswap32(x); }
+__attribute__((noinline)) static uint64_t _elem64(uint64_t x) { return __builtin_bswap64(x); }
+
+static void
+_loop16(void *data, size_t count)
+{
+    for(size_t n = 0; n < count; n++) ((uint16_t *)data)[n] = _elem16(((uint16_t *)data)[n]);
+}
+
+static void
+_loop32(void *data, size_t count)
+{
+    for(size_t n = 0; n < count; n++) ((uint32_t *)data)[n] = _elem32(((uint32_t *)data)[n]);
+}
+
+static void
+_loop64(void *data, size_t count)
+{
+    for(size_t n = 0; n < count; n++) ((uint64_t *)data)[n] = _elem64(((uint64_t *)data)[n]);
+}
+
+/* Returns the number of elements per second that swap() gets through */
+static double
+_run(void (*swap)(void *, size_t), void *data, size_t count, double seconds)
+{
+    double start, elapsed;
+    long passes = 0;
+
+    start = _now();
+    do {
+        swap(data, count);
+        passes++;
+        elapsed = _now() - start;
+    } while(elapsed < seconds);
+    return passes * count / elapsed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    size_t count = 65536;
+    double seconds = 0.5;
+    uint8_t *data;
+    int n;
+    struct {
+        int size;
+        void (*loop)(void *, size_t);
+        void (*kernel)(void *, size_t);
+    } widths[] = {{16, _loop16, conv_swap16}, {32, _loop32, conv_swap32}, {64, _loop64, conv_swap64}};
+
+    if(argc > 1) count = atol(argv[1]);
+    if(argc > 2) seconds = atoi(argv[2]) / 1000.0;
+    data = malloc(count * 8);
+    if(data == NULL) return -1;
+    for(n = 0; n < count * 8; n++) data[n] = n;
+
+    printf("%zu elements, best kernel for this CPU is %s\n", count, conv_get_kernel());
+    printf("%-10s %12s %12s %12s   (million elements/s)\n", "", "16 bit", "32 bit", "64 bit");
+    printf("%-10s", "loop");
+    for(int w = 0; w < 3; w++) {
+        printf(" %12.1f", _run(widths[w].loop, data, count, seconds) / 1e6);
+    }
+    printf("\n");
+    for(n = 0; kernels[n] != NULL; n++) {
+        if(conv_set_kernel(kernels[n])) continue;
+        printf("%-10s", kernels[n]);
+        for(int w = 0; w < 3; w++) {
+            printf(" %12.1f", _run(widths[w].kernel, data, count, seconds) / 1e6);
+        }
+        printf("\n");
+    }
+    free(data);
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This benchmark measures the message throughput of the tag server as the
+ *  number of message worker threads is increased.  For each worker count a
+ *  new tag server is started and a number of client threads, each with its
+ *  own connection and its own tag, hammer the server with reads and writes
+ *  for a fixed amount of time.
+ *
+ *  usage: bench_workers [clients] [seconds]
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+static int _worker_counts[] = {0, 1, 2, 4, 8, 16};
+static volatile int _running;
+
+typedef struct {
+    int id;
+    int error;
+    long count;
+} client_info;
+
+static void *
+_client_thread(void *arg)
+{
+    client_info *info;
+    dax_state *ds;
+    tag_handle h;
+    char tagname[32];
+    dax_dint data[16];
+    int n;
+
+    info = (client_info *)arg;
+    ds = dax_init("bench");
+    dax_configure(ds, 1, (char **)"dummy", 0);
+    if(dax_connect(ds)) {
+        info->error = 1;
+        return NULL;
+    }
+    snprintf(tagname, sizeof(tagname), "BENCH%d", info->id);
+    if(dax_tag_add(ds, &h, tagname, DAX_DINT, 16, 0)) {
+        info->error = 1;
+        dax_disconnect(ds);
+        return NULL;
+    }
+    for(n = 0; n < 16; n++) data[n] = n;
+    while(_running) {
+        if(info->count % 2) {
+            dax_read_tag(ds, h, data);
+        } else {
+            dax_write_tag(ds, h, data);
+        }
+        info->count++;
+    }
+    dax_disconnect(ds);
+    dax_free(ds);
+    return NULL;
+}
+
+static pid_t
+_start_server(int workers)
+{
+    pid_t pid;
+    dax_state *ds;
+    char wstr[16];
+
+    snprintf(wstr, sizeof(wstr), "%d", workers);
+    pid = fork();
+    if(pid == 0) {
+        execl("../../src/server/tagserver", "../../src/server/tagserver", "-W", wstr, NULL);
+        printf("Failed to launch tagserver\n");
+        exit(-1);
+    } else if(pid < 0) {
+        return pid;
+    }
+    /* Wait for the server to start accepting connections */
+    ds = dax_init("bench_loader");
+    dax_configure(ds, 1, (char **)"dummy", 0);
+    for(int n = 0; n < 50; n++) {
+        if(dax_connect(ds) == 0) {
+            dax_disconnect(ds);
+            break;
+        }
+        usleep(20000);
+    }
+    dax_free(ds);
+    return pid;
+}
+
+static double
+_run(int workers, int clients, int seconds)
+{
+    pthread_t *threads;
+    client_info *info;
+    pid_t pid;
+    long total = 0;
+    int n, status;
+
+    pid = _start_server(workers);
+    if(pid < 0) return -1.0;
+
+    threads = malloc(sizeof(pthread_t) * clients);
+    info = calloc(clients, sizeof(client_info));
+    _running = 1;
+    for(n = 0; n < clients; n++) {
+        info[n].id = n;
+        pthread_create(&threads[n], NULL, _client_thread, &info[n]);
+    }
+    sleep(seconds);
+    _running = 0;
+    for(n = 0; n < clients; n++) {
+        pthread_join(threads[n], NULL);
+        if(info[n].error) {
+            fprintf(stderr, "Client %d failed\n", n);
+        }
+        total += info[n].count;
+    }
+    kill(pid, SIGINT);
+    waitpid(pid, &status, 0);
+    free(threads);
+    free(info);
+    return (double)total / seconds;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int clients = 16;
+    int seconds = 3;
+    int n;
+    double rate, base = 0.0;
+
+    if(argc > 1) clients = atoi(argv[1]);
+    if(argc > 2) seconds = atoi(argv[2]);
+
+    printf("%d clients, %d seconds per run\n", clients, seconds);
+    printf("%8s %14s %8s\n", "workers", "messages/sec", "scale");
+    for(n = 0; n < sizeof(_worker_counts) / sizeof(int); n++) {
+        rate = _run(_worker_counts[n], clients, seconds);
+        if(n == 0) base = rate;
+        printf("%8d %14.0f %8.2f\n", _worker_counts[n], rate, base > 0.0 ? rate / base : 0.0);
+        fflush(stdout);
+    }
+    return 0;
+}
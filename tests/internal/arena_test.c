@@ -0,0 +1,154 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Test of the slab allocator for the tag database
+ */
+
+/* This test makes sure that the arena hands out zeroed blocks that are
+ * packed together, that freed blocks are reused and that tags which are
+ * added and deleted over and over don't keep growing the arena.  It also
+ * grows a tag that has an override installed to make sure that the data
+ * and the override are kept.
+ */
+
+#include <tagbase.h>
+#include <arena.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <opendax.h>
+
+#define TAG_COUNT 200
+#define PASSES 20
+
+static void
+_test_pool(void)
+{
+    arena_pool pool;
+    uint8_t *a, *b, *c;
+    int n;
+
+    arena_pool_init(&pool, 12);
+    assert(pool.size == 16);
+    a = arena_pool_alloc(&pool);
+    b = arena_pool_alloc(&pool);
+    assert(b == a + pool.size);
+    for(n = 0; n < pool.size; n++) assert(a[n] == 0);
+    memset(a, 0xAA, pool.size);
+    arena_pool_free(&pool, a);
+    c = arena_pool_alloc(&pool);
+    /* We should get the same block back and it should be clean */
+    assert(c == a);
+    for(n = 0; n < pool.size; n++) assert(c[n] == 0);
+    assert(pool.used == 2);
+    /* Fill more than one slab */
+    for(n = 0; n < ARENA_SLAB_SIZE / pool.size; n++) {
+        assert(arena_pool_alloc(&pool) != NULL);
+    }
+    assert(pool.slabs == 2);
+}
+
+static void
+_test_sizes(void)
+{
+    uint8_t *small, *big;
+    char *str;
+    int n;
+
+    small = arena_alloc(5);
+    assert(small != NULL);
+    for(n = 0; n < 5; n++) assert(small[n] == 0);
+    arena_free(small, 5);
+    /* Anything in the same size class comes from the same pool */
+    assert(arena_alloc(8) == small);
+    arena_free(small, 8);
+
+    big = arena_alloc(ARENA_MAX_SIZE * 2);
+    assert(big != NULL);
+    for(n = 0; n < ARENA_MAX_SIZE * 2; n++) assert(big[n] == 0);
+    arena_free(big, ARENA_MAX_SIZE * 2);
+
+    str = arena_strdup("SomeTagName");
+    assert(strcmp(str, "SomeTagName") == 0);
+    arena_strfree(str);
+}
+
+static void
+_test_churn(void)
+{
+    char name[DAX_TAGNAME_SIZE + 1];
+    tag_index idx[TAG_COUNT];
+    size_t size = 0;
+    int n, pass;
+
+    for(pass = 0; pass < PASSES; pass++) {
+        for(n = 0; n < TAG_COUNT; n++) {
+            snprintf(name, sizeof(name), "churn_%d_%d", pass, n);
+            idx[n] = tag_add(-1, name, n % 2 ? DAX_REAL : DAX_INT, n % 7 + 1, 0);
+            assert(idx[n] >= 0);
+        }
+        for(n = 0; n < TAG_COUNT; n++) {
+            assert(tag_del(idx[n]) == 0);
+        }
+        /* After the first pass everything should come off the free lists */
+        if(pass == 0) size = arena_get_size();
+        assert(arena_get_size() == size);
+    }
+}
+
+static void
+_test_grow(void)
+{
+    tag_index idx;
+    dax_dint data[4] = {1, 2, 3, 4};
+    dax_dint odata[4] = {0, 0, 55, 0};
+    uint8_t omask[16];
+    dax_dint result[32];
+    uint8_t mask[sizeof(result)];
+
+    idx = tag_add(-1, "grow_tag", DAX_DINT, 4, 0);
+    assert(idx >= 0);
+    assert(tag_write(-1, idx, 0, data, sizeof(data)) == 0);
+    memset(omask, 0, sizeof(omask));
+    memset(&omask[8], 0xFF, 4);
+    assert(override_add(idx, 0, odata, omask, sizeof(odata)) == 0);
+    /* This moves the data into a bigger block */
+    assert(tag_add(-1, "grow_tag", DAX_DINT, 32, 0) == idx);
+    assert(tag_read(-1, idx, 0, result, sizeof(result)) == 0);
+    assert(memcmp(result, data, sizeof(data)) == 0);
+    for(int n = 4; n < 32; n++) assert(result[n] == 0);
+    assert(override_get(idx, 0, sizeof(result), result, mask) == 0);
+    assert(memcmp(mask, omask, sizeof(omask)) == 0);
+    for(int n = sizeof(omask); n < sizeof(mask); n++) assert(mask[n] == 0);
+    /* The override data should still be there too */
+    assert(override_set(idx, 1) == 0);
+    assert(tag_read(-1, idx, 0, result, sizeof(result)) == 0);
+    assert(result[1] == 2 && result[2] == 55 && result[3] == 4);
+    assert(tag_del(idx) == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    _test_pool();
+    _test_sizes();
+    initialize_tagbase();
+    _test_churn();
+    _test_grow();
+    return 0;
+}
@@ -99,6 +99,8 @@ main(int argc, char *argv[])
 {
     dax_state *ds;
     tag_index head;
+    uint32_t epoch;
+    dax_tag tag;
     dax_tag tags[100];
     char tagname[DAX_TAGNAME_SIZE + 1];
     int n, result;
@@ -168,13 +170,43 @@ main(int argc, char *argv[])
         cache_tag_add(ds, &tags[n]);
     }
     print_cache(ds);
-    for(n=0;n<9;n++)for(n=0;n<8;n++) {
-        if(n != 7) {
-            check_cache_hit(ds, tags[n]);
-        }
+    /* The first one that we added is the least recently used */
+    check_cache_miss(ds, tags[0]);
+    for(n=1;n<9;n++) {
+        check_cache_hit(ds, tags[n]);
+    }
+    print_cache(ds);
+    printf("Check that the least recently used tag is the one dropped\n");
+    check_cache_hit(ds, tags[1]);
+    cache_tag_add(ds, &tags[9]);
+    check_cache_miss(ds, tags[2]);
+    check_cache_hit(ds, tags[1]);
+    check_cache_hit(ds, tags[9]);
+    print_cache(ds);
+    printf("Check that re-adding a tag replaces the old one\n");
+    tags[10].idx = tags[4].idx;
+    strcpy(tags[10].name, "Renamed");
+    cache_tag_add(ds, &tags[10]);
+    result = check_cache_name(ds, tags[4].name, &tag);
+    if(result != ERR_NOTFOUND) {
+        printf("Tag with name %s was found in the cache\n", tags[4].name);
+        exit(-1);
+    }
+    check_cache_hit(ds, tags[10]);
+    printf("Check invalidation\n");
+    epoch = cache_get_epoch(ds);
+    cache_invalidate(ds, tags[5].idx);
+    check_cache_miss(ds, tags[5]);
+    if(cache_get_epoch(ds) == epoch) {
+        printf("The cache epoch didn't change\n");
+        exit(-1);
     }
+    /* An answer that was asked for before the invalidation is not cached */
+    cache_tag_add_since(ds, &tags[5], epoch);
+    check_cache_miss(ds, tags[5]);
+    cache_tag_add_since(ds, &tags[5], cache_get_epoch(ds));
+    check_cache_hit(ds, tags[5]);
     print_cache(ds);
-    check_cache_miss(ds, tags[7]);
 
     free_tag_cache(ds);
     print_cache(ds);
@@ -0,0 +1,227 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test adds compound datatypes to the library's datatype cache the
+ * same way that they come from the server and checks the member offsets
+ * and the table of runs that the data conversion functions use.  Then it
+ * makes sure that converting an array of them from a server with the other
+ * byte order swaps exactly the bytes that it should.  The second pair of
+ * datatypes has BOOLs that don't start on a byte inside a nested datatype.
+ */
+
+#include <libcommon.h>
+#include "libdax.h"
+
+struct run_check {
+    uint32_t offset;
+    tag_type type;
+    uint32_t count;
+};
+
+static int
+check_runs(datatype *dt, struct run_check *runs, int count)
+{
+    int n;
+
+    if(dt->run_count != count) {
+        printf("%s has %d runs, expected %d\n", dt->name, dt->run_count, count);
+        return -1;
+    }
+    for(n = 0; n < count; n++) {
+        if(dt->runs[n].offset != runs[n].offset || dt->runs[n].type != runs[n].type ||
+           dt->runs[n].count != runs[n].count) {
+            printf("%s run %d is {%u, 0x%X, %u}, expected {%u, 0x%X, %u}\n", dt->name, n,
+                   dt->runs[n].offset, dt->runs[n].type, dt->runs[n].count,
+                   runs[n].offset, runs[n].type, runs[n].count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* 'bits' can be NULL if every member should be on a byte boundary */
+static int
+check_members(datatype *dt, uint32_t *bytes, uint32_t *bits, int count)
+{
+    cdt_member *this;
+    int n;
+
+    this = dt->members;
+    for(n = 0; this != NULL && n < count; n++) {
+        if(this->byte != bytes[n] || this->bit != (bits ? bits[n] : 0)) {
+            printf("%s member %s is at %u.%u, expected %u.%u\n", dt->name, this->name,
+                   this->byte, this->bit, bytes[n], bits ? bits[n] : 0);
+            return -1;
+        }
+        this = this->next;
+    }
+    if(this != NULL || n != count) {
+        printf("%s has the wrong number of members\n", dt->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Swaps the bytes of the runs one at a time the slow way */
+static void
+swap_runs(datatype *dt, uint8_t *data, int count)
+{
+    int e, r, n, size, i;
+    uint8_t *p, temp;
+
+    for(e = 0; e < count; e++) {
+        for(r = 0; r < dt->run_count; r++) {
+            size = TYPESIZE(dt->runs[r].type) / 8;
+            p = data + e * dt->size + dt->runs[r].offset;
+            for(n = 0; n < dt->runs[r].count; n++, p += size) {
+                for(i = 0; i < size / 2; i++) {
+                    temp = p[i];
+                    p[i] = p[size - 1 - i];
+                    p[size - 1 - i] = temp;
+                }
+            }
+        }
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    dax_state *ds;
+    datatype *inner, *outer, *bits, *nest;
+    int size, n;
+    tag_handle h;
+    tag_group_id id;
+    uint8_t data[120], check[120];
+    /* add_cdt_to_cache() writes to these */
+    char inner_desc[] = "Inner:flag,BOOL,1:w,INT,2:v,INT,1:d,DINT,1";
+    char outer_desc[] = "Outer:b,BOOL,3:in,Inner,2:r,REAL,4:l,LREAL,1:c,CHAR,5:t,TIME,1";
+    /* The two INTs in Inner are joined into one run */
+    struct run_check inner_runs[] = {{1, DAX_INT, 3}, {7, DAX_DINT, 1}};
+    struct run_check outer_runs[] = {{2, DAX_INT, 3}, {8, DAX_DINT, 1},
+                                     {13, DAX_INT, 3}, {19, DAX_DINT, 1},
+                                     {23, DAX_REAL, 4}, {39, DAX_LREAL, 1},
+                                     {52, DAX_TIME, 1}};
+    uint32_t outer_bytes[] = {0, 1, 23, 39, 47, 52};
+    /* b starts at bit 3 and runs into the second byte.  Nest puts a
+     * datatype of only BOOLs and then two of Bits after five BOOLs */
+    char flags_desc[] = "Flags:f,BOOL,3";
+    char bits_desc[] = "Bits:a,BOOL,3:b,BOOL,7:s,INT,1:c,BOOL,2";
+    char nest_desc[] = "Nest:x,BOOL,5:fl,Flags,1:bits,Bits,2:y,BOOL,4:z,DINT,1";
+    uint32_t bits_bytes[] = {0, 0, 2, 4};
+    uint32_t bits_bits[] = {0, 3, 0, 0};
+    uint32_t nest_bytes[] = {0, 1, 2, 12, 13};
+    struct run_check bits_runs[] = {{2, DAX_INT, 1}};
+    struct run_check nest_runs[] = {{4, DAX_INT, 1}, {9, DAX_INT, 1}, {13, DAX_DINT, 1}};
+
+    ds = dax_init("cdt_layout_test");
+    dax_init_config(ds, "cdt_layout_test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+
+    if(add_cdt_to_cache(ds, CDT_TO_TYPE(1), inner_desc)) return -1;
+    if(add_cdt_to_cache(ds, CDT_TO_TYPE(2), outer_desc)) return -1;
+    inner = get_cdt_pointer(ds, CDT_TO_TYPE(1), NULL);
+    outer = get_cdt_pointer(ds, CDT_TO_TYPE(2), NULL);
+    if(inner == NULL || outer == NULL) return -1;
+
+    if(inner->size != 11 || outer->size != 60) {
+        printf("Bad sizes %d, %d\n", inner->size, outer->size);
+        return -1;
+    }
+    /* The size has to match what dax_get_typesize() figures the long way */
+    outer->size = 0;
+    size = dax_get_typesize(ds, CDT_TO_TYPE(2));
+    outer->size = 60;
+    if(size != 60) {
+        printf("dax_get_typesize() returned %d\n", size);
+        return -1;
+    }
+    if(check_members(outer, outer_bytes, NULL, sizeof(outer_bytes) / sizeof(uint32_t))) return -1;
+    if(check_runs(inner, inner_runs, sizeof(inner_runs) / sizeof(struct run_check))) return -1;
+    if(check_runs(outer, outer_runs, sizeof(outer_runs) / sizeof(struct run_check))) return -1;
+
+    /* Nothing is touched if the server has our format */
+    for(n = 0; n < sizeof(data); n++) data[n] = check[n] = n;
+    bzero(&h, sizeof(h));
+    h.type = CDT_TO_TYPE(2);
+    h.count = 2;
+    h.size = sizeof(data);
+    bzero(&id, sizeof(id));
+    id.count = 1;
+    id.size = h.size;
+    id.handles = &h;
+    if(group_read_format(ds, &id, data)) return -1;
+    if(memcmp(data, check, sizeof(data))) {
+        printf("Data was changed without a reformat\n");
+        return -1;
+    }
+    ds->reformat = REF_INT_SWAP | REF_FLT_SWAP;
+    if(group_read_format(ds, &id, data)) return -1;
+    swap_runs(outer, check, 2);
+    if(memcmp(data, check, sizeof(data))) {
+        printf("Reformatted data is wrong\n");
+        return -1;
+    }
+    if(group_write_format(ds, &id, data)) return -1;
+    for(n = 0; n < sizeof(data); n++) {
+        if(data[n] != n) {
+            printf("Write format didn't put byte %d back\n", n);
+            return -1;
+        }
+    }
+    ds->reformat = 0;
+
+    if(add_cdt_to_cache(ds, CDT_TO_TYPE(3), flags_desc)) return -1;
+    if(add_cdt_to_cache(ds, CDT_TO_TYPE(4), bits_desc)) return -1;
+    if(add_cdt_to_cache(ds, CDT_TO_TYPE(5), nest_desc)) return -1;
+    bits = get_cdt_pointer(ds, CDT_TO_TYPE(4), NULL);
+    nest = get_cdt_pointer(ds, CDT_TO_TYPE(5), NULL);
+    if(bits == NULL || nest == NULL) return -1;
+    if(bits->size != 5 || nest->size != 17) {
+        printf("Bad sizes %d, %d\n", bits->size, nest->size);
+        return -1;
+    }
+    nest->size = 0;
+    size = dax_get_typesize(ds, CDT_TO_TYPE(5));
+    nest->size = 17;
+    if(size != 17) {
+        printf("dax_get_typesize() returned %d for Nest\n", size);
+        return -1;
+    }
+    if(check_members(bits, bits_bytes, bits_bits, sizeof(bits_bytes) / sizeof(uint32_t))) return -1;
+    if(check_members(nest, nest_bytes, NULL, sizeof(nest_bytes) / sizeof(uint32_t))) return -1;
+    if(check_runs(bits, bits_runs, sizeof(bits_runs) / sizeof(struct run_check))) return -1;
+    if(check_runs(nest, nest_runs, sizeof(nest_runs) / sizeof(struct run_check))) return -1;
+
+    /* Only the INTs and the DINT get swapped, the bits are left alone */
+    for(n = 0; n < 34; n++) data[n] = check[n] = n;
+    h.type = CDT_TO_TYPE(5);
+    h.size = id.size = 34;
+    ds->reformat = REF_INT_SWAP | REF_FLT_SWAP;
+    if(group_read_format(ds, &id, data)) return -1;
+    swap_runs(nest, check, 2);
+    if(memcmp(data, check, 34)) {
+        printf("Reformatted Nest data is wrong\n");
+        return -1;
+    }
+    ds->reformat = 0;
+
+    dax_free_config(ds);
+    dax_free(ds);
+    return 0;
+}
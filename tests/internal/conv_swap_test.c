@@ -0,0 +1,77 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* This test checks the bulk byte swapping functions in the library.  Every
+ * kernel that will run on this machine is checked against a byte at a time
+ * swap for a range of counts and alignments.  The bytes around the array
+ * must not be touched.
+ */
+
+#include <libcommon.h>
+#include "libdax.h"
+
+#define MAX_COUNT 100
+#define PAD 32
+
+static const char *kernels[] = {"scalar", "ssse3", "avx2", "neon", NULL};
+
+static int
+check_swap(int size, void (*swap)(void *, size_t))
+{
+    uint8_t buff[MAX_COUNT * 8 + PAD * 2], check[MAX_COUNT * 8 + PAD * 2];
+    int count, align, n, i;
+
+    for(count = 0; count <= MAX_COUNT; count++) {
+        for(align = 0; align < 8; align++) {
+            for(n = 0; n < sizeof(buff); n++) {
+                buff[n] = check[n] = (uint8_t)(n * 7 + 3);
+            }
+            for(n = 0; n < count; n++) {
+                for(i = 0; i < size; i++) {
+                    check[PAD + align + n * size + i] = buff[PAD + align + n * size + size - 1 - i];
+                }
+            }
+            swap(&buff[PAD + align], count);
+            if(memcmp(buff, check, sizeof(buff))) {
+                printf("%d byte swap failed for count = %d, align = %d\n", size, count, align);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int n;
+
+    printf("Picked the %s kernel\n", conv_get_kernel());
+    for(n = 0; kernels[n] != NULL; n++) {
+        if(conv_set_kernel(kernels[n])) {
+            printf("Skipping %s\n", kernels[n]);
+            continue;
+        }
+        printf("Testing %s\n", kernels[n]);
+        if(check_swap(2, conv_swap16)) return -1;
+        if(check_swap(4, conv_swap32)) return -1;
+        if(check_swap(8, conv_swap64)) return -1;
+    }
+    if(conv_set_kernel("bogus") != ERR_NOTFOUND) return -1;
+    return 0;
+}
@@ -14,132 +14,150 @@
  *  You should have received a copy of the GNU General Public License
  *  along with this program; if not, write to the Free Software
  *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
- *
- *  Main source code file for the OpenDAX Bad Module
  */
 
-/* This test program loads up the caching functions from the library and
- * tests that the functions that deal with the cache behave correctly
+/* This test loads the event functions from the library and checks that the
+ * event message queue behaves like a ring and that the events are found in
+ * the event table when the messages are dispatched.
  */
 
 #include <libcommon.h>
 #include "../../src/lib/libdax.h"
+#include <arpa/inet.h>
 
-/* pushes 16 events to the queue and checks that we can
- * pop them off properly */
-int
-simple_push_test(void) {
-    dax_state *ds;
-    dax_message msg;
-    dax_message *eq;
-    int n, result;
+static int validation[64];
 
-    ds = dax_init("event_queue");
-    msg.size = 10;
-    msg.msg_type = 20;
+static void
+test_callback(dax_state *ds, void *udata) {
+    validation[(long)udata]++;
+}
 
-    for(n=0; n<16; n++) {
-        msg.fd = n+1;
-        push_event(ds, &msg);
-    }
-    eq = ds->emsg_queue;
-    for(n=0; n<16; n++) {
-        assert(eq[n].fd == n+1);
-    }
-    dax_free(ds);
-    return 0;
+/* Gets an event message buffer from the library and fills it in */
+static dax_message *
+_new_msg(dax_state *ds, uint32_t idx, uint32_t id, int fd)
+{
+    dax_message *msg;
+
+    msg = event_msg_alloc(ds, 8);
+    assert(msg != NULL);
+    msg->size = 8;
+    msg->msg_type = MSG_EVENT;
+    msg->fd = fd;
+    *(uint32_t *)&msg->data[0] = htonl(idx);
+    *(uint32_t *)&msg->data[4] = htonl(id);
+    return msg;
 }
 
 /* this puts three events on the queue and then pops them off to
- * move the pointer up in the list.  Then it adds eight more to the
+ * move the head up in the ring.  Then it adds eight more to the
  * queue to test that it rolls over properly */
 int
 simple_fragment_test(void) {
     dax_state *ds;
-    dax_message msg;
-    dax_message *eq, *test;
-    int n, result;
+    dax_message *test;
+    int n;
 
     ds = dax_init("event_queue");
-    msg.size = 10;
-    msg.msg_type = 20;
-    /* put three messages on the queue */
     for(n=0; n<3; n++) {
-        msg.fd = n+1;
-        push_event(ds, &msg);
+        assert(push_event(ds, _new_msg(ds, 1, 1, n+1)) == 0);
     }
-    eq = ds->emsg_queue;
-    for(n=0; n<3; n++) {
-        assert(eq[n].fd == n+1);
-    }
-    /* pop them off */
     for(n=0; n<3; n++) {
         test = pop_event(ds);
-        assert(test == &eq[n]);
+        assert(test->fd == n+1);
+        event_msg_free(ds, test);
     }
-    /* Add 8 more */
-    for(n=0; n<8; n++) {
-        msg.fd = n+11;
-        push_event(ds, &msg);
+    assert(pop_event(ds) == NULL);
+    /* The buffers should be handed out again */
+    assert(ds->emsg_pool_count == 3);
+    for(n=0; n<EVENT_QUEUE_SIZE; n++) {
+        assert(push_event(ds, _new_msg(ds, 1, 1, n+11)) == 0);
     }
-    /* Check that we get them properly */
-    for(n=0; n<8; n++) {
+    assert(ds->emsg_pool_count == 0);
+    for(n=0; n<EVENT_QUEUE_SIZE; n++) {
         test = pop_event(ds);
         assert(test->fd == n+11);
+        event_msg_free(ds, test);
     }
     dax_free(ds);
     return 0;
 }
 
+/* Overfills the queue and checks that the oldest messages are the ones that
+ * are thrown away */
 int
-fragment_grow_test(void) {
+overflow_test(void) {
     dax_state *ds;
-    dax_message msg;
-    dax_message *eq, *test;
+    dax_message *test;
     int n, result;
 
     ds = dax_init("event_queue");
-    msg.size = 10;
-    msg.msg_type = 20;
-    /* put three messages on the queue */
-    for(n=0; n<3; n++) {
-        msg.fd = n+1;
-        push_event(ds, &msg);
-    }
-    eq = ds->emsg_queue;
-    for(n=0; n<3; n++) {
-        assert(eq[n].fd == n+1);
+    for(n=0; n<EVENT_QUEUE_SIZE+4; n++) {
+        result = push_event(ds, _new_msg(ds, 1, 1, n+1));
+        assert(result == (n < EVENT_QUEUE_SIZE ? 0 : ERR_OVERFLOW));
     }
-    /* pop them off */
-    for(n=0; n<3; n++) {
+    assert(ds->emsg_queue_count == EVENT_QUEUE_SIZE);
+    for(n=0; n<EVENT_QUEUE_SIZE; n++) {
         test = pop_event(ds);
-        assert(test == &eq[n]);
+        assert(test->fd == n+5);
+        event_msg_free(ds, test);
     }
-    /* Add 12 more */
-    for(n=0; n<12; n++) {
-        msg.fd = n+11;
-        push_event(ds, &msg);
+    dax_free(ds);
+    return 0;
+}
+
+/* Adds enough events to make the table grow, deletes some and then
+ * dispatches messages for all of them through dax_event_poll() */
+int
+dispatch_test(void) {
+    dax_state *ds;
+    dax_message *msg;
+    dax_id id;
+    int n, result;
+
+    ds = dax_init("event_queue");
+    for(n=0; n<64; n++) {
+        id.index = n / 4;
+        id.id = n % 4;
+        assert(add_event(ds, id, (void *)(long)n, test_callback, NULL) == 0);
     }
-    /* Check that we get them properly */
-    for(n=0; n<12; n++) {
-        test = pop_event(ds);
-        assert(test->fd == n+11);
+    assert(ds->event_count == 64);
+    assert(ds->event_size >= 64);
+    for(n=0; n<64; n+=3) {
+        id.index = n / 4;
+        id.id = n % 4;
+        assert(del_event(ds, id) == 0);
+        assert(del_event(ds, id) == ERR_NOTFOUND);
     }
+    for(n=0; n<64; n++) {
+        msg = _new_msg(ds, n / 4, n % 4, 0);
+        pthread_mutex_lock(&ds->event_lock);
+        push_event(ds, msg);
+        pthread_mutex_unlock(&ds->event_lock);
+        result = dax_event_poll(ds, &id);
+        if(n % 3 == 0) {
+            assert(result == ERR_GENERIC);
+            assert(validation[n] == 0);
+        } else {
+            assert(result == 0);
+            assert(id.index == n / 4 && id.id == n % 4);
+            assert(validation[n] == 1);
+        }
+    }
+    assert(dax_event_poll(ds, NULL) == ERR_NOTFOUND);
     dax_free(ds);
     return 0;
 }
 
-
 int
 main(int argc, char *argv[])
 {
     int result;
 
-    result = simple_push_test();
-    if(result) return result;
     result = simple_fragment_test();
     if(result) return result;
-    result = fragment_grow_test();
+    result = overflow_test();
+    if(result) return result;
+    result = dispatch_test();
     if(result) return result;
     return 0;
 }
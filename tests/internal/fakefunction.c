@@ -25,3 +25,8 @@ dax_module *
 module_find_fd(int fd) {
     return NULL;
 }
+
+void
+module_notify_tag(tag_index idx) {
+    return;
+}
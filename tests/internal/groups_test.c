@@ -24,6 +24,7 @@
 #include "opendax.h"
 #include "daxtypes.h"
 #include "groups.h"
+#include "tagbase.h"
 #include "libcommon.h"
 
 
@@ -35,11 +36,12 @@ _test_simple(void) {
     tag_handle h;
 
     /* Initialize the module */
+    bzero(&mod, sizeof(mod));
     mod.groups_size = 0;
     mod.tag_groups = NULL;
     mod.name = "test";
 
-    index = group_add(&mod, NULL, 0);
+    index = group_add(&mod, NULL, 0, 0);
     if(index < 0) exit(index);
     assert(mod.groups_size == TAG_GROUP_START_COUNT);
     assert(index==0); /* Zero should be the first one */
@@ -54,12 +56,13 @@ _test_group_array_growth(void) {
     tag_handle h;
 
     /* Initialize the module */
+    bzero(&mod, sizeof(mod));
     mod.groups_size = 0;
     mod.tag_groups = NULL;
     mod.name = "test";
 
     for(n=0;n<TAG_GROUP_START_COUNT;n++) {
-        index = group_add(&mod, NULL, 0);
+        index = group_add(&mod, NULL, 0, 0);
         if(index < 0) exit(index);
         assert(index == n);
     }
@@ -67,7 +70,7 @@ _test_group_array_growth(void) {
     assert(mod.groups_size == TAG_GROUP_START_COUNT);
 
     /* Now add one more and make sure it doubles in size */
-    index = group_add(&mod, NULL, 0);
+    index = group_add(&mod, NULL, 0, 0);
     if(index < 0) exit(index);
     assert(index == TAG_GROUP_START_COUNT);
 
@@ -85,11 +88,12 @@ _test_group_size(void) {
     int result, count;
 
     /* Initialize the module */
+    bzero(&mod, sizeof(mod));
     mod.groups_size = 0;
     mod.tag_groups = NULL;
     mod.name = "test";
 
-    index = group_add(&mod, NULL, 0);
+    index = group_add(&mod, NULL, 0, 0);
     if(index < 0) exit(index);
 
     count = MSG_TAG_GROUP_DATA_SIZE / 4;
@@ -97,10 +101,207 @@ _test_group_size(void) {
     groups_cleanup(&mod);
 }
 
+/* Puts a handle in the buffer the same way that the group add message does */
+static void
+_put_handle(uint8_t *buff, int n, tag_index idx, uint32_t byte, uint8_t bit,
+            uint32_t count, uint32_t size, tag_type type) {
+    buff = &buff[21*n];
+    memcpy(&buff[0], &idx, 4);
+    memcpy(&buff[4], &byte, 4);
+    buff[8] = bit;
+    memcpy(&buff[9], &count, 4);
+    memcpy(&buff[13], &size, 4);
+    memcpy(&buff[17], &type, 4);
+}
+
+/* Makes sure members that follow each other are coalesced and that BOOL
+ * members are packed and unpacked properly */
+static void
+_test_group_plan(void) {
+    dax_module mod;
+    tag_index a, b;
+    uint8_t handles[21*5];
+    uint8_t buff[64];
+    dax_dint dints[10];
+    uint32_t bits, packed;
+    int index, n;
+
+    bzero(&mod, sizeof(mod));
+    mod.groups_size = 0;
+    mod.tag_groups = NULL;
+    mod.name = "test";
+
+    initialize_tagbase();
+    a = tag_add(-1, "grp_dint", DAX_DINT, 10, 0);
+    b = tag_add(-1, "grp_bool", DAX_BOOL, 32, 0);
+    assert(a > 0 && b > 0);
+    for(n=0;n<10;n++) dints[n] = n * 11;
+    assert(tag_write(-1, a, 0, dints, sizeof(dints)) == 0);
+    bits = 0xA5A5A5A5;
+    assert(tag_write(-1, b, 0, &bits, 4) == 0);
+
+    _put_handle(handles, 0, a, 0, 0, 2, 8, DAX_DINT);
+    _put_handle(handles, 1, a, 8, 0, 1, 4, DAX_DINT);
+    _put_handle(handles, 2, b, 0, 3, 10, 2, DAX_BOOL);
+    _put_handle(handles, 3, a, 20, 0, 1, 4, DAX_DINT);
+    _put_handle(handles, 4, b, 2, 0, 16, 2, DAX_BOOL);
+    index = group_add(&mod, handles, 5, 0);
+    assert(index >= 0);
+    /* The first two members are in one span and the byte aligned BOOLs
+     * don't need to be packed */
+    assert(mod.tag_groups[index].plan_count == 4);
+    assert(mod.tag_groups[index].size == 20);
+
+    assert(group_read(&mod, index, buff, sizeof(buff), 0) == 20);
+    assert(memcmp(buff, dints, 12) == 0);
+    packed = 0;
+    memcpy(&packed, &buff[12], 2);
+    assert(packed == ((0xA5A5 >> 3) & 0x3FF));
+    assert(memcmp(&buff[14], &dints[5], 4) == 0);
+    assert(memcmp(&buff[18], &((uint8_t *)&bits)[2], 2) == 0);
+
+    /* Writing the BOOL member should only change its own bits */
+    packed = 0x3FF;
+    memcpy(&buff[12], &packed, 2);
+    assert(group_write(&mod, index, buff) == 20);
+    assert(tag_read(-1, b, 0, &bits, 4) == 0);
+    assert(bits == (0xA5A5A5A5 | (0x3FF << 3)));
+    groups_cleanup(&mod);
+}
+
+/* Adds, reads and writes a group that is too big for one frame a piece
+ * at a time the same way that the messages do */
+static void
+_test_group_chunked(void) {
+    dax_module mod;
+    tag_index a;
+    uint8_t *handles, *data;
+    uint8_t buff[64];
+    dax_dint dints[1000], out[1000];
+    int index, n, result;
+    uint32_t offset;
+
+    bzero(&mod, sizeof(mod));
+    mod.name = "test";
+
+    a = tag_add(-1, "grp_big", DAX_DINT, 1000, 0);
+    assert(a > 0);
+    for(n=0;n<1000;n++) dints[n] = n * 3;
+    assert(tag_write(-1, a, 0, dints, sizeof(dints)) == 0);
+    /* Every other element backwards so that nothing is coalesced */
+    handles = malloc(GRP_HANDLE_SIZE * 500);
+    assert(handles != NULL);
+    for(n=0;n<500;n++) _put_handle(handles, n, a, (999 - n*2)*4, 0, 1, 4, DAX_DINT);
+
+    /* A continuation without a start is refused */
+    assert(group_add_part(&mod, handles, 100, 0, GRP_XFER_NEXT) == ERR_ARG);
+    assert(group_add_part(&mod, handles, 200, 0, GRP_XFER_MORE) == 0);
+    assert(group_add_part(&mod, &handles[GRP_HANDLE_SIZE*200], 200, 0, GRP_XFER_MORE | GRP_XFER_NEXT) == 0);
+    index = group_add_part(&mod, &handles[GRP_HANDLE_SIZE*400], 100, 0, GRP_XFER_NEXT);
+    assert(index >= 0);
+    assert(mod.tag_groups[index].count == 500);
+    assert(mod.tag_groups[index].size == 2000);
+
+    /* The first frame reads the whole group.  Changing the tag after that
+     * shouldn't show up in the rest of the frames. */
+    data = NULL;
+    result = group_read_part(&mod, index, 0, 0, buff, sizeof(buff), 800, &data);
+    assert(result == 800);
+    memcpy(out, data, result);
+    offset = result;
+    bzero(dints, sizeof(dints));
+    assert(tag_write(-1, a, 0, dints, sizeof(dints)) == 0);
+    /* Frames have to come in order */
+    assert(group_read_part(&mod, index, 100, 0, buff, sizeof(buff), 800, &data) == ERR_ARG);
+    while(offset < 2000) {
+        result = group_read_part(&mod, index, offset, 0, buff, sizeof(buff), 800, &data);
+        assert(result > 0);
+        memcpy(&((uint8_t *)out)[offset], data, result);
+        offset += result;
+    }
+    assert(result == 400);
+    for(n=0;n<500;n++) assert(out[n] == (999 - n*2) * 3);
+
+    /* Nothing is written until the last piece is in */
+    assert(group_write_part(&mod, index, 0, (uint8_t *)out, 1200) == 0);
+    assert(tag_read(-1, a, 0, dints, sizeof(dints)) == 0);
+    assert(dints[999] == 0);
+    assert(group_write_part(&mod, index, 1200, &((uint8_t *)out)[1200], 1000) == ERR_2BIG);
+    assert(group_write_part(&mod, index, 0, (uint8_t *)out, 1200) == 0);
+    assert(group_write_part(&mod, index, 1200, &((uint8_t *)out)[1200], 800) == 2000);
+    assert(tag_read(-1, a, 0, dints, sizeof(dints)) == 0);
+    for(n=0;n<1000;n++) assert(dints[n] == (n % 2 ? n * 3 : 0));
+
+    free(handles);
+    groups_cleanup(&mod);
+    assert(mod.xfer.data == NULL);
+}
+
+/* A delta read that is too big for one frame should only count as sent once
+ * the last frame is out.  If the module gives up part way the next read has
+ * to send every member again. */
+static void
+_test_group_delta_chunked(void) {
+    dax_module mod;
+    tag_index a;
+    uint8_t *handles, *data, *buff;
+    dax_dint dints[1000];
+    int index, n, result, size, map;
+    uint32_t offset;
+
+    bzero(&mod, sizeof(mod));
+    mod.name = "test";
+
+    a = tag_add(-1, "grp_delta_big", DAX_DINT, 1000, 0);
+    assert(a > 0);
+    for(n=0;n<1000;n++) dints[n] = n;
+    assert(tag_write(-1, a, 0, dints, sizeof(dints)) == 0);
+    handles = malloc(GRP_HANDLE_SIZE * 500);
+    assert(handles != NULL);
+    for(n=0;n<500;n++) _put_handle(handles, n, a, (999 - n*2)*4, 0, 1, 4, DAX_DINT);
+    index = group_add(&mod, handles, 500, GROUP_OPT_DELTA);
+    assert(index >= 0);
+    map = GRP_DELTA_MAP_SIZE(500);
+    size = 2000 + map;
+    buff = malloc(size);
+    assert(buff != NULL);
+
+    /* Only the first frame goes out */
+    result = group_read_part(&mod, index, 0, 0, buff, size, 800, &data);
+    assert(result == 800);
+    /* Everything has to come again even though nothing changed */
+    result = group_read_part(&mod, index, 0, 0, buff, size, size, &data);
+    assert(result == size);
+    for(n=0;n<map;n++) assert(data[n] == (n < map - 1 ? 0xFF : 0x0F));
+    /* That one was all in one frame so now nothing is sent */
+    result = group_read_part(&mod, index, 0, 0, buff, size, size, &data);
+    assert(result == map);
+
+    /* Change all of the members and read them in frames all the way
+     * through.  After that the shadow is good again. */
+    bzero(dints, sizeof(dints));
+    assert(tag_write(-1, a, 0, dints, sizeof(dints)) == 0);
+    result = group_read_part(&mod, index, 0, 0, buff, size, 800, &data);
+    assert(result == 800);
+    for(offset = result; offset < size; offset += result) {
+        result = group_read_part(&mod, index, offset, 0, buff, size, 800, &data);
+        assert(result > 0);
+    }
+    result = group_read_part(&mod, index, 0, 0, buff, size, size, &data);
+    assert(result == map);
+
+    free(buff);
+    free(handles);
+    groups_cleanup(&mod);
+}
+
 int
 main(int argc, char *argv[]) {
     _test_simple();
     _test_group_array_growth();
     _test_group_size();
+    _test_group_plan();
+    _test_group_chunked();
+    _test_group_delta_chunked();
     exit(0);
 }
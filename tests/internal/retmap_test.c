@@ -0,0 +1,164 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Tests the memory mapped tag retention file.  Each part runs in its own
+ *  process so that the tag database starts empty like it would in a new
+ *  server.  The last part corrupts the newest copy of the page that holds
+ *  a retained tag and makes sure that we fall back to the older copy.
+ */
+
+#include <tagbase.h>
+#include <retain.h>
+#include <retmap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+#include <opendax.h>
+
+#define RETFILE "retmap_test.map"
+#define BIG_COUNT 5000
+
+static void
+_write_dint(tag_index idx, int32_t value)
+{
+    int32_t data[4] = {value, value, value, value};
+
+    assert(tag_write(-1, idx, 0, data, sizeof(data)) == 0);
+}
+
+static void
+_check_dint(int32_t value)
+{
+    dax_tag tag;
+    int32_t data[4];
+
+    assert(tag_get_name("ret_dint", &tag) == 0);
+    assert(tag.attr & TAG_ATTR_RETAIN);
+    assert(tag_read(-1, tag.idx, 0, data, sizeof(data)) == 0);
+    assert(data[0] == value && data[3] == value);
+}
+
+static void
+_first_run(void)
+{
+    tag_index idx, big, gone;
+    tag_type type;
+    int32_t data[BIG_COUNT];
+    int n;
+
+    assert(ret_init(RETFILE, "mmap", 0) == 0);
+    idx = tag_add(-1, "ret_dint", DAX_DINT, 4, TAG_ATTR_RETAIN);
+    assert(idx > 0);
+    type = cdt_create("RetType:Value,DINT,1:Flags,BOOL,3", NULL);
+    assert(type != 0);
+    assert(tag_add(-1, "ret_cdt", type, 2, TAG_ATTR_RETAIN) > 0);
+    gone = tag_add(-1, "ret_gone", DAX_INT, 1, TAG_ATTR_RETAIN);
+    assert(gone > 0);
+    /* Big enough to make the file grow */
+    big = tag_add(-1, "ret_big", DAX_DINT, BIG_COUNT, TAG_ATTR_RETAIN);
+    assert(big > 0);
+    for(n = 0; n < BIG_COUNT; n++) data[n] = n * 3;
+    assert(tag_write(-1, big, 0, data, sizeof(data)) == 0);
+    assert(tag_del(gone) == 0);
+    /* These two have to be last for the corruption test */
+    _write_dint(idx, 1);
+    _write_dint(idx, 2);
+    ret_close();
+}
+
+static void
+_second_run(void)
+{
+    dax_tag tag;
+    int32_t data[BIG_COUNT];
+    int n;
+
+    assert(ret_init(RETFILE, "mmap", 0) == 0);
+    _check_dint(2);
+    assert(tag_get_name("ret_gone", &tag) == ERR_NOTFOUND);
+    assert(tag_get_name("ret_cdt", &tag) == 0);
+    assert(tag.type == cdt_get_type("RetType"));
+    assert(tag_get_name("ret_big", &tag) == 0);
+    assert(tag_read(-1, tag.idx, 0, data, sizeof(data)) == 0);
+    for(n = 0; n < BIG_COUNT; n++) assert(data[n] == n * 3);
+    ret_close();
+}
+
+static void
+_third_run(void)
+{
+    assert(ret_init(RETFILE, "mmap", 0) == 0);
+    _check_dint(1);
+    ret_close();
+}
+
+/* Flips a byte in the newest copy of page 0, which is where ret_dint is */
+static void
+_corrupt(void)
+{
+    FILE *f;
+    retmap_trailer t[2];
+    long pos[2];
+    int n, c;
+
+    f = fopen(RETFILE, "r+b");
+    assert(f != NULL);
+    for(n = 0; n < 2; n++) {
+        pos[n] = (long)RETMAP_PAGE_SLOT(0, n) * RETMAP_SLOT_SIZE;
+        assert(fseek(f, pos[n] + RETMAP_PAGE_DATA, SEEK_SET) == 0);
+        assert(fread(&t[n], sizeof(retmap_trailer), 1, f) == 1);
+        assert(t[n].magic == RETMAP_MAGIC);
+    }
+    n = t[1].seq > t[0].seq;
+    assert(fseek(f, pos[n] + 64, SEEK_SET) == 0);
+    c = fgetc(f);
+    assert(fseek(f, pos[n] + 64, SEEK_SET) == 0);
+    fputc(c ^ 0xFF, f);
+    fclose(f);
+}
+
+static void
+_run(void (*func)(void))
+{
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    assert(pid >= 0);
+    if(pid == 0) {
+        initialize_tagbase();
+        func();
+        exit(0);
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    unlink(RETFILE);
+    _run(_first_run);
+    _run(_second_run);
+    _corrupt();
+    _run(_third_run);
+    unlink(RETFILE);
+    return 0;
+}
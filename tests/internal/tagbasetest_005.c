@@ -0,0 +1,82 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Test of the tag name index with a large number of tags
+ */
+
+/* This test adds enough tags to force the name index to grow a few times,
+ * deletes some of them and makes sure that the lookups and the ordered
+ * view of the index are still correct.
+ */
+
+#include <tagbase.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <opendax.h>
+
+#define TAG_COUNT 10000
+
+int
+main(int argc, char *argv[])
+{
+    dax_tag tag;
+    char name[DAX_TAGNAME_SIZE + 1];
+    char last[DAX_TAGNAME_SIZE + 1];
+    int n, idx, count;
+    tag_index indexes[TAG_COUNT];
+
+    initialize_tagbase();
+    for(n = 0; n < TAG_COUNT; n++) {
+        snprintf(name, sizeof(name), "tag_%d", (n * 7919) % TAG_COUNT);
+        indexes[n] = tag_add(-1, name, DAX_INT, 1, 0);
+        assert(indexes[n] >= 0);
+    }
+    /* Delete every third tag */
+    for(n = 0; n < TAG_COUNT; n += 3) {
+        assert(tag_del(indexes[n]) == 0);
+    }
+    for(n = 0; n < TAG_COUNT; n++) {
+        snprintf(name, sizeof(name), "tag_%d", (n * 7919) % TAG_COUNT);
+        if(n % 3 == 0) {
+            assert(tag_get_name(name, &tag) == ERR_NOTFOUND);
+        } else {
+            assert(tag_get_name(name, &tag) == 0);
+            assert(tag.idx == indexes[n]);
+        }
+    }
+    /* Add the deleted ones back */
+    for(n = 0; n < TAG_COUNT; n += 3) {
+        snprintf(name, sizeof(name), "tag_%d", (n * 7919) % TAG_COUNT);
+        assert(tag_add(-1, name, DAX_INT, 1, 0) >= 0);
+        assert(tag_get_name(name, &tag) == 0);
+    }
+    /* The ordered view should have every tag, including the system
+     * tags, in alphabetical order */
+    last[0] = '\0';
+    count = 0;
+    for(n = 0; (idx = tag_get_ordered(n)) >= 0; n++) {
+        assert(tag_get_index(idx, &tag) == 0);
+        assert(strcmp(last, tag.name) < 0);
+        strcpy(last, tag.name);
+        if(strncmp(tag.name, "tag_", 4) == 0) count++;
+    }
+    assert(count == TAG_COUNT);
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ *  Test of reusing the slots of deleted tags
+ */
+
+/* This test adds and deletes tags over and over and makes sure that the
+ * database doesn't grow, that the slots are reused and that the index of a
+ * deleted tag doesn't find the tag that took its slot.
+ */
+
+#include <tagbase.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <opendax.h>
+
+#define TAG_COUNT 100
+#define PASSES 50
+
+int
+main(int argc, char *argv[])
+{
+    dax_tag tag;
+    char name[DAX_TAGNAME_SIZE + 1];
+    tag_index slots[TAG_COUNT], old[TAG_COUNT], start;
+    dax_dint temp;
+    int n, pass;
+
+    initialize_tagbase();
+    start = get_tagindex();
+    for(pass = 0; pass < PASSES; pass++) {
+        for(n = 0; n < TAG_COUNT; n++) {
+            snprintf(name, sizeof(name), "temp_%d_%d", pass, n);
+            slots[n] = tag_add(-1, name, DAX_DINT, 1, 0);
+            assert(slots[n] >= 0);
+            assert(tag_get_name(name, &tag) == 0);
+            assert(tag_resolve(tag.idx) == slots[n]);
+            temp = pass * TAG_COUNT + n;
+            assert(tag_write(-1, slots[n], 0, &temp, sizeof(temp)) == 0);
+            if(pass > 0) {
+                /* The index of the tag that was deleted is stale now */
+                assert(tag_resolve(old[n]) == ERR_DELETED);
+            }
+        }
+        for(n = 0; n < TAG_COUNT; n++) {
+            assert(tag_get_index(slots[n], &tag) == 0);
+            assert(tag_read(-1, slots[n], 0, &temp, sizeof(temp)) == 0);
+            assert(temp == pass * TAG_COUNT + n);
+            old[n] = tag.idx;
+            assert(tag_del(slots[n]) == 0);
+            assert(tag_resolve(old[n]) == ERR_DELETED);
+        }
+        /* Only the first pass should have needed new slots */
+        assert(get_tagindex() == start + TAG_COUNT);
+    }
+    assert(tag_resolve(TAG_INDEX(start + TAG_COUNT, 0)) == ERR_ARG);
+    assert(tag_resolve(-1) == ERR_ARG);
+
+    /* Slots are retired once their generation is used up so eventually
+     * we have to get a new one */
+    snprintf(name, sizeof(name), "retired");
+    for(n = 0; get_tagindex() == start + TAG_COUNT; n++) {
+        assert(n <= TAG_COUNT * (TAG_GEN_MAX + 1));
+        slots[0] = tag_add(-1, name, DAX_DINT, 1, 0);
+        assert(slots[0] >= 0);
+        assert(tag_del(slots[0]) == 0);
+    }
+    assert(slots[0] == start + TAG_COUNT);
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test sends many asynchronous reads and writes without waiting for
+ *  the responses and makes sure that they all complete in order.  A
+ *  synchronous read is mixed in to make sure that it gets the right
+ *  response.  More requests are sent than will fit in the request table.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define TEST_COUNT 600
+
+static int _done;
+static int _errors;
+
+static void
+_callback(dax_state *ds, int result, void *udata)
+{
+    /* The requests should be finished in the order they were sent */
+    if((long)udata != _done) {
+        DF("Request %ld finished out of order", (long)udata);
+        _errors++;
+    }
+    if(result) {
+        DF("Request %ld returned %d", (long)udata, result);
+        _errors++;
+    }
+    _done++;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0;
+    long n, req = 0;
+    uint32_t id;
+    tag_handle h;
+    dax_dint data[TEST_COUNT], x, y;
+
+    ds = dax_init("test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result = dax_tag_add(ds, &h, "TEST1", DAX_DINT, TEST_COUNT, 0);
+    if(result) return -1;
+
+    for(n = 0; n < TEST_COUNT; n++) {
+        x = n * 3;
+        result = dax_write_async(ds, h.index, n * sizeof(dax_dint), &x, sizeof(dax_dint),
+                                 _callback, (void *)req++, NULL);
+        if(result) return -1;
+    }
+    /* This should be answered after all of the writes */
+    result = dax_read(ds, h.index, (TEST_COUNT - 1) * sizeof(dax_dint), &y, sizeof(dax_dint));
+    if(result || y != (TEST_COUNT - 1) * 3) {
+        DF("Synchronous read failed %d, %d", result, y);
+        return -1;
+    }
+    bzero(data, sizeof(data));
+    for(n = 0; n < TEST_COUNT; n++) {
+        result = dax_read_async(ds, h.index, n * sizeof(dax_dint), &data[n], sizeof(dax_dint),
+                                _callback, (void *)req++, &id);
+        if(result) return -1;
+    }
+    result = dax_async_wait(ds, id, 2000);
+    if(result) {
+        DF("Timeout waiting on async requests");
+        return -1;
+    }
+    if(_done != TEST_COUNT * 2 || _errors) {
+        DF("%d requests finished with %d errors", _done, _errors);
+        return -1;
+    }
+    for(n = 0; n < TEST_COUNT; n++) {
+        if(data[n] != n * 3) {
+            DF("Test Failed %d != %ld", data[n], n * 3);
+            return -1;
+        }
+    }
+    DF("Test Passed");
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,166 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test makes sure that dax_connect() fails when the server stores
+ *  its data in a different format than we do.  A fake server answers the
+ *  registration with the test values in the wrong byte order.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <libdax.h>
+#include <pthread.h>
+#include <byteswap.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <libcommon.h>
+#include "libtest_common.h"
+
+#define FAKE_SOCKET "/tmp/opendax_byte_order"
+
+#define SWAP_INT   0x01
+#define SWAP_FLOAT 0x02
+
+static int _listenfd;
+
+/* Answers one registration the way a server with the other byte order
+ * would and then waits for the module to close the socket */
+static void *
+_fake_server(void *arg)
+{
+    int fd, swap = *(int *)arg;
+    uint32_t header[2], temp;
+    uint8_t buff[DAX_MSGMAX];
+    float real = REG_TEST_REAL;
+    double lreal = REG_TEST_LREAL;
+    uint64_t u64;
+
+    fd = accept(_listenfd, NULL, NULL);
+    if(fd < 0) return NULL;
+    if(recv(fd, header, MSG_HDR_SIZE, MSG_WAITALL) != MSG_HDR_SIZE ||
+       recv(fd, buff, ntohl(header[0]) - MSG_HDR_SIZE, MSG_WAITALL) <= 0) {
+        close(fd);
+        return NULL;
+    }
+    header[0] = htonl(REG_RESPONSE_SIZE);
+    header[1] = htonl(MSG_MOD_REG | MSG_RESPONSE);
+    bzero(buff, REG_RESPONSE_SIZE);
+    *((uint16_t *)&buff[4]) = REG_TEST_INT;
+    *((uint32_t *)&buff[6]) = REG_TEST_DINT;
+    *((uint64_t *)&buff[10]) = REG_TEST_LINT;
+    if(swap & SWAP_INT) {
+        *((uint16_t *)&buff[4]) = bswap_16(REG_TEST_INT);
+        *((uint32_t *)&buff[6]) = bswap_32(REG_TEST_DINT);
+        *((uint64_t *)&buff[10]) = bswap_64(REG_TEST_LINT);
+    }
+    memcpy(&buff[18], &real, 4);
+    memcpy(&buff[22], &lreal, 8);
+    if(swap & SWAP_FLOAT) {
+        memcpy(&temp, &real, 4);
+        temp = bswap_32(temp);
+        memcpy(&buff[18], &temp, 4);
+        memcpy(&u64, &lreal, 8);
+        u64 = bswap_64(u64);
+        memcpy(&buff[22], &u64, 8);
+    }
+    send(fd, header, MSG_HDR_SIZE, MSG_NOSIGNAL);
+    send(fd, buff, REG_RESPONSE_SIZE, MSG_NOSIGNAL);
+    while(recv(fd, buff, sizeof(buff), 0) > 0);
+    close(fd);
+    return NULL;
+}
+
+/* Connects to the fake server and returns what dax_connect() returned */
+static int
+_connect_swapped(int swap, int argc, char *argv[])
+{
+    dax_state *ds;
+    pthread_t thread;
+    int result;
+
+    if(pthread_create(&thread, NULL, _fake_server, &swap)) return ERR_GENERIC;
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    dax_set_attr(ds, "socketname", FAKE_SOCKET);
+    result = dax_connect(ds);
+    if(result == 0) {
+        /* The fake server doesn't answer the unregister message */
+        shutdown(ds->sfd, SHUT_RDWR);
+        dax_disconnect(ds);
+    }
+    pthread_join(thread, NULL);
+    dax_free(ds);
+    return result;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    dax_state *ds;
+    int result;
+
+    unlink(FAKE_SOCKET);
+    _listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(_listenfd < 0) return -1;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, FAKE_SOCKET, sizeof(addr.sun_path) - 1);
+    if(bind(_listenfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(_listenfd, 1)) {
+        close(_listenfd);
+        return -1;
+    }
+
+    result = _connect_swapped(SWAP_INT, argc, argv);
+    if(result != ERR_NOTIMPLEMENTED) {
+        DF("Connect with swapped integers returned %d", result);
+        return -1;
+    }
+    result = _connect_swapped(SWAP_FLOAT, argc, argv);
+    if(result != ERR_NOTIMPLEMENTED) {
+        DF("Connect with swapped floats returned %d", result);
+        return -1;
+    }
+    close(_listenfd);
+    unlink(FAKE_SOCKET);
+
+    /* The real server still works */
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        DF("Connect to the tag server returned %d", result);
+        return -1;
+    }
+    dax_disconnect(ds);
+    DF("Test Passed");
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
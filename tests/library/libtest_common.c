@@ -37,7 +37,11 @@ run_test(int (testfunc(int argc, char **argv)), int argc, char **argv, int opts)
     pid = fork();
 
     if(pid == 0) { // Child
-        execl("../../src/server/tagserver", "../../src/server/tagserver", "-v", NULL);
+        if(opts & SMALL_FRAMES) {
+            execl("../../src/server/tagserver", "../../src/server/tagserver", "-v", "-F", "4096", NULL);
+        } else {
+            execl("../../src/server/tagserver", "../../src/server/tagserver", "-v", NULL);
+        }
         printf("Failed to launch tagserver\n");
         exit(-1);
     } else if(pid < 0) {
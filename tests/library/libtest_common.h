@@ -20,5 +20,6 @@
  */
 
 #define NO_UNLINK_RETAIN 0x01
+#define SMALL_FRAMES     0x02 /* Keep the server from using frames larger than DAX_MSGMAX */
 
 int run_test(int (testfunc(int argc, char **argv)), int argc, char **argv, int opts);
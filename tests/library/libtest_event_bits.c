@@ -0,0 +1,135 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test puts set, reset and change events on large ranges of a large
+ *  BOOL array that don't start on a byte boundary and then writes single
+ *  bits to make sure that the events fire for exactly the bits that they
+ *  should.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define SET_EVENT    0
+#define RESET_EVENT  1
+#define CHANGE_EVENT 2
+
+static int hits[3];
+static int events[3] = {SET_EVENT, RESET_EVENT, CHANGE_EVENT};
+
+void
+test_callback(dax_state *ds, void *udata) {
+    hits[*(int *)udata]++;
+}
+
+/* Writes a single bit and then checks the number of times each event fired */
+static int
+_write_bit(dax_state *ds, int bit, dax_byte value, int set, int reset, int change)
+{
+    tag_handle h;
+    char str[32];
+    int result;
+
+    bzero(hits, sizeof(hits));
+    snprintf(str, sizeof(str), "ALARMS[%d]", bit);
+    result = dax_tag_handle(ds, &h, str, 1);
+    if(result) return result;
+    result = dax_write_tag(ds, h, &value);
+    if(result) return result;
+    while(dax_event_poll(ds, NULL) == 0);
+    if(hits[SET_EVENT] != set || hits[RESET_EVENT] != reset || hits[CHANGE_EVENT] != change) {
+        DF("Bit %d = %d, set %d, reset %d, change %d", bit, value,
+           hits[SET_EVENT], hits[RESET_EVENT], hits[CHANGE_EVENT]);
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle h;
+    dax_id id;
+    int result;
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    result = dax_tag_add(ds, &h, "ALARMS", DAX_BOOL, 32768, 0);
+    if(result) return result;
+
+    result = dax_tag_handle(ds, &h, "ALARMS[3]", 32000);
+    if(result) return result;
+    result = dax_event_add(ds, &h, EVENT_SET, NULL, &id, test_callback, &events[SET_EVENT], NULL);
+    if(result) return result;
+    result = dax_tag_handle(ds, &h, "ALARMS[5]", 100);
+    if(result) return result;
+    result = dax_event_add(ds, &h, EVENT_RESET, NULL, &id, test_callback, &events[RESET_EVENT], NULL);
+    if(result) return result;
+    result = dax_tag_handle(ds, &h, "ALARMS[1001]", 9000);
+    if(result) return result;
+    result = dax_event_add(ds, &h, EVENT_CHANGE, NULL, &id, test_callback, &events[CHANGE_EVENT], NULL);
+    if(result) return result;
+
+    /* The first write to the reset event's range fires it because
+     * the bits are all clear */
+    if(_write_bit(ds, 50, 0, 0, 1, 0)) return -1;
+    if(_write_bit(ds, 50, 0, 0, 0, 0)) return -1;
+    if(_write_bit(ds, 50, 1, 1, 0, 0)) return -1;
+    if(_write_bit(ds, 50, 0, 0, 1, 0)) return -1;
+    /* Bit 2 is outside of the set event's range */
+    if(_write_bit(ds, 2, 1, 0, 0, 0)) return -1;
+    if(_write_bit(ds, 3, 1, 1, 0, 0)) return -1;
+    /* 10000 is the last bit in the change event's range */
+    if(_write_bit(ds, 10000, 1, 1, 0, 1)) return -1;
+    if(_write_bit(ds, 10001, 1, 1, 0, 0)) return -1;
+    if(_write_bit(ds, 10000, 1, 0, 0, 0)) return -1;
+    if(_write_bit(ds, 10000, 0, 0, 0, 1)) return -1;
+    /* Just past the end of the change event but in the same byte */
+    if(_write_bit(ds, 10001, 0, 0, 0, 0)) return -1;
+    if(_write_bit(ds, 10002, 1, 1, 0, 0)) return -1;
+    /* The last bit of the set event and just past it */
+    if(_write_bit(ds, 32002, 1, 1, 0, 0)) return -1;
+    if(_write_bit(ds, 32003, 1, 0, 0, 0)) return -1;
+    /* The change event starts at bit 1001 */
+    if(_write_bit(ds, 1000, 1, 1, 0, 0)) return -1;
+    if(_write_bit(ds, 1001, 1, 1, 0, 1)) return -1;
+
+    DF("Test Passed");
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,150 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test adds a lot of write events on overlapping slices of one large
+ *  array tag and makes sure that a small write only fires the events whose
+ *  range overlaps the data that was written.  Some of the events are then
+ *  deleted to make sure that they are taken out of the server's index.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define TAG_COUNT   1000
+#define EVENT_COUNT 199
+#define EVENT_SPAN  10
+#define EVENT_STEP  5
+
+static int hits[EVENT_COUNT + 1];
+
+void
+test_callback(dax_state *ds, void *udata) {
+    hits[*(int *)udata]++;
+}
+
+/* Writes the element and then checks that exactly the events that
+ * contain it have fired */
+static int
+_check_write(dax_state *ds, tag_handle h, int element, int big_event)
+{
+    tag_handle hw;
+    dax_dint x;
+    char str[32];
+    int n, expected, result;
+
+    bzero(hits, sizeof(hits));
+    snprintf(str, sizeof(str), "EVR[%d]", element);
+    result = dax_tag_handle(ds, &hw, str, 1);
+    if(result) return result;
+    x = element;
+    result = dax_write_tag(ds, hw, &x);
+    if(result) return result;
+    while(dax_event_poll(ds, NULL) == 0);
+    for(n = 0; n < EVENT_COUNT; n++) {
+        expected = (element >= n * EVENT_STEP && element < n * EVENT_STEP + EVENT_SPAN);
+        if(hits[n] != expected) {
+            DF("Event %d hit %d times for element %d", n, hits[n], element);
+            return -1;
+        }
+    }
+    if(hits[EVENT_COUNT] != big_event) {
+        DF("Whole tag event hit %d times", hits[EVENT_COUNT]);
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle h, he;
+    dax_id ids[EVENT_COUNT + 1];
+    int udata[EVENT_COUNT + 1];
+    int n, result;
+    char str[32];
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    result = dax_tag_add(ds, &h, "EVR", DAX_DINT, TAG_COUNT, 0);
+    if(result) return result;
+    /* Add them in an order that isn't sorted */
+    for(n = 0; n < EVENT_COUNT; n++) {
+        udata[n] = (n * 7) % EVENT_COUNT;
+        snprintf(str, sizeof(str), "EVR[%d]", udata[n] * EVENT_STEP);
+        result = dax_tag_handle(ds, &he, str, EVENT_SPAN);
+        if(result) return result;
+        result = dax_event_add(ds, &he, EVENT_WRITE, NULL, &ids[udata[n]], test_callback, &udata[n], NULL);
+        if(result) return result;
+    }
+    udata[EVENT_COUNT] = EVENT_COUNT;
+    result = dax_event_add(ds, &h, EVENT_WRITE, NULL, &ids[EVENT_COUNT], test_callback, &udata[EVENT_COUNT], NULL);
+    if(result) return result;
+
+    if(_check_write(ds, h, 0, 1)) return -1;
+    if(_check_write(ds, h, 503, 1)) return -1;
+    if(_check_write(ds, h, 999, 1)) return -1;
+    if(_check_write(ds, h, 512, 1)) return -1;
+
+    /* Delete the big one and every other small one */
+    result = dax_event_del(ds, ids[EVENT_COUNT]);
+    if(result < 0) return result;
+    for(n = 0; n < EVENT_COUNT; n += 2) {
+        result = dax_event_del(ds, ids[n]);
+        if(result < 0) return result;
+    }
+    bzero(hits, sizeof(hits));
+    for(n = 1; n < EVENT_COUNT; n += 2) {
+        snprintf(str, sizeof(str), "EVR[%d]", n * EVENT_STEP + EVENT_STEP);
+        result = dax_tag_handle(ds, &he, str, 1);
+        if(result) return result;
+        /* Elements from the deleted events' ranges only fire the odd events */
+        result = dax_write_tag(ds, he, &n);
+        if(result) return result;
+        while(dax_event_poll(ds, NULL) == 0);
+    }
+    for(n = 0; n < EVENT_COUNT; n++) {
+        if(hits[n] != ((n % 2) ? 1 : 0)) {
+            DF("Event %d hit %d times after deleting", n, hits[n]);
+            return -1;
+        }
+    }
+    if(hits[EVENT_COUNT]) return -1;
+    DF("Test Passed");
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,123 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test reads a group that was added with GROUP_OPT_DELTA and makes
+ *  sure that only the members that have changed are returned
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+static int
+_check(dax_dint *data, dax_dint *expected)
+{
+    for(int n=0;n<5;n++) {
+        if(data[n] != expected[n]) {
+            printf("Array[%d] = 0x%X should be 0x%X\n", n, data[n], expected[n]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0;
+    tag_group_id *idx;
+    tag_handle h[5];
+    dax_dint temp;
+    dax_dint values[5] = {0x1122, 0x3344, 0x5566, 0x7788, 0x99AA};
+    dax_dint temp_array[5];
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result = 0;
+    result += dax_tag_add(ds, &h[0], "TEST1", DAX_DINT, 1, 0);
+    result += dax_tag_add(ds, &h[1], "TEST2", DAX_DINT, 1, 0);
+    result += dax_tag_add(ds, &h[2], "TEST3", DAX_DINT, 1, 0);
+    result += dax_tag_add(ds, &h[3], "TEST4", DAX_DINT, 1, 0);
+    result += dax_tag_add(ds, &h[4], "TEST5", DAX_DINT, 1, 0);
+    if(result) return -1;
+    idx = dax_group_add(ds, &result, h, 5, GROUP_OPT_DELTA);
+    if(result) return result;
+
+    for(int n=0;n<5;n++) {
+        result += dax_write_tag(ds, h[n], &values[n]);
+    }
+    if(result) return -1;
+    /* The first read gets everything */
+    result = dax_group_read(ds, idx, temp_array, sizeof(temp_array));
+    printf("First read returned %d\n", result);
+    if(result != 5) return -1;
+    if(_check(temp_array, values)) return -1;
+
+    /* Nothing has changed so nothing should come back */
+    result = dax_group_read(ds, idx, temp_array, sizeof(temp_array));
+    printf("Second read returned %d\n", result);
+    if(result != 0) return -1;
+    if(_check(temp_array, values)) return -1;
+
+    /* Writing the same value isn't a change */
+    result = dax_write_tag(ds, h[0], &values[0]);
+    values[2] = 0x12345678;
+    result += dax_write_tag(ds, h[2], &values[2]);
+    if(result) return -1;
+    result = dax_group_read(ds, idx, temp_array, sizeof(temp_array));
+    printf("Third read returned %d\n", result);
+    if(result != 1) return -1;
+    if(_check(temp_array, values)) return -1;
+
+    /* Only the changed member is written into the buffer */
+    temp_array[4] = 0;
+    temp = 0x55;
+    values[3] = temp;
+    result = dax_write_tag(ds, h[3], &temp);
+    if(result) return -1;
+    result = dax_group_read(ds, idx, temp_array, sizeof(temp_array));
+    if(result != 1) return -1;
+    if(temp_array[3] != 0x55 || temp_array[4] != 0) return -1;
+
+    result = dax_group_del(ds, idx);
+    dax_disconnect(ds);
+
+    return result;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
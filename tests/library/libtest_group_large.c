@@ -0,0 +1,131 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test adds groups that are too large to fit in a single message
+ *  frame and makes sure that they can be read and written.  The server is
+ *  started so that it won't negotiate frames larger than DAX_MSGMAX.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define MEMBERS 3000
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0;
+    tag_group_id *idx, *didx;
+    tag_handle tag, *h;
+    dax_dint *values, *temp_array;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    h = malloc(sizeof(tag_handle) * MEMBERS);
+    values = malloc(sizeof(dax_dint) * MEMBERS);
+    temp_array = malloc(sizeof(dax_dint) * MEMBERS);
+    if(h == NULL || values == NULL || temp_array == NULL) return -1;
+
+    result = dax_tag_add(ds, &tag, "BIG", DAX_DINT, MEMBERS, 0);
+    if(result) return -1;
+    /* One member for each element, backwards so the server can't join them */
+    for(int n=0;n<MEMBERS;n++) {
+        h[n] = tag;
+        h[n].byte = (MEMBERS - 1 - n) * 4;
+        h[n].count = 1;
+        h[n].size = 4;
+        values[n] = n * 7 + 1;
+    }
+    result = dax_write_tag(ds, tag, values);
+    if(result) return -1;
+
+    idx = dax_group_add(ds, &result, h, MEMBERS, 0);
+    if(result) return result;
+    if(dax_group_get_size(idx) != MEMBERS * 4) return -1;
+
+    result = dax_group_read(ds, idx, temp_array, sizeof(dax_dint) * MEMBERS);
+    if(result) return result;
+    for(int n=0;n<MEMBERS;n++) {
+        if(temp_array[n] != values[MEMBERS - 1 - n]) {
+            printf("Member[%d] = %d should be %d\n", n, temp_array[n], values[MEMBERS - 1 - n]);
+            return -1;
+        }
+    }
+
+    /* Writing the values to the group should put them in the tag backwards */
+    memcpy(temp_array, values, sizeof(dax_dint) * MEMBERS);
+    result = dax_group_write(ds, idx, temp_array);
+    if(result) return result;
+    result = dax_read_tag(ds, tag, temp_array);
+    if(result) return result;
+    for(int n=0;n<MEMBERS;n++) {
+        if(temp_array[n] != values[MEMBERS - 1 - n]) {
+            printf("Array[%d] = %d should be %d\n", n, temp_array[n], values[MEMBERS - 1 - n]);
+            return -1;
+        }
+    }
+
+    /* A delta group gets everything the first time and then just the changes */
+    didx = dax_group_add(ds, &result, h, MEMBERS, GROUP_OPT_DELTA);
+    if(result) return result;
+    result = dax_group_read(ds, didx, temp_array, sizeof(dax_dint) * MEMBERS);
+    printf("First delta read returned %d\n", result);
+    if(result != MEMBERS) return -1;
+    values[0] = 0x1234;
+    result = dax_write_tag(ds, tag, values);
+    if(result) return -1;
+    result = dax_group_read(ds, didx, temp_array, sizeof(dax_dint) * MEMBERS);
+    printf("Second delta read returned %d\n", result);
+    /* Putting the tag back in order changes every member */
+    if(result != MEMBERS) return -1;
+    for(int n=0;n<MEMBERS;n++) {
+        if(temp_array[n] != values[MEMBERS - 1 - n]) return -1;
+    }
+
+    result = dax_group_del(ds, idx);
+    result += dax_group_del(ds, didx);
+    dax_disconnect(ds);
+    free(h);
+    free(values);
+    free(temp_array);
+
+    return result;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, SMALL_FRAMES)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -37,7 +37,7 @@ do_test(int argc, char *argv[])
     dax_state *ds;
     int result = 0, count, n;
     tag_type type;
-    tag_handle h;
+    tag_handle h, hcache;
 
 
     ds = dax_init("test");
@@ -83,6 +83,12 @@ do_test(int argc, char *argv[])
             printf(" - Type received %d != %d for tag = %s\n", h.type, type, tests_pass[n].tagname);
             return 1;
         }
+        /* The second time the handle should come from the cache */
+        result = dax_tag_handle(ds, &hcache, tests_pass[n].tagname, tests_pass[n].count_request);
+        if(result || memcmp(&h, &hcache, sizeof(tag_handle))) {
+            printf(" - Cached handle is different for tag = %s\n", tests_pass[n].tagname);
+            return 1;
+        }
     }
 
     count = sizeof(tests_fail) / sizeof(struct handle_test_t);
@@ -0,0 +1,149 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test makes sure that the large frame size is negotiated with the
+ *  server and that a large tag can be read and written with a single
+ *  message using the raw dax_read() and dax_write() functions.  It also
+ *  checks that a socket that hasn't registered can't send a large frame.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <libcommon.h>
+#include "libtest_common.h"
+
+#define TEST_COUNT 65536
+
+/* Sends only the header of a frame that is larger than DAX_MSGMAX on a
+ * socket that hasn't registered.  The server should close the connection
+ * instead of waiting for the rest of it. */
+static int
+_unregistered_frame(void)
+{
+    struct sockaddr_un addr;
+    struct timeval tv;
+    uint32_t header[2];
+    char buff[16];
+    int fd;
+    ssize_t result;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, "/tmp/opendax", sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    tv.tv_sec = 2;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    header[0] = htonl(DAX_MSGMAX * 16);
+    header[1] = htonl(MSG_TAG_READ);
+    send(fd, header, MSG_HDR_SIZE, MSG_NOSIGNAL);
+    result = recv(fd, buff, sizeof(buff), 0);
+    close(fd);
+    if(result != 0) {
+        DF("Server didn't close the connection, recv() returned %zd", result);
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0;
+    tag_handle h;
+    dax_real *data;
+
+    ds = dax_init("test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result = dax_tag_add(ds, &h, "TEST1", DAX_REAL, TEST_COUNT, 0);
+    if(result) return -1;
+    data = malloc(h.size);
+    if(data == NULL) return -1;
+
+    for(int n=0;n<TEST_COUNT;n++) {
+        data[n] = n * 0.5;
+    }
+    /* These would return ERR_2BIG if the frame size were not negotiated */
+    result = dax_write(ds, h.index, 0, data, h.size);
+    if(result != ERR_OK) {
+        DF("Write Failure %d", result);
+        return -1;
+    }
+    bzero(data, h.size);
+    result = dax_read(ds, h.index, 0, data, h.size);
+    if(result != ERR_OK) {
+        DF("Read Failure %d", result);
+        return -1;
+    }
+    for(int n=0;n<TEST_COUNT;n++) {
+        if(data[n] != n * 0.5) {
+            DF("Test Failed %f != %f", data[n], n * 0.5);
+            return -1;
+        }
+    }
+    /* The high level functions should work the same */
+    for(int n=0;n<TEST_COUNT;n++) {
+        data[n] = TEST_COUNT - n;
+    }
+    result = dax_tag_write(ds, h, data);
+    if(result != ERR_OK) return -1;
+    bzero(data, h.size);
+    result = dax_tag_read(ds, h, data);
+    if(result != ERR_OK) return -1;
+    for(int n=0;n<TEST_COUNT;n++) {
+        if(data[n] != TEST_COUNT - n) {
+            DF("Test Failed %f != %d", data[n], TEST_COUNT - n);
+            return -1;
+        }
+    }
+    free(data);
+    if(_unregistered_frame()) return -1;
+    DF("Test Passed");
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
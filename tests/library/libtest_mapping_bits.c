@@ -0,0 +1,169 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test checks BOOL mappings where the bits have to be moved to a
+ *  different place in the destination bytes, mappings that line up with
+ *  the destination and mappings that are larger than the server's scratch
+ *  buffer.  It also makes sure that the mappings to a tag are removed when
+ *  that tag is deleted.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define SRC_BITS  80000
+#define DEST_BITS 80100
+
+struct map_def {
+    int src;
+    int dest;
+    int count;
+};
+
+/* The destination ranges must not overlap */
+static struct map_def _maps[] = {
+    {3,     5,     1000},  /* Shifted up */
+    {13,    2000,  2000},  /* Shifted down */
+    {64,    10000, 512},   /* Straight copy */
+    {7,     20007, 9},     /* Same bit, needs a mask */
+    {1,     30004, 1},     /* Single bit */
+    {5,     1,     70000}  /* Larger than the scratch buffer, goes to TEST3 */
+};
+#define MAP_COUNT (sizeof(_maps) / sizeof(struct map_def))
+
+static inline int
+_get_bit(uint8_t *data, int bit)
+{
+    return (data[bit / 8] >> (bit % 8)) & 0x01;
+}
+
+static inline void
+_put_bit(uint8_t *data, int bit, int value)
+{
+    if(value) data[bit / 8] |= (0x01 << (bit % 8));
+    else data[bit / 8] &= ~(0x01 << (bit % 8));
+}
+
+static int
+_check(dax_state *ds, tag_handle *dest, uint8_t *src, uint8_t *expect[2])
+{
+    uint8_t actual[DEST_BITS / 8 + 1];
+    int n, i, t;
+
+    /* Work out what both destination tags should look like */
+    for(n = 0; n < MAP_COUNT; n++) {
+        t = (n == MAP_COUNT - 1) ? 1 : 0;
+        for(i = 0; i < _maps[n].count; i++) {
+            _put_bit(expect[t], _maps[n].dest + i, _get_bit(src, _maps[n].src + i));
+        }
+    }
+    for(t = 0; t < 2; t++) {
+        if(dax_read(ds, dest[t].index, 0, actual, dest[t].size)) return -1;
+        for(n = 0; n < DEST_BITS; n++) {
+            if(_get_bit(actual, n) != _get_bit(expect[t], n)) {
+                DF("Bit %d of destination %d is %d should be %d", n, t, _get_bit(actual, n), _get_bit(expect[t], n));
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle h[3], hs, hd;
+    dax_id id[MAP_COUNT];
+    uint8_t src[SRC_BITS / 8];
+    uint8_t dest0[DEST_BITS / 8 + 1], dest1[DEST_BITS / 8 + 1];
+    uint8_t *expect[2];
+    char tagname[32];
+    int n, pass;
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    if(dax_tag_add(ds, &h[0], "TEST1", DAX_BOOL, SRC_BITS, 0)) return -1;
+    if(dax_tag_add(ds, &h[1], "TEST2", DAX_BOOL, DEST_BITS, 0)) return -1;
+    if(dax_tag_add(ds, &h[2], "TEST3", DAX_BOOL, DEST_BITS, 0)) return -1;
+
+    /* Give the destinations a pattern so that we'll know if the bits around
+     * the mappings get clobbered */
+    memset(dest0, 0xA5, sizeof(dest0));
+    memset(dest1, 0x5A, sizeof(dest1));
+    if(dax_write(ds, h[1].index, 0, dest0, h[1].size)) return -1;
+    if(dax_write(ds, h[2].index, 0, dest1, h[2].size)) return -1;
+    expect[0] = dest0;
+    expect[1] = dest1;
+
+    for(n = 0; n < MAP_COUNT; n++) {
+        snprintf(tagname, sizeof(tagname), "TEST1[%d]", _maps[n].src);
+        if(dax_tag_handle(ds, &hs, tagname, _maps[n].count)) return -1;
+        snprintf(tagname, sizeof(tagname), "%s[%d]", (n == MAP_COUNT - 1) ? "TEST3" : "TEST2", _maps[n].dest);
+        if(dax_tag_handle(ds, &hd, tagname, _maps[n].count)) return -1;
+        if(dax_map_add(ds, &hs, &hd, &id[n])) {
+            DF("Unable to add mapping %d", n);
+            return -1;
+        }
+    }
+
+    srand(1234);
+    for(pass = 0; pass < 8; pass++) {
+        for(n = 0; n < sizeof(src); n++) src[n] = rand();
+        if(dax_write(ds, h[0].index, 0, src, sizeof(src))) return -1;
+        if(_check(ds, &h[1], src, expect)) {
+            DF("Check failed on pass %d", pass);
+            return -1;
+        }
+    }
+
+    /* Write a single byte in the middle of the big one */
+    src[4000] = ~src[4000];
+    if(dax_write(ds, h[0].index, 4000, &src[4000], 1)) return -1;
+    if(_check(ds, &h[1], src, expect)) return -1;
+
+    /* Deleting the destination should take the mapping with it */
+    if(dax_tag_del(ds, h[2].index)) return -1;
+    if(dax_map_get(ds, &hs, &hd, id[MAP_COUNT - 1]) == 0) {
+        DF("Mapping to the deleted tag is still there");
+        return -1;
+    }
+    if(dax_write(ds, h[0].index, 0, src, sizeof(src))) return -1;
+    if(dax_map_get(ds, &hs, &hd, id[0])) return -1;
+
+    dax_disconnect(ds);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,138 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test checks that writes follow chains of mappings, that mappings
+ *  that would make a loop are refused and that a chain stops after
+ *  MAX_MAP_HOPS mappings.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define CHAIN_LENGTH 130
+
+static int
+_check_value(dax_state *ds, tag_handle h, dax_dint value)
+{
+    dax_dint temp;
+
+    if(dax_tag_read(ds, h, &temp)) return -1;
+    if(temp != value) {
+        DF("Tag index %d is %d should be %d", h.index, temp, value);
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle a, b, c, d, e, d0, d1;
+    tag_handle chain[CHAIN_LENGTH];
+    dax_dint temp;
+    dax_id id;
+    char tagname[32];
+    int n;
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    if(dax_tag_add(ds, &a, "TESTA", DAX_DINT, 1, 0)) return -1;
+    if(dax_tag_add(ds, &b, "TESTB", DAX_DINT, 1, 0)) return -1;
+    if(dax_tag_add(ds, &c, "TESTC", DAX_DINT, 1, 0)) return -1;
+    if(dax_tag_add(ds, &d, "TESTD", DAX_DINT, 2, 0)) return -1;
+    if(dax_tag_add(ds, &e, "TESTE", DAX_DINT, 1, 0)) return -1;
+    if(dax_tag_handle(ds, &d0, "TESTD[0]", 1)) return -1;
+    if(dax_tag_handle(ds, &d1, "TESTD[1]", 1)) return -1;
+
+    /* A diamond, A -> B -> D[0] and A -> C -> D[1].  The maps are added
+     * from the bottom up so that the ranks have to be moved. */
+    if(dax_map_add(ds, &b, &d0, &id)) return -1;
+    if(dax_map_add(ds, &c, &d1, &id)) return -1;
+    if(dax_map_add(ds, &a, &b, &id)) return -1;
+    if(dax_map_add(ds, &a, &c, &id)) return -1;
+
+    temp = 1234;
+    if(dax_tag_write(ds, a, &temp)) return -1;
+    if(_check_value(ds, b, 1234)) return -1;
+    if(_check_value(ds, c, 1234)) return -1;
+    if(_check_value(ds, d0, 1234)) return -1;
+    if(_check_value(ds, d1, 1234)) return -1;
+
+    /* These would all make loops */
+    if(dax_map_add(ds, &d0, &a, &id) == 0) {
+        DF("Mapping from D back to A was allowed");
+        return -1;
+    }
+    if(dax_map_add(ds, &d0, &c, &id) == 0) {
+        DF("Mapping from D back to C was allowed");
+        return -1;
+    }
+    if(dax_map_add(ds, &d0, &d1, &id) == 0) {
+        DF("Mapping a tag to itself was allowed");
+        return -1;
+    }
+
+    /* B and E mirror each other so writes to either one go down the chain */
+    if(dax_map_add(ds, &b, &e, &id)) return -1;
+    if(dax_map_add(ds, &e, &b, &id)) {
+        DF("Mirror mapping was refused");
+        return -1;
+    }
+    temp = 5678;
+    if(dax_tag_write(ds, a, &temp)) return -1;
+    if(_check_value(ds, e, 5678)) return -1;
+    if(_check_value(ds, d0, 5678)) return -1;
+    temp = 42;
+    if(dax_tag_write(ds, e, &temp)) return -1;
+    if(_check_value(ds, b, 42)) return -1;
+    if(_check_value(ds, d0, 42)) return -1;
+    if(_check_value(ds, a, 5678)) return -1;
+
+    /* The chain stops after MAX_MAP_HOPS mappings */
+    for(n = 0; n < CHAIN_LENGTH; n++) {
+        snprintf(tagname, sizeof(tagname), "CHAIN%d", n);
+        if(dax_tag_add(ds, &chain[n], tagname, DAX_DINT, 1, 0)) return -1;
+        if(n > 0 && dax_map_add(ds, &chain[n - 1], &chain[n], &id)) return -1;
+    }
+    temp = 99;
+    if(dax_tag_write(ds, chain[0], &temp)) return -1;
+    if(_check_value(ds, chain[128], 99)) return -1;
+    if(_check_value(ds, chain[129], 0)) return -1;
+
+    dax_disconnect(ds);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
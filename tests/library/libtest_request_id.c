@@ -0,0 +1,169 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test makes sure that a response always goes to the request that it
+ *  answers.  Responses that don't belong to any request and requests that
+ *  the server never answers must not throw off the responses that come
+ *  after them.  It also checks that the server answers commands that it
+ *  doesn't handle, with the request id that was sent.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <libdax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <libcommon.h>
+#include "libtest_common.h"
+
+/* Sends a message with no data and the request id in the command word */
+static int
+_send_raw(int fd, uint32_t command, uint32_t id)
+{
+    uint32_t header[2];
+
+    header[0] = htonl(MSG_HDR_SIZE);
+    header[1] = htonl(command | ((id << MSG_ID_SHIFT) & MSG_ID_MASK));
+    if(send(fd, header, MSG_HDR_SIZE, MSG_NOSIGNAL) != MSG_HDR_SIZE) return -1;
+    return 0;
+}
+
+/* Sends 'command' on a socket of our own and checks that the server
+ * answers with 'error' and the same request id */
+static int
+_check_answer(uint32_t command, int error)
+{
+    struct sockaddr_un addr;
+    struct timeval tv;
+    uint32_t buff[3];
+    int fd;
+    ssize_t result;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, "/tmp/opendax", sizeof(addr.sun_path) - 1);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    tv.tv_sec = 2;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    _send_raw(fd, command, 0x1234);
+    result = recv(fd, buff, sizeof(buff), MSG_WAITALL);
+    close(fd);
+    if(result != sizeof(buff)) {
+        DF("No answer to command 0x%X, recv() returned %zd", command, result);
+        return -1;
+    }
+    if(ntohl(buff[1]) != (command | MSG_ERROR | (0x1234 << MSG_ID_SHIFT)) ||
+       (int32_t)buff[2] != error) {
+        DF("Command 0x%X was answered with 0x%X, %d", command, ntohl(buff[1]), (int32_t)buff[2]);
+        return -1;
+    }
+    return 0;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0;
+    tag_handle h;
+    dax_request *req;
+    dax_dint data[4] = {5, 6, 7, 8}, x[4], y;
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+    if(! ds->reqids) {
+        DF("The server didn't agree to request ids");
+        return -1;
+    }
+    result = dax_tag_add(ds, &h, "TEST_REQID", DAX_DINT, 4, 0);
+    if(result) return -1;
+    if(dax_write_tag(ds, h, data)) return -1;
+
+    /* Answers that no request is waiting for are thrown away */
+    pthread_mutex_lock(&ds->lock);
+    result += _send_raw(ds->sfd, 0x7E, ds->request_id + 1000);
+    result += _send_raw(ds->sfd, MSG_TAG_LIST, ds->request_id + 1001);
+    result += _send_raw(ds->sfd, MSG_EVNT_GET, ds->request_id + 1002);
+    pthread_mutex_unlock(&ds->lock);
+    if(result) return -1;
+    bzero(x, sizeof(x));
+    result = dax_read_async(ds, h.index, 0, x, sizeof(x), NULL, NULL, NULL);
+    if(result) return -1;
+    result = dax_read(ds, h.index, 3 * sizeof(dax_dint), &y, sizeof(y));
+    if(result || y != 8) {
+        DF("Read after the stray answers returned %d, %d", result, y);
+        return -1;
+    }
+    if(dax_async_wait(ds, 0, 1000) || x[0] != 5 || x[3] != 8) {
+        DF("Asynchronous read after the stray answers failed");
+        return -1;
+    }
+
+    /* This is what a synchronous call leaves behind when it times out.
+     * The server never answers it here so the next answer has to go past
+     * it to the request that it belongs to. */
+    pthread_mutex_lock(&ds->lock);
+    pthread_mutex_lock(&ds->msg_lock);
+    req = &ds->requests[(ds->request_head + ds->request_count) % MAX_REQUESTS];
+    bzero(req, sizeof(dax_request));
+    req->id = ++ds->request_id;
+    req->command = MSG_TAG_READ;
+    req->flags = REQ_SYNC | REQ_DISCARD;
+    ds->request_count++;
+    pthread_mutex_unlock(&ds->msg_lock);
+    pthread_mutex_unlock(&ds->lock);
+    for(int n = 0; n < 3; n++) {
+        result = dax_read(ds, h.index, n * sizeof(dax_dint), &y, sizeof(y));
+        if(result || y != data[n]) {
+            DF("Read %d after the unanswered request returned %d, %d", n, result, y);
+            return -1;
+        }
+    }
+
+    /* The server answers commands that it doesn't know or doesn't do */
+    if(_check_answer(0x7E, ERR_MSG_BAD)) return -1;
+    if(_check_answer(MSG_TAG_LIST, ERR_NOTIMPLEMENTED)) return -1;
+    if(_check_answer(MSG_EVNT_GET, ERR_NOTIMPLEMENTED)) return -1;
+
+    DF("Test Passed");
+    dax_disconnect(ds);
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
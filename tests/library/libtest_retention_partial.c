@@ -0,0 +1,109 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  Tests that partial writes to a retained array are all kept.  The server
+ *  only writes the parts of the tag that changed to the retention file so
+ *  this writes a few pieces in different places, some of them more than
+ *  once, and then checks the whole array after the server restarts.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define ARRAY_SIZE 1000
+
+/* What we expect element n to be after test_one */
+static dax_dint
+_expected(int n)
+{
+    if(n >= 10 && n < 20) return n * 3;
+    if(n == 500) return -500;
+    if(n >= 990) return n + 7;
+    return 0;
+}
+
+int
+test_one(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle h;
+    dax_dint temp[ARRAY_SIZE];
+    int n, pass;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+    if(dax_tag_add(ds, &h, "RETAIN1", DAX_DINT, ARRAY_SIZE, TAG_ATTR_RETAIN)) return -1;
+
+    for(pass = 1; pass <= 3; pass++) {
+        for(n = 10; n < 20; n++) temp[n] = n * pass;
+        if(dax_write(ds, h.index, 10 * sizeof(dax_dint), &temp[10], 10 * sizeof(dax_dint))) return -1;
+    }
+    temp[500] = -500;
+    if(dax_write(ds, h.index, 500 * sizeof(dax_dint), &temp[500], sizeof(dax_dint))) return -1;
+    for(n = 990; n < ARRAY_SIZE; n++) temp[n] = n + 7;
+    if(dax_write(ds, h.index, 990 * sizeof(dax_dint), &temp[990], 10 * sizeof(dax_dint))) return -1;
+
+    dax_disconnect(ds);
+    return 0;
+}
+
+int
+test_two(int argc, char *argv[])
+{
+    dax_state *ds;
+    tag_handle h;
+    dax_dint temp[ARRAY_SIZE];
+    int n;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+    if(dax_tag_add(ds, &h, "RETAIN1", DAX_DINT, ARRAY_SIZE, TAG_ATTR_RETAIN)) return -1;
+    if(dax_read_tag(ds, h, temp)) return -1;
+    for(n = 0; n < ARRAY_SIZE; n++) {
+        if(temp[n] != _expected(n)) {
+            printf("ERROR: Element %d is %d should be %d\n", n, temp[n], _expected(n));
+            return -1;
+        }
+    }
+    dax_disconnect(ds);
+    return 0;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    if(run_test(test_one, argc, argv, NO_UNLINK_RETAIN)) {
+        exit(-1);
+    } else {
+        if(run_test(test_two, argc, argv, 0)) {
+            exit(-1);
+        } else {
+            exit(0);
+        }
+    }
+}
@@ -0,0 +1,145 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test makes sure that local modules get the shared memory tag data
+ *  from the server and that reading from it gives the same results as
+ *  reading through the server.  Writes from another connection, overrides,
+ *  virtual tags and deleted tags are checked.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <libdax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+#define TEST_COUNT 1000
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds, *ds2;
+    int result = 0;
+    tag_handle h, ht;
+    dax_dint data[TEST_COUNT], temp;
+    dax_time time;
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+    ds2 = dax_init("test2");
+    dax_configure(ds2, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds2)) return -1;
+
+    if(ds->shm == NULL) {
+        DF("Shared memory was not mapped");
+        return -1;
+    }
+    result = dax_tag_add(ds, &h, "TEST1", DAX_DINT, TEST_COUNT, 0);
+    if(result) return -1;
+    /* Data written by the other module should show up here right away */
+    for(int n=0;n<TEST_COUNT;n++) data[n] = n * 3;
+    result = dax_write(ds2, h.index, 0, data, h.size);
+    if(result) return -1;
+    bzero(data, sizeof(data));
+    result = dax_read(ds, h.index, 0, data, h.size);
+    if(result) return -1;
+    for(int n=0;n<TEST_COUNT;n++) {
+        if(data[n] != n * 3) {
+            DF("Read failed %d != %d", data[n], n * 3);
+            return -1;
+        }
+    }
+    /* A piece from the middle */
+    result = dax_read(ds, h.index, 40, &temp, sizeof(dax_dint));
+    if(result || temp != 30) {
+        DF("Offset read failed %d", temp);
+        return -1;
+    }
+    /* Reading past the end still gives the error from the server */
+    result = dax_read(ds, h.index, h.size - 2, &temp, sizeof(dax_dint));
+    if(result != ERR_2BIG) {
+        DF("Bad size returned %d", result);
+        return -1;
+    }
+    /* Async writes that are still waiting have to be seen by the next read */
+    temp = 1234;
+    result = dax_write_async(ds, h.index, 0, &temp, sizeof(dax_dint), NULL, NULL, NULL);
+    if(result) return -1;
+    temp = 0;
+    result = dax_read(ds, h.index, 0, &temp, sizeof(dax_dint));
+    if(result || temp != 1234) {
+        DF("Async write not read %d", temp);
+        return -1;
+    }
+
+    /* The override has to come from the server */
+    result = dax_tag_add(ds, &ht, "TEST2", DAX_DINT, 1, 0);
+    if(result) return -1;
+    temp = 12;
+    if(dax_write_tag(ds, ht, &temp)) return -1;
+    temp = -15;
+    if(dax_tag_add_override(ds, ht, &temp)) return -1;
+    if(dax_tag_set_override(ds, ht)) return -1;
+    if(dax_read_tag(ds, ht, &temp) || temp != -15) {
+        DF("Override read failed %d", temp);
+        return -1;
+    }
+    if(dax_tag_clr_override(ds, ht)) return -1;
+    if(dax_read_tag(ds, ht, &temp) || temp != 12) {
+        DF("Cleared override read failed %d", temp);
+        return -1;
+    }
+
+    /* Virtual tags are never in the shared memory */
+    result = dax_tag_handle(ds, &ht, "_time", 0);
+    if(result) return -1;
+    time = 0;
+    if(dax_read_tag(ds, ht, &time) || time == 0) {
+        DF("Virtual tag read failed");
+        return -1;
+    }
+
+    /* Deleted tags aren't in there anymore either */
+    result = dax_tag_del(ds, h.index);
+    if(result) return -1;
+    result = dax_read(ds2, h.index, 0, data, h.size);
+    if(result != ERR_DELETED) {
+        DF("Deleted tag returned %d", result);
+        return -1;
+    }
+    DF("Test Passed");
+    dax_disconnect(ds2);
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
@@ -0,0 +1,116 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test makes sure that the tag and handle caches in one module don't
+ *  hand out old information after another module deletes a tag or makes it
+ *  bigger.
+ *  The server sends a notice to the module for each of these and the notice
+ *  is always ahead of the response to any message that is sent after it.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <libdax.h>
+#include "libtest_common.h"
+
+/* Any message to the server and back makes sure that the notices that were
+ * sent before it have been handled */
+static int
+_sync(dax_state *ds, tag_handle h)
+{
+    dax_dint temp = 1;
+
+    return dax_write(ds, h.index, 0, &temp, sizeof(temp));
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds, *ds2;
+    tag_handle h, hsync, h2;
+    dax_tag tag;
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+    ds2 = dax_init("test2");
+    dax_configure(ds2, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds2)) return -1;
+
+    if(dax_tag_add(ds2, &hsync, "TEST_SYNC", DAX_DINT, 1, 0)) return -1;
+    if(dax_tag_add(ds, &h, "TEST_A", DAX_DINT, 1, 0)) return -1;
+    /* Now the other module has it in its cache */
+    if(dax_tag_byname(ds2, &tag, "TEST_A") || tag.idx != h.index) return -1;
+    if(dax_tag_handle(ds2, &h2, "TEST_A", 0) || h2.index != h.index) return -1;
+
+    if(dax_tag_del(ds, h.index)) return -1;
+    if(_sync(ds2, hsync)) return -1;
+    if(dax_tag_byname(ds2, &tag, "TEST_A") != ERR_NOTFOUND) {
+        DF("Deleted tag found at index 0x%X", tag.idx);
+        return -1;
+    }
+    if(dax_tag_byindex(ds2, &tag, h.index) != ERR_DELETED) {
+        DF("Deleted tag found by index");
+        return -1;
+    }
+    if(dax_tag_handle(ds2, &h2, "TEST_A", 0) != ERR_NOTFOUND) {
+        DF("Handle found for deleted tag");
+        return -1;
+    }
+
+    /* Same name in the same slot but it's a different tag */
+    if(dax_tag_add(ds, &h, "TEST_A", DAX_DINT, 4, 0)) return -1;
+    if(dax_tag_byname(ds2, &tag, "TEST_A") || tag.idx != h.index || tag.count != 4) {
+        DF("Bad tag after it was added again 0x%X, %d", tag.idx, tag.count);
+        return -1;
+    }
+
+    /* Growing the tag keeps the index but the count changes */
+    if(dax_tag_add(ds, &h, "TEST_A", DAX_DINT, 10, 0)) return -1;
+    if(_sync(ds2, hsync)) return -1;
+    if(dax_tag_byname(ds2, &tag, "TEST_A") || tag.idx != h.index || tag.count != 10) {
+        DF("Bad tag after it grew 0x%X, %d", tag.idx, tag.count);
+        return -1;
+    }
+    if(dax_tag_byindex(ds2, &tag, h.index) || tag.count != 10) {
+        DF("Bad tag by index after it grew %d", tag.count);
+        return -1;
+    }
+    if(dax_tag_handle(ds2, &h2, "TEST_A", 0) || h2.count != 10 || h2.size != 40) {
+        DF("Bad handle after the tag grew %d", h2.count);
+        return -1;
+    }
+
+    DF("Test Passed");
+    dax_disconnect(ds2);
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
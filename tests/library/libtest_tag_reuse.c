@@ -0,0 +1,139 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test deletes tags and adds new ones in their place.  The new tag
+ *  should get the slot of the old one but the handle of the old tag has to
+ *  give ERR_DELETED instead of the data of the new tag, both through the
+ *  server and through the shared memory.  Adding and deleting a lot of tags
+ *  shouldn't make the database any bigger.
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <libdax.h>
+#include "libtest_common.h"
+
+#define CHURN_COUNT 2000
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result, n;
+    tag_handle ha, hb, hlast;
+    dax_dint temp, last1, last2;
+    dax_tag tag;
+    char name[DAX_TAGNAME_SIZE + 1];
+
+    ds = dax_init("test");
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    if(dax_connect(ds)) return -1;
+
+    result = dax_tag_add(ds, &ha, "TEST_A", DAX_DINT, 1, 0);
+    if(result) return -1;
+    temp = 5;
+    if(dax_write_tag(ds, ha, &temp)) return -1;
+    if(dax_tag_del(ds, ha.index)) return -1;
+
+    result = dax_tag_add(ds, &hb, "TEST_B", DAX_DINT, 1, 0);
+    if(result) return -1;
+    if(TAG_SLOT(hb.index) != TAG_SLOT(ha.index) || hb.index == ha.index) {
+        DF("Slot not reused 0x%X, 0x%X", ha.index, hb.index);
+        return -1;
+    }
+    temp = 7;
+    if(dax_write_tag(ds, hb, &temp)) return -1;
+
+    result = dax_read(ds, ha.index, 0, &temp, sizeof(temp));
+    if(result != ERR_DELETED) {
+        DF("Stale read returned %d, %d", result, temp);
+        return -1;
+    }
+    temp = 9;
+    result = dax_write(ds, ha.index, 0, &temp, sizeof(temp));
+    if(result != ERR_DELETED) {
+        DF("Stale write returned %d", result);
+        return -1;
+    }
+    result = dax_tag_del(ds, ha.index);
+    if(result == 0) {
+        DF("Stale delete worked");
+        return -1;
+    }
+    temp = 0;
+    if(dax_read_tag(ds, hb, &temp) || temp != 7) {
+        DF("New tag read failed %d", temp);
+        return -1;
+    }
+    if(dax_tag_byindex(ds, &tag, hb.index) || strcmp(tag.name, "TEST_B")) {
+        DF("Tag by index failed");
+        return -1;
+    }
+    /* The first handle has no generation bits but it still has to fail
+     * now that another tag is in its slot */
+    result = dax_tag_byindex(ds, &tag, ha.index);
+    if(result != ERR_DELETED) {
+        DF("Tag by first index returned %d, %s", result, tag.name);
+        return -1;
+    }
+    if(dax_tag_byslot(ds, &tag, TAG_SLOT(ha.index)) || tag.idx != hb.index) {
+        DF("Tag by slot failed");
+        return -1;
+    }
+    if(dax_tag_del(ds, hb.index)) return -1;
+    if(dax_tag_add(ds, &ha, "TEST_C", DAX_DINT, 1, 0)) return -1;
+    if(dax_tag_byindex(ds, &tag, hb.index) != ERR_DELETED) {
+        DF("Tag by stale index found %s", tag.name);
+        return -1;
+    }
+    if(dax_read(ds, hb.index, 0, &temp, sizeof(temp)) != ERR_DELETED) {
+        DF("Stale read of second generation worked");
+        return -1;
+    }
+
+    /* The database shouldn't grow when tags come and go.  The first one
+     * might need a new slot. */
+    if(dax_tag_handle(ds, &hlast, "_lastindex", 1)) return -1;
+    for(n = 0; n < CHURN_COUNT; n++) {
+        if(n == 1 && dax_read_tag(ds, hlast, &last1)) return -1;
+        snprintf(name, sizeof(name), "CHURN_%d", n);
+        if(dax_tag_add(ds, &ha, name, DAX_DINT, 4, 0)) return -1;
+        if(dax_tag_del(ds, ha.index)) return -1;
+    }
+    if(dax_read_tag(ds, hlast, &last2)) return -1;
+    if(last2 != last1) {
+        DF("Database grew from %d to %d", last1, last2);
+        return -1;
+    }
+    DF("Test Passed");
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}
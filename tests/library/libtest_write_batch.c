@@ -0,0 +1,162 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2024 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/*
+ *  This test sends several writes in one batch and makes sure that the
+ *  data, the events and the mappings all come out right
+ */
+
+#include <common.h>
+#include <opendax.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "libtest_common.h"
+
+static int events = 0;
+
+static void
+_callback(dax_state *ds, void *udata) {
+    events++;
+}
+
+int
+do_test(int argc, char *argv[])
+{
+    dax_state *ds;
+    int result = 0;
+    tag_handle ha, hb, hc, hsrc;
+    dax_id id;
+    dax_write_item items[6];
+    dax_dint a[10], c[4];
+    dax_dint values[5] = {1, 2, 3, 4, 9};
+    dax_int b = 7, temp;
+
+    ds = dax_init("test");
+    dax_init_config(ds, "test");
+
+    dax_configure(ds, argc, argv, CFG_CMDLINE);
+    result = dax_connect(ds);
+    if(result) {
+        return -1;
+    }
+    result += dax_tag_add(ds, &ha, "BATCH_A", DAX_DINT, 10, 0);
+    result += dax_tag_add(ds, &hb, "BATCH_B", DAX_INT, 1, 0);
+    result += dax_tag_add(ds, &hc, "BATCH_C", DAX_DINT, 4, 0);
+    if(result) return -1;
+    result = dax_tag_handle(ds, &hsrc, "BATCH_A[0]", 4);
+    if(result) return -1;
+    result = dax_map_add(ds, &hsrc, &hc, &id);
+    if(result) return -1;
+    result = dax_event_add(ds, &ha, EVENT_WRITE, NULL, NULL, _callback, NULL, NULL);
+    if(result) return -1;
+
+    /* The first four are one piece of the tag */
+    for(int n=0;n<4;n++) {
+        items[n].idx = ha.index;
+        items[n].offset = n * 4;
+        items[n].data = &values[n];
+        items[n].size = 4;
+    }
+    items[4].idx = ha.index;
+    items[4].offset = 32;
+    items[4].data = &values[4];
+    items[4].size = 4;
+    items[5].idx = hb.index;
+    items[5].offset = 0;
+    items[5].data = &b;
+    items[5].size = 2;
+    result = dax_write_batch(ds, items, 6);
+    if(result) return result;
+
+    result = dax_read_tag(ds, ha, a);
+    result += dax_read_tag(ds, hb, &temp);
+    result += dax_read_tag(ds, hc, c);
+    if(result) return -1;
+    for(int n=0;n<4;n++) {
+        if(a[n] != values[n] || c[n] != values[n]) {
+            printf("a[%d] = %d, c[%d] = %d should be %d\n", n, a[n], n, c[n], values[n]);
+            return -1;
+        }
+    }
+    if(a[8] != 9 || temp != 7) return -1;
+
+    /* One event for each piece of the tag instead of each write */
+    while(dax_event_poll(ds, NULL) == 0);
+    printf("Received %d events\n", events);
+    if(events != 2) return -1;
+
+    /* Writes to the same tag are joined even when other tags are written
+     * between them, and the last write to the same bytes wins */
+    values[0] = 11;
+    values[1] = 12;
+    values[2] = 13;
+    items[0].idx = ha.index;
+    items[0].offset = 4;
+    items[0].data = &values[0];
+    items[0].size = 4;
+    items[1].idx = hb.index;
+    items[1].offset = 0;
+    items[1].data = &b;
+    items[1].size = 2;
+    items[2].idx = ha.index;
+    items[2].offset = 0;
+    items[2].data = &values[1];
+    items[2].size = 4;
+    items[3].idx = ha.index;
+    items[3].offset = 4;
+    items[3].data = &values[2];
+    items[3].size = 4;
+    events = 0;
+    result = dax_write_batch(ds, items, 4);
+    if(result) return result;
+    result = dax_read_tag(ds, ha, a);
+    if(result) return -1;
+    if(a[0] != 12 || a[1] != 13 || a[2] != 3) {
+        printf("a = %d, %d, %d should be 12, 13, 3\n", a[0], a[1], a[2]);
+        return -1;
+    }
+    while(dax_event_poll(ds, NULL) == 0);
+    printf("Received %d events\n", events);
+    if(events != 1) return -1;
+
+    /* A bad write keeps the rest of the batch from being written */
+    b = 100;
+    items[0].idx = hb.index;
+    items[1].idx = 99999;
+    items[1].offset = 0;
+    result = dax_write_batch(ds, items, 2);
+    if(result != ERR_ARG) return -1;
+    result = dax_read_tag(ds, hb, &temp);
+    if(result || temp != 7) return -1;
+
+    dax_disconnect(ds);
+
+    return 0;
+}
+
+/* main inits and then calls run */
+int
+main(int argc, char *argv[])
+{
+    if(run_test(do_test, argc, argv, 0)) {
+        exit(-1);
+    } else {
+        exit(0);
+    }
+}